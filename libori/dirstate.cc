@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <mutex>
+#include <exception>
+#include <unordered_map>
+
+#include <oriutil/debug.h>
+#include <oriutil/orifile.h>
+#include <oriutil/objecthash.h>
+#include <oriutil/stream.h>
+#include <ori/tree.h>
+#include <ori/dirstate.h>
+
+using namespace std;
+
+#define DIRSTATE_VERSION    1
+
+#if defined(__APPLE__)
+#define DIRSTATE_MTIME(sb)  DirState_Time((sb).st_mtimespec)
+#define DIRSTATE_CTIME(sb)  DirState_Time((sb).st_ctimespec)
+#else
+#define DIRSTATE_MTIME(sb)  DirState_Time((sb).st_mtim)
+#define DIRSTATE_CTIME(sb)  DirState_Time((sb).st_ctim)
+#endif
+
+static int64_t
+DirState_Time(const struct timespec &ts)
+{
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+DirState::DirState()
+    : fileName(), savedTime(0), dirty(false), lock(), entries()
+{
+}
+
+DirState::~DirState()
+{
+}
+
+void
+DirState::open(const string &stateFile)
+{
+    struct stat sb;
+
+    fileName = stateFile;
+    savedTime = 0;
+    dirty = false;
+    entries.clear();
+
+    if (stat(stateFile.c_str(), &sb) < 0)
+        return;
+
+    try {
+        string blob = OriFile_ReadFile(stateFile);
+        strstream ss(blob);
+
+        if (ss.readUInt32() != DIRSTATE_VERSION) {
+            WARNING("Unsupported dirstate version, ignoring it");
+            return;
+        }
+
+        uint32_t num = ss.readUInt32();
+        for (uint32_t i = 0; i < num; i++) {
+            string path;
+            Entry e;
+
+            ss.readLPStr(path);
+            e.size = ss.readUInt64();
+            e.mtime = ss.readInt64();
+            e.ctime = ss.readInt64();
+            e.ino = ss.readUInt64();
+            ss.readHash(e.hash);
+            if (ss.error())
+                throw exception();
+
+            entries[path] = e;
+        }
+    } catch (exception &e) {
+        WARNING("Corrupt dirstate, ignoring it");
+        entries.clear();
+        return;
+    }
+
+    // Written with the same timestamp granularity as the working files
+    savedTime = DIRSTATE_MTIME(sb);
+}
+
+void
+DirState::save()
+{
+    if (!dirty || fileName == "")
+        return;
+
+    strwstream ss;
+    unordered_map<string, Entry>::iterator it;
+
+    ss.writeUInt32(DIRSTATE_VERSION);
+    ss.writeUInt32(entries.size());
+    for (it = entries.begin(); it != entries.end(); it++) {
+        ss.writeLPStr(it->first);
+        ss.writeUInt64(it->second.size);
+        ss.writeInt64(it->second.mtime);
+        ss.writeInt64(it->second.ctime);
+        ss.writeUInt64(it->second.ino);
+        ss.writeHash(it->second.hash);
+    }
+
+    string tmpFile = fileName + ".tmp";
+    if (!OriFile_WriteFile(ss.str(), tmpFile)) {
+        WARNING("Could not write the dirstate");
+        return;
+    }
+    OriFile_Rename(tmpFile, fileName);
+
+    struct stat sb;
+    if (stat(fileName.c_str(), &sb) == 0)
+        savedTime = DIRSTATE_MTIME(sb);
+    dirty = false;
+}
+
+void
+DirState::clear()
+{
+    entries.clear();
+    dirty = true;
+}
+
+bool
+DirState::lookup(const string &path, const struct stat &sb,
+                 ObjectHash *hash) const
+{
+    unique_lock<mutex> l(lock);
+    unordered_map<string, Entry>::const_iterator it = entries.find(path);
+
+    if (it == entries.end())
+        return false;
+
+    const Entry &e = it->second;
+    if (e.hash.isEmpty())
+        return false;
+    if (e.size != (uint64_t)sb.st_size || e.ino != (uint64_t)sb.st_ino ||
+        e.mtime != DIRSTATE_MTIME(sb) || e.ctime != DIRSTATE_CTIME(sb))
+        return false;
+
+    // Racily clean, the file may have changed after it was recorded
+    if (e.mtime >= savedTime)
+        return false;
+
+    *hash = e.hash;
+    return true;
+}
+
+void
+DirState::update(const string &path, const struct stat &sb,
+                 const ObjectHash &hash)
+{
+    unique_lock<mutex> l(lock);
+    Entry &e = entries[path];
+
+    e.size = sb.st_size;
+    e.mtime = DIRSTATE_MTIME(sb);
+    e.ctime = DIRSTATE_CTIME(sb);
+    e.ino = sb.st_ino;
+    e.hash = hash;
+    dirty = true;
+}
+
+void
+DirState::remove(const string &path)
+{
+    unique_lock<mutex> l(lock);
+
+    if (entries.erase(path) != 0)
+        dirty = true;
+}
+
+void
+DirState::updateFromTree(const Tree::Flat &flat)
+{
+    unordered_map<string, Entry>::iterator it = entries.begin();
+
+    while (it != entries.end()) {
+        Tree::Flat::const_iterator te = flat.find(it->first);
+
+        if (te == flat.end() || te->second.type == TreeEntry::Tree) {
+            it = entries.erase(it);
+            dirty = true;
+            continue;
+        }
+
+        if (it->second.hash.isEmpty()) {
+            it->second.hash = (te->second.type == TreeEntry::LargeBlob) ?
+                te->second.largeHash : te->second.hash;
+            dirty = true;
+        }
+        it++;
+    }
+}
+
+size_t
+DirState::size() const
+{
+    return entries.size();
+}
@@ -72,6 +72,29 @@ ssize_t evbufwstream::write(const void *ptr, size_t n)
     return -1;
 }
 
+static void
+evbufwstream_releaseRef(const void *data, size_t len, void *arg)
+{
+    delete (std::shared_ptr<const void> *)arg;
+}
+
+/*
+ * Adds the buffer by reference so large blocks (e.g. from a mapped
+ * packfile) are sent without being copied into the evbuffer.
+ */
+ssize_t evbufwstream::writeRef(const void *ptr, size_t n,
+                               const std::shared_ptr<const void> &owner)
+{
+    std::shared_ptr<const void> *ref = new std::shared_ptr<const void>(owner);
+
+    if (evbuffer_add_reference(_buf, ptr, n,
+                               evbufwstream_releaseRef, ref) == 0)
+        return n;
+
+    delete ref;
+    return -1;
+}
+
 struct evbuffer *evbufwstream::buf() const
 {
     return _buf;
@@ -41,6 +41,8 @@ public:
     evbufwstream(struct evbuffer *inbuf = NULL);
     ~evbufwstream();
     ssize_t write(const void *ptr, size_t n);
+    ssize_t writeRef(const void *ptr, size_t n,
+                     const std::shared_ptr<const void> &owner);
 
     struct evbuffer *buf() const;
 
@@ -20,6 +20,7 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -29,6 +30,9 @@
 #include <resolv.h>
 
 #include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
 #include <iostream>
 
 #include <event2/event.h>
@@ -41,12 +45,15 @@
 #include <oriutil/debug.h>
 #include <oriutil/oristr.h>
 #include <oriutil/zeroconf.h>
+#include <oriutil/systemexception.h>
+#include <oriutil/threadpool.h>
 #include <ori/version.h>
 #include <ori/localrepo.h>
 #include <ori/httpserver.h>
 
 #include "evbufstream.h"
 #include "httpdefs.h"
+#include "tuneables.h"
 
 using namespace std;
 
@@ -71,40 +78,290 @@ HTTPServerReqHandlerCB(struct evhttp_request *req, void *arg)
     return;
 }
 
-HTTPServer::HTTPServer(LocalRepo &repository, uint16_t port)
-    : repo(repository), port(port), httpd(NULL), base(NULL)
+static void
+HTTPServerStopCB(evutil_socket_t fd, short what, void *arg)
 {
-    base = event_base_new();
-    event_set_log_callback(HTTPServerLogCB);
+    struct event_base *base = (struct event_base *)arg;
+
+    event_base_loopexit(base, NULL);
+}
+
+/*
+ * A response sent in chunks.  next writes the following chunk of roughly
+ * HTTPSERVER_CHUNKSIZE bytes and returns false once the response is done.
+ */
+class HTTPStream
+{
+public:
+    HTTPStream(struct evhttp_request *req) : req(req) {}
+    virtual ~HTTPStream() {}
+    virtual bool next(bytewstream *out) = 0;
+
+    struct evhttp_request *req;
+};
+
+/*
+ * The next chunk is produced once the previous one has been written to the
+ * socket.
+ */
+static void
+HTTPServerStreamCB(struct evhttp_connection *conn, void *arg)
+{
+    HTTPStream *stream = (HTTPStream *)arg;
+    struct evhttp_request *req = stream->req;
+    evbufwstream out;
+    bool more;
+
+    try {
+        more = stream->next(&out);
+    } catch (std::exception &e) {
+        // The client sees a short response
+        WARNING("httpd: streaming a response failed: %s", e.what());
+        more = false;
+    }
+
+    if (more) {
+        evhttp_send_reply_chunk_with_cb(req, out.buf(), HTTPServerStreamCB,
+                                        stream);
+        return;
+    }
+
+    if (evbuffer_get_length(out.buf()) > 0)
+        evhttp_send_reply_chunk(req, out.buf());
+    evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                  NULL, NULL);
+    delete stream;
+    evhttp_send_reply_end(req);
+}
+
+/*
+ * The client went away in the middle of a streamed response.
+ */
+static void
+HTTPServerStreamCloseCB(struct evhttp_connection *conn, void *arg)
+{
+    HTTPStream *stream = (HTTPStream *)arg;
+
+    DLOG("httpd: connection closed while streaming");
+    delete stream;
+}
+
+class HTTPIndexStream : public HTTPStream
+{
+public:
+    HTTPIndexStream(struct evhttp_request *req, LocalRepo &repo)
+        : HTTPStream(req), repo(repo), left(repo.numObjects()),
+          started(false), last()
+    {
+    }
+    bool next(bytewstream *out)
+    {
+        if (!started) {
+            out->writeUInt64(left);
+            started = true;
+        }
+
+        size_t max = HTTPSERVER_CHUNKSIZE / ObjectInfo::SIZE;
+        vector<ObjectInfo> infos = repo.listObjects(last, min(left, max));
+        for (size_t i = 0; i < infos.size(); i++) {
+            out->writeInfo(infos[i]);
+        }
+        if (infos.size() == 0 && left > 0) {
+            WARNING("httpd: the index shrank while it was sent");
+            return false;
+        }
+        left -= infos.size();
+        if (infos.size() > 0)
+            last = infos.back().hash;
+
+        return left > 0;
+    }
+private:
+    LocalRepo &repo;
+    size_t left;
+    bool started;
+    ObjectHash last;
+};
+
+class HTTPCommitsStream : public HTTPStream
+{
+public:
+    HTTPCommitsStream(struct evhttp_request *req, LocalRepo &repo)
+        : HTTPStream(req), commits(repo.listCommits()), started(false), pos(0)
+    {
+    }
+    bool next(bytewstream *out)
+    {
+        size_t bytes = 0;
+
+        if (!started) {
+            out->writeUInt32(commits.size());
+            started = true;
+        }
+
+        while (pos < commits.size() && bytes < HTTPSERVER_CHUNKSIZE) {
+            std::string blob = commits[pos++].getBlob();
+            out->writePStr(blob);
+            bytes += blob.size();
+        }
+
+        return pos < commits.size();
+    }
+private:
+    vector<Commit> commits;
+    bool started;
+    size_t pos;
+};
+
+class HTTPObjsStream : public HTTPStream
+{
+public:
+    HTTPObjsStream(struct evhttp_request *req, LocalRepo &repo,
+                   const vector<ObjectHash> &objs)
+        : HTTPStream(req), repo(repo), objs(objs), pos(0)
+    {
+    }
+    /// Each chunk is one or more transmit groups
+    bool next(bytewstream *out)
+    {
+        vector<ObjectHash> batch;
+        size_t bytes = 0;
+
+        while (pos < objs.size() && bytes < HTTPSERVER_CHUNKSIZE) {
+            bytes += repo.getObjectInfo(objs[pos]).payload_size;
+            batch.push_back(objs[pos++]);
+        }
+
+        // A missing object ends the transfer like LocalRepo::transmit
+        if (!repo.transmitGroups(out, batch))
+            pos = objs.size();
+
+        if (pos == objs.size()) {
+            out->writeUInt32(0);
+            return false;
+        }
+        return true;
+    }
+private:
+    LocalRepo &repo;
+    vector<ObjectHash> objs;
+    size_t pos;
+};
+
+HTTPServer::HTTPServer(LocalRepo &repository, uint16_t port, int threads)
+    : repo(repository), port(port), listenFd(-1), workers()
+{
+    struct sockaddr_in addr;
+    int one = 1;
 
-    httpd = evhttp_new(base);
-    evhttp_bind_socket(httpd, "0.0.0.0", port);
+    if (threads < 0)
+        threads = HTTPSERVER_THREADS;
+    if (threads < 0)
+        threads = ThreadPool::defaultSize();
+    if (threads == 0)
+        threads = 1;
+
+    event_set_log_callback(HTTPServerLogCB);
 
-    evhttp_set_gencb(httpd, HTTPServerReqHandlerCB, this);
+    if (pipe(stopPipe) < 0)
+        throw SystemException();
+
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0)
+        throw SystemException();
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (::bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        throw SystemException();
+    if (listen(listenFd, 128) < 0)
+        throw SystemException();
+    // Every loop polls the socket, whoever loses the race must not block
+    evutil_make_socket_nonblocking(listenFd);
+
+    for (int i = 0; i < threads; i++) {
+        Worker w;
+
+        w.base = event_base_new();
+        w.httpd = evhttp_new(w.base);
+        evhttp_accept_socket(w.httpd, listenFd);
+        evhttp_set_gencb(w.httpd, HTTPServerReqHandlerCB, this);
+
+        // The pipe is never drained so that every loop sees it readable
+        w.stopEvent = event_new(w.base, stopPipe[0], EV_READ,
+                                HTTPServerStopCB, w.base);
+        event_add(w.stopEvent, NULL);
+
+        workers.push_back(w);
+    }
 }
 
 HTTPServer::~HTTPServer()
 {
-    evhttp_free(httpd);
-    event_base_free(base);
+    for (size_t i = 0; i < workers.size(); i++) {
+        event_free(workers[i].stopEvent);
+        evhttp_free(workers[i].httpd);
+        event_base_free(workers[i].base);
+    }
+    close(listenFd);
+    close(stopPipe[0]);
+    close(stopPipe[1]);
 }
 
 void
 HTTPServer::start(bool mDNSEnable)
 {
+    vector<thread> threads;
+
 #if !defined(WITHOUT_MDNS)
     // mDNS
     if (mDNSEnable)
-        MDNS_Register(port);
+        MDNS_Register(getPort());
 #endif
 
-    event_base_dispatch(base);
+    for (size_t i = 1; i < workers.size(); i++) {
+        threads.push_back(thread(event_base_dispatch, workers[i].base));
+    }
+    event_base_dispatch(workers[0].base);
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
 }
 
 void
 HTTPServer::stop()
 {
-    event_base_loopexit(base, NULL);
+    if (write(stopPipe[1], "", 1) != 1)
+        WARNING("httpd: could not stop the server: %s", strerror(errno));
+}
+
+uint16_t
+HTTPServer::getPort()
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    if (getsockname(listenFd, (struct sockaddr *)&addr, &len) < 0)
+        return port;
+
+    return ntohs(addr.sin_port);
+}
+
+void
+HTTPServer::sendStream(HTTPStream *stream)
+{
+    struct evhttp_request *req = stream->req;
+
+    evhttp_add_header(req->output_headers, "Content-Type",
+            "application/octet-stream");
+    evhttp_send_reply_start(req, HTTP_OK, "OK");
+    evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                  HTTPServerStreamCloseCB, stream);
+    HTTPServerStreamCB(evhttp_request_get_connection(req), stream);
 }
 
 void
@@ -201,7 +458,7 @@ HTTPServer::stop(struct evhttp_request *req)
 
     evbuffer_add_printf(buf, "Stopping\n");
     evhttp_send_reply(req, HTTP_OK, "OK", buf);
-    event_base_loopexit(base, NULL);
+    stop();
 }
 
 void
@@ -269,24 +526,7 @@ HTTPServer::getIndex(struct evhttp_request *req)
 {
     DLOG("httpd: getindex");
 
-    evbufwstream es;
-
-    std::set<ObjectInfo> objects = repo.listObjects();
-    es.writeUInt64(objects.size());
-    for (std::set<ObjectInfo>::iterator it = objects.begin();
-            it != objects.end();
-            it++) {
-        int status = es.writeInfo(*it);
-        if (status < 0) {
-            LOG("couldn't write info to evbuffer!");
-            evhttp_send_error(req, HTTP_INTERNAL, "Internal Error");
-            return;
-        }
-    }
-
-    evhttp_add_header(req->output_headers, "Content-Type",
-            "application/octet-stream");
-    evhttp_send_reply(req, HTTP_OK, "OK", es.buf());
+    sendStream(new HTTPIndexStream(req, repo));
 }
 
 void
@@ -294,22 +534,7 @@ HTTPServer::getCommits(struct evhttp_request *req)
 {
     DLOG("httpd: getCommits");
 
-    evbufwstream es;
-
-    vector<Commit> commits = repo.listCommits();
-    es.writeUInt32(commits.size());
-    for (size_t i = 0; i < commits.size(); i++) {
-        std::string blob = commits[i].getBlob();
-        if (es.writePStr(blob) < 0) {
-            LOG("couldn't write pstr to evbuffer");
-            evhttp_send_error(req, HTTP_INTERNAL, "Internal Error");
-            return;
-        }
-    }
-
-    evhttp_add_header(req->output_headers, "Content-Type",
-            "application/octet-stream");
-    evhttp_send_reply(req, HTTP_OK, "OK", es.buf());
+    sendStream(new HTTPCommitsStream(req, repo));
 }
 
 void
@@ -365,13 +590,7 @@ HTTPServer::getObjs(struct evhttp_request *req)
     }
 
 
-    // Transmit
-    evbufwstream out;
-    repo.transmit(&out, objs);
-
-    evhttp_add_header(req->output_headers, "Content-Type",
-            "application/octet-stream");
-    evhttp_send_reply(req, HTTP_OK, "OK", out.buf());
+    sendStream(new HTTPObjsStream(req, repo, objs));
 }
 
 void
@@ -21,14 +21,20 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include <string>
 #include <set>
+#include <vector>
 #include <iostream>
-#include <unordered_map>
+#include <algorithm>
+#include <map>
 
 #include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
 #include <oriutil/runtimeexception.h>
 #include <oriutil/systemexception.h>
 #include <oriutil/orifile.h>
@@ -36,14 +42,80 @@
 #include <ori/object.h>
 #include <ori/index.h>
 
+#include "tuneables.h"
+
 using namespace std;
 
 /// Adds a checksum
 #define TOTAL_ENTRYSIZE (IndexEntry::SIZE + 16)
 
+/*
+ * Sorted base index layout:
+ *   "ORIX" | version | count | fanout[256] | checksum[16] | entries[count]
+ * All integers are 32-bit big endian.  fanout[b] is the number of entries
+ * whose first hash byte is less than or equal to b.  The checksum covers the
+ * header only, entries carry their own checksum just like the index log.
+ */
+#define INDEX_BASE_MAGIC "ORIX"
+#define INDEX_BASE_VERSION 1
+#define INDEX_BASE_HDRSIZE (3 * sizeof(uint32_t) + 256 * sizeof(uint32_t))
+#define INDEX_BASE_ENTRYOFF (INDEX_BASE_HDRSIZE + 16)
+/// Offset of the object hash within an entry
+#define INDEX_HASHOFF ORI_OBJECT_TYPESIZE
+
+static string
+Index_EncodeEntry(const IndexEntry &e)
+{
+    strwstream ss;
+
+    string info_str = e.info.toString();
+    ss.write(info_str.data(), info_str.size());
+
+    ss.writeUInt32(e.offset);
+    ss.writeUInt32(e.packed_size);
+    ss.writeUInt32(e.packfile);
+
+    ObjectHash checksum = OriCrypt_HashString(ss.str());
+    ss.write(checksum.hash, 16);
+
+    ASSERT(ss.str().size() == TOTAL_ENTRYSIZE);
+
+    return ss.str();
+}
+
+/*
+ * Decodes an entry and verifies its checksum.
+ */
+static bool
+Index_DecodeEntry(const uint8_t *buf, IndexEntry *entry)
+{
+    std::string entry_str((const char *)buf, TOTAL_ENTRYSIZE);
+
+    string info_str = entry_str.substr(0, ObjectInfo::SIZE);
+    entry->info.fromString(info_str);
+
+    strstream ss(entry_str, ObjectInfo::SIZE);
+    entry->offset = ss.readUInt32();
+    entry->packed_size = ss.readUInt32();
+    entry->packfile = ss.readUInt32();
+
+    ObjectHash computedChecksum =
+        OriCrypt_HashString(entry_str.substr(0, IndexEntry::SIZE));
+
+    return memcmp(buf + IndexEntry::SIZE, computedChecksum.hash, 16) == 0;
+}
+
 Index::Index()
 {
     fd = -1;
+    rewriteLog = false;
+    batchDepth = 0;
+    baseFd = -1;
+    baseMap = NULL;
+    baseLen = 0;
+    baseEntries = NULL;
+    baseCount = 0;
+    memset(fanout, 0, sizeof(fanout));
 }
 
 Index::~Index()
@@ -54,20 +126,20 @@ Index::~Index()
 void
 Index::open(const string &indexFile)
 {
-    int i, entries;
+    size_t i, entries;
     struct stat sb;
 
     fileName = indexFile;
 
-    // Read index
-    fd = ::open(indexFile.c_str(), O_RDWR | O_CREAT,
+    // The log is opened before the base.  A rewrite replaces the base
+    // first, so whichever log is read the base has at least its entries.
+    fd = ::open(indexFile.c_str(), O_RDWR | O_CREAT | O_APPEND,
               S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
     if (fd < 0) {
         WARNING("Could not open the index file!");
         throw SystemException();
     }
 
-
     if (::fstat(fd, &sb) < 0) {
         int errcode = errno;
         ::close(fd);
@@ -76,39 +148,40 @@ Index::open(const string &indexFile)
         throw SystemException(errcode);
     }
 
-    if (sb.st_size % TOTAL_ENTRYSIZE != 0) {
-        // XXX: Attempt truncating last entries
-        WARNING("Index seems dirty please rebuild it!");
-        ::close(fd);
-        fd = -1;
-        throw RuntimeException(ORIEC_INDEXDIRTY, "Index dirty");
+    // A partial entry at the end is still being written by another process
+    // or was torn by a crash, either way it is not read.  The writer drops
+    // it with a rewrite before appending (see _needsRewrite).
+    rewriteLog = (sb.st_size % TOTAL_ENTRYSIZE != 0);
+    if (rewriteLog)
+        WARNING("Ignoring a partial entry at the end of the index log");
+
+    std::string log_str(sb.st_size - sb.st_size % TOTAL_ENTRYSIZE, '\0');
+    size_t bytesRead = 0;
+    while (bytesRead < log_str.size()) {
+        ssize_t status = read(fd, &log_str[bytesRead],
+                              log_str.size() - bytesRead);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status <= 0) {
+            int errcode = (status < 0) ? errno : EIO;
+            index.clear();
+            ::close(fd);
+            fd = -1;
+            WARNING("Could not read the index file!");
+            throw SystemException(errcode);
+        }
+        bytesRead += status;
     }
 
-    entries = sb.st_size / TOTAL_ENTRYSIZE;
+    entries = log_str.size() / TOTAL_ENTRYSIZE;
     for (i = 0; i < entries; i++) {
-        std::string entry_str(TOTAL_ENTRYSIZE, '\0');
-
-        int status UNUSED = read(fd, &entry_str[0], TOTAL_ENTRYSIZE);
-        ASSERT(status == TOTAL_ENTRYSIZE);
-
         IndexEntry entry;
 
-        string info_str = entry_str.substr(0, ObjectInfo::SIZE);
-        entry.info.fromString(info_str);
-
-        strstream ss(entry_str, ObjectInfo::SIZE);
-        entry.offset = ss.readUInt32();
-        entry.packed_size = ss.readUInt32();
-        entry.packfile = ss.readUInt32();
-
-
-        std::vector<uint8_t> storedChecksum(16);
-        ss.read(&storedChecksum[0], 16);
-        ObjectHash computedChecksum =
-            OriCrypt_HashString(entry_str.substr(0, IndexEntry::SIZE));
-        if (memcmp(&storedChecksum[0], computedChecksum.hash, 16) != 0) {
+        if (!Index_DecodeEntry((const uint8_t *)log_str.data() +
+                               i * TOTAL_ENTRYSIZE, &entry)) {
             // XXX: Attempt truncating last entries
             WARNING("Index has corrupt entries please rebuild it!");
+            index.clear();
             ::close(fd);
             fd = -1;
             throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
@@ -116,26 +189,38 @@ Index::open(const string &indexFile)
 
         index[entry.info.hash] = entry;
     }
-    ::close(fd);
-
-    // Reopen append only
-    fd = ::open(indexFile.c_str(), O_WRONLY | O_APPEND);
-    ASSERT(fd >= 0); // Assume that the repository lock protects the index
 
-    // Delete temporary index if present
-    if (OriFile_Exists(indexFile + ".tmp")) {
-        OriFile_Delete(indexFile + ".tmp");
+    // Map the sorted base
+    try {
+        _openBase();
+    } catch (exception &e) {
+        ::close(fd);
+        fd = -1;
+        index.clear();
+        throw;
     }
+
+    // Nothing is written here, other processes may have the index open.
+    // A legacy index that is all log is converted by the first write.
+    if (baseMap == NULL && !index.empty())
+        rewriteLog = true;
 }
 
 void
 Index::close()
 {
+    ASSERT(batchDepth == 0);
+
     if (fd != -1) {
         ::fsync(fd);
         ::close(fd);
         fd = -1;
     }
+
+    // Not locked, there are no readers left and this may run from a static
+    // destructor after the RWLock debugging state is gone
+    _closeBase();
+    index.clear();
 }
 
 void
@@ -144,41 +229,191 @@ Index::sync()
     ::fsync(fd);
 }
 
+/*
+ * Merges the index log into a new sorted base and truncates the log.  The
+ * base is replaced before the log so a crash in between only leaves
+ * duplicate entries behind.  Only the writer rewrites, a reader in another
+ * process keeps the files it opened.  Throws SystemException on failure,
+ * the index is left as it was.
+ */
 void
 Index::rewrite()
 {
     int fdNew;
-    string newIndex = fileName + ".tmp";
+    string newBase;
+    string newIndex;
+    uint32_t newFanout[256];
+    uint32_t count = 0;
+    int status;
+
+    ASSERT(batchDepth == 0);
 
-    fdNew = ::open(newIndex.c_str(), O_RDWR | O_CREAT,
-                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    for (map<ObjectHash, IndexEntry>::iterator it = index.begin();
+            it != index.end();
+            it++)
+    {
+        if (_findBase(it->first) == NULL)
+            count++;
+    }
+    count += baseCount;
+
+    fdNew = OriFile_CreateTemp(fileName + INDEX_SORTED_SUFFIX, &newBase);
     if (fdNew < 0) {
-        perror("open");
-        WARNING("Could not open a temporary index file!");
-        return;
-    };
+        WARNING("Could not open a temporary index file: %s",
+                strerror(-fdNew));
+        throw SystemException(-fdNew);
+    }
+
+    // Reserve space for the header and write the merged entries
+    string buf;
+    buf.reserve(COPYFILE_BUFSZ + TOTAL_ENTRYSIZE);
+    buf.assign(INDEX_BASE_ENTRYOFF, '\0');
+
+    memset(newFanout, 0, sizeof(newFanout));
+
+    size_t b = 0;
+    map<ObjectHash, IndexEntry>::iterator l = index.begin();
+    while (b < baseCount || l != index.end()) {
+        const uint8_t *baseEntry = NULL;
+        int cmp;
+
+        if (b < baseCount)
+            baseEntry = baseEntries + b * TOTAL_ENTRYSIZE;
+
+        if (baseEntry == NULL) {
+            cmp = 1;
+        } else if (l == index.end()) {
+            cmp = -1;
+        } else {
+            cmp = memcmp(baseEntry + INDEX_HASHOFF,
+                         l->first.hash, ObjectHash::SIZE);
+        }
+
+        if (cmp < 0) {
+            newFanout[baseEntry[INDEX_HASHOFF]]++;
+            buf.append((const char *)baseEntry, TOTAL_ENTRYSIZE);
+            b++;
+        } else {
+            // Log entries replace the base entry for the same object
+            newFanout[l->first.hash[0]]++;
+            buf.append(Index_EncodeEntry(l->second));
+            if (cmp == 0)
+                b++;
+            l++;
+        }
+
+        if (buf.size() >= COPYFILE_BUFSZ) {
+            if (::write(fdNew, buf.data(), buf.size()) != (ssize_t)buf.size())
+                goto writeError;
+            buf.clear();
+        }
+    }
+    if (::write(fdNew, buf.data(), buf.size()) != (ssize_t)buf.size())
+        goto writeError;
+
+    // Write the header now that the fanout is known
+    {
+        strwstream hdr;
+
+        hdr.write(INDEX_BASE_MAGIC, 4);
+        hdr.writeUInt32(INDEX_BASE_VERSION);
+        hdr.writeUInt32(count);
+        for (int i = 1; i < 256; i++)
+            newFanout[i] += newFanout[i - 1];
+        for (int i = 0; i < 256; i++)
+            hdr.writeUInt32(newFanout[i]);
+        ASSERT(newFanout[255] == count);
+
+        ObjectHash checksum = OriCrypt_HashString(hdr.str());
+        hdr.write(checksum.hash, 16);
+
+        const string &hdr_str = hdr.str();
+        ASSERT(hdr_str.size() == INDEX_BASE_ENTRYOFF);
+        if (::pwrite(fdNew, hdr_str.data(), hdr_str.size(), 0) !=
+                (ssize_t)hdr_str.size())
+            goto writeError;
+    }
+
+    if (::fsync(fdNew) < 0)
+        goto writeError;
+    ::close(fdNew);
+
+    {
+        RWKey::sp key = lock.writeLock();
+        status = OriFile_Rename(newBase, fileName + INDEX_SORTED_SUFFIX);
+        if (status == 0) {
+            _closeBase();
+            _openBase();
+        }
+    }
+    if (status < 0) {
+        WARNING("Could not replace the sorted index: %s", strerror(-status));
+        OriFile_Delete(newBase);
+        throw SystemException(-status);
+    }
 
-    int tmpFd = fd;
+    // Start a new empty log
+    fdNew = OriFile_CreateTemp(fileName, &newIndex);
+    if (fdNew < 0) {
+        WARNING("Could not open a temporary index file: %s",
+                strerror(-fdNew));
+        throw SystemException(-fdNew);
+    }
+    status = 0;
+    if (fcntl(fdNew, F_SETFL, O_APPEND) < 0 || ::fsync(fdNew) < 0)
+        status = -errno;
+    if (status == 0)
+        status = OriFile_Rename(newIndex, fileName);
+    if (status < 0) {
+        WARNING("Could not replace the index log: %s", strerror(-status));
+        ::close(fdNew);
+        OriFile_Delete(newIndex);
+        throw SystemException(-status);
+    }
+
+    ::close(fd);
     fd = fdNew;
-    ::close(tmpFd);
+    rewriteLog = false;
 
-    // Write new index
-    for (unordered_map<ObjectHash, IndexEntry>::iterator it = index.begin();
-            it != index.end();
-            it++)
     {
-        _writeEntry((*it).second);
+        RWKey::sp key = lock.writeLock();
+        index.clear();
     }
 
-    OriFile_Rename(newIndex, fileName);
+    return;
+
+writeError:
+    {
+        // A short write leaves errno alone
+        int errcode = (errno != 0) ? errno : EIO;
+        WARNING("Could not write the temporary index file: %s",
+                strerror(errcode));
+        ::close(fdNew);
+        OriFile_Delete(newBase);
+        throw SystemException(errcode);
+    }
 }
 
 void
 Index::dump()
 {
-    unordered_map<ObjectHash, IndexEntry>::iterator it;
+    RWKey::sp key = lock.readLock();
+    map<ObjectHash, IndexEntry>::iterator it;
 
     cout << "***** BEGIN REPOSITORY INDEX *****" << endl;
+    for (uint32_t i = 0; i < baseCount; i++)
+    {
+        IndexEntry entry;
+
+        Index_DecodeEntry(baseEntries + i * TOTAL_ENTRYSIZE, &entry);
+        if (index.find(entry.info.hash) != index.end())
+            continue;
+
+        cout << entry.info.hash.hex() << " packfile: " <<
+            entry.packfile << "," <<
+            entry.offset << "," <<
+            entry.packed_size << endl;
+    }
     for (it = index.begin(); it != index.end(); it++)
     {
         cout << (*it).first.hex() << " packfile: " <<
@@ -194,29 +429,73 @@ Index::updateEntry(const ObjectHash &objId, const IndexEntry &entry)
 {
     ASSERT(!objId.isEmpty());
 
-    _writeEntry(entry);
+    if (batchDepth > 0) {
+        batch.push_back(Index_EncodeEntry(entry));
+    } else {
+        if (_needsRewrite())
+            rewrite();
+        _writeEntry(entry);
+    }
 
     if (index.find(objId) != index.end()) {
         fprintf(stderr, "WARNING: duplicate updateEntry\n");
     }
 
     // Add to in-memory index
-    index[objId] = entry;
+    {
+        RWKey::sp key = lock.writeLock();
+        index[objId] = entry;
+    }
+}
+
+void
+Index::beginBatch()
+{
+    batchDepth++;
+}
+
+void
+Index::commitBatch()
+{
+    ASSERT(batchDepth > 0);
+
+    batchDepth--;
+    if (batchDepth > 0 || batch.size() == 0)
+        return;
+
+    if (_needsRewrite())
+        rewrite();
+
+    vector<struct iovec> iov(batch.size());
+    for (size_t i = 0; i < batch.size(); i++) {
+        iov[i].iov_base = (void *)batch[i].data();
+        iov[i].iov_len = batch[i].size();
+    }
+
+    int status = Util_WriteV(fd, iov);
+    batch.clear();
+    if (status < 0) {
+        WARNING("Could not write to the index file!");
+        throw SystemException(-status);
+    }
+
+    ::fsync(fd);
 }
 
-const IndexEntry &
+IndexEntry
 Index::getEntry(const ObjectHash &objId) const
 {
-    unordered_map<ObjectHash, IndexEntry>::const_iterator it = index.find(objId);
-    if (it == index.end()) {
+    IndexEntry entry;
+
+    if (!lookup(objId, &entry)) {
         WARNING("Could not find the object!");
         throw RuntimeException(ORIEC_INDEXNOTFOUND, "Index not found");
     }
 
-    return (*it).second;
+    return entry;
 }
 
-const ObjectInfo &
+ObjectInfo
 Index::getInfo(const ObjectHash &objId) const
 {
     return getEntry(objId).info;
@@ -225,45 +504,279 @@ Index::getInfo(const ObjectHash &objId) const
 bool
 Index::hasObject(const ObjectHash &objId) const
 {
-    unordered_map<ObjectHash, IndexEntry>::const_iterator it;
+    RWKey::sp key = lock.readLock();
+    map<ObjectHash, IndexEntry>::const_iterator it;
 
     it = index.find(objId);
+    if (it != index.end())
+        return true;
+
+    return _findBase(objId) != NULL;
+}
 
-    return it != index.end();
+bool
+Index::lookup(const ObjectHash &objId, IndexEntry *entry) const
+{
+    RWKey::sp key = lock.readLock();
+
+    return _lookup(objId, entry);
 }
 
 set<ObjectInfo>
 Index::getList()
 {
+    RWKey::sp key = lock.readLock();
     set<ObjectInfo> lst;
-    unordered_map<ObjectHash, IndexEntry>::iterator it;
+    map<ObjectHash, IndexEntry>::iterator it;
 
     for (it = index.begin(); it != index.end(); it++)
     {
         lst.insert((*it).second.info);
     }
 
+    for (uint32_t i = 0; i < baseCount; i++)
+    {
+        IndexEntry entry;
+
+        if (!Index_DecodeEntry(baseEntries + i * TOTAL_ENTRYSIZE, &entry)) {
+            WARNING("Index has corrupt entries please rebuild it!");
+            throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
+        }
+        lst.insert(entry.info);
+    }
+
     return lst;
 }
 
+/*
+ * Merges the log entries after the cursor with the sorted base.  Both are
+ * entered with a binary search, so a page costs O(max + log n).
+ */
+void
+Index::getList(const ObjectHash &after, size_t max,
+               vector<ObjectInfo> *infos) const
+{
+    RWKey::sp key = lock.readLock();
+    bool first = after.isEmpty();
+    map<ObjectHash, IndexEntry>::const_iterator l;
+
+    l = first ? index.begin() : index.upper_bound(after);
+
+    // First base entry after the cursor
+    uint32_t lo = 0, hi = baseCount;
+    while (!first && lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const uint8_t *entry = baseEntries + (size_t)mid * TOTAL_ENTRYSIZE;
+
+        if (memcmp(entry + INDEX_HASHOFF, after.hash, ObjectHash::SIZE) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    uint32_t b = lo;
+    for (size_t n = 0; n < max && (l != index.end() || b < baseCount); n++) {
+        IndexEntry entry;
 
+        if (b < baseCount && !Index_DecodeEntry(baseEntries +
+                                                (size_t)b * TOTAL_ENTRYSIZE,
+                                                &entry)) {
+            WARNING("Index has corrupt entries please rebuild it!");
+            throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
+        }
+
+        if (b == baseCount ||
+            (l != index.end() && !(entry.info.hash < l->first))) {
+            // The log entry replaces a base entry for the same object
+            if (b < baseCount && entry.info.hash == l->first)
+                b++;
+            infos->push_back(l->second.info);
+            l++;
+        } else {
+            infos->push_back(entry.info);
+            b++;
+        }
+    }
+}
+
+size_t
+Index::size() const
+{
+    RWKey::sp key = lock.readLock();
+    map<ObjectHash, IndexEntry>::const_iterator it;
+    size_t num = baseCount;
+
+    for (it = index.begin(); it != index.end(); it++) {
+        if (_findBase(it->first) == NULL)
+            num++;
+    }
+
+    return num;
+}
+
+/*
+ * Maps the sorted base index if one exists.
+ */
 void
-Index::_writeEntry(const IndexEntry &e)
+Index::_openBase()
 {
-    strwstream ss;
+    struct stat sb;
+    string baseFile = fileName + INDEX_SORTED_SUFFIX;
 
-    string info_str = e.info.toString();
-    ss.write(info_str.data(), info_str.size());
+    baseFd = ::open(baseFile.c_str(), O_RDONLY);
+    if (baseFd < 0) {
+        if (errno == ENOENT)
+            return;
+        WARNING("Could not open the sorted index file!");
+        throw SystemException();
+    }
 
-    ss.writeUInt32(e.offset);
-    ss.writeUInt32(e.packed_size);
-    ss.writeUInt32(e.packfile);
+    if (::fstat(baseFd, &sb) < 0) {
+        int errcode = errno;
+        _closeBase();
+        WARNING("Could not fstat the sorted index file!");
+        throw SystemException(errcode);
+    }
 
-    ObjectHash checksum = OriCrypt_HashString(ss.str());
-    ss.write(checksum.hash, 16);
+    if ((size_t)sb.st_size < INDEX_BASE_ENTRYOFF) {
+        _closeBase();
+        WARNING("Sorted index is truncated please rebuild it!");
+        throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
+    }
+
+    baseLen = sb.st_size;
+    void *map = mmap(NULL, baseLen, PROT_READ, MAP_SHARED, baseFd, 0);
+    if (map == MAP_FAILED) {
+        int errcode = errno;
+        baseLen = 0;
+        _closeBase();
+        WARNING("Could not mmap the sorted index file!");
+        throw SystemException(errcode);
+    }
+    baseMap = (const uint8_t *)map;
+#ifdef MADV_RANDOM
+    madvise(map, baseLen, MADV_RANDOM);
+#endif
+
+    string hdr_str((const char *)baseMap, INDEX_BASE_HDRSIZE);
+    ObjectHash checksum = OriCrypt_HashString(hdr_str);
+    if (memcmp(baseMap, INDEX_BASE_MAGIC, 4) != 0 ||
+        memcmp(baseMap + INDEX_BASE_HDRSIZE, checksum.hash, 16) != 0) {
+        _closeBase();
+        WARNING("Sorted index has a corrupt header please rebuild it!");
+        throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
+    }
+
+    strstream hdr(hdr_str, 4);
+    uint32_t version = hdr.readUInt32();
+    if (version != INDEX_BASE_VERSION) {
+        _closeBase();
+        WARNING("Sorted index has an unsupported version!");
+        throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
+    }
+    baseCount = hdr.readUInt32();
+    for (int i = 0; i < 256; i++) {
+        fanout[i] = hdr.readUInt32();
+    }
+
+    if (fanout[255] != baseCount ||
+        baseLen != INDEX_BASE_ENTRYOFF + (size_t)baseCount * TOTAL_ENTRYSIZE) {
+        _closeBase();
+        WARNING("Sorted index seems dirty please rebuild it!");
+        throw RuntimeException(ORIEC_INDEXDIRTY, "Index dirty");
+    }
+
+    baseEntries = baseMap + INDEX_BASE_ENTRYOFF;
+}
+
+void
+Index::_closeBase()
+{
+    if (baseMap != NULL) {
+        munmap((void *)baseMap, baseLen);
+    }
+    if (baseFd != -1) {
+        ::close(baseFd);
+    }
+    baseFd = -1;
+    baseMap = NULL;
+    baseLen = 0;
+    baseEntries = NULL;
+    baseCount = 0;
+    memset(fanout, 0, sizeof(fanout));
+}
+
+/*
+ * Checked by the writer before it appends to the log.  The log is rewritten
+ * if open found it torn or written before the sorted base existed, or once
+ * it reaches a fixed fraction of the base.  The last bounds both the log
+ * read on open and the amortized cost of rewriting the base.
+ */
+bool
+Index::_needsRewrite() const
+{
+    if (rewriteLog)
+        return true;
+
+    return index.size() > INDEX_REWRITE_MINENTRIES &&
+           index.size() > baseCount / INDEX_REWRITE_RATIO;
+}
+
+/*
+ * Binary search of the sorted base within the fanout bucket of the first
+ * hash byte.  Returns a pointer to the raw entry or NULL.
+ */
+const uint8_t *
+Index::_findBase(const ObjectHash &objId) const
+{
+    uint8_t first = objId.hash[0];
+    uint32_t lo = (first == 0) ? 0 : fanout[first - 1];
+    uint32_t hi = fanout[first];
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const uint8_t *entry = baseEntries + (size_t)mid * TOTAL_ENTRYSIZE;
+        int cmp = memcmp(entry + INDEX_HASHOFF, objId.hash, ObjectHash::SIZE);
+
+        if (cmp == 0)
+            return entry;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+/*
+ * Must be called with the lock held.
+ */
+bool
+Index::_lookup(const ObjectHash &objId, IndexEntry *entry) const
+{
+    map<ObjectHash, IndexEntry>::const_iterator it = index.find(objId);
+    if (it != index.end()) {
+        *entry = (*it).second;
+        return true;
+    }
+
+    const uint8_t *baseEntry = _findBase(objId);
+    if (baseEntry == NULL)
+        return false;
+
+    if (!Index_DecodeEntry(baseEntry, entry)) {
+        WARNING("Index has corrupt entries please rebuild it!");
+        throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
+    }
 
-    const string &final = ss.str();
+    return true;
+}
+
+void
+Index::_writeEntry(const IndexEntry &e)
+{
+    const string &final = Index_EncodeEntry(e);
     ASSERT(final.size() == TOTAL_ENTRYSIZE);
     write(fd, final.data(), final.size());
 }
-
@@ -27,20 +27,23 @@
 #include <errno.h>
 
 #include <string>
+#include <vector>
 #include <sstream>
 #include <iostream>
 #include <iomanip>
-
-#include <openssl/sha.h>
-
-#ifdef OPENSSL_NO_SHA256
-#error "SHA256 not supported!"
-#endif
+#include <functional>
+#include <memory>
 
 #include <oriutil/debug.h>
 #include <oriutil/oricrypt.h>
+#include <oriutil/threadpool.h>
 #include <ori/largeblob.h>
 
+#include "tuneables.h"
+
+// Ranges shorter than this are stored as a single chunk
+#define LARGEBLOB_MINRANGE      64
+
 #ifdef ORI_USE_RK
 #include "rkchunker.h"
 #endif /* ORI_USE_RK */
@@ -90,61 +93,112 @@ LargeBlob::~LargeBlob()
 {
 }
 
+/*
+ * A chunk found by the chunker, as an offset into the chunking buffer.
+ */
+struct FileChunk {
+    uint64_t off;
+    uint32_t len;
+    ObjectHash hash;
+};
+
+/*
+ * Hashes the chunks in [first, last).
+ */
+static void
+LargeBlob_HashChunks(const uint8_t *buf, vector<FileChunk> *chunks,
+                     size_t first, size_t last)
+{
+    for (size_t i = first; i < last; i++) {
+        FileChunk &fc = (*chunks)[i];
+        fc.hash = OriCrypt_HashBlob(buf + fc.off, fc.len);
+    }
+}
+
+/*
+ * Reads a LargeBlobSource from the start of the given file.
+ */
+class FdSource : public LargeBlobSource
+{
+public:
+    explicit FdSource(int fd) : fd(fd) { }
+    ssize_t read(uint8_t *buf, size_t s, off_t off)
+    {
+        size_t total = 0;
+
+        while (total < s) {
+            ssize_t status = pread(fd, buf + total, s - total, off + total);
+            if (status < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -errno;
+            }
+            if (status == 0)
+                break;
+            total += status;
+        }
+
+        return total;
+    }
+private:
+    int fd;
+};
+
+/*
+ * Reads a range of the source once.  Each read is fed to the running hash of
+ * the whole file and to the chunker, matches are only recorded as offsets
+ * into the buffer.  Before the buffer is recycled the recorded chunks are
+ * hashed, on the shared pool when there are enough of them, and added to the
+ * repository in file order.  The chunks are placed at their source offsets
+ * in the LargeBlob.
+ */
 class FileChunkerCB : public ChunkerCB
 {
 public:
-    FileChunkerCB(LargeBlob *l)
+    FileChunkerCB(LargeBlob *l, OriCryptHash *total)
     {
         lb = l;
         lbOff = 0;
+        src = NULL;
+        totalState = total;
         buf = NULL;
     }
     ~FileChunkerCB()
     {
         if (buf)
             delete[] buf;
-        if (srcFd > 0)
-            ::close(srcFd);
     }
-    int open(const string &path)
+    int open(LargeBlobSource *s, uint64_t off, uint64_t len)
     {
-        struct stat sb;
-
-        bufLen = 8 * 1024 * 1024;
+        bufLen = MIN(8 * 1024 * 1024, len);
         buf = new uint8_t[bufLen];
         if (buf == NULL)
             return -ENOMEM;
 
-        srcFd = ::open(path.c_str(), O_RDONLY);
-        if (srcFd < 0)
-            return -errno;
-
-        if (fstat(srcFd, &sb) < 0) {
-            close(srcFd);
-            return -errno;
-        }
-        fileLen = sb.st_size;
+        src = s;
+        srcOff = off;
+        lbOff = off;
+        fileLen = len;
         fileOff = 0;
 
         return 0;
     }
     virtual void match(const uint8_t *b, uint32_t l)
     {
-        // Add the fragment into the repository
-        // XXX: Journal for cleanup!
-        string blob = string((const char *)b, l);
-        ObjectHash hash = OriCrypt_HashString(blob);
-        lb->repo->addObject(ObjectInfo::Blob, hash, blob);
-
-        // Add the fragment to the LargeBlob object.
-        lb->parts.insert(make_pair(lbOff, LBlobEntry(hash, l)));
-        lbOff += l;
+        FileChunk fc;
+
+        fc.off = b - buf;
+        fc.len = l;
+        chunks.push_back(fc);
     }
     virtual int load(uint8_t **b, uint64_t *l, uint64_t *o)
     {
         if (*b == NULL)
             *b = buf;
 
+        // Chunks point into the buffer, finish them before it moves
+        flush();
+
         if (fileOff == fileLen)
             return 0;
 
@@ -156,21 +210,24 @@ public:
         if (*o != 0 || *o != *l) {
             ASSERT(*o > 32); // XXX: Must equal hashLen
             ASSERT(*l > 32);
-            memcpy(buf, buf + *o - 32, *l - *o + 32);
+            memmove(buf, buf + *o - 32, *l - *o + 32);
             *l = *l - *o + 32;
             *o = 32;
         }
 
         uint64_t toRead = MIN(bufLen - *l, fileLen - fileOff);
-        int status;
+        ssize_t status;
 
-        status = read(srcFd, buf + *l, toRead);
+        status = src->read(buf + *l, toRead, srcOff + fileOff);
         if (status < 0) {
+            errno = -status;
             perror("Cannot read large file");
             PANIC();
             return -1;
         }
-        ASSERT(status == (int)toRead);
+        ASSERT(status == (ssize_t)toRead);
+
+        totalState->update(buf + *l, status);
 
         fileOff += status;
         *l += status;
@@ -178,24 +235,68 @@ public:
 
         return 1;
     }
+    void flush()
+    {
+        if (chunks.size() == 0)
+            return;
+
+        std::shared_ptr<ThreadPool> pool = ThreadPool::shared();
+        size_t slices = pool->size();
+
+        if (chunks.size() < LARGEFILE_HASHMINCHUNKS || slices <= 1) {
+            LargeBlob_HashChunks(buf, &chunks, 0, chunks.size());
+        } else {
+            TaskGroup group(pool.get());
+            size_t per = (chunks.size() + slices - 1) / slices;
+
+            for (size_t i = 0; i < chunks.size(); i += per) {
+                size_t last = MIN(i + per, chunks.size());
+                group.run(std::bind(LargeBlob_HashChunks, buf, &chunks,
+                                    i, last));
+            }
+            group.wait();
+        }
+
+        for (size_t i = 0; i < chunks.size(); i++) {
+            const FileChunk &fc = chunks[i];
+
+            // Add the fragment into the repository
+            // XXX: Journal for cleanup!
+            lb->repo->addObject(ObjectInfo::Blob, fc.hash,
+                                string((const char *)buf + fc.off, fc.len));
+
+            // Add the fragment to the LargeBlob object.
+            lb->parts.insert(make_pair(lbOff, LBlobEntry(fc.hash, fc.len)));
+            lbOff += fc.len;
+        }
+        chunks.clear();
+    }
 private:
     // Output large blob
     LargeBlob *lb;
     uint64_t lbOff;
-    // Input file
-    int srcFd;
+    // Input range
+    LargeBlobSource *src;
+    uint64_t srcOff;
     uint64_t fileLen;
     uint64_t fileOff;
+    OriCryptHash *totalState;
     // RK buffer
     uint8_t *buf;
     uint64_t bufLen;
+    // Chunks not yet added
+    vector<FileChunk> chunks;
 };
 
-void
-LargeBlob::chunkFile(const string &path)
+/*
+ * Chunks len bytes of src at off into lb.
+ */
+static void
+LargeBlob_ChunkRange(LargeBlob *lb, LargeBlobSource *src, uint64_t off,
+                     uint64_t len, OriCryptHash *total)
 {
     int status;
-    FileChunkerCB cb = FileChunkerCB(this);
+    FileChunkerCB cb = FileChunkerCB(lb, total);
 #ifdef ORI_USE_RK
     RKChunker<4096, 2048, 8192> c = RKChunker<4096, 2048, 8192>();
 #endif /* ORI_USE_RK */
@@ -205,16 +306,124 @@ LargeBlob::chunkFile(const string &path)
     FChunker<32*1024> c = FChunker<32*1024>();
 #endif /* ORI_USE_FIXED */
 
-    status = cb.open(path);
+    // The chunker needs a full hash window, short ranges are one chunk
+    if (len < LARGEBLOB_MINRANGE) {
+        uint8_t buf[LARGEBLOB_MINRANGE];
+        ObjectHash hash;
+        ssize_t n = src->read(buf, len, off);
+
+        if (n != (ssize_t)len) {
+            perror("Cannot read large file");
+            PANIC();
+            return;
+        }
+        total->update(buf, len);
+        hash = OriCrypt_HashBlob(buf, len);
+        lb->repo->addObject(ObjectInfo::Blob, hash,
+                            string((const char *)buf, len));
+        lb->parts.insert(make_pair(off, LBlobEntry(hash, len)));
+        return;
+    }
+
+    status = cb.open(src, off, len);
     if (status < 0) {
+        errno = -status;
         perror("Cannot open large file for chunking");
         PANIC();
         return;
     }
 
-    totalHash = OriCrypt_HashFile(path);
-
     c.chunk(&cb);
+    cb.flush();
+}
+
+void
+LargeBlob::chunkFile(const string &path)
+{
+    OriCryptHash total;
+    struct stat sb;
+    int fd;
+
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0 || fstat(fd, &sb) < 0) {
+        perror("Cannot open large file for chunking");
+        PANIC();
+        return;
+    }
+
+    FdSource src = FdSource(fd);
+
+    LargeBlob_ChunkRange(this, &src, 0, sb.st_size, &total);
+    totalHash = total.final();
+
+    ::close(fd);
+}
+
+/*
+ * Builds the blob of a file that was modified in place from the blob of its
+ * previous contents.  changed maps the start of every modified byte range to
+ * its end.  Chunks of base that lie within size and do not overlap a changed
+ * range are kept at their offsets, the gaps between them are read from src
+ * and chunked again.  The whole file is still hashed for totalHash, the kept
+ * chunks are read back from the repository for that.
+ */
+void
+LargeBlob::rechunk(const LargeBlob &base,
+                   const map<uint64_t, uint64_t> &changed,
+                   uint64_t size, LargeBlobSource *src)
+{
+    OriCryptHash total;
+    map<uint64_t, LBlobEntry>::const_iterator it = base.parts.begin();
+    uint64_t off = 0;
+
+    parts.clear();
+
+    while (off < size) {
+        // Next chunk of base that can be kept
+        for (; it != base.parts.end(); it++) {
+            uint64_t start = (*it).first;
+            uint64_t end = start + (*it).second.length;
+            map<uint64_t, uint64_t>::const_iterator c;
+
+            if (start < off)
+                continue;
+            if (end > size) {
+                it = base.parts.end();
+                break;
+            }
+
+            // First changed range ending after start
+            c = changed.upper_bound(start);
+            if (c != changed.begin()) {
+                c--;
+                if ((*c).second <= start)
+                    c++;
+            }
+            if (c == changed.end() || (*c).first >= end)
+                break;
+        }
+
+        uint64_t next = (it == base.parts.end()) ? size : (*it).first;
+        if (next > off)
+            LargeBlob_ChunkRange(this, src, off, next - off, &total);
+        if (it == base.parts.end())
+            break;
+
+        Object::sp o(repo->getObject((*it).second.hash));
+        if (!o) {
+            LOG("missing blob %s in LB", (*it).second.hash.hex().c_str());
+            PANIC();
+            return;
+        }
+        string payload = o->getPayload();
+        ASSERT(payload.size() == (*it).second.length);
+        total.update((const uint8_t *)payload.data(), payload.size());
+        parts.insert(*it);
+        off = next + (*it).second.length;
+        it++;
+    }
+
+    totalHash = total.final();
 }
 
 void
@@ -256,49 +465,61 @@ LargeBlob::extractFile(const string &path)
 #endif /* DEBUG */
 }
 
+/*
+ * Finds the chunk holding off in O(log n) and copies consecutive chunks
+ * until the buffer is full.  The chunks following the read are prefetched
+ * so that sequential readers find them in memory.
+ */
 ssize_t
 LargeBlob::read(uint8_t *buf, size_t s, off_t off) const
 {
     map<uint64_t, LBlobEntry>::const_iterator it;
-    // XXX: Using upper/lower_bound should be faster
+    size_t total = 0;
 
-    for (it = parts.begin(); it != parts.end(); it++) {
-        if ((*it).first <= off && ((*it).first + (*it).second.length) > off)
-            break;
+    it = parts.upper_bound(off);
+    if (it == parts.begin()) {
+        LOG("offset %" PRIu64 " before first blob in LB", off);
+        return 0;
     }
+    it--;
 
-    if (it == parts.end()) {
+    if ((*it).first + (*it).second.length <= (uint64_t)off) {
         LOG("offset %" PRIu64 " larger than large blob", off);
         return 0;
     }
 
-    off_t part_off = off - (*it).first;
-    if (part_off >= (*it).second.length) {
-        LOG("offset %" PRIu64 " larger than last blob in LB", off);
-        ASSERT(false);
-        return 0;
-    }
-    if (part_off < 0) {
-        LOG("part_off less than 0");
-        ASSERT(false);
-        return -EIO;
-    }
+    while (total < s && it != parts.end()) {
+        uint64_t part_off = off + total - (*it).first;
+        size_t to_read = MIN((*it).second.length - part_off, s - total);
 
-    int left = (*it).second.length - part_off;
-    if (left <= 0) {
-        LOG("incorrect computation of left! (%d)", left);
-        ASSERT(false);
-        return -EIO;
-    }
+        Object::sp o(repo->getObject((*it).second.hash));
+        if (!o) {
+            LOG("missing blob %s in LB", (*it).second.hash.hex().c_str());
+            return total > 0 ? total : -EIO;
+        }
+        ASSERT(o->getInfo().type == ObjectInfo::Blob);
+
+        if (part_off == 0 && to_read == (*it).second.length) {
+            // Whole chunk, decode straight into the caller's buffer
+            bytestream::ap bs(o->getPayloadStream());
+            bs->readExact(buf + total, to_read);
+        } else {
+            const std::string &payload = o->getPayload();
+            memcpy(buf + total, payload.data() + part_off, to_read);
+        }
 
-    size_t to_read = MIN((size_t)left, s);
+        total += to_read;
+        it++;
+    }
 
-    Object::sp o(repo->getObject((*it).second.hash));
-    ASSERT(o->getInfo().type == ObjectInfo::Blob);
-    const std::string &payload = o->getPayload();
-    memcpy(buf, payload.data()+part_off, to_read);
+    ObjectHashVec next;
+    for (; it != parts.end() && next.size() < LARGEFILE_PREFETCHCHUNKS; it++) {
+        next.push_back((*it).second.hash);
+    }
+    if (next.size() > 0)
+        repo->prefetchObjects(next);
 
-    return to_read;
+    return total;
 }
 
 const string
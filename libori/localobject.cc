@@ -52,7 +52,7 @@ using namespace std;
  * Object
  */
 LocalObject::LocalObject(PfTransaction::sp transaction, size_t ix)
-    : Object(transaction->infos[ix]), transaction(transaction), ix_tr(ix),
+    : Object(transaction->getInfo(ix)), transaction(transaction), ix_tr(ix),
       packfile()
 {
 }
@@ -66,22 +66,13 @@ LocalObject::~LocalObject()
 {
 }
 
-// XXX: Eliminate duplicate compression code!
 bytestream *LocalObject::getPayloadStream() {
     if (packfile.get()) {
         return packfile->getPayload(entry);
     }
     if (transaction.get()) {
-        switch(info.getAlgo()) {
-            case ObjectInfo::ZIPALGO_NONE:
-                return new strstream(transaction->payloads[ix_tr]);
-            case ObjectInfo::ZIPALGO_FASTLZ:
-                return new zipstream(new strstream(transaction->payloads[ix_tr]),
-                                     DECOMPRESS, info.payload_size);
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
-        }
+        return zipstream::decode(new strstream(transaction->getPayload(ix_tr)),
+                                 info);
     }
     return NULL;
 }
@@ -29,11 +29,14 @@
 #include <deque>
 #include <queue>
 #include <set>
+#include <unordered_set>
 #include <algorithm>
 #include <sstream>
 #include <iomanip>
 #include <iostream>
 #include <functional>
+#include <exception>
+#include <atomic>
 
 #include <ori/version.h>
 #include <oriutil/debug.h>
@@ -51,6 +54,8 @@
 #include <ori/sshrepo.h>
 #include <ori/remoterepo.h>
 
+#include "tuneables.h"
+
 using namespace std;
 
 #define ORI_DIR_MASK        0755
@@ -165,6 +170,13 @@ LocalRepo_Init(const string &rootPath, bool bareRepo, const string &uuid)
     write(fd, ORI_FS_VERSION_STR, strlen(ORI_FS_VERSION_STR));
     close(fd);
 
+    // Record the compression policy
+    if (!OriFile_WriteFile(ObjectInfo::getStrForAlgo(REPO_DEFAULT_ZIPALGO),
+                           oriPath + ORI_PATH_COMPRESSION)) {
+        perror("Could not create compression file");
+        return 1;
+    }
+
     return 0;
 }
 
@@ -195,8 +207,23 @@ LocalRepoLock::~LocalRepoLock()
  *
  ********************************************************************/
 
+/*
+ * The default pool is shared by all repositories in the process, an
+ * explicit thread count gets a pool of its own.
+ */
+static std::shared_ptr<ThreadPool>
+LocalRepo_NewPool(int threads)
+{
+    if (threads < 0)
+        return ThreadPool::shared();
+
+    return std::shared_ptr<ThreadPool>(new ThreadPool(threads));
+}
+
 LocalRepo::LocalRepo(const string &root)
     : opened(false),
+      workerThreads(REPO_WORKERTHREADS),
+      compression(ObjectInfo::ZIPALGO_FASTLZ),
       remoteRepo(NULL)
 {
     rootPath = (root == "") ? findRootPath() : root;
@@ -245,6 +272,18 @@ LocalRepo::open(const string &root)
             WARNING("LocalRepo::open: Unsupported file system version!");
             throw RuntimeException(ORIEC_UNSUPPORTEDVERSION, "Unsuppported file system version!");
         }
+
+        // Read compression policy, repositories without one use FastLZ
+        compression = ObjectInfo::ZIPALGO_FASTLZ;
+        if (OriFile_Exists(rootPath + ORI_PATH_COMPRESSION)) {
+            string algo = OriFile_ReadFile(rootPath + ORI_PATH_COMPRESSION);
+            compression = ObjectInfo::getAlgoForStr(algo);
+            if (!zipstream::hasAlgo(compression)) {
+                WARNING("LocalRepo::open: Compression '%s' unsupported, "
+                        "using FastLZ", algo.c_str());
+                compression = ObjectInfo::ZIPALGO_FASTLZ;
+            }
+        }
     } catch (std::ios_base::failure &e) {
         WARNING("LocalRepo::open: %s", e.what());
         throw SystemException();
@@ -271,6 +310,7 @@ LocalRepo::open(const string &root)
         throw e;
     }
     packfiles.reset(new PackfileManager(getRootPath() + ORI_PATH_OBJS));
+    workers = LocalRepo_NewPool(workerThreads);
 
     // Scan for peers
     string peer_path = rootPath + ORI_PATH_REMOTES;
@@ -301,13 +341,54 @@ LocalRepo::close()
 
     sync();
 
-    currTransaction.reset();
+    // A new packfile is started on the next open
+    sealPackfile();
+
+    setTransaction(PfTransaction::sp());
+    workers.reset();
     index.close();
     snapshots.close();
     packfiles.reset();
     opened = false;
 }
 
+/*
+ * Sets the number of threads used to hash and compress new objects, a
+ * negative count selects one per CPU and zero does the work inline.
+ * Transactions already under way keep their pool.
+ */
+void
+LocalRepo::setWorkerThreads(int threads)
+{
+    workerThreads = threads;
+    if (opened)
+        workers = LocalRepo_NewPool(workerThreads);
+}
+
+/*
+ * Sets the compression policy.  New objects are compressed with algo when
+ * it makes them smaller, existing objects keep the algorithm they were
+ * stored with.
+ */
+void
+LocalRepo::setCompression(ObjectInfo::ZipAlgo algo)
+{
+    if (!zipstream::hasAlgo(algo))
+        throw RuntimeException(ORIEC_INVALIDARGS,
+                               "Compression algorithm not supported");
+
+    if (!OriFile_WriteFile(ObjectInfo::getStrForAlgo(algo),
+                           rootPath + ORI_PATH_COMPRESSION))
+        throw SystemException();
+    compression = algo;
+}
+
+ObjectInfo::ZipAlgo
+LocalRepo::getCompression() const
+{
+    return compression;
+}
+
 LocalRepoLock::sp
 LocalRepo::lock()
 {
@@ -426,25 +507,50 @@ LocalObject::sp LocalRepo::getLocalObject(const ObjectHash &objId)
 {
     ASSERT(opened);
 
-    if (currTransaction.get()) {
-        if (currTransaction->has(objId)) {
-            return LocalObject::sp(new LocalObject(currTransaction,
-                        currTransaction->hashToIx[objId]));
-        }
+    PfTransaction::sp tr = getTransaction();
+    size_t ix;
+    if (tr.get() && tr->find(objId, &ix)) {
+        return LocalObject::sp(new LocalObject(tr, ix));
     }
 
     /*
      * The object may not be present locally as is the case with
      * instacloning.
      */
-    if (!index.hasObject(objId))
+    IndexEntry ie;
+    if (!index.lookup(objId, &ie))
 	return LocalObject::sp();
 
-    const IndexEntry &ie = index.getEntry(objId);
     Packfile::sp packfile = packfiles->getPackfile(ie.packfile);
     return LocalObject::sp(new LocalObject(packfile, ie));
 }
 
+/*
+ * Returns the open transaction, readers keep their own reference so the
+ * writer may commit and replace it at any time.
+ */
+PfTransaction::sp
+LocalRepo::getTransaction()
+{
+    Monitor lock(txLock);
+
+    return currTransaction;
+}
+
+/*
+ * Called only by the writer.
+ */
+void
+LocalRepo::setTransaction(PfTransaction::sp tr)
+{
+    {
+        Monitor lock(txLock);
+        currTransaction.swap(tr);
+    }
+
+    // The old transaction is released (and committed) outside the lock
+}
+
 void
 LocalRepo::createObjDirs(const ObjectHash &objId)
 {
@@ -497,18 +603,22 @@ LocalRepo::addObject(ObjectType type, const ObjectHash &hash,
 
     if (!currPackfile.get()) {
         currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
+        setTransaction(currPackfile->begin(&index, workers, compression));
     }
 
     if (!currTransaction.get()) {
-        currTransaction = currPackfile->begin(&index);
+        // Transactions committed by sync may have filled the packfile
+        if (currPackfile->full()) {
+            sealPackfile();
+            currPackfile = packfiles->newPackfile();
+        }
+        setTransaction(currPackfile->begin(&index, workers, compression));
     }
 
     if (currTransaction->full()) {
-        currTransaction->commit();
-        currTransaction.reset();
+        sealPackfile();
         currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
+        setTransaction(currPackfile->begin(&index, workers, compression));
     }
 
     ObjectInfo info(hash);
@@ -616,6 +726,110 @@ LocalRepo::getPayload(const ObjectHash &objId)
     return bs->readAll();
 }
 
+/*
+ * Small files are read and hashed on the worker pool, about
+ * REPO_ADDFILES_BATCHBYTES at a time, and then added in order so the
+ * packfile contents don't depend on thread scheduling.  Large files are
+ * added one at a time since chunking already hashes in parallel.
+ */
+vector<pair<ObjectHash, ObjectHash> >
+LocalRepo::addFiles(const vector<string> &paths)
+{
+    vector<pair<ObjectHash, ObjectHash> > rval(paths.size());
+    vector<size_t> sizes(paths.size());
+    size_t i = 0;
+
+    for (size_t j = 0; j < paths.size(); j++) {
+        sizes[j] = OriFile_GetSize(paths[j]);
+    }
+
+    while (i < paths.size()) {
+        if (sizes[i] > LARGEFILE_MINIMUM) {
+            rval[i] = addLargeFile(paths[i]);
+            i++;
+            continue;
+        }
+
+        size_t first = i;
+        size_t bytes = 0;
+        while (i < paths.size() && sizes[i] <= LARGEFILE_MINIMUM &&
+               bytes < REPO_ADDFILES_BATCHBYTES) {
+            bytes += sizes[i];
+            i++;
+        }
+
+        vector<string> blobs(i - first);
+        exception_ptr error;
+        Mutex errorLock;
+        TaskGroup group(workers.get());
+        for (size_t j = first; j < i; j++) {
+            group.run([&, j]() {
+                try {
+                    diskstream ds(paths[j]);
+                    blobs[j - first] = ds.readAll();
+                    rval[j].first = OriCrypt_HashString(blobs[j - first]);
+                } catch (...) {
+                    errorLock.lock();
+                    error = current_exception();
+                    errorLock.unlock();
+                }
+            });
+        }
+        group.wait();
+        if (error)
+            rethrow_exception(error);
+
+        for (size_t j = first; j < i; j++) {
+            addObject(ObjectInfo::Blob, rval[j].first, blobs[j - first]);
+        }
+    }
+
+    return rval;
+}
+
+/*
+ * Hint the packfile ranges holding the given objects to the kernel.
+ * Objects that sit next to each other in a packfile are merged into a
+ * single range.
+ */
+void
+LocalRepo::prefetchObjects(const ObjectHashVec &objs)
+{
+    vector<IndexEntry> entries;
+
+    for (size_t i = 0; i < objs.size(); i++) {
+        if (index.hasObject(objs[i]))
+            entries.push_back(index.getEntry(objs[i]));
+    }
+    if (entries.size() == 0)
+        return;
+
+    sort(entries.begin(), entries.end(),
+         [](const IndexEntry &a, const IndexEntry &b) {
+             if (a.packfile != b.packfile)
+                 return a.packfile < b.packfile;
+             return a.offset < b.offset;
+         });
+
+    packid_t id = entries[0].packfile;
+    offset_t start = entries[0].offset;
+    offset_t end = start + entries[0].packed_size;
+    for (size_t i = 1; i <= entries.size(); i++) {
+        if (i < entries.size() && entries[i].packfile == id &&
+            entries[i].offset <= end + PACKFILE_PREFETCH_GAP) {
+            end = MAX(end, entries[i].offset + entries[i].packed_size);
+            continue;
+        }
+
+        packfiles->getPackfile(id)->prefetch(start, end - start);
+        if (i < entries.size()) {
+            id = entries[i].packfile;
+            start = entries[i].offset;
+            end = start + entries[i].packed_size;
+        }
+    }
+}
+
 /*
  * Get an object length.
  */
@@ -764,6 +978,22 @@ LocalRepo::listObjects()
     return index.getList();
 }
 
+vector<ObjectInfo>
+LocalRepo::listObjects(const ObjectHash &after, size_t max)
+{
+    vector<ObjectInfo> infos;
+
+    index.getList(after, max, &infos);
+
+    return infos;
+}
+
+size_t
+LocalRepo::numObjects()
+{
+    return index.size();
+}
+
 /*
  * This gu
  */
@@ -774,34 +1004,44 @@ LocalRepo::sync()
     if (currTransaction.get()) {
         full = currTransaction->full();
         currTransaction->commit();
-        currTransaction.reset();
-        index.sync();
+        full = full || currPackfile->full();
+        setTransaction(PfTransaction::sp());
         metadata.sync();
     }
     if (full) {
+        sealPackfile();
         currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
+        setTransaction(currPackfile->begin(&index, workers, compression));
     }
 }
 
-struct RebuildIndexStruct
+/*
+ * Seals the current packfile once the writer moves on from it, committing
+ * any transaction still open on it first.
+ */
+void
+LocalRepo::sealPackfile()
 {
-    Index *idx;
-    packid_t id;
-};
+    if (!currPackfile.get())
+        return;
+
+    PfTransaction::sp tr = getTransaction();
+    if (tr.get()) {
+        if (!tr->committed)
+            tr->commit();
+        setTransaction(PfTransaction::sp());
+    }
+
+    currPackfile->seal();
+    currPackfile.reset();
+}
 
 void
-rebuildIndexCb(const ObjectInfo &info, offset_t off, void *arg)
+rebuildIndexCb(const IndexEntry &entry, void *arg)
 {
-    RebuildIndexStruct *ris = (RebuildIndexStruct *)arg;
-    struct IndexEntry entry;
+    vector<IndexEntry> *entries = (vector<IndexEntry> *)arg;
 
-    entry.info = info;
-    entry.offset = off;
-    entry.packed_size = info.payload_size;
-    entry.packfile = ris->id;
-
-    ris->idx->updateEntry(info.hash, entry);
+    entries->push_back(entry);
 }
 
 bool
@@ -811,23 +1051,40 @@ LocalRepo::rebuildIndex()
     index.close();
 
     OriFile_Delete(indexPath);
+    if (OriFile_Exists(indexPath + INDEX_SORTED_SUFFIX))
+        OriFile_Delete(indexPath + INDEX_SORTED_SUFFIX);
 
     index.open(indexPath);
 
     vector<packid_t> pfIds = packfiles->getPackfileList();
-    vector<packid_t>::iterator it;
+    vector<vector<IndexEntry> > entries(pfIds.size());
+    atomic<bool> failed(false);
 
-    for (it = pfIds.begin(); it != pfIds.end(); it++)
+    // Sealed packfiles only need their table of contents read
     {
-        RebuildIndexStruct ris;
-        Packfile::sp pf = packfiles->getPackfile(*it);
+        TaskGroup group(workers.get());
+
+        for (size_t i = 0; i < pfIds.size(); i++) {
+            group.run([this, &pfIds, &entries, &failed, i]() {
+                try {
+                    Packfile::sp pf = packfiles->getPackfile(pfIds[i]);
+                    pf->readEntries(rebuildIndexCb, (void *)&entries[i]);
+                } catch (exception &e) {
+                    WARNING("Cannot read packfile %u: %s", pfIds[i], e.what());
+                    failed = true;
+                }
+            });
+        }
+    }
 
-        ris.idx = &index;
-        ris.id = *it;
-        pf->readEntries(rebuildIndexCb, (void *)&ris);
+    index.beginBatch();
+    for (size_t i = 0; i < entries.size(); i++) {
+        for (size_t j = 0; j < entries[i].size(); j++)
+            index.updateEntry(entries[i][j].info.hash, entries[i][j]);
     }
+    index.commitBatch();
     
-    return true;
+    return !failed;
 }
 
 void
@@ -837,10 +1094,11 @@ LocalRepo::dumpIndex()
 }
 
 void
-packfileDumper(const ObjectInfo &info, offset_t off, void *arg)
+packfileDumper(const IndexEntry &entry, void *arg)
 {
-    info.print();
-    printf("  packfile: offset = 0x%x\n", off);
+    entry.info.print();
+    printf("  packfile: offset = 0x%x, stored size = %u\n", entry.offset,
+           entry.packed_size);
 }
 
 void
@@ -856,6 +1114,24 @@ LocalRepo::dumpPackfile(packid_t id)
     packfile->readEntries(packfileDumper, NULL);
 }
 
+vector<packid_t>
+LocalRepo::listPackfiles()
+{
+    return packfiles->getPackfileList();
+}
+
+/*
+ * Verify the checksums of every object stored in a sealed packfile.
+ */
+string
+LocalRepo::verifyPackfile(packid_t id)
+{
+    if (!packfiles->hasPackfile(id))
+        return "Packfile not found!";
+
+    return packfiles->getPackfile(id)->verify();
+}
+
 bool _timeCompare(const Commit &c1, const Commit &c2) {
     return c1.getTime() < c2.getTime();
 }
@@ -865,17 +1141,20 @@ LocalRepo::listCommits()
 {
     vector<Commit> rval;
 
-    // TODO: more efficient
-    set<ObjectInfo> objs = listObjects();
-    for (set<ObjectInfo>::iterator it = objs.begin();
-            it != objs.end();
-            it++) {
-        const ObjectInfo &oi = *it;
-        if (oi.type == ObjectInfo::Commit) {
-            const Commit &c = getCommit(oi.hash);
-            rval.push_back(c);
+    // Walk the index a page at a time instead of copying all of it
+    ObjectHash last;
+    vector<ObjectInfo> objs;
+    do {
+        objs = listObjects(last, 4096);
+        for (size_t i = 0; i < objs.size(); i++) {
+            if (objs[i].type == ObjectInfo::Commit) {
+                const Commit &c = getCommit(objs[i].hash);
+                rval.push_back(c);
+            }
         }
-    }
+        if (objs.size() > 0)
+            last = objs.back().hash;
+    } while (objs.size() == 4096);
 
     sort(rval.begin(), rval.end(), _timeCompare);
     return rval;
@@ -890,13 +1169,11 @@ LocalRepo::listSnapshots()
 ObjectHash
 LocalRepo::lookupSnapshot(const string &name)
 {
-    map<string, ObjectHash> snaps = snapshots.getList();
-    map<string, ObjectHash>::iterator it = snaps.find(name);
+    ObjectHash hash;
 
-    if (it != snaps.end())
-	return (*it).second;
+    snapshots.lookup(name, &hash);
 
-    return ObjectHash();
+    return hash;
 }
 
 /*
@@ -904,92 +1181,156 @@ LocalRepo::lookupSnapshot(const string &name)
  */
 
 /*
- * Pull changes from the source repository.
+ * State for a batched pull.  Hashes still to be requested sit in toPull,
+ * toPullSet dedups them against everything requested so far.  Objects
+ * whose children must be discovered (commits, trees and LargeBlobs) are
+ * also recorded in toScan and parsed as soon as their group arrives, so
+ * the next batch already carries the children of the current one.
  */
-void
-LocalRepo::pull(Repo *r)
-{
-    vector<Commit> remoteCommits = r->listCommits();
+struct PullOp {
+    PullOp(LocalRepo &r)
+        : repo(r), batches(0), objects(0)
+    {
+    }
+    LocalRepo &repo;
+
     deque<ObjectHash> toPull;
+    deque<size_t> toPullBytes;
+    unordered_set<ObjectHash> toPullSet;
+    unordered_set<ObjectHash> toScan;
 
     deque<Commit> newCommits;
 
-    for (size_t i = 0; i < remoteCommits.size(); i++) {
-        ObjectHash hash = remoteCommits[i].hash();
-        if (!hasObject(hash)) {
-            toPull.push_back(hash);
+    uint64_t batches;
+    uint64_t objects;
 
-            // TODO: partial pull
-        }
+    /// bytes is an estimate of the payload size or 0 if unknown
+    void enqueue(const ObjectHash &hash, bool scan, size_t bytes = 0) {
+        if (toPullSet.find(hash) != toPullSet.end()) return;
+        if (repo.hasObject(hash)) return;
+        toPull.push_back(hash);
+        toPullBytes.push_back(bytes);
+        toPullSet.insert(hash);
+        if (scan)
+            toScan.insert(hash);
     }
 
-    //LocalRepoLock::sp _lock(lock());
-
-    bytestream::ap objs(r->getObjects(toPull));
-    receive(objs.get());
+    /// Takes the next batch off the queue, bounded in objects and bytes
+    ObjectHashVec nextBatch() {
+        ObjectHashVec batch;
+        size_t bytes = 0;
 
-    // Perform the pull
-    while (!toPull.empty()) {
-        ObjectHash hash = toPull.front();
-        toPull.pop_front();
-
-        Object::sp o(getObject(hash));
-        if (!o) {
-            printf("Error getting object %s\n", hash.hex().c_str());
-            continue;
+        while (!toPull.empty() && batch.size() < PULL_BATCHOBJS) {
+            if (batch.size() > 0 &&
+                bytes + toPullBytes.front() > PULL_BATCHBYTES)
+                break;
+            batch.push_back(toPull.front());
+            bytes += toPullBytes.front();
+            toPull.pop_front();
+            toPullBytes.pop_front();
         }
 
-        // Enqueue the object's references
-        ObjectType t = o->getInfo().type;
-        /*printf("Pulling object %s (%s)\n", hash.c_str(),
-                Object::getStrForType(t));*/
+        return batch;
+    }
 
-        vector<ObjectHash> newObjs;
-        if (t == ObjectInfo::Commit) {
+    /// Enqueues the references of an object that was just received
+    void scan(const ObjectInfo &info) {
+        if (toScan.erase(info.hash) == 0)
+            return;
+
+        if (info.type == ObjectInfo::Commit) {
             Commit c;
-            c.fromBlob(o->getPayload());
-            if (!hasObject(c.getTree())) {
-                toPull.push_back(c.getTree());
-                newObjs.push_back(c.getTree());
-            }
+            c.fromBlob(repo.getPayload(info.hash));
+            enqueue(c.getTree(), true);
             newCommits.push_back(c);
-        } else if (t == ObjectInfo::Tree) {
+        } else if (info.type == ObjectInfo::Tree) {
             Tree t;
-            t.fromBlob(o->getPayload());
+            t.fromBlob(repo.getPayload(info.hash));
             for (map<string, TreeEntry>::iterator it = t.tree.begin();
                     it != t.tree.end();
                     it++) {
-                const ObjectHash &entry_hash = (*it).second.hash;
-                if (!hasObject(entry_hash)) {
-                    if ((*it).second.type != TreeEntry::Blob) {
-                        toPull.push_back(entry_hash);
-                    }
-                    newObjs.push_back(entry_hash);
-                }
+                const TreeEntry &te = (*it).second;
+                size_t bytes = 0;
+                if (te.type == TreeEntry::Blob && te.attrs.has(ATTR_FILESIZE))
+                    bytes = te.attrs.getAs<size_t>(ATTR_FILESIZE);
+                enqueue(te.hash, te.type != TreeEntry::Blob, bytes);
             }
-        } else if (t == ObjectInfo::LargeBlob) {
-            LargeBlob lb(this);
-            lb.fromBlob(o->getPayload());
-
+        } else if (info.type == ObjectInfo::LargeBlob) {
+            LargeBlob lb(&repo);
+            lb.fromBlob(repo.getPayload(info.hash));
             for (map<uint64_t, LBlobEntry>::iterator pit = lb.parts.begin();
                     pit != lb.parts.end();
                     pit++) {
-                const ObjectHash &h = (*pit).second.hash;
-                if (!hasObject(h)) {
-                    //toPull.push_back(h);
-                    newObjs.push_back(h);
-                }
+                enqueue((*pit).second.hash, false, (*pit).second.length);
             }
         }
+    }
+};
+
+/*
+ * Pull changes from the source repository.
+ *
+ * Objects are requested breadth first in batches of up to PULL_BATCHOBJS
+ * objects (and roughly PULL_BATCHBYTES of payload) rather than one request
+ * per tree.  Each response is consumed group by group: the group is written
+ * to the current packfile and the trees, commits and LargeBlobs in it are
+ * parsed right away so their children join the queue for the next batch.
+ * At most one batch is buffered at a time, bounding memory use regardless
+ * of the size of the pull.
+ */
+void
+LocalRepo::pull(Repo *r)
+{
+    vector<Commit> remoteCommits = r->listCommits();
+    PullOp op(*this);
+
+    for (size_t i = 0; i < remoteCommits.size(); i++) {
+        op.enqueue(remoteCommits[i].hash(), true);
+
+        // TODO: partial pull
+    }
+
+    //LocalRepoLock::sp _lock(lock());
+
+    // Perform the pull
+    while (!op.toPull.empty()) {
+        ObjectHashVec batch = op.nextBatch();
+        vector<ObjectInfo> received;
+
+        bytestream::ap objs(r->getObjects(batch));
+        op.batches++;
+        if (!objs.get()) {
+            printf("Error getting %lu objects\n", batch.size());
+            continue;
+        }
 
-        if (newObjs.size() > 0) {
-            objs.reset(r->getObjects(newObjs));
-            receive(objs.get());
+        while (true) {
+            if (!currPackfile.get() || currPackfile->full()) {
+                sealPackfile();
+                currPackfile = packfiles->newPackfile();
+            }
+            received.clear();
+            if (!currPackfile->receive(objs.get(), &index, &received))
+                break;
+            for (size_t i = 0; i < received.size(); i++) {
+                op.scan(received[i]);
+            }
+            op.objects += received.size();
         }
     }
-    while (!newCommits.empty()) {
-        Commit nc = newCommits.front();
-        newCommits.pop_front();
+
+    // Anything left to scan was never sent by the remote
+    for (unordered_set<ObjectHash>::iterator it = op.toScan.begin();
+            it != op.toScan.end();
+            it++) {
+        printf("Error getting object %s\n", (*it).hex().c_str());
+    }
+
+    DLOG("Pulled %lu objects in %lu requests", op.objects, op.batches);
+
+    while (!op.newCommits.empty()) {
+        Commit nc = op.newCommits.front();
+        op.newCommits.pop_front();
 
         // Add user snapshots
         if (nc.getSnapshot() != "") {
@@ -1003,6 +1344,7 @@ LocalRepo::pull(Repo *r)
         MdTransaction::sp tr(metadata.begin());
         addCommitBackrefs(nc, tr);
         tr->setMeta(nc.hash(), "status", "normal");
+        tr->commit();
     }
 }
 
@@ -1193,6 +1535,15 @@ void
 LocalRepo::transmit(bytewstream *bs, const ObjectHashVec &objs)
 {
     DLOG("local transmit");
+
+    transmitGroups(bs, objs);
+    /* Write (numobjs_t)0 */
+    bs->writeUInt32(0);
+}
+
+bool
+LocalRepo::transmitGroups(bytewstream *bs, const ObjectHashVec &objs)
+{
     unordered_set<ObjectHash> includedHashes;
 
     typedef std::vector<IndexEntry> IndexEntryVec;
@@ -1224,11 +1575,13 @@ LocalRepo::transmit(bytewstream *bs, const ObjectHashVec &objs)
         } else {
             DLOG("Exception: %s", e.what());
         }
+        return false;
     } catch (...)  {
         DLOG("unexpected exception in transmit");
+        return false;
     }
-    /* Write (numobjs_t)0 */
-    bs->writeUInt32(0);
+
+    return true;
 }
 
 void
@@ -1237,6 +1590,7 @@ LocalRepo::receive(bytestream *bs)
     bool cont = true;
     while (cont) {
         if (!currPackfile.get() || currPackfile->full()) {
+            sealPackfile();
             currPackfile = packfiles->newPackfile();
         }
         cont = currPackfile->receive(bs, &index);
@@ -1405,6 +1759,7 @@ LocalRepo::commitFromTree(const ObjectHash &treeHash, Commit &c,
     MdTransaction::sp tr(metadata.begin());
     addCommitBackrefs(c, tr);
     tr->setMeta(commitHash, "status", status);
+    tr->commit();
 
     // Update .ori/HEAD
     if (status == "normal") {
@@ -1450,10 +1805,20 @@ LocalRepo::commitFromObjects(const ObjectHash &treeHash, Repo *objects,
 void
 LocalRepo::gc()
 {
+    LocalRepoLock::sp _lock(lock());
+
+    // Nothing else writes while the repository is collected, temporary
+    // files are left over from rewrites that crashed
+    OriFile_DeleteTemps(rootPath + ORI_PATH_INDEX);
+    OriFile_DeleteTemps(rootPath + ORI_PATH_INDEX INDEX_SORTED_SUFFIX);
+    OriFile_DeleteTemps(rootPath + ORI_PATH_METADATA);
+    OriFile_DeleteTemps(rootPath + ORI_PATH_METADATA
+                        METADATALOG_CHECKPOINT_SUFFIX);
+
     // Commit all ongoing transactions
     if (currTransaction.get()) {
         currTransaction->commit();
-        currTransaction.reset();
+        setTransaction(PfTransaction::sp());
     }
 
     // Compact the index
@@ -1487,7 +1852,9 @@ LocalRepo::gc()
 bool
 LocalRepo::isObjectStored(const ObjectHash &objId)
 {
-    if (currTransaction.get() && currTransaction->has(objId)) {
+    PfTransaction::sp tr = getTransaction();
+
+    if (tr.get() && tr->has(objId)) {
         return true;
     }
 
@@ -1515,8 +1882,15 @@ LocalRepo::hasObject(const ObjectHash &objId)
 ObjectInfo
 LocalRepo::getObjectInfo(const ObjectHash &objId)
 {
-    if (index.hasObject(objId)) {
-        return index.getInfo(objId);
+    PfTransaction::sp tr = getTransaction();
+    IndexEntry ie;
+    size_t ix;
+
+    if (tr.get() && tr->find(objId, &ix)) {
+        return tr->getInfo(ix);
+    }
+    if (index.lookup(objId, &ie)) {
+        return ie.info;
     }
     
     Monitor lock(remoteLock);
@@ -1625,7 +1999,7 @@ LocalRepo::purgeObject(const ObjectHash &objId)
     ASSERT(metadata.getRefCount(objId) == 0);
 
     if (currTransaction.get())
-        currTransaction.reset();
+        setTransaction(PfTransaction::sp());
 
     /*const IndexEntry &ie = index.getEntry(objId);
     Packfile::sp packfile = packfiles->getPackfile(ie.packfile);
@@ -16,26 +16,192 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
 
 #include <string>
+#include <vector>
 #include <iostream>
 #include <memory>
+#include <algorithm>
 #include <unordered_map>
 
 #include <oriutil/debug.h>
 #include <oriutil/orifile.h>
+#include <oriutil/oricrypt.h>
 #include <oriutil/stream.h>
+#include <oriutil/runtimeexception.h>
 #include <oriutil/systemexception.h>
 #include <ori/metadatalog.h>
 
+#include "tuneables.h"
+
 using namespace std;
 
+/*
+ * Checkpoint layout:
+ *   "ORIM" | version | generation | count | mdlen | fanout[256] |
+ *   mdchecksum[16] | checksum[16] | entries[count] | metadata[mdlen]
+ * All integers are 32-bit big endian.  An entry is a hash followed by its
+ * reference count, entries are sorted and fanout is as in the sorted index.
+ * The checksum covers the header.  Entries are not checksummed, the counts
+ * can always be rebuilt from the objects.
+ *
+ * Tail layout:
+ *   "ORIL" | version | generation | records
+ * Each record is its length, the encoded transaction and its checksum.
+ */
+#define MDLOG_BASE_MAGIC "ORIM"
+#define MDLOG_TAIL_MAGIC "ORIL"
+#define MDLOG_VERSION 1
+#define MDLOG_CHECKSUMSIZE 16
+#define MDLOG_BASE_HDRSIZE \
+    (5 * sizeof(uint32_t) + 256 * sizeof(uint32_t) + MDLOG_CHECKSUMSIZE)
+#define MDLOG_BASE_ENTRYOFF (MDLOG_BASE_HDRSIZE + MDLOG_CHECKSUMSIZE)
+#define MDLOG_BASE_ENTRYSIZE (ObjectHash::SIZE + sizeof(int32_t))
+#define MDLOG_TAIL_HDRSIZE (3 * sizeof(uint32_t))
+
+/*
+ * Well known metadata keys and values are stored as their one based index
+ * in these tables, anything else as a zero followed by the string.  The
+ * tables may only be appended to.
+ */
+static const char *MetadataLog_Keys[] = {
+    "status",
+    NULL
+};
+static const char *MetadataLog_Values[] = {
+    "normal",
+    "graft",
+    "fuse",
+    "purging",
+    "purged",
+    NULL
+};
+
+static void
+MetadataLog_WriteStr(strwstream &ws, const char **table, const string &str)
+{
+    for (int i = 0; table[i] != NULL; i++) {
+        if (str == table[i]) {
+            ws.writeUInt8(i + 1);
+            return;
+        }
+    }
+    ws.writeUInt8(0);
+    ws.writePStr(str);
+}
+
+static string
+MetadataLog_ReadStr(bytestream &ss, const char **table)
+{
+    uint8_t id = ss.readUInt8();
+
+    if (id == 0) {
+        string str;
+        ss.readPStr(str);
+        return str;
+    }
+    for (int i = 0; table[i] != NULL; i++) {
+        if (i + 1 == id)
+            return table[i];
+    }
+
+    throw RuntimeException(ORIEC_MDLOGCORRUPT,
+                           "Metadata log has an unknown string id " +
+                           to_string(id));
+}
+
+static void
+MetadataLog_WriteMeta(strwstream &ws, const ObjectHash &hash,
+                      const ObjMetadata &md)
+{
+    ObjMetadata::const_iterator it;
+
+    ws.writeHash(hash);
+    ws.writeUInt32(md.size());
+    for (it = md.begin(); it != md.end(); it++) {
+        MetadataLog_WriteStr(ws, MetadataLog_Keys, it->first);
+        MetadataLog_WriteStr(ws, MetadataLog_Values, it->second);
+    }
+}
+
+static void
+MetadataLog_ReadMeta(bytestream &ss, MetadataMap *md)
+{
+    ObjectHash hash;
+    ss.readHash(hash);
+
+    uint32_t num_mde = ss.readUInt32();
+    for (uint32_t i = 0; i < num_mde; i++) {
+        string key = MetadataLog_ReadStr(ss, MetadataLog_Keys);
+        string value = MetadataLog_ReadStr(ss, MetadataLog_Values);
+        (*md)[hash][key] = value;
+    }
+}
+
+/*
+ * Decodes a transaction and applies it, throws if it cannot be decoded in
+ * which case nothing is applied.
+ */
+static void
+MetadataLog_Apply(bytestream &ss, RefcountMap *refs, MetadataMap *md)
+{
+    RefcountMap newRefs;
+    MetadataMap newMd;
+
+    uint32_t num_rc = ss.readUInt32();
+    uint32_t num_md = ss.readUInt32();
+
+    for (uint32_t i = 0; i < num_rc; i++) {
+        ObjectHash hash;
+        ss.readHash(hash);
+        newRefs[hash] = ss.readInt32();
+    }
+    for (uint32_t i = 0; i < num_md; i++) {
+        MetadataLog_ReadMeta(ss, &newMd);
+    }
+    if (!ss.ended())
+        throw exception();
+
+    for (RefcountMap::iterator it = newRefs.begin(); it != newRefs.end(); it++)
+        (*refs)[it->first] = it->second;
+    for (MetadataMap::iterator it = newMd.begin(); it != newMd.end(); it++) {
+        ObjMetadata &obj = (*md)[it->first];
+        for (ObjMetadata::iterator mit = it->second.begin();
+                mit != it->second.end();
+                mit++)
+            obj[mit->first] = mit->second;
+    }
+}
+
+static string
+MetadataLog_TailHeader(uint32_t generation)
+{
+    strwstream ws;
+
+    ws.write(MDLOG_TAIL_MAGIC, 4);
+    ws.writeUInt32(MDLOG_VERSION);
+    ws.writeUInt32(generation);
+
+    return ws.str();
+}
+
+static refcount_t
+MetadataLog_DecodeCount(const uint8_t *entry)
+{
+    uint32_t val;
+
+    memcpy(&val, entry + ObjectHash::SIZE, sizeof(val));
+    return (refcount_t)be32toh(val);
+}
+
 MdTransaction::MdTransaction(MetadataLog *log)
     : log(log)
 {
@@ -43,11 +209,21 @@ MdTransaction::MdTransaction(MetadataLog *log)
 
 MdTransaction::~MdTransaction()
 {
-    if (log != NULL) {
+    if (log == NULL)
+        return;
+
+    try {
         log->commit(this);
+    } catch (exception &e) {
+        WARNING("Could not commit a metadata transaction: %s", e.what());
     }
 }
 
+void MdTransaction::commit()
+{
+    log->commit(this);
+}
+
 void MdTransaction::addRef(const ObjectHash &hash)
 {
     counts[hash] += 1;
@@ -56,7 +232,7 @@ void MdTransaction::addRef(const ObjectHash &hash)
 void MdTransaction::decRef(const ObjectHash &hash)
 {
     counts[hash] -= 1;
-    ASSERT(log->refcounts[hash] + counts[hash] >= 0);
+    ASSERT(log->getRefCount(hash) + counts[hash] >= 0);
 }
 
 void MdTransaction::setMeta(const ObjectHash &hash, const string &key,
@@ -72,8 +248,11 @@ void MdTransaction::setMeta(const ObjectHash &hash, const string &key,
  */
 
 MetadataLog::MetadataLog()
-    : fd(-1)
+    : fd(-1), generation(0), tailBytes(0), tailValid(false), baseFd(-1),
+      baseMap(NULL),
+      baseLen(0), baseEntries(NULL), baseCount(0)
 {
+    memset(fanout, 0, sizeof(fanout));
 }
 
 MetadataLog::~MetadataLog()
@@ -81,78 +260,65 @@ MetadataLog::~MetadataLog()
     if (fd != -1) {
         ::close(fd);
     }
+    _closeBase();
 }
 
-// XXX: Handle crach detection and recovery
 void
 MetadataLog::open(const string &filename)
 {
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+    _closeBase();
+    refcounts.clear();
+
+    this->filename = filename;
+    tailBytes = 0;
+    tailValid = false;
+
+    // The tail is opened before the checkpoint.  A checkpoint replaces the
+    // checkpoint file before the tail, so a tail from an older generation
+    // than the checkpoint was already folded into it.
     fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
     if (fd < 0) {
         WARNING("MetadataLog open failed!");
         throw SystemException();
     }
 
-    this->filename = filename;
-
     struct stat sb;
     if (fstat(fd, &sb) < 0) {
         WARNING("MetadataLog fstat failed!");
         throw SystemException();
     }
 
-    size_t readSoFar = 0;
-    while (true) {
-        uint32_t nbytes;
-        int n = read(fd, &nbytes, sizeof(uint32_t));
-        readSoFar += sizeof(uint32_t);
-        if (n == 0)
-            break;
-        if (n < 0) {
-            WARNING("MetadataLog read failed!");
-            throw SystemException();
-        }
-
-        if (readSoFar + nbytes > (size_t)sb.st_size) {
-            // TODO: truncate this entry
-            WARNING("Corrupted metadata log entry!");
-            throw SystemException();
-        }
-
-        string packet;
-        packet.resize(nbytes);
-        if (read(fd, &packet[0], nbytes) < 0) {
+    // Read the whole tail at once
+    string log(sb.st_size, '\0');
+    size_t bytesRead = 0;
+    while (bytesRead < log.size()) {
+        ssize_t status = pread(fd, &log[bytesRead], log.size() - bytesRead,
+                               bytesRead);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status <= 0) {
             WARNING("MetadataLog read failed!");
-            throw SystemException();
-        }
-        readSoFar += nbytes;
-
-        strstream ss(packet);
-        uint32_t num_rc = ss.readUInt32();
-        uint32_t num_md = ss.readUInt32();
-
-        //fprintf(stderr, "Reading %u refcount entries\n", num_rc);
-        for (size_t i = 0; i < num_rc; i++) {
-            ObjectHash hash;
-            ss.readHash(hash);
-
-            refcount_t refcount = ss.readInt32();
-            refcounts[hash] = refcount;
+            throw SystemException(status < 0 ? errno : EIO);
         }
+        bytesRead += status;
+    }
 
-        //fprintf(stderr, "Reading %u metadata entries\n", num_md);
-        for (size_t i = 0; i < num_md; i++) {
-            ObjectHash hash;
-            ss.readHash(hash);
-
-            uint32_t num_mde = ss.readUInt32();
-            for (size_t ix_mde = 0; ix_mde < num_mde; ix_mde++) {
-                string key, value;
-                ss.readPStr(key);
-                ss.readPStr(value);
-                metadata[hash][key] = value;
-            }
-        }
+    _openBase();
+
+    // Nothing is written here, other processes may have the log open.  A
+    // tail that cannot be appended to is replaced by a checkpoint on the
+    // first commit.
+    if (log.size() >= 4 && memcmp(log.data(), MDLOG_TAIL_MAGIC, 4) == 0) {
+        _replay(log);
+    } else if (log.size() != 0 && baseMap != NULL) {
+        WARNING("Ignoring a metadata log older than its checkpoint");
+    } else if (log.size() != 0) {
+        // A log written before checkpoints existed
+        _replayLegacy(log);
     }
 }
 
@@ -165,32 +331,19 @@ MetadataLog::sync()
 void
 MetadataLog::rewrite(const RefcountMap *refs, const MetadataMap *data)
 {
-    if (refs == NULL)
-        refs = &refcounts;
     if (data == NULL)
         data = &metadata;
 
-    string tmpFilename = filename + ".tmp";
-    int newFd = ::open(tmpFilename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
-    if (newFd < 0) {
-        perror("MetadataLog::rewrite open");
-        throw SystemException();
+    if (!_writeCheckpoint(refs, *data)) {
+        WARNING("Could not rewrite the metadata log!");
+        throw SystemException(EIO);
     }
+}
 
-    int oldFd = fd;
-    fd = newFd;
-
-    ftruncate(fd, 0);
-    lseek(fd, 0, SEEK_SET);
-    MdTransaction::sp tr = begin();
-    tr->counts = *refs;
-    tr->metadata = *data;
-
-    refcounts.clear();
-    metadata.clear();
-
-    OriFile_Rename(tmpFilename, filename);
-    ::close(oldFd);
+void
+MetadataLog::checkpoint()
+{
+    rewrite();
 }
 
 void
@@ -207,9 +360,13 @@ refcount_t
 MetadataLog::getRefCount(const ObjectHash &hash) const
 {
     RefcountMap::const_iterator it = refcounts.find(hash);
-    if (it == refcounts.end())
+    if (it != refcounts.end())
+        return (*it).second;
+
+    const uint8_t *entry = _findBase(hash);
+    if (entry == NULL)
         return 0;
-    return (*it).second;
+    return MetadataLog_DecodeCount(entry);
 }
 
 string
@@ -239,12 +396,12 @@ MetadataLog::commit(MdTransaction *tr)
     
     DLOG("Committing %u refcount changes, %u metadata entries", num_rc, num_md);
 
-    //write(fd, &num, sizeof(uint32_t));
-
     strwstream ws(36*num_rc + 8);
     ws.writeUInt32(num_rc);
     ws.writeUInt32(num_md);
 
+    // Nothing is applied in memory until the record is on disk
+    RefcountMap newCounts;
     for (RefcountMap::iterator it = tr->counts.begin();
             it != tr->counts.end();
             it++) {
@@ -252,43 +409,73 @@ MetadataLog::commit(MdTransaction *tr)
         ASSERT(!hash.isEmpty());
 
         ws.writeHash(hash);
-        refcount_t final_count = refcounts[hash] + (*it).second;
+        refcount_t final_count = getRefCount(hash) + (*it).second;
         ASSERT(final_count >= 0);
 
-        refcounts[hash] = final_count;
+        newCounts[hash] = final_count;
         ws.writeInt32(final_count);
     }
 
     for (MetadataMap::iterator it = tr->metadata.begin();
             it != tr->metadata.end();
             it++) {
-        const ObjectHash &hash = (*it).first;
-        ASSERT(!hash.isEmpty());
+        ASSERT(!(*it).first.isEmpty());
+        MetadataLog_WriteMeta(ws, (*it).first, (*it).second);
+    }
 
-        ws.writeHash(hash);
-        uint32_t num_mde = (*it).second.size();
-        ws.writeUInt32(num_mde);
+    // Length, transaction and checksum go out in one write
+    const string &str = ws.str();
+    ObjectHash checksum = OriCrypt_HashString(str);
+    strwstream rec(str.size() + 4 + MDLOG_CHECKSUMSIZE);
+    rec.writeUInt32(str.size());
+    rec.write(str.data(), str.size());
+    rec.write(checksum.hash, MDLOG_CHECKSUMSIZE);
+
+    // The first commit after open starts a tail it can append to
+    if (!tailValid && !_writeCheckpoint(NULL, metadata)) {
+        WARNING("Could not checkpoint the metadata log!");
+        throw SystemException(EIO);
+    }
 
+    const string &rec_str = rec.str();
+    off_t end = lseek(fd, 0, SEEK_END);
+    ssize_t status = ::write(fd, rec_str.data(), rec_str.size());
+    if (status != (ssize_t)rec_str.size()) {
+        int errcode = (status < 0) ? errno : EIO;
+
+        // The transaction is dropped, leave no partial record behind
+        tr->counts.clear();
+        tr->metadata.clear();
+        if (end < 0 || ftruncate(fd, end) < 0)
+            WARNING("Could not truncate the metadata log!");
+        WARNING("MetadataLog write failed!");
+        throw SystemException(errcode);
+    }
+    tailBytes += rec_str.size();
+
+    for (RefcountMap::iterator it = newCounts.begin();
+            it != newCounts.end();
+            it++) {
+        refcounts[(*it).first] = (*it).second;
+    }
+    for (MetadataMap::iterator it = tr->metadata.begin();
+            it != tr->metadata.end();
+            it++) {
         for (ObjMetadata::iterator mit =
                 (*it).second.begin();
                 mit != (*it).second.end();
                 mit++) {
-            metadata[hash][(*mit).first] = (*mit).second;
-            ws.writePStr((*mit).first);
-            ws.writePStr((*mit).second);
+            metadata[(*it).first][(*mit).first] = (*mit).second;
         }
     }
 
-    //ObjectHash commitHash = Util_HashString(ws.str());
-    //ws.write(commitHash.data(), commitHash.size());
-
-    const string &str = ws.str();
-    uint32_t nbytes = str.size();
-    write(fd, &nbytes, sizeof(uint32_t));
-    write(fd, str.data(), str.size());
-
     tr->counts.clear();
     tr->metadata.clear();
+
+    if (tailBytes > METADATALOG_CHECKPOINT_MINBYTES && tailBytes > baseLen) {
+        if (!_writeCheckpoint(NULL, metadata))
+            WARNING("Could not checkpoint the metadata log!");
+    }
 }
 
 void
@@ -297,6 +484,16 @@ MetadataLog::dumpRefs() const
     RefcountMap::const_iterator it;
 
     cout << "Reference Counts:" << endl;
+    for (uint32_t i = 0; i < baseCount; i++)
+    {
+        const uint8_t *entry = baseEntries + i * MDLOG_BASE_ENTRYSIZE;
+        ObjectHash hash;
+
+        memcpy(hash.hash, entry, ObjectHash::SIZE);
+        if (refcounts.find(hash) != refcounts.end())
+            continue;
+        cout << hash.hex() << ": " << MetadataLog_DecodeCount(entry) << endl;
+    }
     for (it = refcounts.begin(); it != refcounts.end(); it++)
     {
         cout << (*it).first.hex() << ": " << (*it).second << endl;
@@ -322,3 +519,455 @@ MetadataLog::dumpMeta() const
     }
 }
 
+/*
+ * Replays the tail on top of the checkpoint.  Replay stops at the first
+ * record that is incomplete or fails its checksum, such a record is being
+ * appended or was torn by a crash.  The tail is left as it is but is not
+ * appended to until a checkpoint replaces it.
+ */
+void
+MetadataLog::_replay(const string &log)
+{
+    if (log.size() < MDLOG_TAIL_HDRSIZE) {
+        WARNING("Ignoring a torn metadata log header");
+        return;
+    }
+
+    strstream hdr(log.substr(0, MDLOG_TAIL_HDRSIZE), 4);
+    uint32_t version = hdr.readUInt32();
+    uint32_t logGeneration = hdr.readUInt32();
+    if (version != MDLOG_VERSION) {
+        WARNING("Metadata log has an unsupported version!");
+        throw RuntimeException(ORIEC_UNSUPPORTEDVERSION,
+                               "Unsupported metadata log version");
+    }
+    if (logGeneration != generation) {
+        WARNING("Ignoring a metadata log older than its checkpoint");
+        return;
+    }
+
+    size_t off = MDLOG_TAIL_HDRSIZE;
+    while (off < log.size()) {
+        size_t left = log.size() - off;
+        if (left < sizeof(uint32_t))
+            break;
+
+        uint32_t nbytes;
+        memcpy(&nbytes, log.data() + off, sizeof(nbytes));
+        nbytes = be32toh(nbytes);
+        if (left - sizeof(uint32_t) < (size_t)nbytes + MDLOG_CHECKSUMSIZE)
+            break;
+
+        const char *rec = log.data() + off + sizeof(uint32_t);
+        ObjectHash checksum = OriCrypt_HashString(string(rec, nbytes));
+        if (memcmp(rec + nbytes, checksum.hash, MDLOG_CHECKSUMSIZE) != 0)
+            break;
+
+        try {
+            memstream ss((const uint8_t *)rec, nbytes);
+            MetadataLog_Apply(ss, &refcounts, &metadata);
+        } catch (exception &e) {
+            break;
+        }
+
+        off += sizeof(uint32_t) + nbytes + MDLOG_CHECKSUMSIZE;
+    }
+
+    if (off < log.size())
+        WARNING("Ignoring a torn metadata log record");
+    tailBytes = off - MDLOG_TAIL_HDRSIZE;
+    tailValid = (off == log.size());
+}
+
+/*
+ * Replays a log from before checkpoints, which has host endian record
+ * lengths, no checksums and plain metadata strings.
+ */
+void
+MetadataLog::_replayLegacy(const string &log)
+{
+    size_t off = 0;
+
+    while (off < log.size()) {
+        size_t left = log.size() - off;
+        if (left < sizeof(uint32_t))
+            break;
+
+        uint32_t nbytes;
+        memcpy(&nbytes, log.data() + off, sizeof(nbytes));
+        if (left - sizeof(uint32_t) < nbytes)
+            break;
+
+        try {
+            memstream ss((const uint8_t *)log.data() + off + sizeof(uint32_t),
+                         nbytes);
+            uint32_t num_rc = ss.readUInt32();
+            uint32_t num_md = ss.readUInt32();
+
+            for (size_t i = 0; i < num_rc; i++) {
+                ObjectHash hash;
+                ss.readHash(hash);
+                refcounts[hash] = ss.readInt32();
+            }
+            for (size_t i = 0; i < num_md; i++) {
+                ObjectHash hash;
+                ss.readHash(hash);
+
+                uint32_t num_mde = ss.readUInt32();
+                for (size_t ix_mde = 0; ix_mde < num_mde; ix_mde++) {
+                    string key, value;
+                    ss.readPStr(key);
+                    ss.readPStr(value);
+                    metadata[hash][key] = value;
+                }
+            }
+        } catch (exception &e) {
+            break;
+        }
+
+        off += sizeof(uint32_t) + nbytes;
+    }
+
+    if (off < log.size())
+        WARNING("Dropping a torn metadata log record");
+}
+
+/*
+ * Writes a new checkpoint of the given counts, or of the current counts if
+ * refs is NULL, and the given metadata and starts a new empty tail.  Only
+ * the writer checkpoints.  The checkpoint is replaced before the tail, a
+ * crash in between leaves a tail of the previous generation behind that
+ * open ignores.  Both are replaced by rename so readers that have them open
+ * keep a consistent pair.
+ */
+bool
+MetadataLog::_writeCheckpoint(const RefcountMap *refs, const MetadataMap &data)
+{
+    string ckptFile = filename + METADATALOG_CHECKPOINT_SUFFIX;
+    string newCkpt;
+    string newLog;
+    const RefcountMap &changed = (refs != NULL) ? *refs : refcounts;
+    // New counts replace the checkpoint rather than being merged into it
+    uint32_t oldCount = (refs != NULL) ? 0 : baseCount;
+    vector<ObjectHash> hashes;
+    uint32_t newFanout[256];
+    uint32_t count = 0;
+    string hdr_str;
+    string md_str;
+    int fdNew;
+
+    hashes.reserve(changed.size());
+    for (RefcountMap::const_iterator it = changed.begin();
+            it != changed.end();
+            it++)
+        hashes.push_back(it->first);
+    sort(hashes.begin(), hashes.end());
+
+    fdNew = OriFile_CreateTemp(ckptFile, &newCkpt);
+    if (fdNew < 0) {
+        errno = -fdNew;
+        perror("MetadataLog checkpoint open");
+        return false;
+    }
+
+    // Reserve space for the header and write the merged entries
+    string buf;
+    buf.reserve(COPYFILE_BUFSZ + MDLOG_BASE_ENTRYSIZE);
+    buf.assign(MDLOG_BASE_ENTRYOFF, '\0');
+
+    memset(newFanout, 0, sizeof(newFanout));
+
+    size_t b = 0, l = 0;
+    while (b < oldCount || l < hashes.size()) {
+        const uint8_t *baseEntry = NULL;
+        const uint8_t *hash;
+        refcount_t refcount;
+        int cmp;
+
+        if (b < oldCount)
+            baseEntry = baseEntries + b * MDLOG_BASE_ENTRYSIZE;
+
+        if (baseEntry == NULL) {
+            cmp = 1;
+        } else if (l == hashes.size()) {
+            cmp = -1;
+        } else {
+            cmp = memcmp(baseEntry, hashes[l].hash, ObjectHash::SIZE);
+        }
+
+        if (cmp < 0) {
+            hash = baseEntry;
+            refcount = MetadataLog_DecodeCount(baseEntry);
+            b++;
+        } else {
+            hash = hashes[l].hash;
+            refcount = changed.find(hashes[l])->second;
+            if (cmp == 0)
+                b++;
+            l++;
+        }
+
+        // Objects without references need no entry
+        if (refcount == 0)
+            continue;
+
+        uint32_t val = htobe32((uint32_t)refcount);
+        newFanout[hash[0]]++;
+        count++;
+        buf.append((const char *)hash, ObjectHash::SIZE);
+        buf.append((const char *)&val, sizeof(val));
+
+        if (buf.size() >= COPYFILE_BUFSZ) {
+            if (::write(fdNew, buf.data(), buf.size()) != (ssize_t)buf.size())
+                goto writeError;
+            buf.clear();
+        }
+    }
+
+    // Metadata follows the entries
+    {
+        strwstream md;
+
+        md.writeUInt32(data.size());
+        for (MetadataMap::const_iterator it = data.begin();
+                it != data.end();
+                it++)
+            MetadataLog_WriteMeta(md, it->first, it->second);
+        md_str = md.str();
+    }
+    buf.append(md_str);
+    if (::write(fdNew, buf.data(), buf.size()) != (ssize_t)buf.size())
+        goto writeError;
+
+    // Write the header now that the fanout is known
+    {
+        strwstream hdr;
+
+        hdr.write(MDLOG_BASE_MAGIC, 4);
+        hdr.writeUInt32(MDLOG_VERSION);
+        hdr.writeUInt32(generation + 1);
+        hdr.writeUInt32(count);
+        hdr.writeUInt32(md_str.size());
+        for (int i = 1; i < 256; i++)
+            newFanout[i] += newFanout[i - 1];
+        for (int i = 0; i < 256; i++)
+            hdr.writeUInt32(newFanout[i]);
+        ASSERT(newFanout[255] == count);
+
+        ObjectHash mdChecksum = OriCrypt_HashString(md_str);
+        hdr.write(mdChecksum.hash, MDLOG_CHECKSUMSIZE);
+        ObjectHash checksum = OriCrypt_HashString(hdr.str());
+        hdr.write(checksum.hash, MDLOG_CHECKSUMSIZE);
+
+        hdr_str = hdr.str();
+        ASSERT(hdr_str.size() == MDLOG_BASE_ENTRYOFF);
+        if (::pwrite(fdNew, hdr_str.data(), hdr_str.size(), 0) !=
+                (ssize_t)hdr_str.size())
+            goto writeError;
+    }
+
+    if (::fsync(fdNew) < 0)
+        goto writeError;
+    ::close(fdNew);
+
+    // Start a new empty tail, kept open as the log from here on
+    hdr_str = MetadataLog_TailHeader(generation + 1);
+    fdNew = OriFile_CreateTemp(filename, &newLog);
+    if (fdNew < 0 ||
+        ::write(fdNew, hdr_str.data(), hdr_str.size()) !=
+            (ssize_t)hdr_str.size() ||
+        fcntl(fdNew, F_SETFL, O_APPEND) < 0 ||
+        ::fsync(fdNew) < 0) {
+        perror("MetadataLog checkpoint write");
+        if (fdNew >= 0) {
+            ::close(fdNew);
+            OriFile_Delete(newLog);
+        }
+        OriFile_Delete(newCkpt);
+        return false;
+    }
+
+    if (OriFile_Rename(newCkpt, ckptFile) < 0) {
+        perror("MetadataLog checkpoint rename");
+        ::close(fdNew);
+        OriFile_Delete(newLog);
+        OriFile_Delete(newCkpt);
+        return false;
+    }
+
+    // The old tail is folded into the new checkpoint either way
+    _closeBase();
+    // Reloads the metadata as well
+    _openBase();
+    refcounts.clear();
+    tailBytes = 0;
+
+    if (OriFile_Rename(newLog, filename) < 0) {
+        perror("MetadataLog checkpoint rename");
+        ::close(fdNew);
+        OriFile_Delete(newLog);
+        tailValid = false;
+        return false;
+    }
+
+    ::close(fd);
+    fd = fdNew;
+    tailValid = true;
+
+    return true;
+
+writeError:
+    perror("MetadataLog checkpoint write");
+    ::close(fdNew);
+    OriFile_Delete(newCkpt);
+    return false;
+}
+
+/*
+ * Maps the checkpoint if one exists and loads its metadata.
+ */
+void
+MetadataLog::_openBase()
+{
+    struct stat sb;
+    string baseFile = filename + METADATALOG_CHECKPOINT_SUFFIX;
+
+    generation = 0;
+    metadata.clear();
+
+    baseFd = ::open(baseFile.c_str(), O_RDONLY);
+    if (baseFd < 0) {
+        if (errno == ENOENT)
+            return;
+        WARNING("Could not open the metadata checkpoint!");
+        throw SystemException();
+    }
+
+    if (::fstat(baseFd, &sb) < 0) {
+        int errcode = errno;
+        _closeBase();
+        WARNING("Could not fstat the metadata checkpoint!");
+        throw SystemException(errcode);
+    }
+
+    if ((size_t)sb.st_size < MDLOG_BASE_ENTRYOFF) {
+        _closeBase();
+        WARNING("Metadata checkpoint is truncated!");
+        throw RuntimeException(ORIEC_MDLOGCORRUPT, "Metadata log corrupt");
+    }
+
+    baseLen = sb.st_size;
+    void *map = mmap(NULL, baseLen, PROT_READ, MAP_SHARED, baseFd, 0);
+    if (map == MAP_FAILED) {
+        int errcode = errno;
+        baseLen = 0;
+        _closeBase();
+        WARNING("Could not mmap the metadata checkpoint!");
+        throw SystemException(errcode);
+    }
+    baseMap = (const uint8_t *)map;
+#ifdef MADV_RANDOM
+    madvise(map, baseLen, MADV_RANDOM);
+#endif
+
+    string hdr_str((const char *)baseMap, MDLOG_BASE_HDRSIZE);
+    ObjectHash checksum = OriCrypt_HashString(hdr_str);
+    if (memcmp(baseMap, MDLOG_BASE_MAGIC, 4) != 0 ||
+        memcmp(baseMap + MDLOG_BASE_HDRSIZE, checksum.hash,
+               MDLOG_CHECKSUMSIZE) != 0) {
+        _closeBase();
+        WARNING("Metadata checkpoint has a corrupt header!");
+        throw RuntimeException(ORIEC_MDLOGCORRUPT, "Metadata log corrupt");
+    }
+
+    strstream hdr(hdr_str, 4);
+    uint32_t version = hdr.readUInt32();
+    if (version != MDLOG_VERSION) {
+        _closeBase();
+        WARNING("Metadata checkpoint has an unsupported version!");
+        throw RuntimeException(ORIEC_UNSUPPORTEDVERSION,
+                               "Unsupported metadata log version");
+    }
+    uint32_t baseGeneration = hdr.readUInt32();
+    baseCount = hdr.readUInt32();
+    uint32_t mdLen = hdr.readUInt32();
+    for (int i = 0; i < 256; i++) {
+        fanout[i] = hdr.readUInt32();
+    }
+
+    size_t mdOff = MDLOG_BASE_ENTRYOFF +
+                   (size_t)baseCount * MDLOG_BASE_ENTRYSIZE;
+    if (fanout[255] != baseCount || baseLen != mdOff + mdLen) {
+        _closeBase();
+        WARNING("Metadata checkpoint has the wrong size!");
+        throw RuntimeException(ORIEC_MDLOGCORRUPT, "Metadata log corrupt");
+    }
+
+    string md_str((const char *)baseMap + mdOff, mdLen);
+    checksum = OriCrypt_HashString(md_str);
+    if (memcmp(baseMap + MDLOG_BASE_HDRSIZE - MDLOG_CHECKSUMSIZE,
+               checksum.hash, MDLOG_CHECKSUMSIZE) != 0) {
+        _closeBase();
+        WARNING("Metadata checkpoint has corrupt metadata!");
+        throw RuntimeException(ORIEC_MDLOGCORRUPT, "Metadata log corrupt");
+    }
+
+    try {
+        strstream md(md_str);
+        uint32_t num_md = md.readUInt32();
+        for (uint32_t i = 0; i < num_md; i++)
+            MetadataLog_ReadMeta(md, &metadata);
+    } catch (exception &e) {
+        _closeBase();
+        metadata.clear();
+        WARNING("Metadata checkpoint has corrupt metadata!");
+        throw RuntimeException(ORIEC_MDLOGCORRUPT, "Metadata log corrupt");
+    }
+
+    generation = baseGeneration;
+    baseEntries = baseMap + MDLOG_BASE_ENTRYOFF;
+}
+
+void
+MetadataLog::_closeBase()
+{
+    if (baseMap != NULL) {
+        munmap((void *)baseMap, baseLen);
+    }
+    if (baseFd != -1) {
+        ::close(baseFd);
+    }
+    baseFd = -1;
+    baseMap = NULL;
+    baseLen = 0;
+    baseEntries = NULL;
+    baseCount = 0;
+    memset(fanout, 0, sizeof(fanout));
+}
+
+/*
+ * Binary search of the checkpoint within the fanout bucket of the first
+ * hash byte.  Returns a pointer to the raw entry or NULL.
+ */
+const uint8_t *
+MetadataLog::_findBase(const ObjectHash &hash) const
+{
+    uint8_t first = hash.hash[0];
+    uint32_t lo = (first == 0) ? 0 : fanout[first - 1];
+    uint32_t hi = fanout[first];
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const uint8_t *entry = baseEntries + (size_t)mid * MDLOG_BASE_ENTRYSIZE;
+        int cmp = memcmp(entry, hash.hash, ObjectHash::SIZE);
+
+        if (cmp == 0)
+            return entry;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
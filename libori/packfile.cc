@@ -18,6 +18,8 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <errno.h>
 
@@ -36,15 +38,21 @@
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/orifile.h>
+#include <oriutil/oricrypt.h>
 #include <oriutil/scan.h>
+#include <oriutil/mutex.h>
+#include <oriutil/monitor.h>
 #include <oriutil/systemexception.h>
 #include <ori/packfile.h>
 #include <ori/index.h>
 
 using namespace std;
 
-PfTransaction::PfTransaction(Packfile *pf, Index *idx)
-    : totalSize(0), committed(false), pf(pf), idx(idx)
+PfTransaction::PfTransaction(Packfile *pf, Index *idx,
+                             std::shared_ptr<ThreadPool> pool,
+                             ObjectInfo::ZipAlgo algo)
+    : totalSize(0), committed(false), pf(pf), idx(idx), pool(pool),
+      algo(algo), lock(), compressed(), done(), group(pool.get())
 {
 }
 
@@ -66,6 +74,35 @@ PfTransaction::_checkCompressionRatio(const string &payload)
     return 1.5f;
 }
 
+/*
+ * Compresses the payload with algo into compressed when it is worth it.
+ * Runs on the worker pool.
+ * @returns the algorithm the payload should be stored with
+ */
+static ObjectInfo::ZipAlgo
+PfTransaction_Compress(ObjectInfo::ZipAlgo algo, const ObjectHash &hash,
+                       const string &payload, string *compressed)
+{
+    if (algo == ObjectInfo::ZIPALGO_NONE ||
+        payload.size() <= ZIP_MINIMUM_SIZE) {
+        return ObjectInfo::ZIPALGO_NONE;
+    }
+
+    zipstream ls(new memstream((const uint8_t *)payload.data(),
+                               payload.size()), algo, COMPRESS);
+    *compressed = ls.readAll();
+    if (ls.error()) {
+        WARNING("Compressing %s failed: %s", hash.hex().c_str(), ls.error());
+        return ObjectInfo::ZIPALGO_NONE;
+    }
+
+    float ratio = (float)compressed->size() / (float)payload.size();
+    if (ratio <= COMPCHECK_RATIO)
+        return algo;
+
+    return ObjectInfo::ZIPALGO_NONE;
+}
+
 void
 PfTransaction::addPayload(ObjectInfo info, const string &payload)
 {
@@ -83,63 +120,104 @@ PfTransaction::addPayload(ObjectInfo info, const string &payload)
     }
 #endif
 
-    ObjectInfo::ZipAlgo defaultAlgo = ObjectInfo::ZIPALGO_FASTLZ;
-    switch (defaultAlgo) {
-        case ObjectInfo::ZIPALGO_NONE:
-        {
-            info.setAlgo(defaultAlgo);
-            payloads.push_back(payload);
-            totalSize += payload.size();
-            break;
-        }
-        case ObjectInfo::ZIPALGO_FASTLZ:
-        {
-            zipstream ls(new strstream(payload), COMPRESS);
-            uint8_t buf[COMPCHECK_BYTES];
-            size_t compSize = 0;
-            bool compress = false;
-
-            if (payload.size() > ZIP_MINIMUM_SIZE) {
-                compSize = ls.read(buf, COMPCHECK_BYTES);
-                float ratio = (float)compSize / (float)ls.inputConsumed();
-
-                if (ratio <= COMPCHECK_RATIO) {
-                    compress = true;
-                }
-            }
-
-            if (compress) {
-                // Okay to compress
-                info.setAlgo(defaultAlgo);
-                // Reuse compression test data
-                strwstream ss(string((char*)buf, compSize));
-                ss.copyFrom(&ls);
-
-                payloads.push_back(ss.str());
-                totalSize += ss.str().size();
-            } else {
-                info.setAlgo(ObjectInfo::ZIPALGO_NONE);
-                payloads.push_back(payload);
-                totalSize += payload.size();
-            }
-            break;
-        }
-        case ObjectInfo::ZIPALGO_LZMA:
-        case ObjectInfo::ZIPALGO_UNKNOWN:
-            NOT_IMPLEMENTED(false);
+    size_t ix;
+    const string *ppayload;
+    {
+        unique_lock<mutex> l(lock);
+        infos.push_back(info);
+        payloads.push_back(payload);
+        checksums.push_back(ObjectHash());
+        done.push_back(false);
+        totalSize += payload.size();
+        ix = infos.size() - 1;
+        hashToIx[info.hash] = ix;
+        // Only _finish modifies the entry from here on
+        ppayload = &payloads.back();
     }
 
-    infos.push_back(info);
-    hashToIx[info.hash] = infos.size()-1;
+    ObjectInfo::ZipAlgo zipAlgo = algo;
+    ObjectHash hash = info.hash;
+    group.run([this, zipAlgo, hash, ix, ppayload]() {
+        string compressed;
+        ObjectInfo::ZipAlgo used;
+
+        used = PfTransaction_Compress(zipAlgo, hash, *ppayload, &compressed);
+        _finish(ix, used, &compressed,
+                OriCrypt_HashString(used == ObjectInfo::ZIPALGO_NONE ?
+                                    *ppayload : compressed));
+    });
 }
 
 bool PfTransaction::has(const ObjectHash &hash) const
 {
-    return hashToIx.find(hash) != hashToIx.end();
+    size_t ix;
+
+    return find(hash, &ix);
+}
+
+bool PfTransaction::find(const ObjectHash &hash, size_t *ix) const
+{
+    unique_lock<mutex> l(lock);
+    unordered_map<ObjectHash, size_t>::const_iterator it = hashToIx.find(hash);
+
+    if (it == hashToIx.end())
+        return false;
+
+    *ix = it->second;
+    return true;
+}
+
+ObjectInfo PfTransaction::getInfo(size_t ix) const
+{
+    unique_lock<mutex> l(lock);
+
+    _waitFor(l, ix);
+    return infos[ix];
+}
+
+string PfTransaction::getPayload(size_t ix) const
+{
+    unique_lock<mutex> l(lock);
+
+    _waitFor(l, ix);
+    return payloads[ix];
+}
+
+/*
+ * Publishes the result of compressing entry ix.  data is swapped into the
+ * transaction if the payload is to be stored compressed, checksum is the
+ * hash of the stored bytes.
+ */
+void PfTransaction::_finish(size_t ix, ObjectInfo::ZipAlgo used, string *data,
+                            const ObjectHash &checksum)
+{
+    unique_lock<mutex> l(lock);
+
+    infos[ix].setAlgo(used);
+    checksums[ix] = checksum;
+    if (used != ObjectInfo::ZIPALGO_NONE) {
+        payloads[ix].swap(*data);
+    }
+    done[ix] = true;
+    compressed.notify_all();
+}
+
+void PfTransaction::_waitFor(unique_lock<mutex> &l, size_t ix) const
+{
+    ASSERT(ix < done.size());
+
+    while (!done[ix])
+        compressed.wait(l);
+}
+
+void PfTransaction::wait()
+{
+    group.wait();
 }
 
 void PfTransaction::commit()
 {
+    wait();
     pf->commit(this, idx);
     if (!committed) {
         throw runtime_error("Unknown error committing PfTransaction");
@@ -150,8 +228,36 @@ void PfTransaction::commit()
 // stored length + offset
 #define ENTRYSIZE (ObjectInfo::SIZE + 4 + 4)
 
+/*
+ * Table of contents of a sealed packfile, appended after the last group:
+ *
+ *   entries      ENTRYSIZE header followed by the checksum, sorted by hash
+ *   trailer      magic, version, offset and number of the entries and the
+ *                hash of the entries
+ */
+#define PFTOC_MAGIC 0x50544F43 // "PTOC"
+#define PFTOC_VERSION 1
+#define PFTOC_ENTRYSIZE (ENTRYSIZE + ObjectHash::SIZE)
+#define PFTOC_TRAILERSIZE (4 + 4 + 4 + 4 + ObjectHash::SIZE)
+
+/*
+ * A read-only mapping of a packfile.  Streams and transmit buffers hold a
+ * reference so the mapping outlives a remap or the Packfile itself.
+ */
+class PfMapping
+{
+public:
+    PfMapping(void *addr, size_t len) : addr(addr), len(len) { }
+    ~PfMapping() { munmap(addr, len); }
+private:
+    void *addr;
+    size_t len;
+};
+
 Packfile::Packfile(const string &filename, packid_t id)
-    : fd(-1), filename(filename), packid(id), numObjects(0), fileSize(0)
+    : fd(-1), filename(filename), packid(id), numObjects(0), fileSize(0),
+      sealed(false), tocOffset(0), tocValid(false), toc(),
+      mapLock(), mapping(), mapAddr(NULL), mapLen(0)
 {
     fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
     if (fd < 0) {
@@ -159,15 +265,15 @@ Packfile::Packfile(const string &filename, packid_t id)
         throw SystemException();
     }
 
-    struct stat sb;
-    if (fstat(fd, &sb) < 0) {
-        perror("Packfile fstat");
-        throw SystemException();
+    _openToc();
+    // Only a packfile written from the start can build its own table
+    tocValid = (fileSize == 0);
+    if (!sealed && fileSize > 0) {
+        // Count the complete groups, anything after them is ignored
+        vector<IndexEntry> entries;
+        _readGroups(&entries);
+        numObjects = entries.size();
     }
-
-    fileSize = sb.st_size;
-    
-    // TODO: check for corruption?
 }
 
 Packfile::~Packfile()
@@ -178,14 +284,15 @@ Packfile::~Packfile()
 
 bool Packfile::full() const
 {
-    return numObjects >= PACKFILE_MAXOBJS ||
+    return sealed || numObjects >= PACKFILE_MAXOBJS ||
         fileSize >= PACKFILE_MAXSIZE;
 }
 
 PfTransaction::sp
-Packfile::begin(Index *idx)
+Packfile::begin(Index *idx, std::shared_ptr<ThreadPool> pool,
+                ObjectInfo::ZipAlgo algo)
 {
-    return PfTransaction::sp(new PfTransaction(this, idx));
+    return PfTransaction::sp(new PfTransaction(this, idx, pool, algo));
 }
 
 void
@@ -194,6 +301,7 @@ Packfile::commit(PfTransaction *t, Index *idx)
     if (t->infos.size() != t->payloads.size()) {
         throw runtime_error("PfTransaction infos.size() != payloads.size())");
     }
+    ASSERT(!sealed);
 
     lseek(fd, 0, SEEK_END);
     vector<offset_t> offsets;
@@ -213,14 +321,45 @@ Packfile::commit(PfTransaction *t, Index *idx)
         off += t->payloads[i].size();
     }
 
-    write(fd, headers_ss.str().data(), headers_ss.str().size());
-    fileSize += headers_ss.str().size();
-
+    // Write the whole group at once
+    vector<struct iovec> iov(t->payloads.size() + 1);
+    iov[0].iov_base = (void *)headers_ss.str().data();
+    iov[0].iov_len = headers_ss.str().size();
     for (size_t i = 0; i < t->payloads.size(); i++) {
-        write(fd, t->payloads[i].data(), t->payloads[i].size());
-        fileSize += t->payloads[i].size();
-        numObjects++;
+        iov[i + 1].iov_base = (void *)t->payloads[i].data();
+        iov[i + 1].iov_len = t->payloads[i].size();
+    }
+
+    int status = Util_WriteV(fd, iov);
+    if (status < 0) {
+        WARNING("Packfile commit failed: %s", strerror(-status));
+        _truncateTorn();
+        throw SystemException(-status);
+    }
+    fileSize = off;
+    numObjects += t->payloads.size();
 
+    ::fsync(fd);
+
+    if (tocValid) {
+        for (size_t i = 0; i < t->payloads.size(); i++) {
+            PfTocEntry e;
+            e.entry.info = t->infos[i];
+            e.entry.offset = offsets[i];
+            e.entry.packed_size = t->payloads[i].size();
+            e.entry.packfile = packid;
+            // Payloads not added through addPayload (purge) have no checksum
+            if (i < t->checksums.size() && !t->checksums[i].isEmpty())
+                e.checksum = t->checksums[i];
+            else
+                e.checksum = OriCrypt_HashString(t->payloads[i]);
+            toc.push_back(e);
+        }
+    }
+
+    // Only index objects once their data is durable
+    idx->beginBatch();
+    for (size_t i = 0; i < t->payloads.size(); i++) {
         IndexEntry ie;
         ie.info = t->infos[i];
         ie.offset = offsets[i];
@@ -229,37 +368,57 @@ Packfile::commit(PfTransaction *t, Index *idx)
 
         idx->updateEntry(ie.info.hash, ie);
     }
+    idx->commitBatch();
 
-    ::fsync(fd);
     t->committed = true;
 }
 
 bytestream *Packfile::getPayload(const IndexEntry &entry)
 {
     ASSERT(entry.packfile == packid);
-    bytestream *stored = new fdstream(fd, entry.offset, entry.packed_size);
+    bytestream *stored;
+    std::shared_ptr<const void> owner;
+    const uint8_t *addr;
+
+    if (_mapRange(entry.offset, entry.packed_size, &owner, &addr))
+        stored = new memstream(addr, entry.packed_size, owner);
+    else
+        stored = new fdstream(fd, entry.offset, entry.packed_size);
    
-    switch (entry.info.getAlgo()) {
-        case ObjectInfo::ZIPALGO_NONE:
-            return stored;
-        case ObjectInfo::ZIPALGO_FASTLZ:
-            return new zipstream(stored, DECOMPRESS, entry.info.payload_size);
-        case ObjectInfo::ZIPALGO_LZMA:
-        case ObjectInfo::ZIPALGO_UNKNOWN:
-            NOT_IMPLEMENTED(false);
+    return zipstream::decode(stored, entry.info);
+}
+
+void
+Packfile::prefetch(offset_t off, size_t len)
+{
+    std::shared_ptr<const void> owner;
+    const uint8_t *addr;
+
+    if (_mapRange(off, len, &owner, &addr)) {
+        uintptr_t pageMask = getpagesize() - 1;
+        uintptr_t start = (uintptr_t)addr & ~pageMask;
+
+        madvise((void *)start, (uintptr_t)addr + len - start, MADV_WILLNEED);
+        return;
     }
-    return 0;
+
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, off, len, POSIX_FADV_WILLNEED);
+#endif
 }
 
 bool Packfile::purge(const set<ObjectHash> &hset, Index *idx)
 {
+    _openToc();
     PfTransaction::sp tr = begin(idx);
+    bool wasSealed = sealed;
     
     // Read the current contents
-    lseek(fd, 0, SEEK_SET);
     vector<uint32_t> storedSizes;
 
-    fdstream fs(fd, 0);
+    vector<IndexEntry> entries;
+    size_t end = sealed ? _dataEnd() : (size_t)_readGroups(&entries);
+    bufferedstream fs(new fdstream(fd, 0, end));
     while (!fs.ended()) {
         string payload;
         set<size_t> skip;
@@ -294,7 +453,7 @@ bool Packfile::purge(const set<ObjectHash> &hset, Index *idx)
         // Read payloads
         for (size_t i = 0; i < num; i++) {
             payload.resize(storedSizes[i]);
-            fs.read((uint8_t*)&payload[0], storedSizes[i]);
+            fs.readExact((uint8_t*)&payload[0], storedSizes[i]);
 
             if (skip.find(i) != skip.end()) {
                 continue;
@@ -315,39 +474,348 @@ bool Packfile::purge(const set<ObjectHash> &hset, Index *idx)
 
     ::close(oldFd);
     OriFile_Rename(tmpFilename, filename);
+    _unmap();
+    fileSize = 0;
+    numObjects = 0;
+    sealed = false;
+    tocOffset = 0;
+    tocValid = true;
+    toc.clear();
 
     // Commit the transaction
     bool empty = tr->payloads.size() == 0;
     tr.reset();
 
+    if (wasSealed)
+        seal();
+
     return empty;
 }
 
+bool
+_tocHashCmp(const PfTocEntry &e1, const PfTocEntry &e2)
+{
+    return e1.entry.info.hash < e2.entry.info.hash;
+}
+
+/*
+ * Empty objects share their offset with the object that follows them and
+ * must come first.
+ */
+bool
+_tocOffsetCmp(const PfTocEntry &e1, const PfTocEntry &e2)
+{
+    if (e1.entry.offset != e2.entry.offset)
+        return e1.entry.offset < e2.entry.offset;
+    return e1.entry.packed_size < e2.entry.packed_size;
+}
+
 void
-Packfile::readEntries(ReadEntryCb cb, void *arg)
+Packfile::seal()
+{
+    if (sealed || fileSize == 0)
+        return;
+
+    if (!tocValid) {
+        // Written by an earlier process, hash what is stored
+        vector<IndexEntry> entries;
+        _readGroups(&entries);
+
+        toc.clear();
+        for (size_t i = 0; i < entries.size(); i++) {
+            PfTocEntry e;
+            string data(entries[i].packed_size, '\0');
+            bufferedstream bs(new fdstream(fd, entries[i].offset,
+                                           entries[i].packed_size));
+
+            bs.readExact((uint8_t *)&data[0], data.size());
+            e.entry = entries[i];
+            e.checksum = OriCrypt_HashString(data);
+            toc.push_back(e);
+        }
+        tocValid = true;
+    }
+
+    sort(toc.begin(), toc.end(), _tocHashCmp);
+
+    strwstream ss(toc.size() * PFTOC_ENTRYSIZE + PFTOC_TRAILERSIZE);
+    for (size_t i = 0; i < toc.size(); i++) {
+        const IndexEntry &ie = toc[i].entry;
+
+        ss.write(ie.info.toString().data(), ObjectInfo::SIZE);
+        ss.writeUInt32(ie.packed_size);
+        ss.writeUInt32(ie.offset);
+        ss.writeHash(toc[i].checksum);
+    }
+    ObjectHash tocHash = OriCrypt_HashString(ss.str());
+    ss.writeUInt32(PFTOC_MAGIC);
+    ss.writeUInt32(PFTOC_VERSION);
+    ss.writeUInt32(fileSize);
+    ss.writeUInt32(toc.size());
+    ss.writeHash(tocHash);
+
+    lseek(fd, 0, SEEK_END);
+    vector<struct iovec> iov(1);
+    iov[0].iov_base = (void *)ss.str().data();
+    iov[0].iov_len = ss.str().size();
+    int status = Util_WriteV(fd, iov);
+    if (status < 0) {
+        WARNING("Sealing packfile %u failed: %s", packid, strerror(-status));
+        _truncateTorn();
+        throw SystemException(-status);
+    }
+    ::fsync(fd);
+
+    tocOffset = fileSize.load();
+    numObjects = toc.size();
+    sealed = true;
+    fileSize += ss.str().size();
+}
+
+bool
+Packfile::isSealed() const
+{
+    return sealed;
+}
+
+/*
+ * Picks up the size of the packfile and whether it is sealed.  Packfile
+ * handles other than the writer's may have been opened before the writer
+ * added to or sealed the packfile.
+ */
+void
+Packfile::_openToc()
+{
+    struct stat sb;
+
+    if (fstat(fd, &sb) < 0) {
+        perror("Packfile fstat");
+        throw SystemException();
+    }
+    size_t size = MAX((size_t)sb.st_size, fileSize.load());
+
+    if (!sealed && size >= PFTOC_TRAILERSIZE) {
+        string trailer(PFTOC_TRAILERSIZE, '\0');
+        if (pread(fd, &trailer[0], trailer.size(),
+                  size - PFTOC_TRAILERSIZE) == (ssize_t)trailer.size()) {
+            strstream ss(trailer);
+            uint32_t magic = ss.readUInt32();
+            uint32_t version = ss.readUInt32();
+            uint32_t off = ss.readUInt32();
+            uint32_t num = ss.readUInt32();
+            if (magic == PFTOC_MAGIC && version == PFTOC_VERSION &&
+                (size_t)off + (size_t)num * PFTOC_ENTRYSIZE +
+                    PFTOC_TRAILERSIZE == size) {
+                tocOffset = off;
+                numObjects = num;
+                sealed = true;
+            }
+        }
+    }
+
+    // Published after sealed, like seal() does
+    if (size > fileSize)
+        fileSize = size;
+}
+
+/*
+ * Discards what a failed write appended after fileSize.  Only the writer
+ * calls this, on its own packfile.  Other handles, possibly in other
+ * processes, never truncate since the writer may still be appending, they
+ * only read up to the last complete group.
+ */
+void
+Packfile::_truncateTorn()
+{
+    if (ftruncate(fd, fileSize) < 0)
+        WARNING("Packfile %u: could not truncate a failed write: %s",
+                packid, strerror(errno));
+}
+
+/*
+ * End of the groups.  fileSize is loaded first, if it already covers the
+ * table of contents then sealed and tocOffset are set as well.
+ */
+size_t
+Packfile::_dataEnd() const
+{
+    size_t size = fileSize;
+
+    return sealed ? (size_t)tocOffset : size;
+}
+
+/*
+ * Reads the table of contents of a sealed packfile, checking it against the
+ * hash in the trailer.
+ */
+bool
+Packfile::_readToc(vector<PfTocEntry> *entries, string *error)
+{
+    ASSERT(sealed);
+
+    // fileSize may not cover the table yet when it was just sealed
+    size_t len = numObjects * PFTOC_ENTRYSIZE + PFTOC_TRAILERSIZE;
+    string data(len, '\0');
+    if (pread(fd, &data[0], len, tocOffset) != (ssize_t)len) {
+        *error = "Cannot read the table of contents";
+        return false;
+    }
+
+    size_t entriesLen = len - PFTOC_TRAILERSIZE;
+    ObjectHash tocHash;
+    strstream trailer(data, entriesLen + 16);
+    trailer.readHash(tocHash);
+    if (OriCrypt_HashBlob((const uint8_t *)data.data(), entriesLen) != tocHash) {
+        *error = "Table of contents checksum mismatch";
+        return false;
+    }
+
+    strstream ss(data);
+    entries->resize(entriesLen / PFTOC_ENTRYSIZE);
+    for (size_t i = 0; i < entries->size(); i++) {
+        PfTocEntry &e = (*entries)[i];
+
+        ss.readInfo(e.entry.info);
+        e.entry.packed_size = ss.readUInt32();
+        e.entry.offset = ss.readUInt32();
+        e.entry.packfile = packid;
+        ss.readHash(e.checksum);
+        if ((size_t)e.entry.offset + e.entry.packed_size > tocOffset) {
+            *error = "Table of contents entry " + e.entry.info.hash.hex() +
+                     " is out of range";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Walks the group headers of the packfile.  Stops at the first group that is
+ * incomplete or does not parse and returns where it starts, which is the end
+ * of the packfile unless a write was torn.
+ */
+offset_t
+Packfile::_readGroups(vector<IndexEntry> *entries)
 {
     offset_t groupOffset = 0;
-    
-    while (groupOffset < fileSize) {
-        fdstream readStream(fd, groupOffset);
-        numobjs_t objs = readStream.readUInt32();
+    size_t end = _dataEnd();
+    string hdrs;
 
-        for (size_t i = 0; i < objs; i++) {
-            ObjectInfo info;
-            uint32_t size;
-            offset_t off;
+    while ((size_t)groupOffset + sizeof(numobjs_t) <= end) {
+        numobjs_t objs;
+        uint8_t num[sizeof(numobjs_t)];
+
+        if (pread(fd, num, sizeof(num), groupOffset) != sizeof(num))
+            break;
+        objs = strstream(string((char *)num, sizeof(num))).readUInt32();
+
+        size_t dataOffset = (size_t)groupOffset + sizeof(numobjs_t) +
+                            (size_t)objs * ENTRYSIZE;
+        if (dataOffset > end)
+            break;
+
+        // One pread covers the headers of a group instead of one per field
+        hdrs.resize((size_t)objs * ENTRYSIZE);
+        if (pread(fd, &hdrs[0], hdrs.size(), groupOffset + sizeof(num)) !=
+                (ssize_t)hdrs.size())
+            break;
+
+        // Payloads follow the headers back to back
+        vector<IndexEntry> group(objs);
+        strstream ss(hdrs);
+        size_t next = dataOffset;
+        size_t i;
+        for (i = 0; i < objs; i++) {
+            IndexEntry &ie = group[i];
+            string type(hdrs, i * ENTRYSIZE, ORI_OBJECT_TYPESIZE);
+
+            if (ObjectInfo::getTypeForStr(type.c_str()) == ObjectInfo::Null)
+                break;
+            ss.readInfo(ie.info);
+            ie.packed_size = ss.readUInt32();
+            ie.offset = ss.readUInt32();
+            ie.packfile = packid;
+            if (ie.offset != next || next + ie.packed_size > end)
+                break;
+            next += ie.packed_size;
+        }
+        if (i != objs)
+            break;
+
+        entries->insert(entries->end(), group.begin(), group.end());
+        groupOffset = next;
+    }
+
+    return groupOffset;
+}
 
-            ASSERT(sizeof(offset_t) == sizeof(uint32_t));
+void
+Packfile::readEntries(ReadEntryCb cb, void *arg)
+{
+    vector<IndexEntry> entries;
 
-            readStream.readInfo(info);
-            size = readStream.readUInt32();
-            off = readStream.readUInt32();
-            cb(info, off, arg);
+    _openToc();
+    if (sealed) {
+        vector<PfTocEntry> tocEntries;
+        string error;
 
-            ASSERT(groupOffset <= size + off);
-            groupOffset = size + off;
+        if (_readToc(&tocEntries, &error)) {
+            for (size_t i = 0; i < tocEntries.size(); i++)
+                cb(tocEntries[i].entry, arg);
+            return;
         }
+        WARNING("Packfile %u: %s, reading the groups instead",
+                packid, error.c_str());
     }
+
+    _readGroups(&entries);
+    for (size_t i = 0; i < entries.size(); i++)
+        cb(entries[i], arg);
+}
+
+string
+Packfile::verify()
+{
+    vector<PfTocEntry> entries;
+    string error;
+
+    _openToc();
+    if (!sealed)
+        return "";
+    if (!_readToc(&entries, &error))
+        return error;
+    if (entries.size() != numObjects)
+        return "Table of contents has the wrong number of entries";
+
+    // Read the packfile front to back, skipping over the group headers
+    sort(entries.begin(), entries.end(), _tocOffsetCmp);
+    bufferedstream bs(new fdstream(fd, 0, tocOffset), COPYFILE_BUFSZ);
+    offset_t pos = 0;
+    string data;
+    try {
+        for (size_t i = 0; i < entries.size(); i++) {
+            const IndexEntry &ie = entries[i].entry;
+
+            if (ie.offset < pos)
+                return "Objects overlap at " + ie.info.hash.hex();
+            data.resize(ie.offset - pos);
+            bs.readExact((uint8_t *)&data[0], data.size());
+
+            data.resize(ie.packed_size);
+            bs.readExact((uint8_t *)&data[0], data.size());
+            pos = ie.offset + ie.packed_size;
+            if (bs.error())
+                return string("Read error: ") + bs.error();
+
+            if (OriCrypt_HashString(data) != entries[i].checksum)
+                return "Object " + ie.info.hash.hex() + " checksum mismatch";
+        }
+    } catch (ios_base::failure &e) {
+        return "Packfile is truncated";
+    }
+
+    return "";
 }
 
 bool
@@ -430,11 +898,19 @@ Packfile::transmit(bytewstream *bs, vector<IndexEntry> objects)
     for (map<offset_t, offset_t>::iterator it = blocks.begin();
             it != blocks.end();
             it++) {
-        lseek(fd, (*it).first, SEEK_SET);
 	ASSERT((*it).second >= (*it).first);
         ssize_t len = (*it).second - (*it).first;
+        std::shared_ptr<const void> owner;
+        const uint8_t *addr;
+
+        // Send straight from the mapping when possible
+        if (_mapRange((*it).first, len, &owner, &addr)) {
+            bs->writeRef(addr, len, owner);
+            continue;
+        }
+
         buf.resize(len);
-        ssize_t n = read(fd, &buf[0], len);
+        ssize_t n = pread(fd, &buf[0], len, (*it).first);
         if (n < 0 || n != len) {
             throw SystemException();
         }
@@ -448,16 +924,19 @@ Packfile::transmit(bytewstream *bs, vector<IndexEntry> objects)
 
 
 bool
-Packfile::receive(bytestream *bs, Index *idx)
+Packfile::receive(bytestream *bs, Index *idx,
+                  std::vector<ObjectInfo> *received)
 {
     ASSERT(sizeof(uint32_t) == sizeof(numobjs_t));
     numobjs_t num = bs->readUInt32();
     if (num == 0) return false;
+    ASSERT(!sealed);
 
     lseek(fd, 0, SEEK_END);
     size_t headers_size = num * ENTRYSIZE;
     offset_t off = fileSize + sizeof(numobjs_t) + headers_size;
     vector<size_t> obj_sizes;
+    vector<IndexEntry> entries;
     
     strwstream headers_ss;
     ASSERT(sizeof(offset_t) == sizeof(numobjs_t));
@@ -478,29 +957,117 @@ Packfile::receive(bytestream *bs, Index *idx)
         headers_ss.writeUInt32(off);
 
         IndexEntry ie = {info, off, obj_size, packid};
-        idx->updateEntry(info.hash, ie);
+        entries.push_back(ie);
 
         off += obj_size;
     }
 
-    write(fd, headers_ss.str().data(), headers_ss.str().size());
-    fileSize += headers_ss.str().size();
+    // fileSize and the table of contents are only updated once the whole
+    // group is written
+    vector<struct iovec> iov(1);
+    iov[0].iov_base = (void *)headers_ss.str().data();
+    iov[0].iov_len = headers_ss.str().size();
+    int status = Util_WriteV(fd, iov);
 
     vector<uint8_t> data;
+    vector<ObjectHash> checksums;
+    try {
+        for (size_t i = 0; status == 0 && i < num; i++) {
+            //fprintf(stderr, "Reading %lu packed size %lu\n", i, obj_sizes[i]);
+            data.resize(obj_sizes[i]);
+            if (!bs->readExact(data.data(), obj_sizes[i])) {
+                status = -EIO;
+                break;
+            }
+
+            iov[0].iov_base = (void *)data.data();
+            iov[0].iov_len = obj_sizes[i];
+            status = Util_WriteV(fd, iov);
+
+            if (tocValid)
+                checksums.push_back(OriCrypt_HashBlob(data.data(),
+                                                      obj_sizes[i]));
+        }
+    } catch (...) {
+        // The stream failed part way through the group
+        _truncateTorn();
+        throw;
+    }
+    if (status < 0) {
+        WARNING("Packfile receive failed: %s", strerror(-status));
+        _truncateTorn();
+        throw SystemException(-status);
+    }
+
+    ::fsync(fd);
+    fileSize = off;
+    numObjects += num;
+
+    for (size_t i = 0; i < checksums.size(); i++) {
+        PfTocEntry e;
+        e.entry = entries[i];
+        e.checksum = checksums[i];
+        toc.push_back(e);
+    }
+
+    idx->beginBatch();
     for (size_t i = 0; i < num; i++) {
-        //fprintf(stderr, "Reading %lu packed size %lu\n", i, obj_sizes[i]);
-        data.resize(obj_sizes[i]);
-        bs->readExact(&data[0], obj_sizes[i]);
-        
-        write(fd, &data[0], obj_sizes[i]);
-        fileSize += obj_sizes[i];
-        numObjects++;
+        idx->updateEntry(entries[i].info.hash, entries[i]);
+    }
+    idx->commitBatch();
+
+    if (received) {
+        for (size_t i = 0; i < num; i++) {
+            received->push_back(entries[i].info);
+        }
     }
 
     return true;
 }
 
+/*
+ * Returns a pointer into the packfile mapping for [off, off + len).
+ * Packfiles are append only, so an existing mapping stays valid for the
+ * bytes it covers and is only replaced when a read runs past its end.
+ * Small (usually still growing) packfiles are not mapped.
+ */
+bool
+Packfile::_mapRange(offset_t off, size_t len,
+                    std::shared_ptr<const void> *owner, const uint8_t **addr)
+{
+    size_t size = fileSize;
 
+    if (size < PACKFILE_MMAP_MINSIZE || (size_t)off + len > size)
+        return false;
+
+    mapLock.lock();
+    if (!mapping || (size_t)off + len > mapLen) {
+        void *a = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (a == MAP_FAILED) {
+            mapLock.unlock();
+            perror("Packfile mmap");
+            return false;
+        }
+        mapping.reset(new PfMapping(a, size));
+        mapAddr = (const uint8_t *)a;
+        mapLen = size;
+    }
+    *owner = mapping;
+    *addr = mapAddr + off;
+    mapLock.unlock();
+
+    return true;
+}
+
+void
+Packfile::_unmap()
+{
+    mapLock.lock();
+    mapping.reset();
+    mapAddr = NULL;
+    mapLen = 0;
+    mapLock.unlock();
+}
 
 
 /*
@@ -508,7 +1075,7 @@ Packfile::receive(bytestream *bs, Index *idx)
  */
 
 PackfileManager::PackfileManager(const string &rootPath)
-    : rootPath(rootPath)
+    : rootPath(rootPath), cacheLock()
 {
     if (!_loadFreeList()) {
         _recomputeFreeList();
@@ -518,12 +1085,27 @@ PackfileManager::PackfileManager(const string &rootPath)
 
 PackfileManager::~PackfileManager()
 {
+    Monitor lock(cacheLock);
+
     _writeFreeList();
 }
 
 Packfile::sp
 PackfileManager::getPackfile(packid_t id)
 {
+    Monitor lock(cacheLock);
+
+    // Readers share the writer's handle so they see each group as soon as
+    // it is committed
+    unordered_map<packid_t, weak_ptr<Packfile> >::iterator it;
+    it = writers.find(id);
+    if (it != writers.end()) {
+        Packfile::sp pf = it->second.lock();
+        if (pf)
+            return pf;
+        writers.erase(it);
+    }
+
     if (!_packfileCache.hasKey(id)) {
         Packfile::sp pf(new Packfile(_getPackfileName(id), id));
 
@@ -537,15 +1119,32 @@ PackfileManager::getPackfile(packid_t id)
 Packfile::sp
 PackfileManager::newPackfile()
 {
+    Monitor lock(cacheLock);
+
     ASSERT(freeList.size() > 0);
-    packid_t id = freeList[0];
-    Packfile::sp pf(new Packfile(_getPackfileName(id), id));
-    if (freeList.size() == 1) {
-        freeList[0] += 1;
-    }
-    else {
-        freeList.pop_front();
+    packid_t id;
+
+    unordered_map<packid_t, weak_ptr<Packfile> >::iterator it;
+    for (it = writers.begin(); it != writers.end();) {
+        if (it->second.expired())
+            it = writers.erase(it);
+        else
+            it++;
     }
+
+    do {
+        // The free list may be stale after a crash, never reuse a packfile
+        id = freeList[0];
+        if (freeList.size() == 1) {
+            freeList[0] += 1;
+        }
+        else {
+            freeList.pop_front();
+        }
+    } while (OriFile_Exists(_getPackfileName(id)));
+
+    Packfile::sp pf(new Packfile(_getPackfileName(id), id));
+    writers[id] = pf;
     return pf;
 }
 
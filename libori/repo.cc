@@ -18,6 +18,7 @@
 
 #include <string>
 #include <vector>
+#include <map>
 #include <set>
 #include <queue>
 #include <iostream>
@@ -75,6 +76,11 @@ Repo::hasObjects(const ObjectHashVec &ids)
     return rval;
 }
 
+void
+Repo::prefetchObjects(const ObjectHashVec &ids)
+{
+}
+
 /*
  * High-level operations
  */
@@ -159,6 +165,55 @@ Repo::addFile(const string &path)
         return make_pair(addSmallFile(path), ObjectHash());
 }
 
+/*
+ * Add a file that was modified in place given the object of its previous
+ * contents, a Blob or a LargeBlob.  changed maps the start of every modified
+ * byte range to its end and src reads the new contents.  Only the modified
+ * parts of a LargeBlob are chunked again, see LargeBlob::rechunk.
+ */
+pair<ObjectHash, ObjectHash>
+Repo::addModifiedFile(const ObjectHash &base,
+                      const map<uint64_t, uint64_t> &changed,
+                      uint64_t size, LargeBlobSource *src)
+{
+    LargeBlob baseLb = LargeBlob(this);
+    LargeBlob lb = LargeBlob(this);
+
+    if (size <= LARGEFILE_MINIMUM) {
+        string blob(size, '\0');
+
+        if (src->read((uint8_t *)&blob[0], size, 0) != (ssize_t)size) {
+            perror("Cannot read modified file");
+            PANIC();
+        }
+
+        return make_pair(addBlob(ObjectInfo::Blob, blob), ObjectHash());
+    }
+
+    Object::sp o(getObject(base));
+    if (o && o->getInfo().type == ObjectInfo::LargeBlob)
+        baseLb.fromBlob(o->getPayload());
+    lb.rechunk(baseLb, changed, size, src);
+
+    return make_pair(addBlob(ObjectInfo::LargeBlob, lb.getBlob()),
+                     lb.totalHash);
+}
+
+/*
+ * Add several files, returning their hashes in the same order.
+ */
+vector<pair<ObjectHash, ObjectHash> >
+Repo::addFiles(const vector<string> &paths)
+{
+    vector<pair<ObjectHash, ObjectHash> > rval;
+
+    for (size_t i = 0; i < paths.size(); i++) {
+        rval.push_back(addFile(paths[i]));
+    }
+
+    return rval;
+}
+
 
 
 
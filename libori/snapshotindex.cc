@@ -191,6 +191,18 @@ SnapshotIndex::getSnapshot(const string &name) const
     return (*it).second;
 }
 
+bool
+SnapshotIndex::lookup(const string &name, ObjectHash *commitId) const
+{
+    map<string, ObjectHash>::const_iterator it = snapshots.find(name);
+
+    if (it == snapshots.end())
+        return false;
+
+    *commitId = (*it).second;
+    return true;
+}
+
 map<string, ObjectHash>
 SnapshotIndex::getList()
 {
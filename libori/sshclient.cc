@@ -119,7 +119,7 @@ int SshClient::connect()
 
     fdToChild = pipe_to_child[D_WRITE];
     fdFromChild = pipe_from_child[D_READ];
-    streamToChild.reset(new fdwstream(fdToChild));
+    streamToChild.reset(new bufferedwstream(new fdwstream(fdToChild)));
 
     // SSH sets stderr to nonblock, possibly screwing up stdout (according to
     // rsync)
@@ -138,6 +138,7 @@ void SshClient::disconnect()
 {
     if (childPid > 0) {
         //kill(childPid, SIGINT);
+        streamToChild.reset();
         close(fdToChild);
         // Wait for child to die
         while (kill(childPid, 0)) {
@@ -155,32 +156,31 @@ bool SshClient::connected() {
 void SshClient::sendCommand(const std::string &command) {
     ASSERT(connected());
     streamToChild->writePStr(command);
-    fsync(fdToChild);
 }
 
 void SshClient::sendData(const std::string &data) {
     ASSERT(connected());
-    size_t len = data.size();
-    size_t off = 0;
-    while (len > 0) {
-        ssize_t written = write(fdToChild, data.data()+off, len);
-        if (written < 0) {
-            perror("SshClient::sendData write");
-            exit(1);
-        }
-        len -= written;
-        off += written;
+    if (streamToChild->write(data.data(), data.size()) < 0) {
+        perror("SshClient::sendData write");
+        exit(1);
     }
-
-    fsync(fdToChild);
 }
 
+// Replies end before the next command is sent, read-ahead stays in one reply
 bytestream *SshClient::getStream() {
-    return new fdstream(fdFromChild, -1);
+    return new bufferedstream(new fdstream(fdFromChild, -1));
 }
 
 bool SshClient::respIsOK() {
     uint8_t resp = 0;
+
+    // Send the command and its arguments in one write
+    if (streamToChild->flush() < 0) {
+        WARNING("SSH error: %s", streamToChild->error());
+        return false;
+    }
+    fsync(fdToChild);
+
     int status = read(fdFromChild, &resp, 1);
     if (status == 1 && resp == 0) return true;
     else {
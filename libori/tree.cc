@@ -24,9 +24,12 @@
 
 #include <string>
 #include <set>
+#include <vector>
+#include <mutex>
 #include <sstream>
 #include <iostream>
 #include <algorithm>
+#include <unordered_map>
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
@@ -47,6 +50,59 @@ using namespace std;
  *
  ********************************************************************/
 
+/*
+ * getpwuid and getgrgid are not reentrant and may read the databases on
+ * every call, so names are looked up once per id and cached.  Ids without
+ * an entry are stored as numbers.
+ */
+static mutex AttrMap_NameLock;
+static unordered_map<uid_t, string> AttrMap_UserNames;
+static unordered_map<gid_t, string> AttrMap_GroupNames;
+
+static string
+AttrMap_UserName(uid_t uid)
+{
+    unique_lock<mutex> l(AttrMap_NameLock);
+    unordered_map<uid_t, string>::iterator it = AttrMap_UserNames.find(uid);
+
+    if (it != AttrMap_UserNames.end())
+        return it->second;
+
+    struct passwd pw, *result = NULL;
+    long bufsz = sysconf(_SC_GETPW_R_SIZE_MAX);
+    vector<char> buf((bufsz > 0) ? bufsz : 16384);
+    string name;
+    if (getpwuid_r(uid, &pw, &buf[0], buf.size(), &result) == 0 && result)
+        name = result->pw_name;
+    else
+        name = to_string(uid);
+
+    AttrMap_UserNames[uid] = name;
+    return name;
+}
+
+static string
+AttrMap_GroupName(gid_t gid)
+{
+    unique_lock<mutex> l(AttrMap_NameLock);
+    unordered_map<gid_t, string>::iterator it = AttrMap_GroupNames.find(gid);
+
+    if (it != AttrMap_GroupNames.end())
+        return it->second;
+
+    struct group gr, *result = NULL;
+    long bufsz = sysconf(_SC_GETGR_R_SIZE_MAX);
+    vector<char> buf((bufsz > 0) ? bufsz : 16384);
+    string name;
+    if (getgrgid_r(gid, &gr, &buf[0], buf.size(), &result) == 0 && result)
+        name = result->gr_name;
+    else
+        name = to_string(gid);
+
+    AttrMap_GroupNames[gid] = name;
+    return name;
+}
+
 AttrMap::AttrMap()
 {
 }
@@ -66,24 +122,25 @@ void AttrMap::setFromFile(const std::string &filename)
 	PANIC();
     }
 
-    struct passwd *upw = getpwuid(sb.st_uid);
-    struct group *ggr = getgrgid(sb.st_gid);
+    setFromStat(sb);
+}
+
+void AttrMap::setFromStat(const struct stat &sb)
+{
     setAs<size_t>(ATTR_FILESIZE, sb.st_size);
     setAs<mode_t>(ATTR_PERMS, sb.st_mode & ~S_IFDIR & ~S_IFREG);
-    attrs[ATTR_USERNAME] = upw->pw_name;
-    attrs[ATTR_GROUPNAME] = ggr->gr_name;
+    attrs[ATTR_USERNAME] = AttrMap_UserName(sb.st_uid);
+    attrs[ATTR_GROUPNAME] = AttrMap_GroupName(sb.st_gid);
     setAs<time_t>(ATTR_CTIME, sb.st_ctime);
     setAs<time_t>(ATTR_MTIME, sb.st_mtime);
 }
 
 void AttrMap::setCreation(mode_t perms)
 {
-    struct passwd *upw = getpwuid(geteuid());
-    struct group *ggr = getgrgid(getegid());
     setAs<size_t>(ATTR_FILESIZE, 0);
     setAs<mode_t>(ATTR_PERMS, perms);
-    attrs[ATTR_USERNAME] = upw->pw_name;
-    attrs[ATTR_GROUPNAME] = ggr->gr_name;
+    attrs[ATTR_USERNAME] = AttrMap_UserName(geteuid());
+    attrs[ATTR_GROUPNAME] = AttrMap_GroupName(getegid());
 
     time_t currTime = time(NULL);
     setAs<time_t>(ATTR_CTIME, currTime);
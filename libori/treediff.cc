@@ -15,22 +15,32 @@
  */
 
 #include <string.h>
+#include <errno.h>
 
 #include <unistd.h>
+#include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <pwd.h>
 #include <grp.h>
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <exception>
+#include <algorithm>
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/orifile.h>
 #include <oriutil/oricrypt.h>
 #include <oriutil/scan.h>
+#include <oriutil/systemexception.h>
+#include <oriutil/threadpool.h>
 #include <ori/treediff.h>
 #include <ori/largeblob.h>
+#include <ori/dirstate.h>
 
 using namespace std;
 
@@ -79,196 +89,343 @@ TreeDiff::TreeDiff()
 {
 }
 
+static void
+TreeDiff_Added(vector<TreeDiffEntry> *out, const string &path,
+               const TreeEntry &entry)
+{
+    TreeDiffEntry diffEntry;
+
+    // New file or directory
+    diffEntry.filepath = path;
+    if (entry.type == TreeEntry::Tree) {
+        diffEntry.type = TreeDiffEntry::NewDir;
+    } else {
+        diffEntry.type = TreeDiffEntry::NewFile;
+        diffEntry.newFilename = "";
+        diffEntry.fileBase = "";
+        diffEntry.hashBase = make_pair(EMPTYFILE_HASH, ObjectHash());
+    }
+    diffEntry.hashes = make_pair(entry.hash, entry.largeHash);
+    diffEntry.newAttrs = entry.attrs;
+
+    out->push_back(diffEntry);
+}
+
+static void
+TreeDiff_Deleted(vector<TreeDiffEntry> *out, const string &path,
+                 const TreeEntry &entry)
+{
+    TreeDiffEntry diffEntry;
+
+    // Deleted file or directory
+    diffEntry.filepath = path;
+    diffEntry.type = entry.type == TreeEntry::Tree ?
+        TreeDiffEntry::DeletedDir : TreeDiffEntry::DeletedFile;
+
+    out->push_back(diffEntry);
+}
+
+/*
+ * Compares entry to entry2, its previous version at the same path.  Does
+ * not look into directories.
+ */
+static void
+TreeDiff_Changed(vector<TreeDiffEntry> *out, const string &path,
+                 const TreeEntry &entry, const TreeEntry &entry2)
+{
+    if (entry.type != TreeEntry::Tree && entry2.type == TreeEntry::Tree) {
+        // Replaced directory with file
+        TreeDiffEntry diffEntry;
+
+        diffEntry.filepath = path;
+        diffEntry.type = TreeDiffEntry::DeletedDir;
+        out->push_back(diffEntry);
+
+        diffEntry.type = TreeDiffEntry::NewFile;
+        diffEntry.newFilename = "";
+        diffEntry.hashes = make_pair(entry.hash, entry.largeHash);
+        diffEntry.newAttrs = entry.attrs;
+        out->push_back(diffEntry);
+    } else if (entry.type == TreeEntry::Tree &&
+               entry2.type != TreeEntry::Tree) {
+        // Replaced file with directory
+        TreeDiffEntry diffEntry;
+
+        diffEntry.filepath = path;
+        diffEntry.type = TreeDiffEntry::DeletedFile;
+        out->push_back(diffEntry);
+
+        diffEntry.type = TreeDiffEntry::NewDir;
+        diffEntry.newAttrs = entry.attrs;
+        diffEntry.hashes = make_pair(entry.hash, entry.largeHash);
+        diffEntry.newAttrs = entry.attrs;
+        out->push_back(diffEntry);
+    } else if (entry.type != TreeEntry::Tree && entry.hash != entry2.hash) {
+        // This should do the right thing even if for some reason the 
+        // file was a small file and became a large file (with the 
+        // exact same content).  That should never happen though!
+        TreeDiffEntry diffEntry;
+
+        diffEntry.filepath = path;
+        diffEntry.type = TreeDiffEntry::Modified;
+        diffEntry.newFilename = "";
+        diffEntry.hashes = make_pair(entry.hash, entry.largeHash);
+        diffEntry.fileBase = "";
+        diffEntry.hashBase = make_pair(entry2.hash, entry2.largeHash);
+        diffEntry.newAttrs = entry.attrs;
+        diffEntry.attrsBase = entry2.attrs;
+
+        out->push_back(diffEntry);
+    }
+    // XXX: Handle attribute only changes
+}
+
 // TODO: 
 void
 TreeDiff::diffTwoTrees(const Tree::Flat &t1, const Tree::Flat &t2)
 {
     map<string, TreeEntry>::const_iterator it;
+    vector<TreeDiffEntry> diffEntries;
 
     for (it = t1.begin(); it != t1.end(); it++) {
-        string path = (*it).first;
-        TreeEntry entry = (*it).second;
-        map<string, TreeEntry>::const_iterator it2;
-
-        it2 = t2.find(path);
-        if (it2 == t2.end()) {
-            TreeDiffEntry diffEntry;
-
-            // New file or directory
-            diffEntry.filepath = path;
-            if (entry.type == TreeEntry::Tree) {
-                diffEntry.type = TreeDiffEntry::NewDir;
-            } else {
-                diffEntry.type = TreeDiffEntry::NewFile;
-                diffEntry.newFilename = "";
-                diffEntry.fileBase = "";
-                diffEntry.hashBase = make_pair(EMPTYFILE_HASH, ObjectHash());
-            }
-            diffEntry.hashes = make_pair(entry.hash, entry.largeHash);
-            diffEntry.newAttrs = entry.attrs;
+        map<string, TreeEntry>::const_iterator it2 = t2.find((*it).first);
 
-            append(diffEntry);
-        } else {
-            TreeEntry entry2 = (*it2).second;
-
-            if (entry.type != TreeEntry::Tree && entry2.type == TreeEntry::Tree) {
-                // Replaced directory with file
-                TreeDiffEntry diffEntry;
-
-                diffEntry.filepath = path;
-                diffEntry.type = TreeDiffEntry::DeletedDir;
-                append(diffEntry);
-
-                diffEntry.type = TreeDiffEntry::NewFile;
-                diffEntry.newFilename = "";
-                diffEntry.hashes = make_pair(entry.hash, entry.largeHash);
-                diffEntry.newAttrs = entry.attrs;
-                append(diffEntry);
-            } else if (entry.type == TreeEntry::Tree &&
-                       entry2.type != TreeEntry::Tree) {
-                // Replaced file with directory
-                TreeDiffEntry diffEntry;
-
-                diffEntry.filepath = path;
-                diffEntry.type = TreeDiffEntry::DeletedFile;
-                append(diffEntry);
-
-                diffEntry.type = TreeDiffEntry::NewDir;
-                diffEntry.newAttrs = entry.attrs;
-                diffEntry.hashes = make_pair(entry.hash, entry.largeHash);
-                diffEntry.newAttrs = entry.attrs;
-                append(diffEntry);
-            } else {
-                // Check for mismatch
-                TreeEntry entry2 = (*it2).second;
-
-                // This should do the right thing even if for some reason the 
-                // file was a small file and became a large file (with the 
-                // exact same content).  That should never happen though!
-                if (entry.type != TreeEntry::Tree && entry.hash != entry2.hash) {
-                    TreeDiffEntry diffEntry;
-
-                    diffEntry.filepath = path;
-                    diffEntry.type = TreeDiffEntry::Modified;
-                    diffEntry.newFilename = "";
-                    diffEntry.hashes = make_pair(entry.hash, entry.largeHash);
-                    diffEntry.fileBase = "";
-                    diffEntry.hashBase = make_pair(entry2.hash, entry2.largeHash);
-                    diffEntry.newAttrs = entry.attrs;
-                    diffEntry.attrsBase = entry2.attrs;
-
-                    append(diffEntry);
-                }
-                // XXX: Handle attribute only changes
-            }
-        }
+        if (it2 == t2.end())
+            TreeDiff_Added(&diffEntries, (*it).first, (*it).second);
+        else
+            TreeDiff_Changed(&diffEntries, (*it).first, (*it).second,
+                             (*it2).second);
     }
 
     for (it = t2.begin(); it != t2.end(); it++) {
-        string path = (*it).first;
-        TreeEntry entry = (*it).second;
-        map<string, TreeEntry>::const_iterator it1;
+        if (t1.find((*it).first) == t1.end())
+            TreeDiff_Deleted(&diffEntries, (*it).first, (*it).second);
+    }
 
-        it1 = t1.find(path);
-        if (it1 == t1.end()) {
-            TreeDiffEntry diffEntry;
+    for (size_t i = 0; i < diffEntries.size(); i++)
+        append(diffEntries[i]);
+}
+
+/*
+ * Adds an entry for every path below the directory entry at path using f.
+ */
+static void
+TreeDiff_Subtree(vector<TreeDiffEntry> *out, const string &path,
+                 const TreeEntry &entry, Repo *r,
+                 void (*f)(vector<TreeDiffEntry> *, const string &,
+                           const TreeEntry &))
+{
+    Tree::Flat flat = r->getTree(entry.hash).flattened(r);
 
-            // Deleted file or directory
-            diffEntry.filepath = path;
-            diffEntry.type = entry.type == TreeEntry::Tree ?
-                TreeDiffEntry::DeletedDir : TreeDiffEntry::DeletedFile;
+    for (Tree::Flat::iterator it = flat.begin(); it != flat.end(); it++)
+        f(out, path + (*it).first, (*it).second);
+}
 
-            append(diffEntry);
+/*
+ * Walks the entries of two versions of the directory at prefix side by
+ * side, directories whose hashes match are skipped without being loaded.
+ */
+static void
+TreeDiff_Walk(const string &prefix, const Tree &t1, const Tree &t2,
+              Repo *r, vector<TreeDiffEntry> *added,
+              vector<TreeDiffEntry> *deleted)
+{
+    map<string, TreeEntry>::const_iterator it1 = t1.tree.begin();
+    map<string, TreeEntry>::const_iterator it2 = t2.tree.begin();
+
+    while (it1 != t1.tree.end() || it2 != t2.tree.end()) {
+        int cmp;
+
+        if (it1 == t1.tree.end())
+            cmp = 1;
+        else if (it2 == t2.tree.end())
+            cmp = -1;
+        else
+            cmp = (*it1).first.compare((*it2).first);
+
+        if (cmp < 0) {
+            const TreeEntry &e1 = (*it1).second;
+            string path = prefix + (*it1).first;
+
+            TreeDiff_Added(added, path, e1);
+            if (e1.type == TreeEntry::Tree)
+                TreeDiff_Subtree(added, path, e1, r, TreeDiff_Added);
+            it1++;
+        } else if (cmp > 0) {
+            const TreeEntry &e2 = (*it2).second;
+            string path = prefix + (*it2).first;
+
+            TreeDiff_Deleted(deleted, path, e2);
+            if (e2.type == TreeEntry::Tree)
+                TreeDiff_Subtree(deleted, path, e2, r, TreeDiff_Deleted);
+            it2++;
+        } else {
+            const TreeEntry &e1 = (*it1).second;
+            const TreeEntry &e2 = (*it2).second;
+            string path = prefix + (*it1).first;
+
+            if (e1.type == TreeEntry::Tree && e2.type == TreeEntry::Tree) {
+                if (e1.hash != e2.hash)
+                    TreeDiff_Walk(path + "/", r->getTree(e1.hash),
+                                  r->getTree(e2.hash), r, added, deleted);
+            } else {
+                TreeDiff_Changed(added, path, e1, e2);
+                if (e1.type == TreeEntry::Tree)
+                    TreeDiff_Subtree(added, path, e1, r, TreeDiff_Added);
+                if (e2.type == TreeEntry::Tree)
+                    TreeDiff_Subtree(deleted, path, e2, r, TreeDiff_Deleted);
+            }
+            it1++;
+            it2++;
         }
     }
+}
 
-    return;
+static bool
+TreeDiff_PathCmp(const TreeDiffEntry &a, const TreeDiffEntry &b)
+{
+    return a.filepath < b.filepath;
 }
 
+void
+TreeDiff::diffTwoTrees(const Tree &t1, const Tree &t2, Repo *r)
+{
+    vector<TreeDiffEntry> added, deleted;
+
+    TreeDiff_Walk("/", t1, t2, r, &added, &deleted);
+
+    // Same order as diffing the flattened trees
+    stable_sort(added.begin(), added.end(), TreeDiff_PathCmp);
+    stable_sort(deleted.begin(), deleted.end(), TreeDiff_PathCmp);
+    for (size_t i = 0; i < added.size(); i++)
+        append(added[i]);
+    for (size_t i = 0; i < deleted.size(); i++)
+        append(deleted[i]);
+}
+
+/*
+ * State shared by the threads scanning a working directory.  Each directory
+ * is scanned by one task which queues a task per subdirectory.  Entries are
+ * collected per directory and merged in path order at the end so the diff
+ * does not depend on scheduling.
+ */
 struct _scanHelperData {
-    set<string> *wd_paths;
-    map<string, TreeEntry> *flattened_tree;
-    TreeDiff *td;
+    const Tree::Flat *flattened_tree;
     Commit *commit;
 
     size_t cwdLen;
     Repo *repo;
+    DirState *state;
+    TaskGroup *group;
+
+    mutex lock;
+    set<string> wd_paths;
+    vector<TreeDiffEntry> entries;
+    exception_ptr error;
 };
 
-static int _diffToDirHelper(_scanHelperData *sd, const string &path)
+/*
+ * Compares one path against the tree.  The path is stat'ed once and the
+ * result reused for the type, the attributes and the directory state.
+ */
+static void
+_diffToDirHelper(_scanHelperData *sd, const string &fullPath,
+                 vector<TreeDiffEntry> *out)
 {
-    string fullPath = path;
-
     string relPath = fullPath.substr(sd->cwdLen);
-    sd->wd_paths->insert(relPath);
+    struct stat sb;
+
+    if (stat(fullPath.c_str(), &sb) < 0) {
+        perror("stat");
+        return;
+    }
 
     TreeDiffEntry diffEntry;
     diffEntry.filepath = relPath;
 
-    map<string, TreeEntry>::iterator it = sd->flattened_tree->find(relPath);
+    Tree::Flat::const_iterator it = sd->flattened_tree->find(relPath);
     if (it == sd->flattened_tree->end()) {
         // New file/dir
-        if (OriFile_IsDirectory(fullPath)) {
+        if (S_ISDIR(sb.st_mode)) {
             diffEntry.type = TreeDiffEntry::NewDir;
         }
         else {
             diffEntry.type = TreeDiffEntry::NewFile;
             diffEntry.newFilename = fullPath;
         }
-        diffEntry.newAttrs.setFromFile(fullPath);
-        sd->td->append(diffEntry);
-        return 0;
+        diffEntry.newAttrs.setFromStat(sb);
+        out->push_back(diffEntry);
+        if (sd->state && diffEntry.type == TreeDiffEntry::NewFile)
+            sd->state->update(relPath, sb);
+        return;
     }
 
     // Potentially modified file/dir
     const TreeEntry &te = (*it).second;
-    if (OriFile_IsDirectory(fullPath)) {
+    if (S_ISDIR(sb.st_mode)) {
         if (te.type != TreeEntry::Tree) {
             // File replaced by dir
             diffEntry.type = TreeDiffEntry::DeletedFile;
-            sd->td->append(diffEntry);
+            out->push_back(diffEntry);
             diffEntry.type = TreeDiffEntry::NewDir;
-            diffEntry.newAttrs.setFromFile(fullPath);
-            sd->td->append(diffEntry);
+            diffEntry.newAttrs.setFromStat(sb);
+            out->push_back(diffEntry);
         }
-        return 0;
+        return;
     }
 
     if (te.type == TreeEntry::Tree) {
         // Dir replaced by file
         diffEntry.type = TreeDiffEntry::DeletedDir;
-        sd->td->append(diffEntry);
+        out->push_back(diffEntry);
         diffEntry.type = TreeDiffEntry::NewFile;
         diffEntry.newFilename = fullPath;
-        diffEntry.newAttrs.setFromFile(fullPath);
-        sd->td->append(diffEntry);
-        return 0;
+        diffEntry.newAttrs.setFromStat(sb);
+        out->push_back(diffEntry);
+        if (sd->state)
+            sd->state->update(relPath, sb);
+        return;
     }
 
     // Check if file is modified
 
-    AttrMap newAttrs;
-    newAttrs.setFromFile(fullPath);
-
+    ObjectHash oldHash = (te.type == TreeEntry::LargeBlob) ? te.largeHash
+                                                           : te.hash;
+    ObjectHash newHash;
     bool modified = false;
-    if (te.type == TreeEntry::Blob) {
-        ObjectInfo info = sd->repo->getObjectInfo(te.hash);
-        if (info.payload_size != newAttrs.getAs<size_t>(ATTR_FILESIZE) ||
-                newAttrs.getAs<time_t>(ATTR_MTIME) >= sd->commit->getTime()) {
+    if (sd->state && sd->state->lookup(relPath, sb, &newHash)) {
+        modified = newHash != oldHash;
+        if (!modified)
+            return;
+    }
 
-            ObjectHash newHash = OriCrypt_HashFile(fullPath);
-            modified = newHash != te.hash;
+    AttrMap newAttrs;
+    newAttrs.setFromStat(sb);
+
+    if (!modified) {
+        size_t oldSize;
+        if (te.attrs.has(ATTR_FILESIZE)) {
+            oldSize = te.attrs.getAs<size_t>(ATTR_FILESIZE);
+        } else if (te.type == TreeEntry::Blob) {
+            oldSize = sd->repo->getObjectInfo(te.hash).payload_size;
+        } else {
+            LargeBlob lb(sd->repo);
+            Object::sp lbObj(sd->repo->getObject(te.hash));
+            lb.fromBlob(lbObj->getPayload());
+            oldSize = lb.totalSize();
         }
-    }
-    else if (te.type == TreeEntry::LargeBlob) {
-        LargeBlob lb(sd->repo);
-        Object::sp lbObj(sd->repo->getObject(te.hash));
-        lb.fromBlob(lbObj->getPayload());
-        if (lb.totalSize() != newAttrs.getAs<size_t>(ATTR_FILESIZE) ||
-                newAttrs.getAs<time_t>(ATTR_MTIME) >= sd->commit->getTime()) {
 
-            ObjectHash newHash = OriCrypt_HashFile(fullPath);
-            modified = newHash != te.largeHash;
+        if (oldSize != (size_t)sb.st_size) {
+            modified = true;
+            if (sd->state)
+                sd->state->update(relPath, sb);
+        } else if (sb.st_mtime >= sd->commit->getTime()) {
+            newHash = OriCrypt_HashFile(fullPath);
+            modified = newHash != oldHash;
+            if (sd->state)
+                sd->state->update(relPath, sb, newHash);
+        } else if (sd->state) {
+            sd->state->update(relPath, sb, oldHash);
         }
     }
 
@@ -279,15 +436,69 @@ static int _diffToDirHelper(_scanHelperData *sd, const string &path)
 
         diffEntry._diffAttrs(te.attrs, newAttrs);
 
-        sd->td->append(diffEntry);
-        return 0;
+        out->push_back(diffEntry);
     }
+}
 
-    return 0;
+/*
+ * Scans one directory, subdirectories are queued as separate tasks.  Like
+ * DirTraverse this skips '.ori' and does not follow symbolic links to
+ * directories.  A directory that cannot be read fails the whole diff, its
+ * children would otherwise look deleted.
+ */
+static void
+_diffToDirScan(_scanHelperData *sd, const string &dir)
+{
+    vector<TreeDiffEntry> entries;
+    vector<string> paths;
+
+    try {
+        unique_ptr<DIR, int (*)(DIR *)> d(opendir(dir.c_str()), closedir);
+        if (!d) {
+            int errcode = errno;
+            WARNING("Couldn't scan directory %s: %s", dir.c_str(),
+                    strerror(errcode));
+            throw SystemException(errcode);
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(d.get())) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 ||
+                strcmp(entry->d_name, "..") == 0 ||
+                strcmp(entry->d_name, ".ori") == 0)
+                continue;
+
+            string fullPath = dir + "/" + entry->d_name;
+            paths.push_back(fullPath.substr(sd->cwdLen));
+            _diffToDirHelper(sd, fullPath, &entries);
+
+            bool isDir = entry->d_type == DT_DIR;
+            if (entry->d_type == DT_UNKNOWN) {
+                struct stat sb;
+                isDir = lstat(fullPath.c_str(), &sb) == 0 &&
+                        S_ISDIR(sb.st_mode);
+            }
+            if (isDir) {
+                sd->group->run([sd, fullPath]() {
+                    _diffToDirScan(sd, fullPath);
+                });
+            }
+        }
+    } catch (...) {
+        unique_lock<mutex> l(sd->lock);
+        if (!sd->error)
+            sd->error = current_exception();
+        return;
+    }
+
+    unique_lock<mutex> l(sd->lock);
+    sd->wd_paths.insert(paths.begin(), paths.end());
+    sd->entries.insert(sd->entries.end(), entries.begin(), entries.end());
 }
 
 void
-TreeDiff::diffToDir(Commit from, const std::string &dir, Repo *r)
+TreeDiff::diffToDir(Commit from, const std::string &dir, Repo *r,
+                    DirState *state, ThreadPool *pool)
 {
     Tree src;
     if (!from.getTree().isEmpty())
@@ -295,33 +506,43 @@ TreeDiff::diffToDir(Commit from, const std::string &dir, Repo *r)
     Tree::Flat flattened_tree = src.flattened(r);
 
     size_t dir_size = dir.size();
-    if (dir[dir_size-1] == '/')
+    if (dir_size > 1 && dir[dir_size-1] == '/')
         dir_size--;
 
-    set<string> wd_paths;
-    _scanHelperData sd = {
-        &wd_paths,
-        &flattened_tree,
-        this,
-        &from,
-        dir_size,
-        r};
+    TaskGroup group(pool);
+    _scanHelperData sd;
+    sd.flattened_tree = &flattened_tree;
+    sd.commit = &from;
+    sd.cwdLen = dir_size;
+    sd.repo = r;
+    sd.state = state;
+    sd.group = &group;
 
     // Find additions and modifications
-    DirTraverse(dir.c_str(), &sd, _diffToDirHelper);
+    _diffToDirScan(&sd, dir.substr(0, dir_size));
+    group.wait();
+    if (sd.error)
+        rethrow_exception(sd.error);
+
+    // Entries for the same path stay in the order they were found
+    stable_sort(sd.entries.begin(), sd.entries.end(), TreeDiff_PathCmp);
+    for (size_t i = 0; i < sd.entries.size(); i++)
+        append(sd.entries[i]);
 
     // Find deletions
     for (map<string, TreeEntry>::iterator it = flattened_tree.begin();
             it != flattened_tree.end();
             it++) {
-        set<string>::iterator wd_it = wd_paths.find((*it).first);
-        if (wd_it == wd_paths.end()) {
+        set<string>::iterator wd_it = sd.wd_paths.find((*it).first);
+        if (wd_it == sd.wd_paths.end()) {
             TreeDiffEntry tde;
             tde.filepath = (*it).first;
             tde.type = ((*it).second.type == TreeEntry::Tree) ?
                 TreeDiffEntry::DeletedDir :
                 TreeDiffEntry::DeletedFile;
             append(tde);
+            if (state)
+                state->remove(tde.filepath);
         }
     }
 }
@@ -749,6 +970,20 @@ TreeDiff::applyTo(Tree::Flat *flat) const
 Tree
 TreeDiff::applyTo(Tree::Flat flat, Repo *dest_repo)
 {
+    // Add all new file contents up front so the repository can batch them
+    vector<string> newFiles;
+    for (size_t i = 0; i < entries.size(); i++) {
+        const TreeDiffEntry &tde = entries[i];
+        if ((tde.type == TreeDiffEntry::NewFile ||
+             tde.type == TreeDiffEntry::Modified) &&
+            tde.newFilename != "") {
+            newFiles.push_back(tde.newFilename);
+        }
+    }
+    vector<pair<ObjectHash, ObjectHash> > newHashes =
+        dest_repo->addFiles(newFiles);
+    size_t nextNew = 0;
+
     for (size_t i = 0; i < entries.size(); i++) {
         const TreeDiffEntry &tde = entries[i];
         if (tde.type == TreeDiffEntry::Noop) continue;
@@ -762,7 +997,7 @@ TreeDiff::applyTo(Tree::Flat flat, Repo *dest_repo)
             if (tde.newFilename == "") {
                 hashes = tde.hashes;
             } else {
-                hashes = dest_repo->addFile(tde.newFilename);
+                hashes = newHashes[nextNew++];
             }
             TreeEntry te(hashes.first, hashes.second);
             te.attrs.mergeFrom(tde.newAttrs);
@@ -799,7 +1034,7 @@ TreeDiff::applyTo(Tree::Flat flat, Repo *dest_repo)
         else if (tde.type == TreeDiffEntry::Modified) {
             TreeEntry te = flat[tde.filepath];
             if (tde.newFilename != "") {
-                pair<ObjectHash, ObjectHash> hashes = dest_repo->addFile(tde.newFilename);
+                pair<ObjectHash, ObjectHash> hashes = newHashes[nextNew++];
                 te.hash = hashes.first;
                 te.largeHash = hashes.second;
                 te.type = (!hashes.second.isEmpty()) ? TreeEntry::LargeBlob :
@@ -20,11 +20,14 @@
 #define COPYFILE_BUFSZ	(256 * 1024)
 
 #define LARGEFILE_MINIMUM (1024 * 1024)
+// Number of chunks of a large file needed before they are hashed on the
+// shared pool
+#define LARGEFILE_HASHMINCHUNKS 256
+// Number of chunks past a LargeBlob read that are prefetched
+#define LARGEFILE_PREFETCHCHUNKS 32
 
 // Minimum compressable object (FastLZ requires 66 bytes)
 #define ZIP_MINIMUM_SIZE 512
-// How much of a payload to check for compressibility
-#define COMPCHECK_BYTES 1024
 // Maximum compression ratio (0.8 means compressed file is 80% size of original)
 #define COMPCHECK_RATIO 0.95
 
@@ -32,6 +35,33 @@
 // 64 MB
 #define PACKFILE_MAXSIZE (1024*1024*64)
 #define PACKFILE_MAXOBJS (2048)
+// Packfiles at least this large are read through a shared mapping
+#define PACKFILE_MMAP_MINSIZE (1024*1024)
+// Objects this close together in a packfile are prefetched as one range
+#define PACKFILE_PREFETCH_GAP (64*1024)
+
+// Threads used to hash and compress new objects (-1 means one per CPU)
+#define REPO_WORKERTHREADS -1
+// Bytes of small files read ahead and hashed in parallel by addFiles
+#define REPO_ADDFILES_BATCHBYTES (32*1024*1024)
+
+// The index log is folded into the sorted base once it holds more than this
+// many entries and more than 1/INDEX_REWRITE_RATIO of the base
+#define INDEX_REWRITE_MINENTRIES 4096
+#define INDEX_REWRITE_RATIO 8
+
+// The metadata log is checkpointed once its tail is larger than both this
+// and the previous checkpoint
+#define METADATALOG_CHECKPOINT_MINBYTES (1024*1024)
+
+// Threads of the HTTP server, each running an event loop (-1 means one per
+// CPU), and the size of the chunks of streamed responses
+#define HTTPSERVER_THREADS -1
+#define HTTPSERVER_CHUNKSIZE (256*1024)
+
+// Upper bounds on a single getObjects request issued by pull
+#define PULL_BATCHOBJS 1024
+#define PULL_BATCHBYTES (1024*1024*16)
 
 // Choose the hash algorithm (choose one)
 //#define ORI_USE_SHA256
@@ -40,12 +70,12 @@
 #error "Please select one hash algorithm."
 #endif
 
-// Choose the compression algorithm (choose one)
-//#define ORI_USE_LZMA
-//#define ORI_USE_FASTLZ
-#if defined(ORI_USE_COMPRESISON) && !defined(ORI_USE_LZMA) && !defined(ORI_USE_FASTLZ)
-#error "Please select one compression algorithm."
+// Compression used by new repositories (ZIPALGO_NONE, _FASTLZ, _LZMA or
+// _SNAPPY), LZMA also needs ORI_USE_LZMA
+#ifndef ORI_DEFAULT_ZIPALGO
+#define ORI_DEFAULT_ZIPALGO ZIPALGO_FASTLZ
 #endif
+#define REPO_DEFAULT_ZIPALGO (ObjectInfo::ORI_DEFAULT_ZIPALGO)
 
 #endif /* __TUNEABLES_H__ */
 
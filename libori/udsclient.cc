@@ -28,6 +28,9 @@
 #include <sys/un.h>
 
 #include <string>
+#include <algorithm>
+#include <mutex>
+#include <ios>
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
@@ -38,19 +41,84 @@
 
 using namespace std;
 
-#define D_READ 0
-#define D_WRITE 1
+#define OK 0
+#define ERROR 1
+
+/*
+ * Reads the response to one request, pulling frames off the socket as
+ * needed.
+ */
+class UDSResponseStream : public bytestream
+{
+public:
+    UDSResponseStream(UDSClient *client, uint32_t id)
+        : client(client), id(id), chunk(), off(0), finished(false)
+    {
+    }
+    ~UDSResponseStream()
+    {
+        if (!finished)
+            client->_abandon(id);
+    }
+    bool ended()
+    {
+        return !_fill();
+    }
+    size_t read(uint8_t *buf, size_t n)
+    {
+        if (!_fill())
+            return 0;
+
+        size_t len = min(n, chunk.size() - off);
+        memcpy(buf, chunk.data() + off, len);
+        off += len;
+        return len;
+    }
+    size_t sizeHint() const
+    {
+        return 0;
+    }
+private:
+    // Returns false at the end of the response
+    bool _fill()
+    {
+        while (off == chunk.size()) {
+            if (finished)
+                return false;
+
+            chunk.clear();
+            off = 0;
+            int status = client->_nextChunk(id, chunk);
+            if (status <= 0) {
+                finished = true;
+                if (status < 0) {
+                    last_error = "UDS request failed";
+                    last_errnum = EIO;
+                }
+                return false;
+            }
+        }
+        return true;
+    }
+
+    UDSClient *client;
+    uint32_t id;
+    std::string chunk;
+    size_t off;
+    bool finished;
+};
 
 /*
  * UDSClient
  */
 
 UDSClient::UDSClient()
+    : fd(-1), nextId(1), reading(false), broken(false)
 {
 }
 
 UDSClient::UDSClient(const string &repoPath)
-    : fd(-1)
+    : fd(-1), nextId(1), reading(false), broken(false)
 {
     udsPath = repoPath + ORI_PATH_UDSSOCK;
 }
@@ -79,20 +147,39 @@ int UDSClient::connect()
         throw SystemException();
 
     fd = sock;
-    streamToChild.reset(new fdwstream(fd));
+    in.reset(new bufferedstream(new fdstream(fd, -1)));
+    out.reset(new bufferedwstream(new fdwstream(fd)));
+    nextId = 1;
+    reading = false;
+    broken = false;
+    responses.clear();
 
     // Sync by waiting for message from server
-    if (!respIsOK()) {
+    if (!respIsOK(in.get())) {
         WARNING("Couldn't connect to UDS server!");
         return -1;
     }
 
+    // Switch the session to framed requests
+    string version;
+    out->writePStr("pipeline");
+    out->writePStr(ORI_UDS_PROTO_VERSION);
+    if (out->flush() < 0 || !respIsOK(in.get()) ||
+        in->readPStr(version) == 0 || version != ORI_UDS_PROTO_VERSION) {
+        WARNING("UDS server does not support protocol version %s",
+                ORI_UDS_PROTO_VERSION);
+        return -1;
+    }
+
     return 0;
 }
 
 void UDSClient::disconnect()
 {
-    close(fd);
+    out.reset();
+    in.reset();
+    if (fd != -1)
+        close(fd);
 
     fd = -1;
 }
@@ -101,41 +188,188 @@ bool UDSClient::connected() {
     return fd != -1;
 }
 
-void UDSClient::sendCommand(const string &command) {
+uint32_t
+UDSClient::send(const string &command, const string &args)
+{
+    uint32_t id;
+
     ASSERT(connected());
-    streamToChild->writePStr(command);
+    {
+        unique_lock<mutex> l(lock);
+        id = nextId++;
+        responses[id] = Response();
+    }
+
+    // Send the request in one write
+    unique_lock<mutex> w(writeLock);
+    out->writeUInt32(id);
+    out->writeUInt32(1 + command.size() + args.size());
+    out->writePStr(command);
+    out->write(args.data(), args.size());
+    if (out->flush() < 0) {
+        WARNING("UDS error: %s", out->error());
+        unique_lock<mutex> l(lock);
+        _fail(l);
+    }
+
+    return id;
 }
 
-void UDSClient::sendData(const string &data) {
-    ASSERT(connected());
-    size_t len = data.size();
-    size_t off = 0;
-    while (len > 0) {
-        ssize_t written = write(fd, data.data()+off, len);
-        if (written < 0) {
-            perror("UDSClient::sendData write");
-            exit(1);
+bytestream *
+UDSClient::receive(uint32_t id)
+{
+    return new UDSResponseStream(this, id);
+}
+
+bytestream *
+UDSClient::call(const string &command, const string &args)
+{
+    return receive(send(command, args));
+}
+
+bool
+UDSClient::respIsOK(bytestream *bs)
+{
+    uint8_t resp;
+
+    try {
+        resp = bs->readUInt8();
+    } catch (std::ios_base::failure &e) {
+        WARNING("UDS error: connection closed");
+        return false;
+    }
+    if (bs->error()) {
+        WARNING("UDS error: %s", bs->error());
+        return false;
+    }
+    if (resp == OK)
+        return true;
+
+    string errStr;
+    bs->readPStr(errStr);
+    WARNING("UDS error (%d): %s", (int)resp, errStr.c_str());
+    return false;
+}
+
+/*
+ * Returns 1 and the next chunk of the response to id, 0 at its end or -1 if
+ * it was aborted or the connection failed.  One thread at a time reads
+ * frames, queueing those for other requests.
+ */
+int
+UDSClient::_nextChunk(uint32_t id, string &chunk)
+{
+    unique_lock<mutex> l(lock);
+
+    while (true) {
+        map<uint32_t, Response>::iterator it = responses.find(id);
+        ASSERT(it != responses.end());
+
+        Response &r = it->second;
+        if (!r.chunks.empty()) {
+            chunk.swap(r.chunks.front());
+            r.chunks.pop_front();
+            return 1;
+        }
+        if (r.done) {
+            bool aborted = r.aborted;
+            responses.erase(it);
+            return aborted ? -1 : 0;
         }
-        len -= written;
-        off += written;
+        if (broken) {
+            responses.erase(it);
+            return -1;
+        }
+
+        if (reading) {
+            cv.wait(l);
+            continue;
+        }
+
+        reading = true;
+        bool ok = _readFrame(l);
+        reading = false;
+        if (!ok)
+            _fail(l);
+        cv.notify_all();
     }
 }
 
-bytestream *UDSClient::getStream() {
-    return new fdstream(fd, -1);
+void
+UDSClient::_abandon(uint32_t id)
+{
+    unique_lock<mutex> l(lock);
+    map<uint32_t, Response>::iterator it = responses.find(id);
+
+    if (it == responses.end())
+        return;
+
+    if (it->second.done || broken) {
+        responses.erase(it);
+    } else {
+        it->second.abandoned = true;
+        it->second.chunks.clear();
+    }
 }
 
-bool UDSClient::respIsOK() {
-    uint8_t resp = 0;
-    int status = read(fd, &resp, 1);
-    if (status == 1 && resp == 0) return true;
-    else {
-        string errStr;
-        fdstream fs(fd, -1);
-        fs.readPStr(errStr);
-        WARNING("UDS error (%d): %s", (int)resp, errStr.c_str());
+/*
+ * Reads one frame without holding the lock and files it under its request.
+ */
+bool
+UDSClient::_readFrame(unique_lock<mutex> &l)
+{
+    uint32_t id, len;
+    uint8_t flags;
+    string data;
+
+    l.unlock();
+    try {
+        id = in->readUInt32();
+        flags = in->readUInt8();
+        len = in->readUInt32();
+        data.resize(len);
+        if (len > 0)
+            in->readExact((uint8_t *)&data[0], len);
+    } catch (std::ios_base::failure &e) {
+        l.lock();
+        return false;
+    }
+    l.lock();
+
+    if (in->error()) {
+        WARNING("UDS error: %s", in->error());
         return false;
     }
+
+    map<uint32_t, Response>::iterator it = responses.find(id);
+    if (it == responses.end()) {
+        WARNING("UDS response to unknown request %u", id);
+        return false;
+    }
+
+    Response &r = it->second;
+    bool last = (flags & (UDS_FRAME_END | UDS_FRAME_ABORT)) != 0;
+    if (r.abandoned) {
+        if (last)
+            responses.erase(it);
+        return true;
+    }
+
+    if (len > 0)
+        r.chunks.push_back(data);
+    if (last) {
+        r.done = true;
+        r.aborted = (flags & UDS_FRAME_ABORT) != 0;
+    }
+
+    return true;
+}
+
+void
+UDSClient::_fail(unique_lock<mutex> &l)
+{
+    broken = true;
+    cv.notify_all();
 }
 
 
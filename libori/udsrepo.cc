@@ -24,6 +24,10 @@
 #include <sstream>
 #include <deque>
 #include <vector>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+#include <exception>
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
@@ -40,12 +44,12 @@ using namespace std;
  */
 
 UDSRepo::UDSRepo()
-    : client(NULL), containedObjs(NULL)
+    : client(NULL), cache(new Cache()), containedObjs(NULL)
 {
 }
 
 UDSRepo::UDSRepo(UDSClient *client)
-    : client(client), containedObjs(NULL)
+    : client(client), cache(new Cache()), containedObjs(NULL)
 {
 }
 
@@ -58,12 +62,10 @@ UDSRepo::~UDSRepo()
 
 std::string UDSRepo::getUUID()
 {
-    client->sendCommand("get fsid");
+    bytestream::ap bs(client->call("get fsid"));
     string fsid = "";
 
-    bool ok = client->respIsOK();
-    bytestream::ap bs(client->getStream());
-    if (ok) {
+    if (UDSClient::respIsOK(bs.get())) {
         bs->readPStr(fsid);
     }
     return fsid;
@@ -71,12 +73,10 @@ std::string UDSRepo::getUUID()
 
 std::string UDSRepo::getVersion()
 {
-    client->sendCommand("get version");
+    bytestream::ap bs(client->call("get version"));
     string version = "";
 
-    bool ok = client->respIsOK();
-    bytestream::ap bs(client->getStream());
-    if (ok) {
+    if (UDSClient::respIsOK(bs.get())) {
         bs->readPStr(version);
     }
     return version;
@@ -84,12 +84,10 @@ std::string UDSRepo::getVersion()
 
 ObjectHash UDSRepo::getHead()
 {
-    client->sendCommand("get head");
+    bytestream::ap bs(client->call("get head"));
     ObjectHash hash;
 
-    bool ok = client->respIsOK();
-    bytestream::ap bs(client->getStream());
-    if (ok) {
+    if (UDSClient::respIsOK(bs.get())) {
         bs->readHash(hash);
     }
     return hash;
@@ -103,10 +101,9 @@ UDSRepo::distance()
     sw.start();
 
     // Send hello command
-    client->sendCommand("hello");
-    bool ok = client->respIsOK();
+    bytestream::ap bs(client->call("hello"));
+    bool ok = UDSClient::respIsOK(bs.get());
     assert(ok);
-    bytestream::ap bs(client->getStream());
     std::string version;
     bs->readPStr(version);
     
@@ -117,65 +114,203 @@ UDSRepo::distance()
 
 Object::sp UDSRepo::getObject(const ObjectHash &id)
 {
-    ObjectHashVec objs;
-    objs.push_back(id);
-    bytestream::ap bs(getObjects(objs));
-    if (bs.get()) {
-        ASSERT(sizeof(numobjs_t) == sizeof(uint32_t));
-        numobjs_t num = bs->readUInt32();
-        if (num != 1) {
-            throw RuntimeException(ORIEC_BSCORRUPT, "Object bytestream invalid");
+    CachedObject obj;
+    bool found;
+
+    {
+        unique_lock<mutex> l(cache->lock);
+
+        found = cache->objects.get(id, obj);
+        while (!found) {
+            unordered_map<ObjectHash, uint32_t>::iterator it;
+            it = cache->pending.find(id);
+            if (it == cache->pending.end())
+                break;
+            found = _completePrefetch(l, it->second, id, &obj) ||
+                    cache->objects.get(id, obj);
         }
+    }
 
-        std::string info_str(ObjectInfo::SIZE, '\0');
-        bs->readExact((uint8_t*)&info_str[0], ObjectInfo::SIZE);
-        ObjectInfo info;
-        info.fromString(info_str);
+    if (!found) {
+        ObjectHashVec ids;
+        vector<CachedObject> objs;
+        ids.push_back(id);
+        bytestream::ap bs(getObjects(ids));
+        if (!bs.get())
+            return Object::sp();
 
-        uint32_t objSize = bs->readUInt32();
-        std::string payload(objSize, '\0');
-        bs->readExact((uint8_t*)&payload[0], objSize);
+        _readObjects(bs.get(), &objs);
 
-        ASSERT(sizeof(numobjs_t) == sizeof(uint32_t));
-        num = bs->readUInt32();
-        if (num != 0) {
-            throw RuntimeException(ORIEC_BSCORRUPT, "Object bytestream invalid");
-        }
+        unique_lock<mutex> l(cache->lock);
+        if (!_cacheObjects(objs, id, &obj))
+            return Object::sp();
+    }
 
-        switch (info.getAlgo()) {
-            case ObjectInfo::ZIPALGO_NONE:
-                payloads[info.hash] = payload;
-                break;
-            case ObjectInfo::ZIPALGO_FASTLZ:
-                payloads[info.hash] = zipstream(new strstream(payload),
-                                                DECOMPRESS,
-                                                info.payload_size).readAll();
-                break;
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
+    return Object::sp(new UDSObject(obj.info, obj.payload));
+}
+
+/*
+ * Asks for the objects not yet cached or requested, the response is read by
+ * the first getObject that needs one of them.
+ */
+void
+UDSRepo::prefetchObjects(const ObjectHashVec &ids)
+{
+    unique_lock<mutex> l(cache->lock);
+    ObjectHashVec objs;
+    CachedObject unused;
+
+    // Bound the responses queued in the client
+    while (cache->requests.size() >= UDSREPO_PREFETCHREQS)
+        _completePrefetch(l, cache->requests.front(), ObjectHash(), &unused);
+
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (objs.size() == UDSREPO_CACHEOBJS / UDSREPO_PREFETCHREQS)
+            break;
+        if (cache->pending.find(ids[i]) == cache->pending.end() &&
+            !cache->objects.hasKey(ids[i]))
+            objs.push_back(ids[i]);
+    }
+    if (objs.size() == 0)
+        return;
+
+    uint32_t req = client->send("readobjs", _readObjsArgs(objs));
+    cache->requests.push_back(req);
+    for (size_t i = 0; i < objs.size(); i++) {
+        cache->pending[objs[i]] = req;
+    }
+}
+
+/*
+ * Adds decoded objects to the cache, called with the cache lock held.
+ * Sets obj and returns true if want is among them, so that the caller
+ * does not depend on it surviving in the cache.
+ */
+bool
+UDSRepo::_cacheObjects(const vector<CachedObject> &objs,
+                       const ObjectHash &want, CachedObject *obj)
+{
+    bool found = false;
+
+    for (size_t i = 0; i < objs.size(); i++) {
+        cache->objects.put(objs[i].info.hash, objs[i]);
+        if (objs[i].info.hash == want) {
+            *obj = objs[i];
+            found = true;
         }
-        return Object::sp(new UDSObject(this, info));
     }
-    return Object::sp();
+
+    return found;
 }
 
-bytestream *
-UDSRepo::getObjects(const ObjectHashVec &objs)
+/*
+ * Reads the response to a prefetch request into the cache.  Called with the
+ * cache lock held, which is dropped while the response is received.  If
+ * another thread is receiving it already this waits for that thread.
+ * @returns true if the response held want, which is then set in obj
+ */
+bool
+UDSRepo::_completePrefetch(unique_lock<mutex> &l, uint32_t req,
+                           const ObjectHash &want, CachedObject *obj)
 {
-    client->sendCommand("readobjs");
+    if (cache->receiving.find(req) != cache->receiving.end()) {
+        while (cache->receiving.find(req) != cache->receiving.end())
+            cache->received.wait(l);
+        return false;
+    }
+
+    vector<CachedObject> objs;
+    cache->receiving.insert(req);
+    l.unlock();
+    try {
+        bytestream::ap bs(client->receive(req));
+
+        if (UDSClient::respIsOK(bs.get()))
+            _readObjects(bs.get(), &objs);
+    } catch (std::exception &e) {
+        WARNING("Prefetching objects failed: %s", e.what());
+    }
+    l.lock();
+
+    bool found = _cacheObjects(objs, want, obj);
 
+    unordered_map<ObjectHash, uint32_t>::iterator it;
+    for (it = cache->pending.begin(); it != cache->pending.end(); ) {
+        if (it->second == req)
+            it = cache->pending.erase(it);
+        else
+            it++;
+    }
+    cache->requests.erase(find(cache->requests.begin(),
+                               cache->requests.end(), req));
+    cache->receiving.erase(req);
+    cache->received.notify_all();
+
+    return found;
+}
+
+string
+UDSRepo::_readObjsArgs(const ObjectHashVec &objs)
+{
     strwstream ss;
+
     ss.writeUInt32(objs.size());
     for (size_t i = 0; i < objs.size(); i++) {
         ss.writeHash(objs[i]);
     }
-    client->sendData(ss.str());
+
+    return ss.str();
+}
+
+/*
+ * Decodes a stream of objects as written by transmit, without the cache
+ * lock.
+ */
+void
+UDSRepo::_readObjects(bytestream *bs, vector<CachedObject> *objs)
+{
+    vector<ObjectInfo> infos;
+    vector<uint32_t> sizes;
+
+    ASSERT(sizeof(numobjs_t) == sizeof(uint32_t));
+    numobjs_t num = bs->readUInt32();
+    while (num != 0) {
+        infos.resize(num);
+        sizes.resize(num);
+        for (numobjs_t i = 0; i < num; i++) {
+            std::string info_str(ObjectInfo::SIZE, '\0');
+            bs->readExact((uint8_t*)&info_str[0], ObjectInfo::SIZE);
+            infos[i].fromString(info_str);
+            sizes[i] = bs->readUInt32();
+        }
+
+        for (numobjs_t i = 0; i < num; i++) {
+            std::string payload(sizes[i], '\0');
+            if (sizes[i] > 0)
+                bs->readExact((uint8_t*)&payload[0], sizes[i]);
+            if (bs->error()) {
+                throw RuntimeException(ORIEC_BSCORRUPT,
+                                       "Object bytestream invalid");
+            }
+
+            CachedObject obj;
+            obj.info = infos[i];
+            obj.payload.reset(new string(bytestream::ap(
+                zipstream::decode(new strstream(payload), infos[i]))->readAll()));
+            objs->push_back(obj);
+        }
+
+        num = bs->readUInt32();
+    }
+}
+
+bytestream *
+UDSRepo::getObjects(const ObjectHashVec &objs)
+{
     DLOG("Requesting %lu objects", objs.size());
+    bytestream::ap bs(client->call("readobjs", _readObjsArgs(objs)));
 
-    bool ok = client->respIsOK();
-    bytestream::ap bs(client->getStream());
-    if (ok) {
+    if (UDSClient::respIsOK(bs.get())) {
         return bs.release();
     }
     return NULL;
@@ -184,18 +319,14 @@ UDSRepo::getObjects(const ObjectHashVec &objs)
 ObjectInfo
 UDSRepo::getObjectInfo(const ObjectHash &id)
 {
-    client->sendCommand("getobjinfo");
-
     strwstream ss;
     ss.writeHash(id);
-    client->sendData(ss.str());
 
-    bool ok = client->respIsOK();
-    if (!ok) {
+    bytestream::ap bs(client->call("getobjinfo", ss.str()));
+    if (!UDSClient::respIsOK(bs.get())) {
         return ObjectInfo();
     }
 
-    bytestream::ap bs(client->getStream());
     ObjectInfo info;
     bs->readInfo(info);
 
@@ -218,12 +349,10 @@ bool UDSRepo::hasObject(const ObjectHash &id) {
 
 std::set<ObjectInfo> UDSRepo::listObjects()
 {
-    client->sendCommand("list objs");
+    bytestream::ap bs(client->call("list objs"));
     std::set<ObjectInfo> rval;
 
-    bool ok = client->respIsOK();
-    bytestream::ap bs(client->getStream());
-    if (ok) {
+    if (UDSClient::respIsOK(bs.get())) {
         uint64_t num = bs->readUInt64();
         for (size_t i = 0; i < num; i++) {
             ObjectInfo info;
@@ -245,12 +374,10 @@ UDSRepo::addObject(ObjectType type, const ObjectHash &hash,
 
 std::vector<Commit> UDSRepo::listCommits()
 {
-    client->sendCommand("list commits");
+    bytestream::ap bs(client->call("list commits"));
     std::vector<Commit> rval;
 
-    bool ok = client->respIsOK();
-    bytestream::ap bs(client->getStream());
-    if (ok) {
+    if (UDSClient::respIsOK(bs.get())) {
         uint32_t num = bs->readUInt32();
         for (size_t i = 0; i < num; i++) {
             std::string commit_str;
@@ -269,20 +396,22 @@ UDSRepo::transmit(bytewstream *out, const ObjectHashVec &objs)
 {
     DLOG("uds transmit");
     numobjs_t num;
-    bytestream *in;
+    bytestream::ap in;
     try {
-        in = getObjects(objs);
+        in.reset(getObjects(objs));
     } catch (RuntimeException& e) {
         if (e.getCode() == ORIEC_INDEXNOTFOUND) {
             DLOG("failed to find objects, ending stream...");
         } else {
             DLOG("Exception: %s", e.what());
         }
-        out->writeUInt32(0);
-        return;
     } catch (...) {
         DLOG("unexpected exception in transmit");
     }
+    if (!in.get()) {
+        out->writeUInt32(0);
+        return;
+    }
     vector<size_t> objSizes;
     string data;
 
@@ -321,11 +450,9 @@ set<string>
 UDSRepo::listExt()
 {
     set<string> exts;
-    client->sendCommand("ext list");
+    bytestream::ap bs(client->call("ext list"));
 
-    bool ok = client->respIsOK();
-    bytestream::ap bs(client->getStream());
-    if (ok) {
+    if (UDSClient::respIsOK(bs.get())) {
         uint8_t numExts = bs->readUInt8();
         for (uint8_t i = 0; i < numExts; i++) {
             string ext;
@@ -340,16 +467,12 @@ UDSRepo::listExt()
 string
 UDSRepo::callExt(const string &ext, const string &data)
 {
-    client->sendCommand("ext call");
-
     strwstream ss;
     ss.writePStr(ext);
     ss.writeLPStr(data);
-    client->sendData(ss.str());
 
-    bool ok = client->respIsOK();
-    bytestream::ap bs(client->getStream());
-    if (ok) {
+    bytestream::ap bs(client->call("ext call", ss.str()));
+    if (UDSClient::respIsOK(bs.get())) {
         string result;
         bs->readLPStr(result);
         return result;
@@ -358,39 +481,23 @@ UDSRepo::callExt(const string &ext, const string &data)
     return "";
 }
 
-std::string &UDSRepo::_payload(const ObjectHash &id)
-{
-    return payloads[id];
-}
-
-void UDSRepo::_addPayload(const ObjectHash &id, const std::string &payload)
-{
-    payloads[id] = payload;
-}
-
-void UDSRepo::_clearPayload(const ObjectHash &id)
-{
-    payloads.erase(id);
-}
-
 
 /*
  * UDSObject
  */
 
-UDSObject::UDSObject(UDSRepo *repo, ObjectInfo info)
-    : Object(info), repo(repo)
+UDSObject::UDSObject(const ObjectInfo &info,
+                     std::shared_ptr<const std::string> payload)
+    : Object(info), payload(payload)
 {
-    ASSERT(repo != NULL);
     ASSERT(!info.hash.isEmpty());
 }
 
 UDSObject::~UDSObject()
 {
-    repo->_clearPayload(info.hash);
 }
 
 bytestream *UDSObject::getPayloadStream()
 {
-    return new strstream(repo->_payload(info.hash));
+    return new strstream(*payload);
 }
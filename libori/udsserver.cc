@@ -27,10 +27,15 @@
 
 #include <string>
 #include <map>
+#include <mutex>
+#include <algorithm>
+#include <exception>
+#include <ios>
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/systemexception.h>
+#include <oriutil/threadpool.h>
 #include <ori/repostore.h>
 #include <ori/localrepo.h>
 #include <ori/udsserver.h>
@@ -180,13 +185,72 @@ UDSServer::registerExt(const string &ext, UDSExtCB cb)
     extensions[ext] = cb;
 }
 
+/*
+ * Collects the response to a framed request and sends it in frames of at
+ * most ORI_UDS_CHUNKSIZE bytes, so large responses are streamed and do not
+ * hold up the responses to other requests for long.
+ */
+class UDSFrameStream : public bytewstream
+{
+public:
+    UDSFrameStream(UDSSession *session, uint32_t id)
+        : session(session), id(id), buf(), failed(false)
+    {
+    }
+    ssize_t write(const void *data, size_t len)
+    {
+        const char *p = (const char *)data;
+        size_t left = len;
+
+        while (left > 0) {
+            size_t n = min(left, (size_t)ORI_UDS_CHUNKSIZE - buf.size());
+            buf.append(p, n);
+            p += n;
+            left -= n;
+            if (buf.size() == ORI_UDS_CHUNKSIZE)
+                _send(0);
+        }
+        if (failed) {
+            last_error = "UDS session closed";
+            last_errnum = EPIPE;
+            return -1;
+        }
+        return len;
+    }
+    void finish()
+    {
+        _send(UDS_FRAME_END);
+    }
+    /// Drops the unsent part of the response and tells the client it failed
+    void abort()
+    {
+        buf.clear();
+        _send(UDS_FRAME_ABORT);
+    }
+private:
+    void _send(uint8_t flags)
+    {
+        if (!failed && !session->writeFrame(id, flags, buf))
+            failed = true;
+        buf.clear();
+    }
+
+    UDSSession *session;
+    uint32_t id;
+    std::string buf;
+    bool failed;
+};
+
 UDSSession::UDSSession(UDSServer *uds, int fd, LocalRepo *repo)
-    : uds(uds), fd(fd), repo(repo)
+    : uds(uds), fd(fd), repo(repo),
+      in(new fdstream(fd, -1)), out(new fdwstream(fd)),
+      writeLock(), inflightLock(), inflightCV(), inflight(0)
 {
 }
 
 UDSSession::~UDSSession()
 {
+    out.flush();
     close(fd);
 }
 
@@ -212,20 +276,16 @@ UDSSession::forceExit()
 #define ERROR 1
 
 void
-UDSSession::printError(const std::string &what)
+UDSSession::printError(bytewstream *out, const std::string &what)
 {
-    fdwstream fs(fd);
-
-    fs.writeUInt8(ERROR);
-    fs.writePStr(what);
+    out->writeUInt8(ERROR);
+    out->writePStr(what);
 }
 
 void
 UDSSession::serve() {
-    fdstream fs(fd, -1);
-
-    uint8_t respOK = OK;
-    write(fd, &respOK, 1);
+    out.writeUInt8(OK);
+    out.flush();
 
     // XXX: Catch exception when exit is forced
     while (true) {
@@ -236,179 +296,264 @@ UDSSession::serve() {
 
         // Get command
         std::string command;
-        if (fs.readPStr(command) == 0)
+        if (in.readPStr(command) == 0)
             break;
 
-        if (command == "hello") {
-            cmd_hello();
+        if (command == "pipeline") {
+            std::string version;
+
+            in.readPStr(version);
+            if (version != ORI_UDS_PROTO_VERSION) {
+                printError(&out, "Unsupported protocol version");
+            } else {
+                out.writeUInt8(OK);
+                out.writePStr(ORI_UDS_PROTO_VERSION);
+                if (out.flush() < 0)
+                    break;
+                servePipelined();
+                break;
+            }
+        } else {
+            dispatch(command, &in, &out);
         }
-        else if (command == "list objs") {
-            cmd_listObjs();
-        }
-        else if (command == "list commits") {
-            cmd_listCommits();
-        }
-        else if (command == "readobjs") {
-            cmd_readObjs();
-        }
-        else if (command == "getobjinfo") {
-            cmd_getObjInfo();
-        }
-        else if (command == "get head") {
-            cmd_getHead();
-        }
-        else if (command == "get fsid") {
-            cmd_getFSID();
-        }
-        else if (command == "get version") {
-            cmd_getVersion();
-        }
-        else if (command == "ext list") {
-            cmd_listExt();
-        }
-        else if (command == "ext call") {
-            cmd_callExt();
-        }
-        else {
-            printError("Unknown command");
+
+        if (out.flush() < 0)
+            break;
+    }
+}
+
+/*
+ * Reads framed requests and hands them to the session's workers until the
+ * client disconnects.  Reading stops while ORI_UDS_MAXINFLIGHT requests are
+ * being served so that a client that never reads its responses cannot make
+ * the session queue without bound.
+ */
+void
+UDSSession::servePipelined()
+{
+    ThreadPool pool(ORI_UDS_SESSIONWORKERS);
+    TaskGroup group(&pool);
+
+    while (!interruptionRequested()) {
+        uint32_t id, len;
+        std::string request;
+
+        try {
+            id = in.readUInt32();
+            len = in.readUInt32();
+            request.resize(len);
+            if (len > 0)
+                in.readExact((uint8_t *)&request[0], len);
+        } catch (std::ios_base::failure &e) {
+            break;
         }
+        if (in.error())
+            break;
+
+        unique_lock<mutex> l(inflightLock);
+        while (inflight >= ORI_UDS_MAXINFLIGHT)
+            inflightCV.wait(l);
+        inflight++;
+        l.unlock();
+
+        group.run([this, id, request]() { _serveRequest(id, request); });
+    }
+
+    group.wait();
+}
+
+void
+UDSSession::_serveRequest(uint32_t id, const std::string &request)
+{
+    strstream req(request);
+    UDSFrameStream resp(this, id);
+    std::string command;
+
+    try {
+        req.readPStr(command);
+        dispatch(command, &req, &resp);
+        resp.finish();
+    } catch (std::exception &e) {
+        WARNING("UDS request '%s' failed: %s", command.c_str(), e.what());
+        resp.abort();
     }
+
+    unique_lock<mutex> l(inflightLock);
+    inflight--;
+    inflightCV.notify_one();
 }
 
-void UDSSession::cmd_hello()
+bool
+UDSSession::writeFrame(uint32_t id, uint8_t flags, const std::string &data)
+{
+    unique_lock<mutex> l(writeLock);
+
+    out.writeUInt32(id);
+    out.writeUInt8(flags);
+    out.writeUInt32(data.size());
+    out.write(data.data(), data.size());
+
+    return out.flush() >= 0;
+}
+
+bool
+UDSSession::dispatch(const std::string &command, bytestream *in,
+                     bytewstream *out)
+{
+    if (command == "hello") {
+        cmd_hello(in, out);
+    }
+    else if (command == "list objs") {
+        cmd_listObjs(in, out);
+    }
+    else if (command == "list commits") {
+        cmd_listCommits(in, out);
+    }
+    else if (command == "readobjs") {
+        cmd_readObjs(in, out);
+    }
+    else if (command == "getobjinfo") {
+        cmd_getObjInfo(in, out);
+    }
+    else if (command == "get head") {
+        cmd_getHead(in, out);
+    }
+    else if (command == "get fsid") {
+        cmd_getFSID(in, out);
+    }
+    else if (command == "get version") {
+        cmd_getVersion(in, out);
+    }
+    else if (command == "ext list") {
+        cmd_listExt(in, out);
+    }
+    else if (command == "ext call") {
+        cmd_callExt(in, out);
+    }
+    else {
+        printError(out, "Unknown command");
+        return false;
+    }
+
+    return true;
+}
+
+void UDSSession::cmd_hello(bytestream *in, bytewstream *out)
 {
     DLOG("hello");
 
-    fdwstream fs(fd);
-    fs.writeUInt8(OK);
-    fs.writePStr(ORI_UDS_PROTO_VERSION);
+    out->writeUInt8(OK);
+    out->writePStr(ORI_UDS_PROTO_VERSION);
 }
 
-void UDSSession::cmd_listObjs()
+void UDSSession::cmd_listObjs(bytestream *in, bytewstream *out)
 {
     DLOG("listObjs");
-    fdwstream fs(fd);
-
-    fs.writeUInt8(OK);
+    out->writeUInt8(OK);
 
     std::set<ObjectInfo> objects = repo->listObjects();
-    fs.writeUInt64(objects.size());
+    out->writeUInt64(objects.size());
     for (auto &it : objects) {
-        fs.writeInfo(it);
+        out->writeInfo(it);
     }
 }
 
-void UDSSession::cmd_listCommits()
+void UDSSession::cmd_listCommits(bytestream *in, bytewstream *out)
 {
     DLOG("listCommits");
-    fdwstream fs(fd);
-
-    fs.writeUInt8(OK);
+    out->writeUInt8(OK);
 
     const std::vector<Commit> &commits = repo->listCommits();
-    fs.writeUInt32(commits.size());
+    out->writeUInt32(commits.size());
     for (size_t i = 0; i < commits.size(); i++) {
         std::string blob = commits[i].getBlob();
-        fs.writePStr(blob);
+        out->writePStr(blob);
     }
 }
 
-void UDSSession::cmd_readObjs()
+void UDSSession::cmd_readObjs(bytestream *in, bytewstream *out)
 {
     // Read object ids
-    fdstream in(fd, -1);
-    uint32_t numObjs = in.readUInt32();
+    uint32_t numObjs = in->readUInt32();
     DLOG("readObjs: Transmitting %u objects", numObjs);
 
     std::vector<ObjectHash> objs;
     for (uint32_t i = 0; i < numObjs; i++) {
         ObjectHash hash;
-        in.readHash(hash);
+        in->readHash(hash);
         objs.push_back(hash);
         DLOG("readObjs: %d of %d - %s", i + 1, numObjs, hash.hex().c_str());
     }
     
     DLOG("uds readObjs");
-    fdwstream fs(fd);
-    fs.writeUInt8(OK);
-    repo->transmit(&fs, objs);
+    out->writeUInt8(OK);
+    repo->transmit(out, objs);
 }
 
-void UDSSession::cmd_getObjInfo()
+void UDSSession::cmd_getObjInfo(bytestream *in, bytewstream *out)
 {
-    fdstream in(fd, -1);
     ObjectHash hash;
     ObjectInfo info;
 
-    in.readHash(hash);
+    in->readHash(hash);
 
-    fdwstream fs(fd);
     info = repo->getObjectInfo(hash);
     if (info.type == ObjectInfo::Null) {
-        fs.writeUInt8(ERROR);
+        printError(out, "Object not found");
         return;
     }
-    fs.writeUInt8(OK);
-    fs.writeInfo(info);
+    out->writeUInt8(OK);
+    out->writeInfo(info);
 }
 
-void UDSSession::cmd_getHead()
+void UDSSession::cmd_getHead(bytestream *in, bytewstream *out)
 {
     DLOG("getHead");
-    fdwstream fs(fd);
-
-    fs.writeUInt8(OK);
-    fs.writeHash(repo->getHead());
+    out->writeUInt8(OK);
+    out->writeHash(repo->getHead());
 }
 
-void UDSSession::cmd_getFSID()
+void UDSSession::cmd_getFSID(bytestream *in, bytewstream *out)
 {
     DLOG("getFSID");
-    fdwstream fs(fd);
-
-    fs.writeUInt8(OK);
-    fs.writePStr(repo->getUUID());
+    out->writeUInt8(OK);
+    out->writePStr(repo->getUUID());
 }
 
-void UDSSession::cmd_getVersion()
+void UDSSession::cmd_getVersion(bytestream *in, bytewstream *out)
 {
     DLOG("getVersion");
 
-    fdwstream fs(fd);
-    fs.writeUInt8(OK);
-    fs.writePStr(repo->getVersion());
+    out->writeUInt8(OK);
+    out->writePStr(repo->getVersion());
 }
 
-void UDSSession::cmd_listExt()
+void UDSSession::cmd_listExt(bytestream *in, bytewstream *out)
 {
     set<string> exts = uds->listExt();
     DLOG("listExt");
-    fdwstream fs(fd);
-
-    fs.writeUInt8(OK);
-    fs.writeUInt8(exts.size());
+    out->writeUInt8(OK);
+    out->writeUInt8(exts.size());
     for (auto &it : exts) {
-        fs.writePStr(it);
+        out->writePStr(it);
     }
 }
 
-void UDSSession::cmd_callExt()
+void UDSSession::cmd_callExt(bytestream *in, bytewstream *out)
 {
-    fdstream in(fd, -1);
     string ext;
     string data;
 
-    in.readPStr(ext);
-    in.readLPStr(data);
+    in->readPStr(ext);
+    in->readLPStr(data);
 
     DLOG("callExt %s", ext.c_str());
-    fdwstream fs(fd);
     if (!uds->hasExt(ext)) {
-        fs.writeUInt8(ERROR);
+        printError(out, "Unknown extension");
+        return;
     }
 
     string result = uds->callExt(ext, data);
-    fs.writeUInt8(OK);
-    fs.writeLPStr(result);
+    out->writeUInt8(OK);
+    out->writeLPStr(result);
 }
-
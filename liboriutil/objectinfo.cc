@@ -101,7 +101,7 @@ ObjectInfo::hasAllFields() const
 
 bool
 ObjectInfo::isCompressed() const {
-    return (flags & ORI_FLAG_ZIPMASK) == ORI_FLAG_UNCOMPRESSED;
+    return (flags & ORI_FLAG_ZIPMASK) != ORI_FLAG_UNCOMPRESSED;
 }
 
 ObjectInfo::ZipAlgo
@@ -113,6 +113,8 @@ ObjectInfo::getAlgo() const {
             return ZIPALGO_FASTLZ;
         case ORI_FLAG_LZMA:
             return ZIPALGO_LZMA;
+        case ORI_FLAG_SNAPPY:
+            return ZIPALGO_SNAPPY;
         default:
             return ZIPALGO_UNKNOWN;
     }
@@ -121,6 +123,7 @@ ObjectInfo::getAlgo() const {
 void
 ObjectInfo::setAlgo(ObjectInfo::ZipAlgo algo)
 {
+    flags &= ~ORI_FLAG_ZIPMASK;
     switch (algo) {
         case ZIPALGO_NONE:
             flags |= ORI_FLAG_UNCOMPRESSED;
@@ -131,6 +134,9 @@ ObjectInfo::setAlgo(ObjectInfo::ZipAlgo algo)
         case ZIPALGO_LZMA:
             flags |= ORI_FLAG_LZMA;
             break;
+        case ZIPALGO_SNAPPY:
+            flags |= ORI_FLAG_SNAPPY;
+            break;
         case ZIPALGO_UNKNOWN:
         default:
             NOT_IMPLEMENTED(false);
@@ -194,3 +200,28 @@ ObjectInfo::Type ObjectInfo::getTypeForStr(const char *str) {
     return Null;
 }
 
+const char *ObjectInfo::getStrForAlgo(ZipAlgo algo) {
+    switch (algo) {
+        case ZIPALGO_NONE:      return "none";
+        case ZIPALGO_FASTLZ:    return "fastlz";
+        case ZIPALGO_LZMA:      return "lzma";
+        case ZIPALGO_SNAPPY:    return "snappy";
+        default:                return "unknown";
+    }
+}
+
+ObjectInfo::ZipAlgo ObjectInfo::getAlgoForStr(const std::string &str) {
+    if (str == "none") {
+        return ZIPALGO_NONE;
+    }
+    else if (str == "fastlz") {
+        return ZIPALGO_FASTLZ;
+    }
+    else if (str == "lzma") {
+        return ZIPALGO_LZMA;
+    }
+    else if (str == "snappy") {
+        return ZIPALGO_SNAPPY;
+    }
+    return ZIPALGO_UNKNOWN;
+}
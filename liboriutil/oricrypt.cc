@@ -92,6 +92,26 @@ OriCrypt_HashBlob(const uint8_t *data, size_t len)
     return hash;
 }
 
+OriCryptHash::OriCryptHash()
+{
+    SHA256_Init(&state);
+}
+
+void
+OriCryptHash::update(const uint8_t *data, size_t len)
+{
+    SHA256_Update(&state, data, len);
+}
+
+ObjectHash
+OriCryptHash::final()
+{
+    ObjectHash hash;
+
+    SHA256_Final(hash.hash, &state);
+
+    return hash;
+}
 
 /*
  * Compute SHA 256 hash for a file.
@@ -46,6 +46,11 @@
 #include <uuid/uuid.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
 #include "tuneables.h"
 
 #include <oriutil/debug.h>
@@ -240,7 +245,7 @@ OriFile_Append(const char *blob, size_t len, const string &path)
 }
 
 /*
- * Copy a file.
+ * Copy a file, as a reflink where the file system supports it.
  */
 int
 OriFile_Copy(const string &origPath, const string &newPath)
@@ -269,6 +274,15 @@ OriFile_Copy(const string &origPath, const string &newPath)
         return -errno;
     }
 
+#ifdef FICLONE
+    // Share the extents on file systems that support reflinks
+    if (ioctl(dstFd, FICLONE, srcFd) == 0) {
+        close(srcFd);
+        close(dstFd);
+        return sb.st_size;
+    }
+#endif /* FICLONE */
+
     bytesLeft = sb.st_size;
     while(bytesLeft > 0) {
         bytesRead = read(srcFd, buf, MIN(bytesLeft, COPYFILE_BUFSZ));
@@ -353,6 +367,56 @@ OriFile_Rename(const std::string &from, const std::string &to)
     return 0;
 }
 
+/*
+ * Create a uniquely named temporary file next to path that is renamed over
+ * it once written.  Returns the open descriptor and sets tmpPath, or
+ * returns -errno.
+ */
+int
+OriFile_CreateTemp(const std::string &path, std::string *tmpPath)
+{
+    std::string templ = path + ".tmp.XXXXXX";
+    int fd = mkstemp(&templ[0]);
+
+    if (fd < 0)
+        return -errno;
+
+    // mkstemp creates the file private
+    if (fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) < 0) {
+        int errcode = errno;
+        close(fd);
+        unlink(templ.c_str());
+        return -errcode;
+    }
+
+    *tmpPath = templ;
+    return fd;
+}
+
+/*
+ * Delete the temporary files of path left behind by a crash.  Whoever
+ * calls this must know that nobody is still writing them.
+ */
+void
+OriFile_DeleteTemps(const std::string &path)
+{
+    size_t ix = path.rfind('/');
+    std::string dir = (ix == std::string::npos) ? "." : path.substr(0, ix);
+    std::string prefix = path.substr(ix + 1) + ".tmp";
+    DIR *d = opendir(dir.c_str());
+    struct dirent *entry;
+
+    if (d == NULL)
+        return;
+
+    while ((entry = readdir(d)) != NULL) {
+        if (strncmp(entry->d_name, prefix.c_str(), prefix.size()) == 0)
+            OriFile_Delete(dir + "/" + entry->d_name);
+    }
+
+    closedir(d);
+}
+
 std::string
 OriFile_Basename(const std::string &path)
 {
@@ -443,6 +507,21 @@ OriFile_selfTest(void)
     ASSERT(OriFile_Delete("test.orig") == 0);
     ASSERT(OriFile_Exists("test.orig") == false);
 
+    // Temporary files
+    std::string tmpA, tmpB;
+    int tmpFd = OriFile_CreateTemp("test.d", &tmpA);
+    ASSERT(tmpFd >= 0);
+    close(tmpFd);
+    tmpFd = OriFile_CreateTemp("test.d", &tmpB);
+    ASSERT(tmpFd >= 0);
+    close(tmpFd);
+    ASSERT(tmpA != tmpB && OriFile_Exists(tmpA) && OriFile_Exists(tmpB));
+    ASSERT(OriFile_WriteFile("d", 1, "test.d"));
+    OriFile_DeleteTemps("test.d");
+    ASSERT(!OriFile_Exists(tmpA) && !OriFile_Exists(tmpB));
+    ASSERT(OriFile_Exists("test.d"));
+    ASSERT(OriFile_Delete("test.d") == 0);
+
     // Tests for string utilities
     std::string path("hello.txt");
     ASSERT(OriFile_Basename(path) == "hello.txt");
@@ -27,6 +27,7 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
@@ -55,6 +56,7 @@
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
+#include <oriutil/orifile.h>
 #include <oriutil/oricrypt.h>
 #include <oriutil/stream.h>
 
@@ -177,6 +179,39 @@ int Util_SetBlocking(int fd, bool block) {
     return 0;
 }
 
+/*
+ * Write out all buffers with as few writev calls as possible, retrying on
+ * short writes.  The iovec array is consumed.  Returns 0 or -errno.
+ */
+int
+Util_WriteV(int fd, std::vector<struct iovec> &iov)
+{
+    size_t i = 0;
+
+    while (i < iov.size()) {
+        int cnt = MIN(iov.size() - i, IOV_MAX);
+        ssize_t status = ::writev(fd, &iov[i], cnt);
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        // Skip over everything that was written
+        size_t written = status;
+        while (i < iov.size() && written >= iov[i].iov_len) {
+            written -= iov[i].iov_len;
+            i++;
+        }
+        if (written > 0) {
+            iov[i].iov_base = (uint8_t *)iov[i].iov_base + written;
+            iov[i].iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
 /*
  * Generate a UUID
  */
@@ -288,6 +323,25 @@ OriUtil_selfTest(void)
     ASSERT(in_stream.readUInt64() == nums[6]);
     ASSERT(in_stream.readInt64() == (int64_t)nums[7]);
 
+    // Test for vectored writes (more buffers than a single writev takes)
+    std::vector<std::string> bufs;
+    std::vector<struct iovec> iov;
+    std::string expected;
+    for (int i = 0; i < 3 * IOV_MAX; i++) {
+        bufs.push_back(std::string(1 + i % 7, 'a' + i % 26));
+        expected += bufs.back();
+    }
+    for (size_t i = 0; i < bufs.size(); i++) {
+        struct iovec v = { (void *)bufs[i].data(), bufs[i].size() };
+        iov.push_back(v);
+    }
+    int fd = open("test.writev", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT(fd >= 0);
+    ASSERT(Util_WriteV(fd, iov) == 0);
+    close(fd);
+    ASSERT(OriFile_ReadFile("test.writev") == expected);
+    OriFile_Delete("test.writev");
+
     return 0;
 }
 
@@ -27,9 +27,8 @@
 #include <fcntl.h>
 #endif
 
-#ifdef ORI_USE_FASTLZ
 #include "fastlz.h"
-#endif /* ORI_USE_FASTLZ */
+#include "snappy.h"
 
 #include <string>
 
@@ -38,6 +37,7 @@
 
 #include <oriutil/debug.h>
 #include <oriutil/systemexception.h>
+#include <oriutil/runtimeexception.h>
 #include <oriutil/stream.h>
 
 using namespace std;
@@ -434,16 +434,40 @@ size_t strstream::sizeHint() const
     return len;
 }
 
+/*
+ * memstream
+ */
+
+memstream::memstream(const uint8_t *buf, size_t len,
+                     std::shared_ptr<const void> owner)
+    : buf(buf), off(0), len(len), owner(owner)
+{
+}
+
+bool memstream::ended() {
+    return off >= len;
+}
+
+size_t memstream::read(uint8_t *out, size_t n)
+{
+    size_t to_read = MIN(n, len - off);
+    memcpy(out, buf + off, to_read);
+    off += to_read;
+    return to_read;
+}
+
+size_t memstream::sizeHint() const
+{
+    return len;
+}
+
 /*
  * fdstream
  */
 
 fdstream::fdstream(int fd, off_t offset, size_t length)
-    : fd(fd), length(length), left(length)
+    : fd(fd), offset(offset), length(length), left(length)
 {
-    if (offset >= 0 && lseek(fd, offset, SEEK_SET) != offset) {
-        setErrno("lseek");
-    }
 }
 
 bool fdstream::ended() {
@@ -452,8 +476,12 @@ bool fdstream::ended() {
 
 size_t fdstream::read(uint8_t *buf, size_t n) {
     size_t final_size = MIN(n, left);
+    ssize_t read_bytes;
 retry_read:
-    ssize_t read_bytes = ::read(fd, buf, final_size);
+    if (offset >= 0)
+        read_bytes = ::pread(fd, buf, final_size, offset);
+    else
+        read_bytes = ::read(fd, buf, final_size);
     if (read_bytes < 0) {
         if (errno == EINTR)
             goto retry_read;
@@ -465,6 +493,8 @@ retry_read:
         return 0;
     }
     left -= read_bytes;
+    if (offset >= 0)
+        offset += read_bytes;
 
     /*LOG("Readd %lu bytes (actually %ld) (%d)\n", n, read_bytes, fd);
     if (n < 100) {
@@ -481,6 +511,56 @@ size_t fdstream::sizeHint() const {
     return 0;
 }
 
+/*
+ * bufferedstream
+ */
+
+bufferedstream::bufferedstream(bytestream *source, size_t bufSize)
+    : source(source), buf(bufSize), off(0), len(0)
+{
+    assert(bufSize > 0);
+}
+
+bufferedstream::~bufferedstream()
+{
+    delete source;
+}
+
+bool bufferedstream::ended() {
+    if (error())
+        return true;
+    return off == len && source->ended();
+}
+
+size_t bufferedstream::read(uint8_t *out, size_t n)
+{
+    if (off == len) {
+        size_t bytesRead;
+
+        if (n >= buf.size()) {
+            bytesRead = source->read(out, n);
+            inheritError(source);
+            return bytesRead;
+        }
+
+        off = len = 0;
+        bytesRead = source->read(&buf[0], buf.size());
+        if (inheritError(source))
+            return 0;
+        len = bytesRead;
+    }
+
+    size_t toRead = MIN(n, len - off);
+    memcpy(out, &buf[off], toRead);
+    off += toRead;
+    return toRead;
+}
+
+size_t bufferedstream::sizeHint() const
+{
+    return source->sizeHint();
+}
+
 /*
  * diskstream
  */
@@ -518,33 +598,71 @@ size_t diskstream::sizeHint() const {
     return source->sizeHint();
 }
 
-#ifdef ORI_USE_LZMA
-
 /*
- * LZMA zipstream
+ * zipstream
  */
 
-zipstream::zipstream(bytestream *source, bool compress, size_t size_hint)
-    : source(source), size_hint(size_hint), output_ended(false)
+zipstream::zipstream(bytestream *source, ObjectInfo::ZipAlgo algo,
+                     bool compress, size_t size_hint)
+    : source(source),
+      algo(algo),
+      size_hint(size_hint),
+
+      compress(compress),
+      output_ended(false),
+
+      input_processed(false),
+      offset(0)
 {
     assert(source != NULL);
 
-    lzma_stream strm2 = LZMA_STREAM_INIT;
-    memcpy(&strm, &strm2, sizeof(lzma_stream));
+    if (!hasAlgo(algo) || algo == ObjectInfo::ZIPALGO_NONE) {
+        last_error = "zipstream: unsupported algorithm ";
+        last_error += ObjectInfo::getStrForAlgo(algo);
+        return;
+    }
 
-    if (compress) {
-        lzma_ret ret = lzma_easy_encoder(&strm, 0, LZMA_CHECK_NONE);
-        if (ret != LZMA_OK)
-            setLzmaErr("lzma_easy_encoder", ret);
+#ifdef ORI_USE_LZMA
+    if (algo == ObjectInfo::ZIPALGO_LZMA) {
+        lzma_stream strm2 = LZMA_STREAM_INIT;
+        memcpy(&strm, &strm2, sizeof(lzma_stream));
+        in_buf.resize(COMPFILE_BUFSZ);
+
+        if (compress) {
+            lzma_options_lzma opts;
+            lzma_filter filters[2];
+
+            // The dictionary never needs to be larger than the object
+            lzma_lzma_preset(&opts, LZMA_PRESET_DEFAULT);
+            if (source->sizeHint() > 0 && source->sizeHint() < opts.dict_size)
+                opts.dict_size = MAX(source->sizeHint(), LZMA_DICT_SIZE_MIN);
+            filters[0].id = LZMA_FILTER_LZMA2;
+            filters[0].options = &opts;
+            filters[1].id = LZMA_VLI_UNKNOWN;
+
+            lzma_ret ret = lzma_stream_encoder(&strm, filters, LZMA_CHECK_NONE);
+            if (ret != LZMA_OK)
+                setLzmaErr("lzma_stream_encoder", ret);
+        }
+        else {
+            lzma_ret ret = lzma_stream_decoder(&strm, UINT64_MAX, 0);
+            if (ret != LZMA_OK)
+                setLzmaErr("lzma_stream_decoder", ret);
+        }
+        return;
     }
-    else {
-        lzma_ret ret = lzma_stream_decoder(&strm, UINT64_MAX, 0);
-        if (ret != LZMA_OK)
-            setLzmaErr("lzma_stream_decoder", ret);
+#endif /* ORI_USE_LZMA */
+
+    if (size_hint > 0) {
+        output.resize(size_hint);
     }
 }
 
 zipstream::~zipstream() {
+#ifdef ORI_USE_LZMA
+    if (algo == ObjectInfo::ZIPALGO_LZMA)
+        lzma_end(&strm);
+#endif /* ORI_USE_LZMA */
     delete source;
 }
 
@@ -553,8 +671,143 @@ bool zipstream::ended() {
 }
 
 size_t zipstream::read(uint8_t *buf, size_t n) {
-    if (output_ended) return 0;
+    if (output_ended || error()) return 0;
+
+#ifdef ORI_USE_LZMA
+    if (algo == ObjectInfo::ZIPALGO_LZMA)
+        return _readLzma(buf, n);
+#endif /* ORI_USE_LZMA */
+
+    return _readBlock(buf, n);
+}
+
+size_t zipstream::sizeHint() const {
+    return size_hint;
+}
+
+size_t zipstream::inputConsumed() const {
+#ifdef ORI_USE_LZMA
+    if (algo == ObjectInfo::ZIPALGO_LZMA)
+        return strm.total_in;
+#endif /* ORI_USE_LZMA */
+
+    if (output.size() == 0)
+        return input.size();
+    return (size_t)((offset / (float)output.size()) * input.size());
+}
+
+bool zipstream::hasAlgo(ObjectInfo::ZipAlgo algo) {
+    switch (algo) {
+        case ObjectInfo::ZIPALGO_NONE:
+        case ObjectInfo::ZIPALGO_FASTLZ:
+        case ObjectInfo::ZIPALGO_SNAPPY:
+            return true;
+        case ObjectInfo::ZIPALGO_LZMA:
+#ifdef ORI_USE_LZMA
+            return true;
+#else
+            return false;
+#endif /* ORI_USE_LZMA */
+        default:
+            return false;
+    }
+}
+
+bytestream *zipstream::decode(bytestream *stored, const ObjectInfo &info) {
+    ObjectInfo::ZipAlgo algo = info.getAlgo();
+
+    if (algo == ObjectInfo::ZIPALGO_NONE)
+        return stored;
 
+    if (!hasAlgo(algo)) {
+        delete stored;
+        throw RuntimeException(ORIEC_UNSUPPORTEDVERSION,
+                "Object " + info.hash.hex() + " is compressed with " +
+                ObjectInfo::getStrForAlgo(algo) +
+                " which this build does not support");
+    }
+
+    return new zipstream(stored, algo, DECOMPRESS, info.payload_size);
+}
+
+/*
+ * FastLZ and snappy
+ */
+
+size_t zipstream::_readBlock(uint8_t *buf, size_t n) {
+    if (!input_processed) {
+        input = source->readAll();
+        if (inheritError(source)) return 0;
+
+        size_t finalSize = 0;
+        if (algo == ObjectInfo::ZIPALGO_SNAPPY) {
+            if (compress) {
+                output.resize(snappy::MaxCompressedLength(input.size()));
+                snappy::RawCompress(input.data(), input.size(),
+                                    (char *)&output[0], &finalSize);
+            } else {
+                size_t length;
+                if (!snappy::GetUncompressedLength(input.data(), input.size(),
+                                                   &length)) {
+                    last_error = "snappy couldn't decompress";
+                    return 0;
+                }
+                output.resize(length);
+                if (length > 0 &&
+                    !snappy::RawUncompress(input.data(), input.size(),
+                                           (char *)&output[0])) {
+                    last_error = "snappy couldn't decompress";
+                    return 0;
+                }
+                finalSize = length;
+            }
+        } else {
+            if (output.size() == 0) {
+                NOT_IMPLEMENTED(compress);
+                // FastLZ may expand its input by up to 5% (at least 66 bytes)
+                output.resize(MAX(input.size() * 1.3, 66));
+            }
+
+            int flzSize = 0;
+            if (compress) {
+                flzSize = fastlz_compress(&input[0], input.size(), &output[0]);
+                if (flzSize == 0) {
+                    last_error = "FastLZ couldn't compress";
+                    return 0;
+                }
+            } else {
+                flzSize = fastlz_decompress(&input[0], input.size(),
+                                            &output[0], output.size());
+                if (flzSize == 0) {
+                    last_error = "FastLZ couldn't decompress";
+                    return 0;
+                }
+            }
+            finalSize = flzSize;
+        }
+
+        output.resize(finalSize);
+        input_processed = true;
+    }
+
+    size_t to_copy = MIN(n, output.size() - offset);
+    if (to_copy > 0)
+        memcpy(buf, &output[offset], to_copy);
+    offset += to_copy;
+
+    if (offset == output.size())
+        output_ended = true;
+
+    return to_copy;
+}
+
+#ifdef ORI_USE_LZMA
+
+/*
+ * LZMA
+ */
+
+size_t zipstream::_readLzma(uint8_t *buf, size_t n) {
     lzma_action action = source->ended() ? LZMA_FINISH : LZMA_RUN;
     size_t begin_total = strm.total_out;
 
@@ -563,19 +816,18 @@ size_t zipstream::read(uint8_t *buf, size_t n) {
     while (strm.avail_out > 0) {
         if (output_ended) break;
 
-        if (strm.avail_in == 0) {
-            size_t read_bytes = source->read(in_buf, COMPFILE_BUFSZ);
+        if (strm.avail_in == 0 && action != LZMA_FINISH) {
+            size_t read_bytes = source->read(&in_buf[0], in_buf.size());
             if (inheritError(source)) return 0;
             action = read_bytes == 0 ? LZMA_FINISH : LZMA_RUN;
 
-            strm.next_in = in_buf;
+            strm.next_in = &in_buf[0];
             strm.avail_in = read_bytes;
         }
 
         lzma_ret ret = lzma_code(&strm, action);
         if (ret == LZMA_STREAM_END) {
             output_ended = true;
-            lzma_end(&strm);
         }
         else if (ret != LZMA_OK) {
             setLzmaErr("lzma_code", ret);
@@ -586,14 +838,6 @@ size_t zipstream::read(uint8_t *buf, size_t n) {
     return strm.total_out - begin_total;
 }
 
-size_t zipstream::sizeHint() const {
-    return size_hint;
-}
-
-size_t zipstream::inputConsumed() const {
-    return strm.total_in;
-}
-
 const char *lzma_ret_str(lzma_ret ret) {
     switch (ret) {
     case LZMA_STREAM_END:
@@ -633,86 +877,6 @@ void zipstream::setLzmaErr(const char *msg, lzma_ret ret)
 
 #endif /* ORI_USE_LZMA */
 
-#ifdef ORI_USE_FASTLZ
-
-/*
- * FastLZ zipstream
- */
-
-zipstream::zipstream(bytestream *source, bool compress, size_t size_hint)
-    : source(source),
-      size_hint(size_hint),
-
-      compress(compress),
-      input_processed(false),
-
-      offset(0),
-      output_ended(false)
-{
-    assert(source != NULL);
-    if (size_hint > 0) {
-        output.resize(size_hint);
-    }
-}
-
-zipstream::~zipstream() {
-    delete source;
-}
-
-bool zipstream::ended() {
-    return output_ended; // || error();
-}
-
-size_t zipstream::read(uint8_t *buf, size_t n) {
-    if (output_ended) return 0;
-
-    if (!input_processed) {
-        input = source->readAll();
-        if (output.size() == 0) {
-            NOT_IMPLEMENTED(compress);
-            output.resize(input.size() * 1.3);
-        }
-
-        int finalSize = 0;
-	if (compress) {
-	    finalSize = fastlz_compress(&input[0], input.size(), &output[0]);
-	    if (finalSize == 0) {
-		last_error = "FastLZ couldn't compress";
-                return 0;
-            }
-	} else {
-	    finalSize = fastlz_decompress(&input[0], input.size(), &output[0],
-                    output.size());
-	    if (finalSize == 0) {
-		last_error = "FastLZ couldn't decompress";
-                return 0;
-            }
-	}
-
-        output.resize(finalSize);
-	input_processed = true;
-    }
-
-    size_t to_copy = MIN(n, output.size() - offset);
-    memcpy(buf, &output[offset], to_copy);
-    offset += to_copy;
-
-    if (offset == output.size())
-	output_ended = true;
-
-    return to_copy;
-}
-
-size_t zipstream::sizeHint() const {
-    return size_hint;
-}
-
-size_t zipstream::inputConsumed() const {
-    return (size_t)((offset / (float)output.size()) * input.size());
-}
-
-#endif /* ORI_USE_FASTLZ */
-
 /*
  * bytewstream
  */
@@ -903,6 +1067,13 @@ bytewstream::writeUInt64(uint64_t n)
     return (int)write(&val, sizeof(uint64_t));
 }
 
+ssize_t
+bytewstream::writeRef(const void *bytes, size_t n,
+                      const std::shared_ptr<const void> &owner)
+{
+    return write(bytes, n);
+}
+
 /*
  * strwstream
  */
@@ -971,3 +1142,124 @@ retryWrite:
     assert(totalWritten == n);
     return totalWritten;
 }
+
+/*
+ * bufferedwstream
+ */
+bufferedwstream::bufferedwstream(bytewstream *sink, size_t bufSize)
+    : sink(sink), buf(bufSize), len(0)
+{
+    assert(bufSize > 0);
+}
+
+bufferedwstream::~bufferedwstream()
+{
+    flush();
+    delete sink;
+}
+
+ssize_t bufferedwstream::write(const void *bytes, size_t n)
+{
+    if (len + n > buf.size()) {
+        int status = flush();
+        if (status < 0)
+            return status;
+    }
+
+    if (n >= buf.size()) {
+        ssize_t bytesWritten = sink->write(bytes, n);
+        if (bytesWritten < 0)
+            inheritError(sink);
+        return bytesWritten;
+    }
+
+    memcpy(&buf[len], bytes, n);
+    len += n;
+    return n;
+}
+
+int bufferedwstream::flush()
+{
+    if (len == 0)
+        return 0;
+
+    ssize_t bytesWritten = sink->write(&buf[0], len);
+    len = 0;
+    if (bytesWritten < 0) {
+        inheritError(sink);
+        return bytesWritten;
+    }
+    return 0;
+}
+
+int
+Stream_selfTest(void)
+{
+    ObjectInfo::ZipAlgo algos[] = {
+        ObjectInfo::ZIPALGO_FASTLZ,
+        ObjectInfo::ZIPALGO_LZMA,
+        ObjectInfo::ZIPALGO_SNAPPY,
+    };
+
+    cout << "Testing zipstream ..." << endl;
+
+    string data;
+    for (int i = 0; i < 20000; i++)
+        data += "ori " + to_string(i % 97) + "\n";
+
+    for (size_t a = 0; a < sizeof(algos) / sizeof(algos[0]); a++) {
+        if (!zipstream::hasAlgo(algos[a]))
+            continue;
+
+        zipstream cs(new strstream(data), algos[a], COMPRESS);
+        string packed = cs.readAll();
+        if (cs.error() || packed.size() >= data.size())
+            return -1;
+
+        ObjectInfo info;
+        info.setAlgo(algos[a]);
+        info.payload_size = data.size();
+        if (!info.isCompressed() || info.getAlgo() != algos[a])
+            return -1;
+
+        bytestream::ap ds(zipstream::decode(new strstream(packed), info));
+        if (ds->readAll() != data || ds->error())
+            return -1;
+    }
+
+    cout << "Testing bufferedstream ..." << endl;
+
+    // Small buffers so fields straddle refills and large writes bypass them
+    string packed;
+    {
+        strwstream *ss = new strwstream();
+        bufferedwstream bs(ss, 16);
+        for (int i = 0; i < 1000; i++) {
+            bs.writeUInt32(i);
+            bs.writePStr(to_string(i));
+        }
+        bs.write(data.data(), data.size());
+        bs.writeUInt64(0x0123456789ABCDEFULL);
+        if (bs.flush() < 0 || bs.error())
+            return -1;
+        packed = ss->str();
+    }
+
+    bufferedstream bs(new strstream(packed), 16);
+    for (int i = 0; i < 1000; i++) {
+        string str;
+        if (bs.readUInt32() != (uint32_t)i)
+            return -1;
+        bs.readPStr(str);
+        if (str != to_string(i))
+            return -1;
+    }
+    string payload(data.size(), '\0');
+    bs.readExact((uint8_t *)&payload[0], payload.size());
+    if (payload != data || bs.readUInt64() != 0x0123456789ABCDEFULL)
+        return -1;
+    if (!bs.ended() || bs.error())
+        return -1;
+
+    return 0;
+}
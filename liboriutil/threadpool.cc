@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <iostream>
+#include <stdexcept>
+
+#include <oriutil/debug.h>
+#include <oriutil/threadpool.h>
+
+using namespace std;
+
+/*
+ * ThreadPool
+ */
+
+ThreadPool::ThreadPool(int n)
+    : lock(), ready(), tasks(), threads(), done(false)
+{
+    if (n < 0)
+        n = defaultSize();
+
+    for (int i = 0; i < n; i++) {
+        threads.push_back(thread(&ThreadPool::worker, this));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        unique_lock<mutex> l(lock);
+        done = true;
+    }
+    ready.notify_all();
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+}
+
+int
+ThreadPool::size() const
+{
+    return threads.size();
+}
+
+/*
+ * One thread per CPU.  A single CPU gets no threads since handing tasks
+ * to one worker only adds context switches.
+ */
+int
+ThreadPool::defaultSize()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (n > 1) ? (int)n : 0;
+}
+
+/*
+ * Shared by every repository in the process so that opening several does
+ * not start a set of threads per CPU for each.
+ */
+shared_ptr<ThreadPool>
+ThreadPool::shared()
+{
+    static mutex sharedLock;
+    static shared_ptr<ThreadPool> pool;
+    unique_lock<mutex> l(sharedLock);
+
+    if (!pool)
+        pool.reset(new ThreadPool(-1));
+
+    return pool;
+}
+
+void
+ThreadPool::enqueue(const function<void()> &task)
+{
+    {
+        unique_lock<mutex> l(lock);
+        tasks.push_back(task);
+    }
+    ready.notify_one();
+}
+
+/*
+ * Runs a queued task on the calling thread.
+ * @returns false if nothing was queued
+ */
+bool
+ThreadPool::runOne()
+{
+    function<void()> task;
+
+    {
+        unique_lock<mutex> l(lock);
+        if (tasks.empty())
+            return false;
+        task = tasks.front();
+        tasks.pop_front();
+    }
+
+    task();
+    return true;
+}
+
+void
+ThreadPool::worker()
+{
+    while (true) {
+        function<void()> task;
+
+        {
+            unique_lock<mutex> l(lock);
+            while (!done && tasks.empty())
+                ready.wait(l);
+            if (tasks.empty())
+                return;
+            task = tasks.front();
+            tasks.pop_front();
+        }
+
+        task();
+    }
+}
+
+/*
+ * TaskGroup
+ */
+
+TaskGroup::TaskGroup(ThreadPool *pool)
+    : pool(pool), lock(), finished(), pending(0), error()
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+    _wait();
+}
+
+void
+TaskGroup::run(const function<void()> &task)
+{
+    if (pool == NULL || pool->size() == 0) {
+        _run(task);
+        return;
+    }
+
+    {
+        unique_lock<mutex> l(lock);
+        pending++;
+    }
+
+    pool->enqueue([this, task]() {
+        _run(task);
+
+        unique_lock<mutex> l(lock);
+        if (--pending == 0)
+            finished.notify_all();
+    });
+}
+
+void
+TaskGroup::wait()
+{
+    _wait();
+
+    unique_lock<mutex> l(lock);
+    if (error) {
+        exception_ptr e = error;
+
+        error = exception_ptr();
+        rethrow_exception(e);
+    }
+}
+
+/*
+ * Runs a task, keeping the first exception for wait().
+ */
+void
+TaskGroup::_run(const function<void()> &task)
+{
+    try {
+        task();
+    } catch (...) {
+        unique_lock<mutex> l(lock);
+        if (!error)
+            error = current_exception();
+    }
+}
+
+void
+TaskGroup::_wait()
+{
+    unique_lock<mutex> l(lock);
+
+    while (pending > 0) {
+        // Help with queued work rather than block a pool thread
+        l.unlock();
+        bool ran = (pool != NULL && pool->runOne());
+        l.lock();
+        if (!ran && pending > 0)
+            finished.wait(l);
+    }
+}
+
+int
+ThreadPool_selfTest(void)
+{
+    cout << "Testing ThreadPool ..." << endl;
+
+    ThreadPool pool(4);
+    vector<int> results(1000, 0);
+    atomic<int> sum(0);
+
+    {
+        TaskGroup group(&pool);
+        for (int i = 0; i < 1000; i++) {
+            group.run([&results, &sum, i]() {
+                results[i] = i * i;
+                sum += i;
+            });
+        }
+        group.wait();
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        if (results[i] != i * i)
+            return -1;
+    }
+    if (sum != 999 * 1000 / 2)
+        return -1;
+
+    // Without a pool tasks run inline
+    ThreadPool inlinePool(0);
+    TaskGroup group(&inlinePool);
+    int value = 0;
+    group.run([&value]() { value = 1; });
+    if (value != 1)
+        return -1;
+
+    // Exceptions are passed to wait() after every task ran
+    {
+        TaskGroup errors(&pool);
+        atomic<int> ran(0);
+        bool caught = false;
+
+        for (int i = 0; i < 100; i++) {
+            errors.run([&ran, i]() {
+                ran++;
+                if (i % 10 == 0)
+                    throw runtime_error("task failed");
+            });
+        }
+        try {
+            errors.wait();
+        } catch (runtime_error &e) {
+            caught = true;
+        }
+        if (!caught || ran != 100)
+            return -1;
+        errors.wait();
+    }
+
+    // Tasks may wait for tasks of their own
+    {
+        TaskGroup outer(&pool);
+        atomic<int> inner(0);
+
+        for (int i = 0; i < 16; i++) {
+            outer.run([&pool, &inner]() {
+                TaskGroup g(&pool);
+                for (int j = 0; j < 16; j++)
+                    g.run([&inner]() { inner++; });
+                g.wait();
+            });
+        }
+        outer.wait();
+        if (inner != 16 * 16)
+            return -1;
+    }
+
+    return 0;
+}
@@ -21,6 +21,7 @@
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
+#include <oriutil/threadpool.h>
 #include <ori/localrepo.h>
 
 #include "fuse_cmd.h"
@@ -53,10 +54,16 @@ cmd_commit(int argc, char * const argv[])
         tip_tree = repository.getTree(c.getTree());
     }
 
+    DirState state;
+    state.open(repository.getRootPath() + ORI_PATH_DIRSTATE);
+
+    ThreadPool pool;
     TreeDiff diff;
-    diff.diffToDir(c, repository.getRootPath(), &repository);
+    diff.diffToDir(c, repository.getRootPath(), &repository, &state,
+                   &pool);
     if (diff.entries.size() == 0) {
         cout << "Nothing to commit!" << endl;
+        state.save();
         return 0;
     }
 
@@ -69,6 +76,9 @@ cmd_commit(int argc, char * const argv[])
     }
     repository.commitFromTree(new_tree.hash(), newCommit);
 
+    state.updateFromTree(new_tree.flattened(&repository));
+    state.save();
+
     return 0;
 }
 
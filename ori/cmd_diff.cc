@@ -22,6 +22,7 @@
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
+#include <oriutil/threadpool.h>
 #include <ori/localrepo.h>
 
 #include "fuse_cmd.h"
@@ -48,8 +49,14 @@ cmd_diff(int argc, char * const argv[])
         c = repository.getCommit(tip);
     }
 
+    DirState state;
+    state.open(repository.getRootPath() + ORI_PATH_DIRSTATE);
+
+    ThreadPool pool;
     TreeDiff td;
-    td.diffToDir(c, repository.getRootPath(), &repository);
+    td.diffToDir(c, repository.getRootPath(), &repository, &state,
+                 &pool);
+    state.save();
 
     Blob a, b, out;
 
@@ -96,6 +96,7 @@ int cmd_show(int argc, char * const argv[]);
 void usage_snapshot(void);
 int cmd_snapshot(int argc, char * const argv[]);
 int cmd_snapshots(int argc, char * const argv[]);
+int cmd_stats(int argc, char * const argv[]);
 int cmd_status(int argc, char * const argv[]);
 int cmd_tip(int argc, char * const argv[]);
 int cmd_varlink(int argc, char * const argv[]);
@@ -327,6 +328,13 @@ static Cmd commands[] = {
         NULL,
         CMD_NEED_FUSE | CMD_DEBUG,
     },
+    {
+        "stats",
+        "Show FUSE file system statistics",
+        cmd_stats,
+        NULL,
+        CMD_NEED_FUSE | CMD_DEBUG,
+    },
     {
         "version",
         "Show version information",
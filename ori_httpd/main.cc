@@ -58,6 +58,7 @@ usage()
     cout << "Usage: ori_httpd [OPTIONS] FSNAME" << endl << endl;
     cout << "Options:" << endl;
     cout << "    -p port    Set the HTTP port number (default: 8080)" << endl;
+    cout << "    -t threads Set the number of server threads (default: one per CPU)" << endl;
 #if !defined(WITHOUT_MDNS)
     cout << "    -m         Enable mDNS (default)" << endl;
     cout << "    -n         Disable mDNS" << endl;
@@ -71,9 +72,10 @@ main(int argc, char *argv[])
     int ch;
     bool mDNS_flag = true;
     unsigned long port = 8080;
+    int threads = -1;
     string rootPath;
 
-    while ((ch = getopt(argc, argv, "p:mnh")) != -1) {
+    while ((ch = getopt(argc, argv, "p:t:mnh")) != -1) {
         switch (ch) {
             case 'p':
             {
@@ -86,6 +88,17 @@ main(int argc, char *argv[])
                 }
                 break;
             }
+            case 't':
+            {
+                char *p;
+                threads = strtol(optarg, &p, 10);
+                if (*p != '\0' || threads < 1) {
+                    cout << "Invalid number of threads '" << optarg << "'" << endl;
+                    usage();
+                    return 1;
+                }
+                break;
+            }
             case 'm':
                 mDNS_flag = true;
                 break;
@@ -124,8 +137,14 @@ main(int argc, char *argv[])
     ori_open_log(repository.getLogPath());
     LOG("libevent %s", event_get_version());
 
-    HTTPServer server = HTTPServer(repository, port);
-    server.start(mDNS_flag);
+    try {
+        HTTPServer server(repository, port, threads);
+        server.start(mDNS_flag);
+    } catch (std::exception &e) {
+        cout << e.what() << endl;
+        cout << "Could not start the HTTP server!" << endl;
+        return 1;
+    }
 
     return 0;
 }
@@ -0,0 +1,1697 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <iostream>
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/orifile.h>
+#include <oriutil/oricrypt.h>
+#include <oriutil/stopwatch.h>
+#include <oriutil/stream.h>
+#include <oriutil/threadpool.h>
+#include <ori/localrepo.h>
+#include <ori/largeblob.h>
+#include <ori/treediff.h>
+#include <ori/udsserver.h>
+#include <ori/udsclient.h>
+#include <ori/udsrepo.h>
+#include <ori/httpserver.h>
+#include <ori/httpclient.h>
+#include <ori/httprepo.h>
+
+using namespace std;
+
+/*
+ * Micro-benchmarks for repository internals.  Each benchmark runs against
+ * fresh repositories created inside a scratch directory given on the
+ * command line, which is left behind for inspection.
+ */
+
+typedef struct Bench {
+    const char *name;
+    const char *desc;
+    int (*bench)(const string &scratch, int argc, char * const argv[]);
+} Bench;
+
+static string
+bench_newRepo(const string &scratch, const string &name)
+{
+    string path = scratch + "/" + name;
+
+    if (OriFile_MkDir(path) < 0 || LocalRepo_Init(path, true) != 0) {
+        printf("Failed to create repository %s\n", path.c_str());
+        return "";
+    }
+
+    return path;
+}
+
+static string
+bench_randomPayload(size_t size)
+{
+    string payload(size, '\0');
+
+    for (size_t i = 0; i < size; i++)
+        payload[i] = rand() & 0xFF;
+
+    return payload;
+}
+
+static void
+bench_writeFile(const string &path, size_t size)
+{
+    int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+
+    for (size_t off = 0; off < size; off += 65536) {
+        string chunk = bench_randomPayload(min((size_t)65536, size - off));
+        write(fd, chunk.data(), chunk.size());
+    }
+    close(fd);
+}
+
+static void
+bench_report(const char *what, uint64_t count, uint64_t bytes, uint64_t us)
+{
+    double secs = (us == 0) ? 1e-6 : us / 1e6;
+
+    printf("%-20s %10" PRIu64 " objs %10.1f MB %10.3f s %12.0f objs/s %8.1f MB/s\n",
+           what, count, bytes / 1048576.0, secs,
+           count / secs, bytes / 1048576.0 / secs);
+}
+
+/*
+ * Add many small objects and commit them.  Exercises the packfile and
+ * index commit path.
+ */
+static int
+bench_commit(const string &scratch, int argc, char * const argv[])
+{
+    size_t objs = (argc > 0) ? atoi(argv[0]) : 20000;
+    size_t size = (argc > 1) ? atoi(argv[1]) : 256;
+    string path = bench_newRepo(scratch, "commit");
+    if (path == "")
+        return 1;
+
+    LocalRepo repo(path);
+    repo.open();
+
+    vector<string> payloads;
+    for (size_t i = 0; i < objs; i++)
+        payloads.push_back(bench_randomPayload(size));
+
+    Stopwatch sw = Stopwatch();
+    Stopwatch syncSw = Stopwatch();
+    sw.start();
+    for (size_t i = 0; i < objs; i++) {
+        repo.addBlob(ObjectInfo::Blob, payloads[i]);
+        if (i % 1024 == 1023) {
+            syncSw.start();
+            repo.sync();
+            syncSw.stop();
+        }
+    }
+    syncSw.start();
+    repo.sync();
+    syncSw.stop();
+    sw.stop();
+
+    bench_report("commit (total)", objs, objs * size, sw.getElapsedTime());
+    bench_report("commit (sync)", objs, objs * size,
+                 syncSw.getElapsedTime());
+
+    repo.close();
+
+    return 0;
+}
+
+/*
+ * Add one large file.  Exercises chunking and hashing of LargeBlobs.
+ */
+static int
+bench_largefile(const string &scratch, int argc, char * const argv[])
+{
+    size_t size = (argc > 0) ? atoi(argv[0]) * 1024 * 1024 : 256 * 1024 * 1024;
+    string file = scratch + "/large.tmp";
+
+    bench_writeFile(file, size);
+
+    string path = bench_newRepo(scratch, "largefile");
+    if (path == "")
+        return 1;
+
+    LocalRepo repo(path);
+    repo.open();
+
+    Stopwatch sw = Stopwatch();
+    sw.start();
+    pair<ObjectHash, ObjectHash> hashes = repo.addLargeFile(file);
+    repo.sync();
+    sw.stop();
+
+    LargeBlob lb = repo.getLargeBlob(hashes.first);
+    bench_report("largefile", lb.parts.size(), size, sw.getElapsedTime());
+
+    repo.close();
+
+    return 0;
+}
+
+/*
+ * Random reads from a large file through LargeBlob::read.
+ */
+static int
+bench_lbread(const string &scratch, int argc, char * const argv[])
+{
+    size_t size = (argc > 0) ? atoi(argv[0]) * 1024 * 1024 : 256 * 1024 * 1024;
+    size_t reads = (argc > 1) ? atoi(argv[1]) : 20000;
+    size_t readSize = (argc > 2) ? atoi(argv[2]) : 128 * 1024;
+    string file = scratch + "/large.tmp";
+
+    bench_writeFile(file, size);
+
+    string path = bench_newRepo(scratch, "lbread");
+    if (path == "")
+        return 1;
+
+    LocalRepo repo(path);
+    repo.open();
+
+    pair<ObjectHash, ObjectHash> hashes = repo.addLargeFile(file);
+    repo.sync();
+    OriFile_Delete(file);
+
+    LargeBlob lb = repo.getLargeBlob(hashes.first);
+    vector<uint8_t> buf(readSize);
+    uint64_t bytes = 0;
+
+    Stopwatch sw = Stopwatch();
+    sw.start();
+    for (size_t i = 0; i < reads; i++) {
+        off_t off = ((uint64_t)rand() * 4096) % size;
+        size_t len = min(readSize, size - (size_t)off);
+        size_t got = 0;
+        while (got < len) {
+            ssize_t n = lb.read(&buf[got], len - got, off + got);
+            if (n <= 0) {
+                printf("Read at %" PRIu64 " failed\n", (uint64_t)off + got);
+                return 1;
+            }
+            got += n;
+        }
+        bytes += got;
+    }
+    sw.stop();
+
+    bench_report("lbread", reads, bytes, sw.getElapsedTime());
+
+    repo.close();
+
+    return 0;
+}
+
+/*
+ * Compressible text made of random words.
+ */
+static string
+bench_textPayload(size_t size)
+{
+    static const char *words[] = {
+        "ori ", "repository ", "packfile ", "object ", "commit ", "tree ",
+        "blob ", "index ", "snapshot ", "merge ", "\n", "sync ", "peer ",
+    };
+    string payload;
+
+    while (payload.size() < size)
+        payload += words[rand() % (sizeof(words) / sizeof(words[0]))];
+    payload.resize(size);
+
+    return payload;
+}
+
+/*
+ * Write a working tree of many small and some medium sized text files,
+ * returns the number of bytes written.
+ */
+static uint64_t
+bench_writeTree(const string &dir, size_t files)
+{
+    uint64_t bytes = 0;
+
+    OriFile_MkDir(dir);
+    for (size_t i = 0; i < files; i++) {
+        string subdir = dir + "/d" + to_string(i / 256);
+        if (i % 256 == 0)
+            OriFile_MkDir(subdir);
+
+        // One in ten files is medium sized
+        size_t size = (i % 10 == 0) ? 64 * 1024 + rand() % (448 * 1024)
+                                    : 1 + rand() % 8192;
+        OriFile_WriteFile(bench_textPayload(size),
+                          subdir + "/f" + to_string(i));
+        bytes += size;
+    }
+
+    return bytes;
+}
+
+/*
+ * Commit a synthetic working tree of many small and some medium sized
+ * files through TreeDiff, the same path as "ori commit".  Exercises
+ * hashing and compression of new objects.
+ */
+static int
+bench_addtree(const string &scratch, int argc, char * const argv[])
+{
+    size_t files = (argc > 0) ? atoi(argv[0]) : 20000;
+    int threads = (argc > 1) ? atoi(argv[1]) : -1;
+    string dir = scratch + "/tree";
+    uint64_t bytes = bench_writeTree(dir, files);
+
+    string path = bench_newRepo(scratch, "addtree");
+    if (path == "")
+        return 1;
+
+    LocalRepo repo(path);
+    repo.open();
+    repo.setWorkerThreads(threads);
+
+    Stopwatch sw = Stopwatch();
+    sw.start();
+    TreeDiff diff;
+    diff.diffToDir(Commit(), dir, &repo);
+    Tree tree = diff.applyTo(Tree::Flat(), &repo);
+    Commit c;
+    c.setMessage("bench");
+    repo.commitFromTree(tree.hash(), c);
+    repo.sync();
+    sw.stop();
+
+    bench_report("addtree", files, bytes, sw.getElapsedTime());
+
+    repo.close();
+
+    return 0;
+}
+
+/*
+ * Commit the tree written by bench_writeTree, recording it in state if
+ * given, then touch every file as a checkout does.  Returns the commit.
+ */
+static Commit
+bench_commitTree(LocalRepo &repo, const string &dir, size_t files,
+                 DirState *state)
+{
+    TreeDiff diff;
+    diff.diffToDir(Commit(), dir, &repo, state);
+    Tree tree = diff.applyTo(Tree::Flat(), &repo);
+    Commit c;
+    c.setMessage("bench");
+    Commit tip = repo.getCommit(repo.commitFromTree(tree.hash(), c));
+    repo.sync();
+    if (state) {
+        state->updateFromTree(tree.flattened(&repo));
+        state->save();
+    }
+
+    sleep(1);
+    for (size_t i = 0; i < files; i++)
+        utimes((dir + "/d" + to_string(i / 256) + "/f" + to_string(i)).c_str(),
+               NULL);
+
+    return tip;
+}
+
+/*
+ * Status of a synthetic working tree like addtree's after committing it and
+ * touching every file, as a checkout does.  Without a dirstate every file
+ * newer than the commit is hashed on each run, with one only the first run
+ * after the files changed hashes them.
+ */
+static int
+bench_status(const string &scratch, int argc, char * const argv[])
+{
+    size_t files = (argc > 0) ? atoi(argv[0]) : 20000;
+    string dir = scratch + "/tree";
+    uint64_t bytes = bench_writeTree(dir, files);
+
+    string path = bench_newRepo(scratch, "status");
+    if (path == "")
+        return 1;
+
+    LocalRepo repo(path);
+    repo.open();
+
+    DirState state;
+    state.open(path + ORI_PATH_DIRSTATE);
+    Commit tip = bench_commitTree(repo, dir, files, &state);
+
+    const char *names[] = {
+        "status (no dirstate)", "status (dirstate)", "status (dirstate)",
+    };
+    for (int i = 0; i < 3; i++) {
+        DirState *s = (i == 0) ? NULL : &state;
+        TreeDiff td;
+
+        Stopwatch sw = Stopwatch();
+        sw.start();
+        if (s)
+            s->open(path + ORI_PATH_DIRSTATE);
+        td.diffToDir(tip, dir, &repo, s);
+        if (s)
+            s->save();
+        sw.stop();
+
+        if (td.entries.size() != 0) {
+            printf("Unexpected changes in the working tree\n");
+            return 1;
+        }
+        bench_report(names[i], files, bytes, sw.getElapsedTime());
+    }
+
+    repo.close();
+
+    return 0;
+}
+
+/*
+ * Scan of a committed and touched tree like status's without a dirstate, so
+ * every file is read and hashed, with the directory walk and hashing spread
+ * over 0 (inline), 1, 2, 4 ... THREADS threads.
+ */
+static int
+bench_scan(const string &scratch, int argc, char * const argv[])
+{
+    size_t files = (argc > 0) ? atoi(argv[0]) : 20000;
+    int maxThreads = (argc > 1) ? atoi(argv[1]) : 8;
+    string dir = scratch + "/tree";
+    uint64_t bytes = bench_writeTree(dir, files);
+
+    string path = bench_newRepo(scratch, "scan");
+    if (path == "")
+        return 1;
+
+    LocalRepo repo(path);
+    repo.open();
+    Commit tip = bench_commitTree(repo, dir, files, NULL);
+
+    for (int threads = 0; threads <= maxThreads;
+         threads = (threads == 0) ? 1 : threads * 2) {
+        ThreadPool pool(threads);
+        TreeDiff td;
+
+        Stopwatch sw = Stopwatch();
+        sw.start();
+        td.diffToDir(tip, dir, &repo, NULL, &pool);
+        sw.stop();
+
+        if (td.entries.size() != 0) {
+            printf("Unexpected changes in the working tree\n");
+            return 1;
+        }
+        string what = "scan (" + to_string(threads) + " threads)";
+        bench_report(what.c_str(), files, bytes, sw.getElapsedTime());
+    }
+
+    repo.close();
+
+    return 0;
+}
+
+/*
+ * Compress and decompress every object of a repository with each codec this
+ * build supports.  Uses the repository at REPO, or one committed from a
+ * synthetic tree like addtree's.
+ */
+static int
+bench_codec(const string &scratch, int argc, char * const argv[])
+{
+    static const ObjectInfo::ZipAlgo algos[] = {
+        ObjectInfo::ZIPALGO_FASTLZ,
+        ObjectInfo::ZIPALGO_SNAPPY,
+        ObjectInfo::ZIPALGO_LZMA,
+    };
+    string path;
+
+    if (argc > 0) {
+        path = argv[0];
+    } else {
+        string dir = scratch + "/tree";
+        bench_writeTree(dir, 2000);
+
+        path = bench_newRepo(scratch, "codec");
+        if (path == "")
+            return 1;
+
+        LocalRepo repo(path);
+        repo.open();
+        TreeDiff diff;
+        diff.diffToDir(Commit(), dir, &repo);
+        Tree tree = diff.applyTo(Tree::Flat(), &repo);
+        Commit c;
+        c.setMessage("bench");
+        repo.commitFromTree(tree.hash(), c);
+        repo.close();
+    }
+
+    LocalRepo repo(path);
+    repo.open();
+    vector<string> payloads;
+    uint64_t bytes = 0;
+    set<ObjectInfo> objs = repo.listObjects();
+    for (set<ObjectInfo>::iterator it = objs.begin(); it != objs.end(); it++) {
+        if (it->type == ObjectInfo::Purged || it->payload_size == 0)
+            continue;
+        payloads.push_back(repo.getPayload(it->hash));
+        bytes += payloads.back().size();
+    }
+    repo.close();
+
+    for (size_t a = 0; a < sizeof(algos) / sizeof(algos[0]); a++) {
+        ObjectInfo::ZipAlgo algo = algos[a];
+        string name = ObjectInfo::getStrForAlgo(algo);
+        vector<string> packed(payloads.size());
+        uint64_t packedBytes = 0;
+
+        if (!zipstream::hasAlgo(algo)) {
+            printf("%-20s not supported by this build\n", name.c_str());
+            continue;
+        }
+
+        Stopwatch compSw = Stopwatch();
+        compSw.start();
+        for (size_t i = 0; i < payloads.size(); i++) {
+            zipstream zs(new memstream((const uint8_t *)payloads[i].data(),
+                                       payloads[i].size()), algo, COMPRESS);
+            packed[i] = zs.readAll();
+            packedBytes += packed[i].size();
+        }
+        compSw.stop();
+
+        Stopwatch decompSw = Stopwatch();
+        decompSw.start();
+        for (size_t i = 0; i < payloads.size(); i++) {
+            zipstream zs(new strstream(packed[i]), algo, DECOMPRESS,
+                         payloads[i].size());
+            if (zs.readAll() != payloads[i]) {
+                printf("%s: object %zu did not round-trip\n", name.c_str(), i);
+                return 1;
+            }
+        }
+        decompSw.stop();
+
+        bench_report((name + " compress").c_str(), payloads.size(), bytes,
+                     compSw.getElapsedTime());
+        bench_report((name + " decompress").c_str(), payloads.size(), bytes,
+                     decompSw.getElapsedTime());
+        printf("%-20s %10.1f MB packed, ratio %.3f\n", name.c_str(),
+               packedBytes / 1048576.0, (double)packedBytes / bytes);
+    }
+
+    return 0;
+}
+
+/*
+ * Forwards to another repository while counting getObjects requests, which
+ * is the number of round-trips a remote pull would make.
+ */
+class BenchCountingRepo : public Repo
+{
+public:
+    BenchCountingRepo(Repo *r) : repo(r), requests(0), objects(0) { }
+    ~BenchCountingRepo() { }
+    std::string getUUID() { return repo->getUUID(); }
+    ObjectHash getHead() { return repo->getHead(); }
+    int distance() { return repo->distance(); }
+    Object::sp getObject(const ObjectHash &id) { return repo->getObject(id); }
+    ObjectInfo getObjectInfo(const ObjectHash &id) {
+        return repo->getObjectInfo(id);
+    }
+    bool hasObject(const ObjectHash &id) { return repo->hasObject(id); }
+    bytestream *getObjects(const ObjectHashVec &objs) {
+        requests++;
+        objects += objs.size();
+        return repo->getObjects(objs);
+    }
+    std::set<ObjectInfo> listObjects() { return repo->listObjects(); }
+    std::vector<Commit> listCommits() { return repo->listCommits(); }
+    int addObject(ObjectType type, const ObjectHash &hash,
+                  const std::string &payload) {
+        return repo->addObject(type, hash, payload);
+    }
+
+    Repo *repo;
+    uint64_t requests;
+    uint64_t objects;
+};
+
+static uint64_t
+bench_maxRSS()
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    // Kilobytes on Linux, bytes on Mac OS X
+#if defined(__APPLE__)
+    return ru.ru_maxrss;
+#else
+    return (uint64_t)ru.ru_maxrss * 1024;
+#endif
+}
+
+static ObjectHash
+bench_pullTree(LocalRepo &repo, int depth, int fanout, int files,
+               uint64_t *count, uint64_t *bytes)
+{
+    Tree t;
+
+    for (int i = 0; i < files; i++) {
+        size_t size = 1 + rand() % 4096;
+        TreeEntry te = TreeEntry(repo.addBlob(ObjectInfo::Blob,
+                                              bench_randomPayload(size)),
+                                 ObjectHash());
+        te.type = TreeEntry::Blob;
+        te.attrs.setCreation(0644);
+        te.attrs.setAs<size_t>(ATTR_FILESIZE, size);
+        t.tree["f" + to_string(i)] = te;
+        *count += 1;
+        *bytes += size;
+    }
+
+    for (int i = 0; depth > 0 && i < fanout; i++) {
+        TreeEntry te = TreeEntry(bench_pullTree(repo, depth - 1, fanout, files,
+                                                count, bytes),
+                                 ObjectHash());
+        te.type = TreeEntry::Tree;
+        te.attrs.setCreation(0755);
+        t.tree["d" + to_string(i)] = te;
+    }
+
+    *count += 1;
+    return repo.addTree(t);
+}
+
+/*
+ * Diff consecutive commits of a tree like pull's where each commit changes a
+ * single file, once by flattening both trees and once structurally.
+ */
+static int
+bench_treediff(const string &scratch, int argc, char * const argv[])
+{
+    int depth = (argc > 0) ? atoi(argv[0]) : 3;
+    int fanout = (argc > 1) ? atoi(argv[1]) : 8;
+    int files = (argc > 2) ? atoi(argv[2]) : 8;
+    int commits = (argc > 3) ? atoi(argv[3]) : 20;
+    uint64_t count = 0, bytes = 0;
+
+    string path = bench_newRepo(scratch, "treediff");
+    if (path == "")
+        return 1;
+
+    LocalRepo repo(path);
+    repo.open();
+
+    vector<Tree> trees;
+    trees.push_back(repo.getTree(bench_pullTree(repo, depth, fanout, files,
+                                                &count, &bytes)));
+    Tree::Flat flat = trees[0].flattened(&repo);
+    vector<string> paths;
+    for (Tree::Flat::iterator it = flat.begin(); it != flat.end(); it++) {
+        if (it->second.type == TreeEntry::Blob)
+            paths.push_back(it->first);
+    }
+    for (int i = 0; i < commits; i++) {
+        TreeEntry &te = flat[paths[rand() % paths.size()]];
+        te.hash = repo.addBlob(ObjectInfo::Blob, bench_randomPayload(64));
+        te.attrs.setAs<size_t>(ATTR_FILESIZE, 64);
+        trees.push_back(Tree::unflatten(flat, &repo));
+    }
+    repo.sync();
+
+    for (int structural = 0; structural < 2; structural++) {
+        Stopwatch sw = Stopwatch();
+        sw.start();
+        for (int i = 0; i < commits; i++) {
+            Tree t1 = repo.getTree(trees[i + 1].hash());
+            Tree t2 = repo.getTree(trees[i].hash());
+            TreeDiff td;
+
+            if (structural)
+                td.diffTwoTrees(t1, t2, &repo);
+            else
+                td.diffTwoTrees(t1.flattened(&repo), t2.flattened(&repo));
+            if (td.entries.size() > 1) {
+                printf("Unexpected changes between commits\n");
+                return 1;
+            }
+        }
+        sw.stop();
+
+        bench_report(structural ? "treediff (tree)" : "treediff (flat)",
+                     commits, 0, sw.getElapsedTime());
+    }
+    printf("%" PRIu64 " objects per tree\n", count);
+
+    repo.close();
+
+    return 0;
+}
+
+/*
+ * Pull a tree of many small files and a few large files between two local
+ * repositories.  Reports the number of requests made to the source, which
+ * is the number of round-trips a remote pull pays, and the peak RSS.
+ */
+static int
+bench_pull(const string &scratch, int argc, char * const argv[])
+{
+    int depth = (argc > 0) ? atoi(argv[0]) : 3;
+    int fanout = (argc > 1) ? atoi(argv[1]) : 8;
+    int files = (argc > 2) ? atoi(argv[2]) : 32;
+    int large = (argc > 3) ? atoi(argv[3]) : 4;
+    size_t largeSize = (argc > 4) ? atoi(argv[4]) : 32 * 1024 * 1024;
+    string srcPath = bench_newRepo(scratch, "src");
+    string dstPath = bench_newRepo(scratch, "dst");
+    if (srcPath == "" || dstPath == "")
+        return 1;
+
+    uint64_t count = 0, bytes = 0;
+    {
+        LocalRepo src(srcPath);
+        src.open();
+
+        Tree root = src.getTree(bench_pullTree(src, depth, fanout, files,
+                                               &count, &bytes));
+        for (int i = 0; i < large; i++) {
+            string tmpFile = scratch + "/large.tmp";
+            bench_writeFile(tmpFile, largeSize);
+
+            pair<ObjectHash, ObjectHash> hashes = src.addLargeFile(tmpFile);
+            TreeEntry te = TreeEntry(hashes.first, hashes.second);
+            te.type = TreeEntry::LargeBlob;
+            te.attrs.setCreation(0644);
+            te.attrs.setAs<size_t>(ATTR_FILESIZE, largeSize);
+            root.tree["large" + to_string(i)] = te;
+            OriFile_Delete(tmpFile);
+            bytes += largeSize;
+        }
+        src.sync();
+
+        Commit c;
+        c.setMessage("bench");
+        src.commitFromTree(src.addTree(root), c);
+        src.close();
+    }
+
+    LocalRepo src(srcPath);
+    LocalRepo dst(dstPath);
+    src.open();
+    dst.open();
+
+    BenchCountingRepo counter(&src);
+    uint64_t rssBefore = bench_maxRSS();
+    Stopwatch sw = Stopwatch();
+    sw.start();
+    dst.pull(&counter);
+    dst.sync();
+    sw.stop();
+    uint64_t rssAfter = bench_maxRSS();
+
+    bench_report("pull", counter.objects, bytes, sw.getElapsedTime());
+    printf("%-20s %10" PRIu64 " requests\n", "pull (round-trips)",
+           counter.requests);
+    printf("%-20s %10.1f MB (%.1f MB before pull)\n", "pull (peak RSS)",
+           rssAfter / 1048576.0, rssBefore / 1048576.0);
+
+    dst.close();
+    src.close();
+
+    return 0;
+}
+
+/*
+ * Reader threads fetching random objects from the same repository, alone and
+ * while a writer adds and syncs new objects.  Reports the aggregate read
+ * throughput for 1, 2, 4, ... THREADS readers.
+ */
+static bool
+bench_readerLoop(LocalRepo *repo, const vector<ObjectHash> *hashes,
+                 size_t reads, unsigned int seed, atomic<uint64_t> *bytes)
+{
+    uint64_t total = 0;
+
+    for (size_t i = 0; i < reads; i++) {
+        const ObjectHash &hash = (*hashes)[rand_r(&seed) % hashes->size()];
+        string payload = repo->getPayload(hash);
+        if (payload.size() != repo->getObjectInfo(hash).payload_size)
+            return false;
+        total += payload.size();
+    }
+    *bytes += total;
+
+    return true;
+}
+
+static int
+bench_readers(const string &scratch, int argc, char * const argv[])
+{
+    int maxThreads = (argc > 0) ? atoi(argv[0]) : 8;
+    size_t objs = (argc > 1) ? atoi(argv[1]) : 20000;
+    size_t size = (argc > 2) ? atoi(argv[2]) : 4096;
+    size_t reads = (argc > 3) ? atoi(argv[3]) : 100000;
+    string path = bench_newRepo(scratch, "readers");
+    if (path == "")
+        return 1;
+
+    LocalRepo repo(path);
+    repo.open();
+
+    vector<ObjectHash> hashes;
+    for (size_t i = 0; i < objs; i++)
+        hashes.push_back(repo.addBlob(ObjectInfo::Blob,
+                                      bench_textPayload(size)));
+    repo.sync();
+
+    vector<string> extra;
+    for (size_t i = 0; i < objs; i++)
+        extra.push_back(bench_textPayload(size));
+
+    for (int writer = 0; writer < 2; writer++) {
+        for (int threads = 1; threads <= maxThreads; threads *= 2) {
+            vector<thread> readers;
+            atomic<uint64_t> bytes(0);
+            atomic<bool> failed(false);
+            atomic<bool> stop(false);
+            thread w;
+
+            if (writer) {
+                // Suffix the payloads so each round adds new objects
+                w = thread([&repo, &extra, &stop, threads]() {
+                    for (size_t i = 0; i < extra.size() && !stop; i++) {
+                        repo.addBlob(ObjectInfo::Blob,
+                                     extra[i] + to_string(threads));
+                        if (i % 256 == 255)
+                            repo.sync();
+                    }
+                    repo.sync();
+                });
+            }
+
+            Stopwatch sw = Stopwatch();
+            sw.start();
+            for (int t = 0; t < threads; t++) {
+                readers.push_back(thread([&, t]() {
+                    if (!bench_readerLoop(&repo, &hashes, reads / threads,
+                                          t + 1, &bytes))
+                        failed = true;
+                }));
+            }
+            for (size_t t = 0; t < readers.size(); t++)
+                readers[t].join();
+            sw.stop();
+
+            if (writer) {
+                stop = true;
+                w.join();
+            }
+            if (failed) {
+                printf("Reader got a bad payload\n");
+                return 1;
+            }
+
+            string what = string(writer ? "readers+writer " : "readers ") +
+                          to_string(threads);
+            bench_report(what.c_str(), reads / threads * threads, bytes,
+                         sw.getElapsedTime());
+        }
+    }
+
+    repo.close();
+
+    return 0;
+}
+
+/*
+ * Open a metadata log of TXNS transactions touching OBJECTS objects written
+ * in the format used before checkpoints, which replays every record, convert
+ * it as the first commit would, then open the resulting checkpoint.  Lookups
+ * of every object are timed after each open.
+ */
+static int
+bench_mdlog(const string &scratch, int argc, char * const argv[])
+{
+    size_t objs = (argc > 0) ? atoi(argv[0]) : 200000;
+    size_t txns = (argc > 1) ? atoi(argv[1]) : 2000;
+    string path = scratch + "/metadata";
+    vector<ObjectHash> hashes;
+
+    for (size_t i = 0; i < objs; i++)
+        hashes.push_back(OriCrypt_HashString(to_string(i)));
+
+    // Every object is referenced by several transactions
+    string log;
+    for (size_t t = 0; t < txns; t++) {
+        size_t perTxn = (objs * 4 + txns - 1) / txns;
+        strwstream ws;
+
+        ws.writeUInt32(perTxn);
+        ws.writeUInt32(1);
+        for (size_t i = 0; i < perTxn; i++) {
+            ws.writeHash(hashes[(t * perTxn + i) % objs]);
+            ws.writeInt32(1 + (t * perTxn + i) / objs);
+        }
+        ws.writeHash(hashes[t % objs]);
+        ws.writeUInt32(1);
+        ws.writePStr("status");
+        ws.writePStr("normal");
+
+        uint32_t nbytes = ws.str().size();
+        log.append((const char *)&nbytes, sizeof(nbytes));
+        log.append(ws.str());
+    }
+    OriFile_WriteFile(log, path);
+
+    const char *names[] = { "mdlog open (replay)", "mdlog open (ckpt)" };
+    for (int i = 0; i < 2; i++) {
+        uint64_t bytes = OriFile_ReadFile(path).size();
+        if (OriFile_Exists(path + METADATALOG_CHECKPOINT_SUFFIX))
+            bytes += OriFile_ReadFile(path +
+                                      METADATALOG_CHECKPOINT_SUFFIX).size();
+
+        MetadataLog md;
+        Stopwatch sw = Stopwatch();
+        sw.start();
+        md.open(path);
+        sw.stop();
+        bench_report(names[i], objs, bytes, sw.getElapsedTime());
+
+        sw = Stopwatch();
+        sw.start();
+        for (size_t j = 0; j < objs; j++) {
+            if (md.getRefCount(hashes[j]) == 0) {
+                printf("Missing reference count\n");
+                return 1;
+            }
+        }
+        sw.stop();
+        bench_report("mdlog lookups", objs, 0, sw.getElapsedTime());
+
+        if (i == 0)
+            md.checkpoint();
+    }
+
+    return 0;
+}
+
+/*
+ * Read and write system calls made so far by this process (all threads), from
+ * /proc/self/io.  Returns false where that is not available.
+ */
+static bool
+bench_ioCalls(uint64_t *reads, uint64_t *writes)
+{
+    FILE *f = fopen("/proc/self/io", "r");
+    char line[128];
+    bool found = false;
+
+    if (f == NULL)
+        return false;
+    *reads = *writes = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "syscr: %" SCNu64, reads) == 1 ||
+            sscanf(line, "syscw: %" SCNu64, writes) == 1)
+            found = true;
+    }
+    fclose(f);
+
+    return found;
+}
+
+static void
+bench_reportCalls(const char *what, uint64_t count, uint64_t reads,
+                  uint64_t writes)
+{
+    printf("%-20s %10" PRIu64 " reads %10" PRIu64 " writes %10.4f calls/op\n",
+           what, reads, writes, (double)(reads + writes) / count);
+}
+
+/*
+ * Write and parse OBJECTS packfile style headers through plain and buffered
+ * fd streams, then make REQUESTS small requests to a UDS server running on a
+ * repository in this process.  Reports the read and write system calls made
+ * by each (both ends of the socket for UDS).
+ */
+static int
+bench_syscalls(const string &scratch, int argc, char * const argv[])
+{
+    size_t objs = (argc > 0) ? atoi(argv[0]) : 100000;
+    size_t requests = (argc > 1) ? atoi(argv[1]) : 1000;
+    string headers = scratch + "/headers";
+    uint64_t r0, w0, r1, w1;
+
+    if (!bench_ioCalls(&r0, &w0)) {
+        printf("System call counts are not available\n");
+        return 1;
+    }
+
+    for (int buffered = 0; buffered < 2; buffered++) {
+        string kind = buffered ? " (buffered)" : " (fdstream)";
+        int fd = open(headers.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+        if (fd < 0) {
+            perror("open");
+            return 1;
+        }
+
+        bench_ioCalls(&r0, &w0);
+        Stopwatch sw = Stopwatch();
+        sw.start();
+        {
+            bytewstream::ap ws(buffered ?
+                    (bytewstream *)new bufferedwstream(new fdwstream(fd)) :
+                    (bytewstream *)new fdwstream(fd));
+            for (size_t i = 0; i < objs; i++) {
+                ObjectInfo info(OriCrypt_HashString(to_string(i)));
+                info.type = ObjectInfo::Blob;
+                info.payload_size = i;
+                ws->writeInfo(info);
+                ws->writeUInt32(i);
+                ws->writeUInt32(i * 2);
+            }
+        }
+        sw.stop();
+        bench_ioCalls(&r1, &w1);
+        uint64_t bytes = lseek(fd, 0, SEEK_END);
+        bench_report(("write" + kind).c_str(), objs, bytes,
+                     sw.getElapsedTime());
+        bench_reportCalls(("write" + kind).c_str(), objs, r1 - r0, w1 - w0);
+
+        bench_ioCalls(&r0, &w0);
+        sw = Stopwatch();
+        sw.start();
+        {
+            bytestream::ap rs(buffered ?
+                    (bytestream *)new bufferedstream(new fdstream(fd, 0)) :
+                    (bytestream *)new fdstream(fd, 0));
+            for (size_t i = 0; i < objs; i++) {
+                ObjectInfo info;
+                rs->readInfo(info);
+                uint32_t size = rs->readUInt32();
+                uint32_t off = rs->readUInt32();
+                if (info.payload_size != i || size != i || off != i * 2) {
+                    printf("Header %zu did not round-trip\n", i);
+                    return 1;
+                }
+            }
+        }
+        sw.stop();
+        bench_ioCalls(&r1, &w1);
+        bench_report(("parse" + kind).c_str(), objs, bytes,
+                     sw.getElapsedTime());
+        bench_reportCalls(("parse" + kind).c_str(), objs, r1 - r0, w1 - w0);
+
+        close(fd);
+    }
+
+    string path = bench_newRepo(scratch, "uds");
+    if (path == "")
+        return 1;
+
+    LocalRepo repo(path);
+    repo.open();
+    for (size_t i = 0; i < 256; i++)
+        repo.addBlob(ObjectInfo::Blob, bench_textPayload(1024));
+    repo.sync();
+
+    // The server thread outlives the benchmark, it exits with the process
+    UDSServer *server = new UDSServer(&repo);
+    server->start();
+
+    UDSClient client(path);
+    if (client.connect() < 0)
+        return 1;
+    UDSRepo remote(&client);
+
+    ObjectHash head = repo.getHead();
+    bench_ioCalls(&r0, &w0);
+    Stopwatch sw = Stopwatch();
+    sw.start();
+    for (size_t i = 0; i < requests; i++) {
+        if (remote.getHead() != head) {
+            printf("UDS server returned the wrong head\n");
+            return 1;
+        }
+    }
+    sw.stop();
+    bench_ioCalls(&r1, &w1);
+    bench_report("uds get head", requests, 0, sw.getElapsedTime());
+    bench_reportCalls("uds get head", requests, r1 - r0, w1 - w0);
+
+    bench_ioCalls(&r0, &w0);
+    sw = Stopwatch();
+    sw.start();
+    for (size_t i = 0; i < requests / 10; i++) {
+        if (remote.listObjects().size() != 256) {
+            printf("UDS server returned the wrong objects\n");
+            return 1;
+        }
+    }
+    sw.stop();
+    bench_ioCalls(&r1, &w1);
+    bench_report("uds list objs", requests / 10, 0, sw.getElapsedTime());
+    bench_reportCalls("uds list objs", requests / 10, r1 - r0, w1 - w0);
+
+    client.disconnect();
+
+    return 0;
+}
+
+/*
+ * Requests to an in-process UDS server over its local socket.  Reports the
+ * round-trip latency of synchronous requests with the version 1 protocol and
+ * with framed requests, the throughput with DEPTH requests in flight from one
+ * thread and with THREADS threads sharing the connection, and object reads
+ * with and without prefetching.
+ */
+static void
+bench_reportLatency(const char *what, vector<uint64_t> &us)
+{
+    uint64_t total = 0;
+
+    sort(us.begin(), us.end());
+    for (size_t i = 0; i < us.size(); i++)
+        total += us[i];
+
+    printf("%-20s %10zu reqs %10.1f us avg %10" PRIu64 " us p50 %8" PRIu64
+           " us p99\n", what, us.size(), (double)total / us.size(),
+           us[us.size() / 2], us[us.size() * 99 / 100]);
+}
+
+static int
+bench_uds(const string &scratch, int argc, char * const argv[])
+{
+    size_t requests = (argc > 0) ? atoi(argv[0]) : 20000;
+    size_t depth = (argc > 1) ? atoi(argv[1]) : 32;
+    int threads = (argc > 2) ? atoi(argv[2]) : 4;
+    size_t objs = 2048;
+    string path = bench_newRepo(scratch, "uds");
+    if (path == "")
+        return 1;
+
+    LocalRepo repo(path);
+    repo.open();
+
+    vector<ObjectHash> hashes;
+    for (size_t i = 0; i < objs; i++)
+        hashes.push_back(repo.addBlob(ObjectInfo::Blob,
+                                      bench_textPayload(4096)));
+    repo.sync();
+    ObjectHash head = repo.getHead();
+
+    // The server thread outlives the benchmark, it exits with the process
+    UDSServer *server = new UDSServer(&repo);
+    server->start();
+
+    // Synchronous requests with the version 1 protocol
+    {
+        struct sockaddr_un addr;
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, repo.getUDSPath().c_str());
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr,
+                              SUN_LEN(&addr)) < 0) {
+            perror("connect");
+            return 1;
+        }
+
+        bufferedstream in(new fdstream(fd, -1));
+        bufferedwstream out(new fdwstream(fd));
+        vector<uint64_t> us;
+
+        in.readUInt8();
+        for (size_t i = 0; i < requests; i++) {
+            ObjectHash hash;
+            Stopwatch sw = Stopwatch();
+
+            sw.start();
+            out.writePStr("get head");
+            out.flush();
+            if (in.readUInt8() != 0) {
+                printf("UDS request failed\n");
+                return 1;
+            }
+            in.readHash(hash);
+            sw.stop();
+            if (hash != head) {
+                printf("UDS server returned the wrong head\n");
+                return 1;
+            }
+            us.push_back(sw.getElapsedTime());
+        }
+        bench_reportLatency("v1 get head", us);
+        close(fd);
+    }
+
+    UDSClient client(path);
+    if (client.connect() < 0)
+        return 1;
+
+    // Synchronous framed requests
+    {
+        UDSRepo remote(&client);
+        vector<uint64_t> us;
+
+        for (size_t i = 0; i < requests; i++) {
+            Stopwatch sw = Stopwatch();
+
+            sw.start();
+            ObjectHash hash = remote.getHead();
+            sw.stop();
+            if (hash != head) {
+                printf("UDS server returned the wrong head\n");
+                return 1;
+            }
+            us.push_back(sw.getElapsedTime());
+        }
+        bench_reportLatency("v2 get head", us);
+    }
+
+    // Pipelined from one thread
+    for (size_t d = 1; d <= depth; d *= 4) {
+        deque<uint32_t> inflight;
+        Stopwatch sw = Stopwatch();
+
+        sw.start();
+        for (size_t i = 0; i < requests || inflight.size() > 0; i++) {
+            if (i < requests)
+                inflight.push_back(client.send("get head"));
+            if (inflight.size() < d && i < requests)
+                continue;
+
+            ObjectHash hash;
+            bytestream::ap bs(client.receive(inflight.front()));
+            inflight.pop_front();
+            if (!UDSClient::respIsOK(bs.get())) {
+                printf("UDS request failed\n");
+                return 1;
+            }
+            bs->readHash(hash);
+            if (hash != head) {
+                printf("UDS server returned the wrong head\n");
+                return 1;
+            }
+        }
+        sw.stop();
+
+        string what = "get head depth " + to_string(d);
+        bench_report(what.c_str(), requests, 0, sw.getElapsedTime());
+    }
+
+    // Threads sharing the connection
+    for (int t = 1; t <= threads; t *= 2) {
+        vector<thread> workers;
+        atomic<bool> failed(false);
+        Stopwatch sw = Stopwatch();
+
+        sw.start();
+        for (int i = 0; i < t; i++) {
+            workers.push_back(thread([&]() {
+                UDSRepo remote(&client);
+                for (size_t j = 0; j < requests / t; j++) {
+                    if (remote.getHead() != head)
+                        failed = true;
+                }
+            }));
+        }
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+        sw.stop();
+        if (failed) {
+            printf("UDS server returned the wrong head\n");
+            return 1;
+        }
+
+        string what = "get head threads " + to_string(t);
+        bench_report(what.c_str(), requests / t * t, 0, sw.getElapsedTime());
+    }
+
+    // Object reads, then the objects still cached read again
+    for (int prefetch = 0; prefetch < 2; prefetch++) {
+        UDSRepo remote(&client);
+        const size_t window = 32;
+
+        for (int pass = 0; pass < 2; pass++) {
+            size_t first = pass ? objs - UDSREPO_CACHEOBJS : 0;
+            uint64_t bytes = 0;
+            Stopwatch sw = Stopwatch();
+
+            sw.start();
+            for (size_t i = first; i < objs; i++) {
+                if (prefetch && !pass && i % window == 0) {
+                    ObjectHashVec next(hashes.begin() + i,
+                                       hashes.begin() + min(objs, i + 2 * window));
+                    remote.prefetchObjects(next);
+                }
+
+                Object::sp obj(remote.getObject(hashes[i]));
+                if (!obj.get()) {
+                    printf("UDS server did not return an object\n");
+                    return 1;
+                }
+                bytestream::ap bs(obj->getPayloadStream());
+                string payload = bs->readAll();
+                if (OriCrypt_HashString(payload) != hashes[i]) {
+                    printf("UDS server returned a bad object\n");
+                    return 1;
+                }
+                bytes += payload.size();
+            }
+            sw.stop();
+
+            string what = pass ? "getobj cached" :
+                          (prefetch ? "getobj prefetch" : "getobj");
+            bench_report(what.c_str(), objs - first, bytes,
+                         sw.getElapsedTime());
+        }
+    }
+
+    client.disconnect();
+
+    return 0;
+}
+
+/*
+ * Load on an in-process HTTP server with THREADS event loops from 1, 2, 4, ...
+ * CLIENTS concurrent clients: HEAD requests per second, full clones (index
+ * and every object) in MB/s, and the latency of HEAD requests issued while
+ * the other clients clone.
+ */
+static bool
+bench_httpClone(const string &url, size_t objs, uint64_t *bytes)
+{
+    HttpClient client(url);
+    if (client.connect() < 0)
+        return false;
+
+    HttpRepo remote(&client);
+    set<ObjectInfo> infos = remote.listObjects();
+    ObjectHashVec hashes;
+    for (set<ObjectInfo>::iterator it = infos.begin(); it != infos.end(); it++)
+        hashes.push_back(it->hash);
+
+    bytestream::ap bs(remote.getObjects(hashes));
+    string data = bs.get() ? bs->readAll() : "";
+    client.disconnect();
+
+    *bytes += data.size();
+    return infos.size() == objs && data.size() > 0;
+}
+
+static int
+bench_http(const string &scratch, int argc, char * const argv[])
+{
+    int maxClients = (argc > 0) ? atoi(argv[0]) : 8;
+    size_t requests = (argc > 1) ? atoi(argv[1]) : 2000;
+    size_t objs = (argc > 2) ? atoi(argv[2]) : 4096;
+    int threads = (argc > 3) ? atoi(argv[3]) : -1;
+    string path = bench_newRepo(scratch, "http");
+    if (path == "")
+        return 1;
+
+    LocalRepo repo(path);
+    repo.open();
+    for (size_t i = 0; i < objs; i++)
+        repo.addBlob(ObjectInfo::Blob, bench_textPayload(16384));
+    repo.sync();
+    objs = repo.numObjects();
+    ObjectHash head = repo.getHead();
+
+    HTTPServer server(repo, 0, threads);
+    thread serverThread([&server]() { server.start(false); });
+    string url = "http://127.0.0.1:" + to_string(server.getPort()) + "/";
+
+    for (int clients = 1; clients <= maxClients; clients *= 2) {
+        vector<thread> workers;
+        atomic<bool> failed(false);
+        Stopwatch sw = Stopwatch();
+
+        sw.start();
+        for (int c = 0; c < clients; c++) {
+            workers.push_back(thread([&]() {
+                HttpClient client(url);
+                if (client.connect() < 0) {
+                    failed = true;
+                    return;
+                }
+                HttpRepo remote(&client);
+                for (size_t i = 0; i < requests / clients; i++) {
+                    if (remote.getHead() != head)
+                        failed = true;
+                }
+                client.disconnect();
+            }));
+        }
+        for (size_t c = 0; c < workers.size(); c++)
+            workers[c].join();
+        sw.stop();
+        if (failed) {
+            printf("HTTP server returned the wrong head\n");
+            return 1;
+        }
+
+        string what = "HEAD clients " + to_string(clients);
+        bench_report(what.c_str(), requests / clients * clients, 0,
+                     sw.getElapsedTime());
+    }
+
+    for (int clients = 1; clients <= maxClients; clients *= 2) {
+        vector<thread> workers;
+        atomic<bool> failed(false);
+        atomic<uint64_t> bytes(0);
+        Stopwatch sw = Stopwatch();
+
+        sw.start();
+        for (int c = 0; c < clients; c++) {
+            workers.push_back(thread([&]() {
+                uint64_t b = 0;
+                if (!bench_httpClone(url, objs, &b))
+                    failed = true;
+                bytes += b;
+            }));
+        }
+        for (size_t c = 0; c < workers.size(); c++)
+            workers[c].join();
+        sw.stop();
+        if (failed) {
+            printf("HTTP clone failed\n");
+            return 1;
+        }
+
+        string what = "clone clients " + to_string(clients);
+        bench_report(what.c_str(), objs * clients, bytes,
+                     sw.getElapsedTime());
+    }
+
+    // HEAD latency while the other clients clone
+    {
+        vector<thread> workers;
+        atomic<bool> failed(false);
+        atomic<bool> done(false);
+        atomic<uint64_t> bytes(0);
+        vector<uint64_t> us;
+
+        for (int c = 1; c < maxClients; c++) {
+            workers.push_back(thread([&]() {
+                while (!done) {
+                    uint64_t b = 0;
+                    if (!bench_httpClone(url, objs, &b))
+                        failed = true;
+                    bytes += b;
+                }
+            }));
+        }
+
+        HttpClient client(url);
+        if (client.connect() < 0)
+            return 1;
+        HttpRepo remote(&client);
+        for (size_t i = 0; i < requests / 10; i++) {
+            Stopwatch sw = Stopwatch();
+
+            sw.start();
+            if (remote.getHead() != head)
+                failed = true;
+            sw.stop();
+            us.push_back(sw.getElapsedTime());
+        }
+        client.disconnect();
+
+        done = true;
+        for (size_t c = 0; c < workers.size(); c++)
+            workers[c].join();
+        if (failed) {
+            printf("HTTP request failed under load\n");
+            return 1;
+        }
+        bench_reportLatency("HEAD under clones", us);
+    }
+
+    server.stop();
+    serverThread.join();
+    repo.close();
+
+    return 0;
+}
+
+/*
+ * Threads walking a directory tree with readdir and an lstat of every entry,
+ * like find or ls -R.  Walks FILES files written to the scratch directory
+ * or, given the mount point of an orifs file system as MOUNT, the tree
+ * there.  Reports metadata operations per second for 1, 2, 4, ... THREADS
+ * threads making PASSES walks each.
+ */
+static bool
+bench_walk(const string &dir, uint64_t *ops)
+{
+    DIR *d = opendir(dir.c_str());
+    struct dirent *de;
+    vector<string> subdirs;
+
+    if (d == NULL)
+        return false;
+    (*ops)++;
+
+    while ((de = readdir(d)) != NULL) {
+        string name = de->d_name;
+        struct stat sb;
+
+        if (name == "." || name == ".." || name == ".snapshot")
+            continue;
+        if (lstat((dir + "/" + name).c_str(), &sb) < 0) {
+            closedir(d);
+            return false;
+        }
+        (*ops)++;
+        if (S_ISDIR(sb.st_mode))
+            subdirs.push_back(dir + "/" + name);
+    }
+    closedir(d);
+
+    for (size_t i = 0; i < subdirs.size(); i++) {
+        if (!bench_walk(subdirs[i], ops))
+            return false;
+    }
+
+    return true;
+}
+
+static int
+bench_metadata(const string &scratch, int argc, char * const argv[])
+{
+    int maxThreads = (argc > 0) ? atoi(argv[0]) : 8;
+    int passes = (argc > 1) ? atoi(argv[1]) : 4;
+    size_t files = (argc > 2) ? atoi(argv[2]) : 20000;
+    string root = (argc > 3) ? argv[3] : "";
+
+    if (root == "") {
+        root = scratch + "/tree";
+        OriFile_MkDir(root);
+        for (size_t i = 0; i < files; i++) {
+            string subdir = root + "/d" + to_string(i / 256);
+            if (i % 256 == 0)
+                OriFile_MkDir(subdir);
+            OriFile_WriteFile("", subdir + "/f" + to_string(i));
+        }
+    }
+
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        vector<thread> walkers;
+        atomic<uint64_t> ops(0);
+        atomic<bool> failed(false);
+
+        Stopwatch sw = Stopwatch();
+        sw.start();
+        for (int t = 0; t < threads; t++) {
+            walkers.push_back(thread([&]() {
+                uint64_t n = 0;
+                for (int i = 0; i < passes; i++) {
+                    if (!bench_walk(root, &n))
+                        failed = true;
+                }
+                ops += n;
+            }));
+        }
+        for (size_t t = 0; t < walkers.size(); t++)
+            walkers[t].join();
+        sw.stop();
+
+        if (failed) {
+            printf("Cannot walk %s\n", root.c_str());
+            return 1;
+        }
+
+        string what = "walkers " + to_string(threads);
+        bench_report(what.c_str(), ops, 0, sw.getElapsedTime());
+    }
+
+    return 0;
+}
+
+static Bench benches[] = {
+    {
+        "commit",
+        "Add and commit many small objects [OBJECTS] [SIZE]",
+        bench_commit,
+    },
+    {
+        "largefile",
+        "Add a large file [MEGABYTES]",
+        bench_largefile,
+    },
+    {
+        "lbread",
+        "Random reads from a large file [MEGABYTES] [READS] [READSIZE]",
+        bench_lbread,
+    },
+    {
+        "addtree",
+        "Commit a tree of small and medium files [FILES] [THREADS]",
+        bench_addtree,
+    },
+    {
+        "status",
+        "Status of a committed tree with and without a dirstate [FILES]",
+        bench_status,
+    },
+    {
+        "scan",
+        "Scan and hash a committed tree with 0 to THREADS threads [FILES] [THREADS]",
+        bench_scan,
+    },
+    {
+        "treediff",
+        "Diff commits changing one file of a large tree [DEPTH] [FANOUT] [FILES] [COMMITS]",
+        bench_treediff,
+    },
+    {
+        "codec",
+        "Compress and decompress repository objects with each codec [REPO]",
+        bench_codec,
+    },
+    {
+        "pull",
+        "Pull between local repositories [DEPTH] [FANOUT] [FILES] [LARGE] [LARGESIZE]",
+        bench_pull,
+    },
+    {
+        "readers",
+        "Concurrent object reads with and without a writer [THREADS] [OBJECTS] [SIZE] [READS]",
+        bench_readers,
+    },
+    {
+        "mdlog",
+        "Open a metadata log by replay and from its checkpoint [OBJECTS] [TXNS]",
+        bench_mdlog,
+    },
+    {
+        "syscalls",
+        "System calls of plain and buffered stream parsing and UDS requests [OBJECTS] [REQUESTS]",
+        bench_syscalls,
+    },
+    {
+        "uds",
+        "UDS request latency and pipelined throughput [REQUESTS] [DEPTH] [THREADS]",
+        bench_uds,
+    },
+    {
+        "http",
+        "HTTP server load from concurrent clients [CLIENTS] [REQUESTS] [OBJECTS] [THREADS]",
+        bench_http,
+    },
+    {
+        "metadata",
+        "Concurrent tree walks with readdir and lstat [THREADS] [PASSES] [FILES] [MOUNT]",
+        bench_metadata,
+    },
+    { NULL, NULL, NULL }
+};
+
+void
+usage_bench()
+{
+    cout << "oridbg bench BENCHMARK SCRATCHDIR [ARGS...]" << endl;
+    cout << endl;
+    cout << "Run a micro-benchmark in a new scratch directory." << endl;
+    cout << endl;
+    cout << "Benchmarks:" << endl;
+    for (int i = 0; benches[i].name != NULL; i++) {
+        printf("    %-14s %s\n", benches[i].name, benches[i].desc);
+    }
+}
+
+int
+cmd_bench(int argc, char * const argv[])
+{
+    if (argc < 3) {
+        usage_bench();
+        return 1;
+    }
+
+    string scratch = argv[2];
+    if (OriFile_Exists(scratch)) {
+        printf("Scratch directory %s already exists!\n", scratch.c_str());
+        return 1;
+    }
+    if (OriFile_MkDir(scratch) < 0) {
+        printf("Cannot create scratch directory %s\n", scratch.c_str());
+        return 1;
+    }
+    scratch = OriFile_RealPath(scratch);
+
+    for (int i = 0; benches[i].name != NULL; i++) {
+        if (strcmp(benches[i].name, argv[1]) == 0) {
+            srand(0);
+            return benches[i].bench(scratch, argc - 3, argv + 3);
+        }
+    }
+
+    printf("Unknown benchmark '%s'\n", argv[1]);
+    usage_bench();
+    return 1;
+}
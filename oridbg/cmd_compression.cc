@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <iostream>
+
+#include <oriutil/stream.h>
+#include <ori/localrepo.h>
+
+using namespace std;
+
+extern LocalRepo repository;
+
+/*
+ * Print or set the compression policy for new objects.
+ */
+int
+cmd_compression(int argc, char * const argv[])
+{
+    if (argc == 1) {
+        cout << ObjectInfo::getStrForAlgo(repository.getCompression()) << endl;
+        return 0;
+    }
+
+    if (argc != 2) {
+        cout << "usage: oridbg compression [none|fastlz|lzma|snappy]" << endl;
+        return 1;
+    }
+
+    ObjectInfo::ZipAlgo algo = ObjectInfo::getAlgoForStr(argv[1]);
+    if (!zipstream::hasAlgo(algo)) {
+        cout << "Compression '" << argv[1] << "' is not supported" << endl;
+        return 1;
+    }
+
+    repository.setCompression(algo);
+
+    return 0;
+}
@@ -33,8 +33,18 @@ cmd_verify(int argc, char * const argv[])
 {
     int status = 0;
     string error;
+    vector<packid_t> packfiles = repository.listPackfiles();
     set<ObjectInfo> objects = repository.listObjects();
 
+    for (auto &it : packfiles) {
+	error = repository.verifyPackfile(it);
+	if (error != "") {
+	    cout << "Packfile " << it << endl;
+	    cout << error << endl;
+	    status = 1;
+	}
+    }
+
     for (auto &it : objects) {
 	error = repository.verifyObject(it.hash);
 	if (error != "") {
@@ -61,6 +61,7 @@ typedef struct Cmd {
 // General Operations
 int cmd_addkey(int argc, char * const argv[]);
 int cmd_branches(int argc, char * const argv[]);
+int cmd_compression(int argc, char * const argv[]);
 int cmd_filelog(int argc, char * const argv[]);
 int cmd_findheads(int argc, char * const argv[]);
 int cmd_gc(int argc, char * const argv[]);
@@ -77,6 +78,8 @@ int cmd_tip(int argc, char * const argv[]);
 int cmd_verify(int argc, char * const argv[]);
 
 // Debug Operations
+int cmd_bench(int argc, char * const argv[]); // Debug
+void usage_bench(void);
 int cmd_catobj(int argc, char * const argv[]); // Debug
 int cmd_dumpindex(int argc, char * const argv[]); // Debug
 int cmd_dumpmeta(int argc, char * const argv[]); // Debug
@@ -116,6 +119,13 @@ static Cmd commands[] = {
         NULL,
         CMD_NEED_REPO,
     },
+    {
+        "compression",
+        "Print or set the compression for new objects",
+        cmd_compression,
+        NULL,
+        CMD_NEED_REPO,
+    },
     {
         "filelog",
         "Display a log of change to the specified file",
@@ -214,6 +224,13 @@ static Cmd commands[] = {
         NULL,
         CMD_NEED_REPO,
     },
+    {
+        "bench",
+        "Run a micro-benchmark in a scratch directory",
+        cmd_bench,
+        usage_bench,
+        0,
+    },
     {
         "catobj",
         "Print an object from the repository",
@@ -541,6 +558,12 @@ main(int argc, char *argv[])
 
 
     DLOG("Executing '%s'", argv[1]);
-    return commands[idx].cmd(argc-1, (char * const*)argv+1);
+    int status = commands[idx].cmd(argc-1, (char * const*)argv+1);
+
+    // Write out pending objects now, the index cannot be locked from static
+    // destructors
+    repository.close();
+
+    return status;
 }
 
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <list>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+#include <oriutil/debug.h>
+#include <oriutil/mutex.h>
+#include <oriutil/objecthash.h>
+#include <ori/largeblob.h>
+#include <ori/tree.h>
+
+#include "oricache.h"
+
+using namespace std;
+
+// Approximate per-entry bookkeeping overhead (map node, list node, hash)
+#define ORICACHE_ENTRY_OVERHEAD     128
+
+OriObjectCache::OriObjectCache(size_t maxBytes)
+    : lock(), lru(), entries(), maxBytes(maxBytes), curBytes(0),
+      hits(0), lbHits(0), treeHits(0), misses(0), evictions(0)
+{
+}
+
+OriObjectCache::~OriObjectCache()
+{
+}
+
+bool
+OriObjectCache::lookup(const ObjectHash &hash, Payload *payload, LBlob *lb)
+{
+    unordered_map<ObjectHash, Entry>::iterator it;
+
+    lock.lock();
+    it = entries.find(hash);
+    if (it == entries.end() || it->second.tree) {
+        misses++;
+        lock.unlock();
+        return false;
+    }
+
+    lru.splice(lru.end(), lru, it->second.lruPos);
+    if (it->second.payload) {
+        *payload = it->second.payload;
+        hits++;
+    } else {
+        *lb = it->second.lb;
+        lbHits++;
+    }
+    lock.unlock();
+
+    return true;
+}
+
+void
+OriObjectCache::putPayload(const ObjectHash &hash, Payload payload)
+{
+    Entry e;
+
+    if (payload->size() > ORIFS_CACHE_MAXOBJBYTES)
+        return;
+
+    e.payload = payload;
+    e.cost = payload->size() + ORICACHE_ENTRY_OVERHEAD;
+
+    insert(hash, e);
+}
+
+void
+OriObjectCache::putLargeBlob(const ObjectHash &hash, LBlob lb)
+{
+    Entry e;
+
+    e.lb = lb;
+    e.cost = sizeof(LargeBlob) + ORICACHE_ENTRY_OVERHEAD +
+             lb->parts.size() * (sizeof(LBlobEntry) + ORICACHE_ENTRY_OVERHEAD);
+
+    if (e.cost > ORIFS_CACHE_MAXOBJBYTES)
+        return;
+
+    insert(hash, e);
+}
+
+bool
+OriObjectCache::lookupTree(const ObjectHash &hash, TreeP *tree)
+{
+    unordered_map<ObjectHash, Entry>::iterator it;
+
+    lock.lock();
+    it = entries.find(hash);
+    if (it == entries.end() || !it->second.tree) {
+        misses++;
+        lock.unlock();
+        return false;
+    }
+
+    lru.splice(lru.end(), lru, it->second.lruPos);
+    *tree = it->second.tree;
+    treeHits++;
+    lock.unlock();
+
+    return true;
+}
+
+void
+OriObjectCache::putTree(const ObjectHash &hash, TreeP tree)
+{
+    Entry e;
+    map<string, TreeEntry>::const_iterator it;
+
+    e.tree = tree;
+    e.cost = sizeof(Tree) + ORICACHE_ENTRY_OVERHEAD;
+    // Each entry carries its name and a small attribute map
+    for (it = tree->tree.begin(); it != tree->tree.end(); it++)
+        e.cost += sizeof(TreeEntry) + it->first.size() +
+                  2 * ORICACHE_ENTRY_OVERHEAD;
+
+    if (e.cost > ORIFS_CACHE_MAXOBJBYTES)
+        return;
+
+    insert(hash, e);
+}
+
+void
+OriObjectCache::clear()
+{
+    lock.lock();
+    lru.clear();
+    entries.clear();
+    curBytes = 0;
+    lock.unlock();
+}
+
+OriObjectCache::Stats
+OriObjectCache::getStats()
+{
+    Stats s;
+
+    lock.lock();
+    s.hits = hits;
+    s.lbHits = lbHits;
+    s.treeHits = treeHits;
+    s.misses = misses;
+    s.evictions = evictions;
+    s.bytes = curBytes;
+    s.maxBytes = maxBytes;
+    s.entries = entries.size();
+    lock.unlock();
+
+    return s;
+}
+
+void
+OriObjectCache::insert(const ObjectHash &hash, const Entry &e)
+{
+    lock.lock();
+
+    // Another reader may have filled the entry while we were decoding
+    if (entries.find(hash) != entries.end()) {
+        lock.unlock();
+        return;
+    }
+
+    while (curBytes + e.cost > maxBytes && !lru.empty())
+        evict();
+
+    Entry &ent = entries[hash];
+    ent = e;
+    ent.lruPos = lru.insert(lru.end(), hash);
+    curBytes += e.cost;
+
+    lock.unlock();
+}
+
+/*
+ * Must be called with the lock held.
+ */
+void
+OriObjectCache::evict()
+{
+    unordered_map<ObjectHash, Entry>::iterator it;
+
+    ASSERT(!lru.empty());
+
+    it = entries.find(lru.front());
+    ASSERT(it != entries.end());
+
+    curBytes -= it->second.cost;
+    entries.erase(it);
+    lru.pop_front();
+    evictions++;
+}
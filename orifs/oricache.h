@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ORICACHE_H__
+#define __ORICACHE_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#include <oriutil/mutex.h>
+#include <oriutil/objecthash.h>
+#include <ori/largeblob.h>
+#include <ori/tree.h>
+
+// Upper bound on the decoded bytes held by the cache
+#define ORIFS_CACHE_MAXBYTES        (64 * 1024 * 1024)
+// Payloads larger than this are never cached
+#define ORIFS_CACHE_MAXOBJBYTES     (ORIFS_CACHE_MAXBYTES / 8)
+
+/*
+ * Cache of decoded objects used by the FUSE read path.  Objects are immutable
+ * and addressed by hash so entries never need to be invalidated, only
+ * evicted.  Blob payloads are stored decompressed, LargeBlobs and Trees are
+ * stored parsed, all are charged against a single byte budget and evicted in LRU
+ * order.  Values are handed out as shared pointers so readers copy out of
+ * them without holding the cache lock.
+ */
+class OriObjectCache
+{
+public:
+    typedef std::shared_ptr<const std::string> Payload;
+    typedef std::shared_ptr<const LargeBlob> LBlob;
+    typedef std::shared_ptr<const Tree> TreeP;
+    struct Stats {
+        uint64_t hits;
+        uint64_t lbHits;
+        uint64_t treeHits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t bytes;
+        uint64_t maxBytes;
+        uint64_t entries;
+    };
+    explicit OriObjectCache(size_t maxBytes = ORIFS_CACHE_MAXBYTES);
+    ~OriObjectCache();
+    /// Returns true and sets either payload or lb if hash is cached
+    bool lookup(const ObjectHash &hash, Payload *payload, LBlob *lb);
+    void putPayload(const ObjectHash &hash, Payload payload);
+    void putLargeBlob(const ObjectHash &hash, LBlob lb);
+    /// Returns true and sets tree if the tree hash is cached
+    bool lookupTree(const ObjectHash &hash, TreeP *tree);
+    void putTree(const ObjectHash &hash, TreeP tree);
+    void clear();
+    Stats getStats();
+private:
+    struct Entry {
+        Payload payload;
+        LBlob lb;
+        TreeP tree;
+        size_t cost;
+        std::list<ObjectHash>::iterator lruPos;
+    };
+    void insert(const ObjectHash &hash, const Entry &e);
+    void evict();
+    Mutex lock;
+    std::list<ObjectHash> lru;
+    std::unordered_map<ObjectHash, Entry> entries;
+    size_t maxBytes;
+    size_t curBytes;
+    uint64_t hits;
+    uint64_t lbHits;
+    uint64_t treeHits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+#endif /* __ORICACHE_H__ */
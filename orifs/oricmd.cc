@@ -90,6 +90,10 @@ OriCommand::process(const string &data)
         return cmd_version(str);
     if (cmd == "purgesnapshot")
 	return cmd_purgesnapshot(str);
+    if (cmd == "stats")
+        return cmd_stats(str);
+    if (cmd == "waitchange")
+        return cmd_waitchange(str);
 
     // Makes debugging easier when a bad request comes in
     return "UNSUPPORTED REQUEST";
@@ -132,9 +136,8 @@ OriCommand::cmd_snapshot(strstream &str)
         c.setSnapshot(name);
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    // Takes the locks itself, nsLock is held only briefly
     ObjectHash hash = priv->commit(c);
-    lock.reset();
     if (hash.isEmpty()) {
         resp.writeUInt8(0);
     } else {
@@ -158,7 +161,7 @@ OriCommand::cmd_snapshots(strstream &str)
 {
     FUSE_LOG("Command: snapshots");
 
-    map<string, ObjectHash> snapshots = priv->repo->listSnapshots();
+    map<string, ObjectHash> snapshots = priv->listSnapshots();
     map<string, ObjectHash>::iterator it;
     strwstream resp;
 
@@ -254,9 +257,10 @@ OriCommand::cmd_pull(strstream &str)
     if (success) {
         hash = srcRepo->getHead();
 
-        // XXX: Change to a repo lock
-        RWKey::sp lock = priv->nsLock.writeLock();
+        // Only adds objects, the namespace stays available
+        RWKey::sp lock = priv->ioLock.writeLock();
         priv->getRepo()->pull(srcRepo.get());
+        priv->refreshSnapshots();
         // XXX: Refcounts need to be done incrementally or rebuilt after
         lock.reset();
     } else {
@@ -300,9 +304,11 @@ OriCommand::cmd_checkout(strstream &str)
     str.readHash(hash);
     force = str.readUInt8();
 
+    RWKey::sp ioKey = priv->ioLock.writeLock();
     RWKey::sp lock = priv->nsLock.writeLock();
     error = priv->checkout(hash, force);
     lock.reset();
+    ioKey.reset();
 
     if (error != "") {
         resp.writeUInt8(0);
@@ -337,9 +343,11 @@ OriCommand::cmd_merge(strstream &str)
     // Parse Command
     str.readHash(hash);
 
+    RWKey::sp ioKey = priv->ioLock.writeLock();
     RWKey::sp lock = priv->nsLock.writeLock();
     error = priv->merge(hash);
     lock.reset();
+    ioKey.reset();
 
     if (error != "") {
         resp.writeUInt8(0);
@@ -540,6 +548,10 @@ OriCommand::cmd_purgesnapshot(strstream &str)
     strwstream resp;
     uint8_t timeBased;
 
+    // Purging must not run concurrently with anything else
+    RWKey::sp ioKey = priv->ioLock.writeLock();
+    RWKey::sp lock = priv->nsLock.writeLock();
+
     timeBased = str.readUInt8();
     if (timeBased) {
         int64_t time = str.readInt64();
@@ -562,8 +574,83 @@ OriCommand::cmd_purgesnapshot(strstream &str)
 	resp.writePStr("Error: Failed to purge object.");
 	return resp.str();
     }
+    priv->refreshSnapshots();
 
     resp.writeUInt8(0);
     return resp.str();
 }
 
+
+/*
+ * Returns internal counters as a list of name/value pairs.
+ */
+string
+OriCommand::cmd_stats(strstream &str)
+{
+    FUSE_PLOG("Command: stats");
+
+    OriObjectCache::Stats cs = priv->cache.getStats();
+    OriPriv::SnapshotStats ss = priv->getSnapshotStats();
+    strwstream resp;
+
+    resp.writeUInt32(16);
+    resp.writeLPStr("cache.hits");
+    resp.writeUInt64(cs.hits);
+    resp.writeLPStr("cache.lbhits");
+    resp.writeUInt64(cs.lbHits);
+    resp.writeLPStr("cache.treehits");
+    resp.writeUInt64(cs.treeHits);
+    resp.writeLPStr("cache.misses");
+    resp.writeUInt64(cs.misses);
+    resp.writeLPStr("cache.evictions");
+    resp.writeUInt64(cs.evictions);
+    resp.writeLPStr("cache.entries");
+    resp.writeUInt64(cs.entries);
+    resp.writeLPStr("cache.bytes");
+    resp.writeUInt64(cs.bytes);
+    resp.writeLPStr("cache.maxbytes");
+    resp.writeUInt64(cs.maxBytes);
+    resp.writeLPStr("snapshot.count");
+    resp.writeUInt64(ss.snapshots);
+    resp.writeLPStr("snapshot.copies");
+    resp.writeUInt64(ss.copies);
+    resp.writeLPStr("snapshot.totalus");
+    resp.writeUInt64(ss.totalUs);
+    resp.writeLPStr("snapshot.maxus");
+    resp.writeUInt64(ss.maxUs);
+    resp.writeLPStr("snapshot.freezeus");
+    resp.writeUInt64(ss.freezeUs);
+    resp.writeLPStr("snapshot.freezemaxus");
+    resp.writeUInt64(ss.freezeMaxUs);
+    resp.writeLPStr("snapshot.applyus");
+    resp.writeUInt64(ss.applyUs);
+    resp.writeLPStr("snapshot.applymaxus");
+    resp.writeUInt64(ss.applyMaxUs);
+
+    return resp.str();
+}
+
+/*
+ * Long poll used by orisync in place of periodic snapshots.  Blocks until the
+ * file system is modified or the head moves, bounded by the given timeout, and
+ * returns the current change generation and head.
+ */
+string
+OriCommand::cmd_waitchange(strstream &str)
+{
+    uint64_t gen, curGen;
+    uint32_t timeout;
+    ObjectHash knownHead, curHead;
+    strwstream resp;
+
+    gen = str.readUInt64();
+    str.readHash(knownHead);
+    timeout = str.readUInt32();
+
+    priv->waitChange(gen, knownHead, timeout, &curGen, &curHead);
+
+    resp.writeUInt64(curGen);
+    resp.writeHash(curHead);
+
+    return resp.str();
+}
@@ -38,6 +38,8 @@ private:
     std::string cmd_branch(strstream &str);
     std::string cmd_version(strstream &str);
     std::string cmd_purgesnapshot(strstream &str);
+    std::string cmd_stats(strstream &str);
+    std::string cmd_waitchange(strstream &str);
     OriPriv *priv;
 };
 
@@ -71,6 +71,21 @@ mount_ori_config config;
 RemoteRepo remoteRepo;
 OriPriv *priv;
 
+static string
+ori_parent(const char *path)
+{
+    string parentPath = OriFile_Dirname(path);
+
+    return (parentPath == "") ? "/" : parentPath;
+}
+
+// Path below ORI_SNAPSHOT_DIRPATH, as taken by the OriPriv snapshot calls
+static string
+ori_snapshot_path(const char *path)
+{
+    return string(path + strlen(ORI_SNAPSHOT_DIRPATH)).substr(1);
+}
+
 // Mount/Unmount
 
 static void *
@@ -133,8 +148,8 @@ ori_unlink(const char *path)
         if (info->isDir())
             return -EPERM;
 
-        // Remove temporary file
-        if (info->path != "")
+        // Remove temporary file, unless a snapshot still reads it
+        if (info->path != "" && !info->frozen)
             unlink(info->path.c_str());
 
         if (info->isReg() || info->isSymlink()) {
@@ -148,6 +163,7 @@ ori_unlink(const char *path)
     }
 
     priv->journal("unlink", path);
+    priv->notifyChange();
 
     return 0;
 }
@@ -156,8 +172,6 @@ static int
 ori_symlink(const char *target_path, const char *link_path)
 {
     OriPriv *priv = GetOriPriv();
-    OriDir *parentDir;
-    string parentPath;
 
 #ifdef FSCK_A_LOT
     priv->fsck();
@@ -165,10 +179,6 @@ ori_symlink(const char *target_path, const char *link_path)
 
     FUSE_LOG("FUSE ori_symlink(path=\"%s\")", link_path);
 
-    parentPath = OriFile_Dirname(link_path);
-    if (parentPath == "")
-        parentPath = "/";
-
     if (strcmp(link_path, ORI_CONTROL_FILEPATH) == 0) {
         return -EACCES;
     } else if (strncmp(link_path,
@@ -178,19 +188,19 @@ ori_symlink(const char *target_path, const char *link_path)
     }
 
     RWKey::sp lock = priv->nsLock.writeLock();
+    OriFileInfo *info;
     try {
-        parentDir = priv->getDir(parentPath);
-    } catch (SystemException e) {
+        info = priv->addSymlink(link_path);
+    } catch (SystemException &e) {
         return -e.getErrno();
     }
 
-    OriFileInfo *info = priv->addSymlink(link_path);
     info->statInfo.st_mode |= 0755;
     info->link = target_path;
     info->statInfo.st_size = info->path.length();
     info->type = FILETYPE_DIRTY;
 
-    parentDir->add(OriFile_Basename(link_path), info->id);
+    priv->notifyChange();
 
     return 0;
 }
@@ -207,10 +217,31 @@ ori_readlink(const char *path, char *buf, size_t size)
 
     FUSE_LOG("FUSE ori_readlink(path\"%s\", size=%ld)", path, size);
 
-    RWKey::sp lock = priv->nsLock.readLock();
+    if (strncmp(path,
+                ORI_SNAPSHOT_DIRPATH,
+                strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
+        TreeEntry entry;
+        struct stat sb;
+        string link;
+
+        try {
+            priv->getSnapshotAttr(ori_snapshot_path(path), &sb, &entry);
+            if (!S_ISLNK(sb.st_mode))
+                return -EINVAL;
+            link = priv->getRepo()->getPayload(entry.hash);
+        } catch (SystemException &e) {
+            return -e.getErrno();
+        }
+
+        memcpy(buf, link.c_str(), MIN(link.length() + 1, size));
+        return 0;
+    }
+
+    RWKey::sp lock;
     try {
+        lock = priv->readLockDir(ori_parent(path));
         info = priv->getFileInfo(path);
-    } catch (SystemException e) {
+    } catch (SystemException &e) {
         return -e.getErrno();
     }
 
@@ -265,11 +296,8 @@ ori_rename(const char *from_path, const char *to_path)
             return -EISDIR;
         }
 
-        // XXX: Need to support renaming directories (nlink, OriPriv::Rename)
-        if (info->isDir()) {
-            FUSE_LOG("ori_rename: Directory rename attempted %s to %s",
-                     from_path, to_path);
-            return -EINVAL;
+        if (toFile != NULL && !info->isDir() && toFile->isDir()) {
+            return -EISDIR;
         }
 
         priv->rename(from_path, to_path);
@@ -281,6 +309,7 @@ ori_rename(const char *from_path, const char *to_path)
     journalArg += ":";
     journalArg += to_path;
     priv->journal("rename", journalArg);
+    priv->notifyChange();
 
     return 0;
 }
@@ -291,8 +320,6 @@ static int
 ori_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
     OriPriv *priv = GetOriPriv();
-    string parentPath;
-    OriDir *parentDir;
 
 #ifdef FSCK_A_LOT
     priv->fsck();
@@ -300,10 +327,6 @@ ori_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 
     FUSE_LOG("FUSE ori_create(path=\"%s\")", path);
 
-    parentPath = OriFile_Dirname(path);
-    if (parentPath == "")
-        parentPath = "/";
-
     if (strncmp(path,
                 ORI_SNAPSHOT_DIRPATH,
                 strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
@@ -311,21 +334,20 @@ ori_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     }
 
     RWKey::sp lock = priv->nsLock.writeLock();
+    pair<OriFileInfo *, uint64_t> info;
     try {
-        parentDir = priv->getDir(parentPath);
-    } catch (SystemException e) {
+        info = priv->addFile(path);
+    } catch (SystemException &e) {
         return -e.getErrno();
     }
 
-    pair<OriFileInfo *, uint64_t> info = priv->addFile(path);
     info.first->statInfo.st_mode |= mode;
     info.first->type = FILETYPE_DIRTY;
 
-    parentDir->add(OriFile_Basename(path), info.first->id);
-
     string journalArg = path;
     journalArg += ":" + info.first->path;
     priv->journal("create", journalArg);
+    priv->notifyChange();
 
     // Set fh
     fi->fh = info.second;
@@ -355,7 +377,21 @@ ori_open(const char *path, struct fuse_file_info *fi)
     } else if (strncmp(path,
                        ORI_SNAPSHOT_DIRPATH,
                        strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
-        return writing ? -EPERM : 0;
+        TreeEntry entry;
+        struct stat sb;
+
+        if (writing)
+            return -EPERM;
+
+        try {
+            priv->getSnapshotAttr(ori_snapshot_path(path), &sb, &entry);
+        } catch (SystemException &e) {
+            return -e.getErrno();
+        }
+
+        RWKey::sp lock = priv->nsLock.writeLock();
+        fi->fh = priv->openSnapshotFile(entry, sb);
+        return 0;
     }
 
     parentPath = OriFile_Dirname(path);
@@ -372,6 +408,8 @@ ori_open(const char *path, struct fuse_file_info *fi)
 
     if (writing)
         parentDir->setDirty();
+    if (trunc)
+        priv->notifyChange();
 
     // Set fh
     fi->fh = info.second;
@@ -397,45 +435,9 @@ ori_read(const char *path, char *buf, size_t size, off_t offset,
             return -EIO;
         memcpy(buf, repoPath.data(), len);
         return len;
-    } else if (strncmp(path,
-                       ORI_SNAPSHOT_DIRPATH,
-                       strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
-        string snapshot = path;
-        string parentPath, fileName;
-        size_t pos = 0;
-        Commit c;
-        Tree t;
-        
-        snapshot = snapshot.substr(strlen(ORI_SNAPSHOT_DIRPATH) + 1);
-        pos = snapshot.find('/', pos);
-
-        ASSERT(pos != snapshot.npos);
-
-        parentPath = snapshot.substr(pos);
-        snapshot = snapshot.substr(0, pos);
-        fileName = OriFile_Basename(parentPath);
-        parentPath = OriFile_Dirname(parentPath);
-        if (parentPath == "")
-            parentPath = "/";
-
-        // XXX: Enforce that this is a valid snapshot & directory path
-        c = priv->lookupSnapshot(snapshot);
-        t = priv->getTree(c, parentPath);
-
-        // lookup tree
-        Tree::iterator it = t.find(fileName);
-        if (it == t.end())
-            return -ENOENT;
-
-        // Read
-        OriFileInfo *tempInfo = new OriFileInfo();
-        tempInfo->type = FILETYPE_COMMITTED;
-        tempInfo->hash = it->second.hash;
-        status = priv->readFile(tempInfo, buf, size, offset);
-        tempInfo->release();
-        return status;
     }
 
+    // Snapshot files are opened as committed files and read like them
     RWKey::sp lock = priv->nsLock.readLock();
     info = priv->getFileInfo(fi->fh);
 
@@ -444,13 +446,13 @@ ori_read(const char *path, char *buf, size_t size, off_t offset,
         return -EISDIR;
     }
 
-    if (info->fd != -1) {
+    if (info->fd != -1 && !info->cow) {
         // File in temporary directory
         status = pread(info->fd, buf, size, offset);
         if (status < 0)
             return -errno;
     } else {
-        // File in repository
+        // File in repository, copy-on-write files are partly in both
         return priv->readFile(info, buf, size, offset);
     }
 
@@ -484,17 +486,17 @@ ori_write(const char *path, const char *buf, size_t size, off_t offset,
         return -EISDIR;
     }
 
-    info->type = FILETYPE_DIRTY;
-    status = pwrite(info->fd, buf, size, offset);
-    if (status < 0)
-        return -errno;
-
-    // Update size
-    if (info->statInfo.st_size < (off_t)size + offset) {
-        info->statInfo.st_size = size + offset;
-        info->statInfo.st_blocks = (size + offset + (512-1))/512;
+    try {
+        priv->prepareWrite(info);
+    } catch (SystemException &e) {
+        return -e.getErrno();
     }
 
+    status = priv->writeFile(info, buf, size, offset);
+    if (status < 0)
+        return status;
+    priv->notifyChange();
+
     return status;
 }
 
@@ -519,13 +521,20 @@ ori_truncate(const char *path, off_t length)
     if (info->type == FILETYPE_DIRTY) {
         int status;
 
-        status = truncate(info->path.c_str(), length);
+        try {
+            priv->prepareWrite(info);
+        } catch (SystemException &e) {
+            return -e.getErrno();
+        }
+
+        status = priv->truncateFile(info, length);
         if (status < 0)
-            return -errno;
+            return status;
 
         // Update size
         info->statInfo.st_size = length;
         info->statInfo.st_blocks = (length + (512-1))/512;
+        priv->notifyChange();
 
         return status;
     } else {
@@ -557,13 +566,20 @@ ori_ftruncate(const char *path, off_t length, struct fuse_file_info *fi)
     if (info->type == FILETYPE_DIRTY) {
         int status;
 
-        status = ftruncate(info->fd, length);
+        try {
+            priv->prepareWrite(info);
+        } catch (SystemException &e) {
+            return -e.getErrno();
+        }
+
+        status = priv->truncateFile(info, length);
         if (status < 0)
-            return -errno;
+            return status;
 
         // Update size
         info->statInfo.st_size = length;
         info->statInfo.st_blocks = (length + (512-1))/512;
+        priv->notifyChange();
 
         return status;
     } else {
@@ -582,10 +598,6 @@ ori_release(const char *path, struct fuse_file_info *fi)
 
     if (strcmp(path, ORI_CONTROL_FILEPATH) == 0) {
         return 0;
-    } else if (strncmp(path,
-                       ORI_SNAPSHOT_DIRPATH,
-                       strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
-        return 0;
     }
 
     RWKey::sp lock = priv->nsLock.writeLock();
@@ -621,6 +633,7 @@ ori_mkdir(const char *path, mode_t mode)
     }
 
     priv->journal("mkdir", path);
+    priv->notifyChange();
 
     return 0;
 }
@@ -665,6 +678,7 @@ ori_rmdir(const char *path)
     }
 
     priv->journal("rmdir", path);
+    priv->notifyChange();
 
     return 0;
 }
@@ -676,10 +690,6 @@ ori_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     OriPriv *priv = GetOriPriv();
     OriDir *dir;
     OriDir::iterator it;
-    string dirPath = path;
-
-    if (dirPath != "/")
-        dirPath += "/";
 
 #ifdef FSCK_A_LOT
     priv->fsck();
@@ -704,52 +714,43 @@ ori_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     } else if (strncmp(path,
                        ORI_SNAPSHOT_DIRPATH,
                        strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
-        string snapshot = path;
-        string relPath;
-        size_t pos = 0;
-        Commit c;
-        Tree t;
-        
-        snapshot = snapshot.substr(strlen(ORI_SNAPSHOT_DIRPATH) + 1);
-        pos = snapshot.find('/', pos);
-
-        if (pos == snapshot.npos) {
-            relPath = "/";
-        } else {
-            relPath = snapshot.substr(pos);
-            snapshot = snapshot.substr(0, pos);
-        }
+        OriObjectCache::TreeP t;
+        map<string, TreeEntry>::const_iterator it;
 
-        // XXX: Enforce that this is a valid snapshot & directory path
-        c = priv->lookupSnapshot(snapshot);
-        t = priv->getTree(c, relPath);
+        try {
+            TreeEntry entry =
+                priv->lookupSnapshotPath(ori_snapshot_path(path));
+            if (entry.type != TreeEntry::Tree)
+                return -ENOTDIR;
+            t = priv->getSnapshotTree(entry.hash);
+        } catch (SystemException &e) {
+            return -e.getErrno();
+        }
 
-        for (map<string, TreeEntry>::iterator it = t.tree.begin();
-             it != t.tree.end();
-             it++) {
+        for (it = t->tree.begin(); it != t->tree.end(); it++) {
             filler(buf, (*it).first.c_str(), NULL, 0);
         }
 
         return 0;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock;
     try {
+        lock = priv->readLockDir(path);
         dir = priv->getDir(path);
-    } catch (SystemException e) {
+    } catch (SystemException &e) {
         return -e.getErrno();
     }
 
+    // The dentries already hold the entries, no need to resolve their paths
     for (it = dir->begin(); it != dir->end(); it++) {
-        OriFileInfo *info;
-        
-        try {
-            info = priv->getFileInfo(dirPath + (*it).first);
-            filler(buf, (*it).first.c_str(), &info->statInfo, 0);
-        } catch (SystemException e) {
-            FUSE_LOG("Unexpected %s", e.what());
-            filler(buf, (*it).first.c_str(), NULL, 0);
-        }
+        OriFileInfo *info = (*it).second;
+
+        if (info->type == FILETYPE_NULL)
+            continue;
+
+        struct stat sb = priv->getStat(info);
+        filler(buf, (*it).first.c_str(), &sb, 0);
     }
 
     return 0;
@@ -789,73 +790,24 @@ ori_getattr(const char *path, struct stat *stbuf)
     } else if (strncmp(path,
                        ORI_SNAPSHOT_DIRPATH,
                        strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
-        string snapshot = path;
-        string parentPath, fileName;
-        size_t pos = 0;
-        Commit c;
-        Tree t;
-        
-        snapshot = snapshot.substr(strlen(ORI_SNAPSHOT_DIRPATH) + 1);
-        pos = snapshot.find('/', pos);
-
-        if (pos == snapshot.npos) {
-            c = priv->lookupSnapshot(snapshot);
-            stbuf->st_uid = geteuid();
-            stbuf->st_gid = getegid();
-            stbuf->st_mode = 0755 | S_IFDIR;
-            stbuf->st_nlink = 2;
-            stbuf->st_size = 512;
-            stbuf->st_blksize = 4096;
-            stbuf->st_blocks = 1;
-            stbuf->st_ctime = c.getTime();
-            stbuf->st_mtime = c.getTime();
-            return 0;
-        }
-
-        parentPath = snapshot.substr(pos);
-        snapshot = snapshot.substr(0, pos);
-        fileName = OriFile_Basename(parentPath);
-        parentPath = OriFile_Dirname(parentPath);
-        if (parentPath == "")
-            parentPath = "/";
-
-        // XXX: Enforce that this is a valid snapshot & directory path
-        c = priv->lookupSnapshot(snapshot);
-        t = priv->getTree(c, parentPath);
-
-        // lookup tree
-        Tree::iterator it = t.find(fileName);
-        if (it == t.end())
-            return -ENOENT;
-
-        // Convert
-        AttrMap *attrs = &it->second.attrs;
-        struct passwd *pw = getpwnam(attrs->getAsStr(ATTR_USERNAME).c_str());
-
-        memset(stbuf, 0, sizeof(*stbuf));
-        if (it->second.type == TreeEntry::Tree) {
-            stbuf->st_mode = S_IFDIR;
-            stbuf->st_nlink = 2; // XXX: Correct this!
-        } else {
-            stbuf->st_mode = S_IFREG;
-            stbuf->st_nlink = 1;
+        try {
+            priv->getSnapshotAttr(ori_snapshot_path(path), stbuf);
+        } catch (SystemException &e) {
+            return -e.getErrno();
         }
-        stbuf->st_mode |= attrs->getAs<mode_t>(ATTR_PERMS);
-        stbuf->st_uid = pw->pw_uid;
-        stbuf->st_gid = pw->pw_gid;
-        stbuf->st_size = attrs->getAs<size_t>(ATTR_FILESIZE);
-        stbuf->st_blocks = (stbuf->st_size + 511) / 512;
-        stbuf->st_mtime = attrs->getAs<time_t>(ATTR_MTIME);
-        stbuf->st_ctime = attrs->getAs<time_t>(ATTR_CTIME);
 
         return 0;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock;
     try {
+        if (strcmp(path, "/") == 0)
+            lock = priv->nsLock.readLock();
+        else
+            lock = priv->readLockDir(ori_parent(path));
         OriFileInfo *info = priv->getFileInfo(path);
-        *stbuf = info->statInfo;
-    } catch (SystemException e) {
+        *stbuf = priv->getStat(info);
+    } catch (SystemException &e) {
         return -e.getErrno();
     }
 
@@ -894,6 +846,7 @@ ori_chmod(const char *path, mode_t mode)
     } catch (SystemException e) {
         return -e.getErrno();
     }
+    priv->notifyChange();
 
     return 0;
 }
@@ -931,6 +884,7 @@ ori_chown(const char *path, uid_t uid, gid_t gid)
     } catch (SystemException e) {
         return -e.getErrno();
     }
+    priv->notifyChange();
 
     return 0;
 }
@@ -968,6 +922,7 @@ ori_utimens(const char *path, const struct timespec tv[2])
     } catch (SystemException e) {
         return -e.getErrno();
     }
+    priv->notifyChange();
 
     return 0;
 }
@@ -18,9 +18,12 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <inttypes.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/param.h>
 #include <pwd.h>
 #include <grp.h>
 #include <errno.h>
@@ -30,8 +33,12 @@
 
 #include <string>
 #include <map>
+#include <set>
+#include <chrono>
 #include <algorithm>
 #include <memory>
+#include <mutex>
+#include <vector>
 #include <unordered_map>
 
 #include <oriutil/debug.h>
@@ -39,9 +46,11 @@
 #include <oriutil/scan.h>
 #include <oriutil/systemexception.h>
 #include <oriutil/rwlock.h>
+#include <oriutil/stopwatch.h>
 #include <oriutil/objecthash.h>
 #include <ori/commit.h>
 #include <ori/localrepo.h>
+#include <ori/largeblob.h>
 #include <ori/treediff.h>
 
 #include "logging.h"
@@ -55,17 +64,58 @@ using namespace std;
 // XXX: Hacky remove dependence
 extern mount_ori_config config;
 
+/*
+ * getpwnam may ask a network name service and it runs for every entry of
+ * every directory loaded and every getattr below .snapshot, so the answers
+ * are remembered for the life of the mount.  Unknown users map to the user
+ * running the file system.
+ */
+static mutex userLock;
+static unordered_map<string, pair<uid_t, gid_t> > userCache;
+
+static pair<uid_t, gid_t>
+OriPriv_LookupUser(const string &name)
+{
+    unordered_map<string, pair<uid_t, gid_t> >::iterator it;
+    pair<uid_t, gid_t> ids;
+    struct passwd pwd;
+    struct passwd *pw = NULL;
+    char buf[16384];
+
+    {
+        unique_lock<mutex> l(userLock);
+        it = userCache.find(name);
+        if (it != userCache.end())
+            return it->second;
+    }
+
+    if (getpwnam_r(name.c_str(), &pwd, buf, sizeof(buf), &pw) != 0 ||
+        pw == NULL) {
+        if (getpwuid_r(getuid(), &pwd, buf, sizeof(buf), &pw) != 0)
+            pw = NULL;
+        NOT_IMPLEMENTED(pw != NULL);
+    }
+    ids = make_pair(pw->pw_uid, pw->pw_gid);
+
+    unique_lock<mutex> l(userLock);
+    userCache[name] = ids;
+
+    return ids;
+}
+
 void
 OriFileInfo::loadAttr(const AttrMap &attrs)
 {
-    struct passwd *pw = getpwnam(attrs.getAsStr(ATTR_USERNAME).c_str());
+    loadAttr(attrs, &statInfo);
+}
 
-    if (pw == NULL) {
-      pw = getpwuid(getuid());
-      NOT_IMPLEMENTED(pw != NULL);
-    }
+void
+OriFileInfo::loadAttr(const AttrMap &attrs, struct stat *statInfo)
+{
+    pair<uid_t, gid_t> ids =
+        OriPriv_LookupUser(attrs.getAsStr(ATTR_USERNAME));
 
-    if (statInfo.st_mode != S_IFDIR) {
+    if (statInfo->st_mode != S_IFDIR) {
         bool isSymlink = false;
 
         if (attrs.has(ATTR_SYMLINK)) {
@@ -73,25 +123,31 @@ OriFileInfo::loadAttr(const AttrMap &attrs)
         }
     
         if (isSymlink) {
-            statInfo.st_mode = S_IFLNK;
-            statInfo.st_nlink = 1;
+            statInfo->st_mode = S_IFLNK;
+            statInfo->st_nlink = 1;
         } else {
-            statInfo.st_mode = S_IFREG;
-            statInfo.st_nlink = 1;
+            statInfo->st_mode = S_IFREG;
+            statInfo->st_nlink = 1;
         }
     }
 
-    statInfo.st_mode |= attrs.getAs<mode_t>(ATTR_PERMS);
-    statInfo.st_uid = pw->pw_uid;
-    statInfo.st_gid = pw->pw_gid;
-    statInfo.st_size = attrs.getAs<size_t>(ATTR_FILESIZE);
-    statInfo.st_blocks = (statInfo.st_size + 511) / 512;
-    statInfo.st_mtime = attrs.getAs<time_t>(ATTR_MTIME);
-    statInfo.st_ctime = attrs.getAs<time_t>(ATTR_CTIME);
+    statInfo->st_mode |= attrs.getAs<mode_t>(ATTR_PERMS);
+    statInfo->st_uid = ids.first;
+    statInfo->st_gid = ids.second;
+    statInfo->st_size = attrs.getAs<size_t>(ATTR_FILESIZE);
+    statInfo->st_blocks = (statInfo->st_size + 511) / 512;
+    statInfo->st_mtime = attrs.getAs<time_t>(ATTR_MTIME);
+    statInfo->st_ctime = attrs.getAs<time_t>(ATTR_CTIME);
 }
 
 void
 OriFileInfo::storeAttr(AttrMap *attrs) const
+{
+    storeAttr(statInfo, attrs);
+}
+
+void
+OriFileInfo::storeAttr(const struct stat &statInfo, AttrMap *attrs)
 {
     ASSERT(attrs != NULL);
 
@@ -108,7 +164,7 @@ OriFileInfo::storeAttr(AttrMap *attrs) const
     else
         attrs->setAsStr(ATTR_GROUPNAME, "nogroup");
 
-    if (isSymlink())
+    if ((statInfo.st_mode & S_IFLNK) == S_IFLNK)
         attrs->setAs<bool>(ATTR_SYMLINK, true);
     else
         attrs->setAs<bool>(ATTR_SYMLINK, false);
@@ -119,6 +175,81 @@ OriFileInfo::storeAttr(AttrMap *attrs) const
     attrs->setAs<time_t>(ATTR_CTIME, statInfo.st_ctime);
 }
 
+/*
+ * Records a written range, overlapping and adjacent ranges are merged.
+ */
+void
+OriCowState::add(uint64_t start, uint64_t end)
+{
+    map<uint64_t, uint64_t>::iterator it = ranges.upper_bound(start);
+
+    if (it != ranges.begin()) {
+        it--;
+        if (it->second < start)
+            it++;
+    }
+    while (it != ranges.end() && it->first <= end) {
+        start = MIN(start, it->first);
+        end = MAX(end, it->second);
+        it = ranges.erase(it);
+    }
+
+    ranges[start] = end;
+}
+
+void
+OriCowState::truncate(uint64_t size)
+{
+    if (baseSize > size)
+        baseSize = size;
+
+    ranges.erase(ranges.lower_bound(size), ranges.end());
+    if (!ranges.empty() && ranges.rbegin()->second > size)
+        ranges.rbegin()->second = size;
+}
+
+void
+OriCowState::extents(uint64_t off, uint64_t end, vector<Extent> *out) const
+{
+    while (off < end) {
+        map<uint64_t, uint64_t>::const_iterator next = ranges.upper_bound(off);
+        map<uint64_t, uint64_t>::const_iterator prev = next;
+        Extent e;
+        uint64_t stop;
+
+        if (prev != ranges.begin() && (--prev)->second > off) {
+            e.temp = true;
+            stop = prev->second;
+        } else {
+            stop = (next == ranges.end()) ? end : next->first;
+            e.temp = (off >= baseSize);
+            if (!e.temp)
+                stop = MIN(stop, baseSize);
+        }
+        stop = MIN(stop, end);
+
+        if (!out->empty() && out->back().temp == e.temp) {
+            out->back().len += stop - off;
+        } else {
+            e.off = off;
+            e.len = stop - off;
+            out->push_back(e);
+        }
+        off = stop;
+    }
+}
+
+map<uint64_t, uint64_t>
+OriCowState::changed(uint64_t size) const
+{
+    OriCowState c = *this;
+
+    if (c.baseSize < size)
+        c.add(c.baseSize, size);
+
+    return c.ranges;
+}
+
 OriPriv::OriPriv(const std::string &repoPath,
                  const string &origin,
                  Repo *remoteRepo)
@@ -126,6 +257,10 @@ OriPriv::OriPriv(const std::string &repoPath,
     repo = new LocalRepo(repoPath);
     nextId = ORIPRIVID_INVALID + 1;
     nextFH = 1;
+    changeGen = 0;
+    changeWaiters = 0;
+    changeExit = false;
+    memset(&snapStats, 0, sizeof(snapStats));
 
     try {
         repo->open();
@@ -156,6 +291,7 @@ OriPriv::OriPriv(const std::string &repoPath,
     RWLock::setLockOrder(order);
 
     reset();
+    refreshSnapshots();
 
     // Create root directory info
     OriFileInfo *dirInfo = new OriFileInfo();
@@ -181,7 +317,7 @@ OriPriv::OriPriv(const std::string &repoPath,
         dirInfo->type = FILETYPE_COMMITTED;
     }
 
-    paths["/"] = dirInfo;
+    rootInfo = dirInfo;
 }
 
 OriPriv::~OriPriv()
@@ -195,6 +331,7 @@ OriPriv::reset()
     if (!head.isEmpty()) {
         headCommit = repo->getCommit(head);
     }
+    headChanged();
 
     // Create temporary directory
     tmpDir = repo->getRootPath() + ORI_PATH_TMP + "fuse";
@@ -249,6 +386,13 @@ OriPriv::cleanup()
     // after a commit.
     DirIterate(tmpDir, this, cleanupHelper);
 
+    // Release waiters so their UDS sessions can exit
+    {
+        unique_lock<mutex> l(changeLock);
+        changeExit = true;
+        changeCV.notify_all();
+    }
+
     UDSServerStop();
 }
 
@@ -292,34 +436,56 @@ OriPriv::generateId()
     return id;
 }
 
+/*
+ * Resolves path one component at a time from the root.  With load set
+ * directories on the way are loaded from the repository, otherwise NULL is
+ * returned when one is not loaded yet.  Throws ENOENT or ENOTDIR.
+ */
 OriFileInfo *
-OriPriv::getFileInfo(const string &path)
+OriPriv::resolve(const string &path, bool load)
 {
-    map<string, OriFileInfo*>::iterator it;
+    OriFileInfo *info = rootInfo;
+    size_t start = 0;
 
-    // Must call getDir to make sure it is loaded
-    if (path != "/") {
-        string parentPath = OriFile_Dirname(path);
-        if (parentPath == "")
-            parentPath = "/";
+    while (start < path.size()) {
+        size_t end = path.find('/', start);
+        if (end == path.npos)
+            end = path.size();
 
-        getDir(parentPath);
-    }
-
-    // Check pending directories
-    it = paths.find(path);
-    if (it != paths.end()) {
-        OriFileInfo *info = (*it).second;
+        if (end > start) {
+            OriDir *dir;
 
-        if (info->type == FILETYPE_NULL)
-            throw SystemException(ENOENT);
+            if (!info->isDir())
+                throw SystemException(ENOTDIR);
+            if (load) {
+                dir = loadDir(info);
+            } else {
+                unordered_map<OriPrivId, OriDir*>::iterator it;
+                it = dirs.find(info->id);
+                if (it == dirs.end())
+                    return NULL;
+                dir = it->second;
+            }
 
-        return info;
+            info = dir->lookup(path.substr(start, end - start));
+            if (info == NULL || info->type == FILETYPE_NULL)
+                throw SystemException(ENOENT);
+        }
+        start = end + 1;
     }
 
-    // Check repository
+    return info;
+}
+
+OriFileInfo *
+OriPriv::getFileInfo(const string &path)
+{
+    OriFileInfo *info = resolve(path, true);
+
+    if (info->type == FILETYPE_NULL)
+        throw SystemException(ENOENT);
 
-    throw SystemException(ENOENT);
+    return info;
 }
 
 OriFileInfo *
@@ -383,12 +549,13 @@ OriPriv::createInfo()
 OriFileInfo *
 OriPriv::addSymlink(const string &path)
 {
+    OriDir *parentDir = getDir(OriFile_Dirname(path));
     OriFileInfo *info = createInfo();
 
     info->statInfo.st_mode = S_IFLNK;
     // XXX: Adjust size properly
 
-    paths[path] = info;
+    parentDir->add(OriFile_Basename(path), info);
 
     return info;
 }
@@ -396,8 +563,10 @@ OriPriv::addSymlink(const string &path)
 pair<OriFileInfo *, uint64_t>
 OriPriv::addFile(const string &path)
 {
-    OriFileInfo *info = createInfo();
+    OriDir *parentDir = getDir(OriFile_Dirname(path));
+    string name = OriFile_Basename(path);
     pair<string, int> file = getTemp();
+    OriFileInfo *info = createInfo();
     uint64_t handle = generateFH();
 
     info->statInfo.st_mode = S_IFREG;
@@ -407,13 +576,13 @@ OriPriv::addFile(const string &path)
     info->fd = file.second;
 
     // Delete any old temporary files
-    map<string, OriFileInfo*>::iterator it = paths.find(path);
-    if (it != paths.end()) {
-        ASSERT(!it->second->isDir());
-        it->second->release();
+    OriFileInfo *old = parentDir->lookup(name);
+    if (old != NULL) {
+        ASSERT(!old->isDir());
+        old->release();
     }
 
-    paths[path] = info;
+    parentDir->add(name, info);
     handles[handle] = info;
 
     info->retain();
@@ -467,6 +636,36 @@ OriPriv::openFile(const string &path, bool writing, bool trunc)
             info->type = FILETYPE_DIRTY;
             info->path = temp.first;
             info->fd = temp.second;
+            info->cow.reset();
+        } else if (writing && info->cow && info->path != "") {
+            // Committed since the last write, the temporary file still works
+            if (info->fd == -1) {
+                int status = open(info->path.c_str(), O_RDWR);
+                if (status < 0) {
+                    ASSERT(false); // XXX: Need to release the handle
+                    throw SystemException(errno);
+                }
+                info->fd = status;
+            }
+
+            info->type = FILETYPE_DIRTY;
+        } else if (writing && !info->largeHash.isEmpty()) {
+            // Copy lazily, see OriCowState
+            pair<string, int> temp = getTemp();
+
+            if (ftruncate(temp.second, info->statInfo.st_size) < 0) {
+                int status = errno;
+                close(temp.second);
+                OriFile_Delete(temp.first);
+                ASSERT(false); // XXX: Need to release the handle
+                throw SystemException(status);
+            }
+
+            info->cow.reset(new OriCowState(info->hash,
+                                            info->statInfo.st_size));
+            info->type = FILETYPE_DIRTY;
+            info->path = temp.first;
+            info->fd = temp.second;
         } else if (writing) {
             // Copy file
             int status;
@@ -487,6 +686,7 @@ OriPriv::openFile(const string &path, bool writing, bool trunc)
             info->type = FILETYPE_DIRTY;
             info->path = temp.first;
             info->fd = status;
+            info->cow.reset();
         } else {
             ASSERT(false);
         }
@@ -501,129 +701,259 @@ OriPriv::openFile(const string &path, bool writing, bool trunc)
 size_t
 OriPriv::readFile(OriFileInfo *info, char *buf, size_t size, off_t offset)
 {
+    if (info->cow) {
+        vector<OriCowState::Extent> extents;
+        ObjectHash base;
+        string path;
+        int fd;
+
+        uint64_t fileSize = getStat(info).st_size;
+
+        {
+            unique_lock<mutex> l(cowLock);
+
+            if ((uint64_t)offset >= fileSize)
+                return 0;
+            info->cow->extents(offset, MIN(offset + size, fileSize), &extents);
+            base = info->cow->base;
+            path = info->path;
+            fd = info->fd;
+        }
+
+        return readExtents(base, path, fd, extents, buf);
+    }
+
     ASSERT(!info->hash.isEmpty());
 
-    ObjectType type = repo->getObjectType(info->hash);
-    if (type == ObjectInfo::Blob) {
-        string payload = repo->getPayload(info->hash);
-        // XXX: Cache
+    return readObject(info->hash, buf, size, offset);
+}
+
+/*
+ * Writes to the temporary file of an open file, records the range for
+ * copy-on-write files and grows the file.  Called with nsLock held for
+ * reading.
+ */
+ssize_t
+OriPriv::writeFile(OriFileInfo *info, const char *buf, size_t size,
+                   off_t offset)
+{
+    ssize_t status = pwrite(info->fd, buf, size, offset);
+
+    if (status < 0)
+        return -errno;
+
+    if (info->cow && status > 0) {
+        unique_lock<mutex> l(cowLock);
+        info->cow->add(offset, offset + status);
+    }
+
+    unique_lock<mutex> l(statLock);
+    info->type = FILETYPE_DIRTY;
+    if (info->statInfo.st_size < offset + status) {
+        info->statInfo.st_size = offset + status;
+        info->statInfo.st_blocks = (offset + status + (512-1))/512;
+    }
+
+    return status;
+}
+
+/*
+ * Returns a consistent copy of the attributes of a file, which writeFile
+ * may be changing under the reader nsLock.
+ */
+struct stat
+OriPriv::getStat(OriFileInfo *info)
+{
+    unique_lock<mutex> l(statLock);
+
+    return info->statInfo;
+}
+
+/*
+ * Called with nsLock held for writing.
+ */
+int
+OriPriv::truncateFile(OriFileInfo *info, off_t length)
+{
+    int status;
+
+    if (info->fd != -1)
+        status = ftruncate(info->fd, length);
+    else
+        status = ::truncate(info->path.c_str(), length);
+    if (status < 0)
+        return -errno;
+
+    if (info->cow) {
+        unique_lock<mutex> l(cowLock);
+        info->cow->truncate(length);
+    }
+
+    return 0;
+}
+
+/*
+ * Reads a committed Blob or LargeBlob through the object cache.
+ */
+ssize_t
+OriPriv::readObject(const ObjectHash &hash, char *buf, size_t size,
+                    off_t offset)
+{
+    OriObjectCache::Payload payload;
+    OriObjectCache::LBlob lb;
+
+    if (!cache.lookup(hash, &payload, &lb)) {
+        ObjectType type = repo->getObjectType(hash);
+        if (type == ObjectInfo::Blob) {
+            payload.reset(new string(repo->getPayload(hash)));
+            cache.putPayload(hash, payload);
+        } else if (type == ObjectInfo::LargeBlob) {
+            LargeBlob *newLb = new LargeBlob(repo);
+            lb.reset(newLb);
+            newLb->fromBlob(repo->getPayload(hash));
+            cache.putLargeBlob(hash, lb);
+        }
+    }
 
-        size_t left = payload.size() - offset;
-        if (left > payload.size())
+    if (payload) {
+        size_t left = payload->size() - offset;
+        if (left > payload->size())
             left = 0;
         size_t real_read = min(size, left);
 
-        memcpy(buf, payload.data() + offset, real_read);
+        memcpy(buf, payload->data() + offset, real_read);
 
         return real_read;
-    } else if (type == ObjectInfo::LargeBlob) {
-        LargeBlob lb = LargeBlob(repo);
-        lb.fromBlob(repo->getPayload(info->hash));
-        // XXX: Cache
-
-        ssize_t total = 0;
-        while (total < size) {
-            ssize_t res = lb.read((uint8_t*)(buf + total),
-                                 size - total,
-                                 offset + total);
-            if (res == 0)
-                return total;
-            else if (res < 0)
-                return res;
-            total += res;
+    } else if (lb) {
+        return lb->read((uint8_t*)buf, size, offset);
+    }
+
+    return -EIO;
+}
+
+/*
+ * Reads the extents of a copy-on-write file into buf, opening the temporary
+ * file if fd is -1.
+ */
+ssize_t
+OriPriv::readExtents(const ObjectHash &base, const string &path, int fd,
+                     const vector<OriCowState::Extent> &extents, char *buf)
+{
+    size_t total = 0;
+    int tempFd = -1;
+
+    for (size_t i = 0; i < extents.size(); i++) {
+        const OriCowState::Extent &e = extents[i];
+        ssize_t status;
+
+        if (e.temp) {
+            if (fd == -1) {
+                tempFd = open(path.c_str(), O_RDONLY);
+                if (tempFd < 0)
+                    return total > 0 ? total : -errno;
+                fd = tempFd;
+            }
+            status = pread(fd, buf + total, e.len, e.off);
+            if (status < 0)
+                status = -errno;
+        } else {
+            status = readObject(base, buf + total, e.len, e.off);
         }
 
-        return total;
+        if (status < 0) {
+            if (tempFd != -1)
+                close(tempFd);
+            return total > 0 ? total : status;
+        }
+        total += status;
+        if ((uint64_t)status < e.len)
+            break;
     }
 
-    return -EIO;
+    if (tempFd != -1)
+        close(tempFd);
+
+    return total;
 }
 
 void
 OriPriv::unlink(const string &path)
 {
+    OriDir *parentDir = getDir(OriFile_Dirname(path));
     OriFileInfo *info = getFileInfo(path);
-    string parentPath;
-    OriDir *parentDir;
-
-    parentPath = OriFile_Dirname(path);
-    if (parentPath == "")
-        parentPath = "/";
-
-    parentDir = getDir(parentPath);
 
     ASSERT(info->isSymlink() || info->isReg());
 
     parentDir->remove(OriFile_Basename(path));
-    paths.erase(path);
 
     // Drop refcount only delete if zero (including temp file)
     info->release();
 }
 
+/*
+ * Moves the entry at fromPath to toPath, replacing a file or an empty
+ * directory there.  Directories are moved with their loaded contents since
+ * entries are found through their parent rather than by path.
+ */
 void
 OriPriv::rename(const string &fromPath, const string &toPath)
 {
-    string fromParent, toParent;
-    OriDir *fromDir;
-    OriDir *toDir;
+    OriFileInfo *fromParent = getFileInfo(OriFile_Dirname(fromPath));
+    OriFileInfo *toParent = getFileInfo(OriFile_Dirname(toPath));
+    OriDir *fromDir = getDir(OriFile_Dirname(fromPath));
+    OriDir *toDir = getDir(OriFile_Dirname(toPath));
+    string from = OriFile_Basename(fromPath);
+    string to = OriFile_Basename(toPath);
     OriFileInfo *info = getFileInfo(fromPath);
-    OriFileInfo *toFile = NULL;
+    OriFileInfo *toFile = toDir->lookup(to);
 
-    fromParent = OriFile_Dirname(fromPath);
-    if (fromParent == "")
-        fromParent = "/";
-    toParent = OriFile_Dirname(toPath);
-    if (toParent == "")
-        toParent = "/";
+    if (toFile == info)
+        return;
 
-    fromDir = getDir(fromParent);
-    toDir = getDir(toParent);
+    // Delete previously present file or empty directory
+    if (toFile != NULL && toFile->isDir()) {
+        unordered_map<OriPrivId, OriDir*>::iterator dit;
 
-    try {
-        toFile = getFileInfo(toPath);
-    } catch (SystemException &e) {
-        // Fall through
+        dit = dirs.find(toFile->id);
+        if (dit != dirs.end()) {
+            ASSERT(dit->second->isEmpty());
+            delete dit->second;
+            dirs.erase(dit);
+        }
+        toParent->statInfo.st_nlink--;
     }
-
-    // XXX: Need to rename all files under a directory
-    if (info->isDir()) {
-        // XXX: Handle refcount movement then we can rename empty directories
-        NOT_IMPLEMENTED(!info->dirLoaded);
+    if (toFile != NULL) {
+        toDir->remove(to);
+        toFile->release();
     }
 
+    /*
+     * A snapshot taken before the rename saw the entry under its old name, so
+     * it must not mark it committed under the new one (see applySnapshot).
+     */
     info->type = FILETYPE_DIRTY;
-    paths.erase(fromPath);
-    paths[toPath] = info;
-
-    string from = OriFile_Basename(fromPath);
-    string to = OriFile_Basename(toPath);
-
+    info->statInfo.st_ctime = time(NULL);
+    info->gen++;
     fromDir->remove(from);
-    toDir->add(to, info->id);
+    toDir->add(to, info);
 
-    // Delete previously present file
-    if (toFile != NULL) {
-        toFile->release();
+    if (info->isDir()) {
+        fromParent->statInfo.st_nlink--;
+        toParent->statInfo.st_nlink++;
+        fromParent->type = FILETYPE_DIRTY;
+        toParent->type = FILETYPE_DIRTY;
     }
-
-    ASSERT(paths.find(fromPath) == paths.end());
-    ASSERT(paths.find(toPath) != paths.end());
 }
 
 OriFileInfo *
 OriPriv::addDir(const string &path)
 {
     OriFileInfo *info;
-    string parentPath;
+    string parentPath = OriFile_Dirname(path);
     OriDir *parentDir;
     OriFileInfo *parentInfo;
     time_t now = time(NULL);
 
-    parentPath = OriFile_Dirname(path);
-    if (parentPath == "")
-        parentPath = "/";
-
     /*
      * getDir must be called first to load the parent directory's structure 
      * into the local cache.  The following two lines may throw a 
@@ -653,9 +983,8 @@ OriPriv::addDir(const string &path)
     info->dirLoaded = true;
 
     dirs[info->id] = new OriDir();
-    paths[path] = info;
 
-    parentDir->add(OriFile_Basename(path), info->id);
+    parentDir->add(OriFile_Basename(path), info);
     parentInfo->statInfo.st_nlink++;
 
     return info;
@@ -666,14 +995,10 @@ OriPriv::rmDir(const string &path)
 {
     OriDir *dir = getDir(path);
     OriFileInfo *info = getFileInfo(path);
-    string parentPath;
+    string parentPath = OriFile_Dirname(path);
     OriDir *parentDir;
     OriFileInfo *parentInfo;
 
-    parentPath = OriFile_Dirname(path);
-    if (parentPath == "")
-        parentPath = "/";
-
     parentDir = getDir(parentPath);
     parentInfo = getFileInfo(parentPath);
 
@@ -683,7 +1008,7 @@ OriPriv::rmDir(const string &path)
      * will prevent non-empty directories from being deleted, other uses inside 
      * OriPriv need this functionality to be complete.
      */
-    ASSERT(dirs[info->id]->isEmpty() || !info->dirLoaded);
+    ASSERT(dir->isEmpty() || !info->dirLoaded);
 
     parentDir->remove(OriFile_Basename(path));
     parentInfo->statInfo.st_nlink--;
@@ -692,7 +1017,6 @@ OriPriv::rmDir(const string &path)
     ASSERT(parentInfo->statInfo.st_nlink >= 2);
 
     dirs.erase(info->id);
-    paths.erase(path);
 
     delete dir;
     info->release();
@@ -701,72 +1025,119 @@ OriPriv::rmDir(const string &path)
 OriDir*
 OriPriv::getDir(const string &path)
 {
-    // Check pending directories
-    map<string, OriFileInfo*>::iterator it;
+    OriFileInfo *info = getFileInfo(path);
 
-    it = paths.find(path);
-    if (it != paths.end()) {
-        map<OriPrivId, OriDir*>::iterator dit;
-        if (!(*it).second->isDir())
-            throw SystemException(ENOTDIR);
-        if ((*it).second->type == FILETYPE_NULL)
-            throw SystemException(ENOENT);
-        dit = dirs.find((*it).second->id);
-        if (dit == dirs.end())
-            goto loadDir;
+    if (!info->isDir())
+        throw SystemException(ENOTDIR);
 
-        return dit->second;
-    }
+    return loadDir(info);
+}
 
-loadDir:
-    // Check repository
-    ObjectHash hash = repo->lookup(headCommit, path);
-    if (!hash.isEmpty()) {
-        Tree t = repo->getTree(hash);
-        Tree::iterator it;
-        OriFileInfo *dirInfo;
-        OriDir *dir = new OriDir();
+/*
+ * Returns the directory of dirInfo, loading its entries from the tree it was
+ * committed as on first use.  The root is loaded from the head commit.
+ */
+OriDir *
+OriPriv::loadDir(OriFileInfo *dirInfo)
+{
+    unordered_map<OriPrivId, OriDir*>::iterator dit = dirs.find(dirInfo->id);
 
-        dirInfo = getFileInfo(path);
+    if (dit != dirs.end())
+        return dit->second;
 
-        for (it = t.begin(); it != t.end(); it++) {
-            OriFileInfo *info = new OriFileInfo();
-            AttrMap *attrs = &it->second.attrs;
-            bool isSymlink = false;
+    ObjectHash hash = (dirInfo == rootInfo) ? headCommit.getTree()
+                                            : dirInfo->hash;
+    if (hash.isEmpty())
+        throw SystemException(ENOENT);
 
-            if (it->second.type == TreeEntry::Tree) {
-                info->statInfo.st_mode = S_IFDIR;
-                info->statInfo.st_nlink = 2;
-                // XXX: This is hacky but a directory gets the correct nlink 
-                // value once it is opened for the first time.
-                dirInfo->statInfo.st_nlink++;
-            }
-            if (attrs->has(ATTR_SYMLINK)) {
-                isSymlink = attrs->getAs<bool>(ATTR_SYMLINK);
-            }
-            info->loadAttr(*attrs);
-            info->type = FILETYPE_COMMITTED;
-            info->id = generateId();
-            info->hash = it->second.hash;
-            info->largeHash = it->second.largeHash;
-            if (isSymlink) {
-                ASSERT(info->largeHash.isEmpty());
-                info->link = repo->getPayload(info->hash);
-            }
+    Tree t = repo->getTree(hash);
+    Tree::iterator it;
+    OriDir *dir = new OriDir();
 
-            dir->add(it->first, info->id);
-            if (path == "/")
-                paths["/" + it->first] = info;
-            else
-                paths[path + "/" + it->first] = info;
+    for (it = t.begin(); it != t.end(); it++) {
+        OriFileInfo *info = new OriFileInfo();
+        AttrMap *attrs = &it->second.attrs;
+        bool isSymlink = false;
+
+        if (it->second.type == TreeEntry::Tree) {
+            info->statInfo.st_mode = S_IFDIR;
+            info->statInfo.st_nlink = 2;
+            // XXX: This is hacky but a directory gets the correct nlink 
+            // value once it is opened for the first time.
+            dirInfo->statInfo.st_nlink++;
+        }
+        if (attrs->has(ATTR_SYMLINK)) {
+            isSymlink = attrs->getAs<bool>(ATTR_SYMLINK);
+        }
+        info->loadAttr(*attrs);
+        info->type = FILETYPE_COMMITTED;
+        info->id = generateId();
+        info->hash = it->second.hash;
+        info->largeHash = it->second.largeHash;
+        if (isSymlink) {
+            ASSERT(info->largeHash.isEmpty());
+            info->link = repo->getPayload(info->hash);
         }
 
-        dirInfo->dirLoaded = true;
-        dirs[dirInfo->id] = dir;
-        return dir;
+        dir->add(it->first, info);
     }
 
-    throw SystemException(ENOENT);
+    dirInfo->dirLoaded = true;
+    dirs[dirInfo->id] = dir;
+    return dir;
+}
+
+/*
+ * Releases everything below dirInfo and forgets its loaded contents.
+ */
+void
+OriPriv::unloadDir(OriFileInfo *dirInfo)
+{
+    unordered_map<OriPrivId, OriDir*>::iterator dit = dirs.find(dirInfo->id);
+
+    if (dit == dirs.end())
+        return;
+
+    OriDir *dir = dit->second;
+    dirs.erase(dit);
+    for (OriDir::iterator it = dir->begin(); it != dir->end(); it++) {
+        if (it->second->isDir())
+            unloadDir(it->second);
+        it->second->release();
+    }
+    delete dir;
+    dirInfo->dirLoaded = false;
+}
+
+bool
+OriPriv::isDirLoaded(const string &path)
+{
+    OriFileInfo *info = resolve(path, false);
+
+    return info != NULL && info->isDir() && info->type != FILETYPE_NULL &&
+           dirs.find(info->id) != dirs.end();
+}
+
+/*
+ * Takes nsLock for reading once the directory at path is loaded.  getDir
+ * loads directories on first use and so needs nsLock for writing, but with
+ * the directory loaded getDir(path) and getFileInfo of its entries only look
+ * things up and may be called by any number of readers.  The write lock is
+ * only taken the first time a directory is visited.  Load errors are thrown
+ * as from getDir.
+ */
+RWKey::sp
+OriPriv::readLockDir(const string &path)
+{
+    while (true) {
+        RWKey::sp key = nsLock.readLock();
+        if (isDirLoaded(path))
+            return key;
+        key.reset();
+
+        key = nsLock.writeLock();
+        getDir(path);
+    }
 }
 
 /*
@@ -776,23 +1147,165 @@ loadDir:
 map<string, ObjectHash>
 OriPriv::listSnapshots()
 {
-    return repo->listSnapshots();
+    unique_lock<mutex> l(snapListLock);
+
+    return snapList;
 }
 
+/*
+ * Returns the commit of a named snapshot, throws ENOENT if there is none.
+ */
 Commit
 OriPriv::lookupSnapshot(const string &name)
 {
-    ObjectHash hash = repo->lookupSnapshot(name);
+    map<string, ObjectHash>::iterator it;
+    unordered_map<ObjectHash, Commit>::iterator cit;
+    ObjectHash hash;
+    Commit c;
+
+    {
+        unique_lock<mutex> l(snapListLock);
+        it = snapList.find(name);
+        if (it == snapList.end())
+            throw SystemException(ENOENT);
+        hash = it->second;
+
+        cit = snapCommits.find(hash);
+        if (cit != snapCommits.end())
+            return cit->second;
+    }
+
+    c = repo->getCommit(hash);
+
+    unique_lock<mutex> l(snapListLock);
+    snapCommits[hash] = c;
+
+    return c;
+}
+
+OriObjectCache::TreeP
+OriPriv::getSnapshotTree(const ObjectHash &hash)
+{
+    OriObjectCache::TreeP t;
+
+    if (cache.lookupTree(hash, &t))
+        return t;
+
+    t.reset(new Tree(repo->getTree(hash)));
+    cache.putTree(hash, t);
 
-    return repo->getCommit(hash);
+    return t;
 }
 
-Tree
-OriPriv::getTree(const Commit &c, const string &path)
+/*
+ * Resolves NAME[/PATH] below .snapshot.  The snapshot itself resolves to an
+ * entry for its root tree without attributes.  Throws ENOENT or ENOTDIR.
+ */
+TreeEntry
+OriPriv::lookupSnapshotPath(const string &path, Commit *c)
 {
-    ObjectHash hash = repo->lookup(c, path);
+    size_t start = path.find('/');
+    Commit snap = lookupSnapshot(path.substr(0, start));
+    TreeEntry e = TreeEntry(snap.getTree(), ObjectHash());
+
+    e.type = TreeEntry::Tree;
+    while (start < path.size()) {
+        size_t end = path.find('/', start + 1);
+        string name = path.substr(start + 1, end - start - 1);
+        OriObjectCache::TreeP t;
+        map<string, TreeEntry>::const_iterator it;
+
+        start = end;
+        if (name == "")
+            continue;
+        if (e.type != TreeEntry::Tree)
+            throw SystemException(ENOTDIR);
+
+        t = getSnapshotTree(e.hash);
+        it = t->tree.find(name);
+        if (it == t->tree.end())
+            throw SystemException(ENOENT);
+        e = it->second;
+    }
+
+    if (c != NULL)
+        *c = snap;
+
+    return e;
+}
 
-    return repo->getTree(hash);
+void
+OriPriv::getSnapshotAttr(const string &path, struct stat *sb,
+                         TreeEntry *entry)
+{
+    Commit c;
+    TreeEntry e = lookupSnapshotPath(path, &c);
+
+    memset(sb, 0, sizeof(*sb));
+    if (path.find('/') == path.npos) {
+        sb->st_uid = geteuid();
+        sb->st_gid = getegid();
+        sb->st_mode = 0755 | S_IFDIR;
+        sb->st_nlink = 2;
+        sb->st_size = 512;
+        sb->st_blocks = 1;
+        sb->st_ctime = c.getTime();
+        sb->st_mtime = c.getTime();
+    } else {
+        if (e.type == TreeEntry::Tree) {
+            sb->st_mode = S_IFDIR;
+            sb->st_nlink = 2; // XXX: Correct this!
+        }
+        OriFileInfo::loadAttr(e.attrs, sb);
+    }
+    sb->st_blksize = 4096;
+
+    if (entry != NULL)
+        *entry = e;
+}
+
+/*
+ * Opens a handle on a snapshot file, reads go through readFile like reads of
+ * committed files.  Must be called with nsLock held for writing.
+ */
+uint64_t
+OriPriv::openSnapshotFile(const TreeEntry &entry, const struct stat &sb)
+{
+    OriFileInfo *info = new OriFileInfo();
+    uint64_t handle = generateFH();
+
+    info->statInfo = sb;
+    info->type = FILETYPE_COMMITTED;
+    info->hash = entry.hash;
+    info->largeHash = entry.largeHash;
+    info->id = generateId();
+    info->retainFd();
+    handles[handle] = info;
+
+    return handle;
+}
+
+/*
+ * Reloads the snapshot list from the repository.  Called by the repository
+ * writers with ioLock held so that the .snapshot namespace never reads the
+ * index while it changes.
+ */
+void
+OriPriv::refreshSnapshots()
+{
+    map<string, ObjectHash> snaps = repo->listSnapshots();
+    map<string, ObjectHash>::iterator it;
+    unordered_map<ObjectHash, Commit> commits;
+    unordered_map<ObjectHash, Commit>::iterator cit;
+
+    unique_lock<mutex> l(snapListLock);
+    for (it = snaps.begin(); it != snaps.end(); it++) {
+        cit = snapCommits.find(it->second);
+        if (cit != snapCommits.end())
+            commits.insert(*cit);
+    }
+    snapList.swap(snaps);
+    snapCommits.swap(commits);
 }
 
 /*
@@ -805,68 +1318,164 @@ OriPriv::getTip()
     return head;
 }
 
+/*
+ * Returns the hash of the subtree name of t or an empty hash if t has no
+ * directory by that name.  Walking trees along with the namespace avoids
+ * looking every directory up from the root commit.
+ */
+static ObjectHash
+oldSubtree(const Tree &t, const string &name)
+{
+    map<string, TreeEntry>::const_iterator it = t.tree.find(name);
+
+    if (it == t.tree.end() || it->second.type != TreeEntry::Tree)
+        return ObjectHash();
+
+    return it->second.hash;
+}
+
+/*
+ * Records the loaded directory at path and everything below it in snap.
+ * Dirty files backed by a temporary file are marked frozen, a later write
+ * copies the file first (see prepareWrite) so the snapshot can read it
+ * without holding nsLock.
+ */
+void
+OriPriv::freezeHelper(const string &path, OriSnapshot *snap)
+{
+    OriDir *dir = getDir(path == "" ? "/" : path);
+    OriSnapshot::Dir &frozen = snap->dirs[path];
+
+    for (OriDir::iterator it = dir->begin(); it != dir->end(); it++) {
+        OriFileInfo *info = it->second;
+        OriFrozenEntry &e = frozen[it->first];
+
+        info->retain();
+        e.info = info;
+        e.statInfo = info->statInfo;
+        e.dirty = (info->type == FILETYPE_DIRTY);
+        e.isDir = info->isDir();
+        e.isSymlink = info->isSymlink();
+        e.dirLoaded = info->dirLoaded;
+        e.gen = info->gen;
+        e.hash = info->hash;
+        e.largeHash = info->largeHash;
+        if (e.dirty && e.isSymlink) {
+            e.link = info->link;
+        } else if (e.dirty && info->path != "") {
+            e.path = info->path;
+            if (info->cow)
+                e.cow = make_shared<OriCowState>(*info->cow);
+            info->frozen = true;
+        }
+    }
+
+    for (OriSnapshot::Dir::iterator it = frozen.begin();
+         it != frozen.end();
+         it++) {
+        if (it->second.isDir && it->second.dirLoaded)
+            freezeHelper(path + "/" + it->first, snap);
+    }
+}
+
+/*
+ * Reads the contents of a frozen copy-on-write file for
+ * Repo::addModifiedFile.
+ */
+class OriCowSource : public LargeBlobSource
+{
+public:
+    OriCowSource(OriPriv *priv, const OriFrozenEntry &e)
+        : priv(priv), e(e), fd(-1) { }
+    ~OriCowSource()
+    {
+        if (fd != -1)
+            close(fd);
+    }
+    ssize_t read(uint8_t *buf, size_t s, off_t off)
+    {
+        vector<OriCowState::Extent> extents;
+        uint64_t size = e.statInfo.st_size;
+
+        if ((uint64_t)off >= size)
+            return 0;
+        e.cow->extents(off, MIN(off + s, size), &extents);
+
+        if (fd == -1) {
+            fd = open(e.path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return -errno;
+        }
+
+        return priv->readExtents(e.cow->base, e.path, fd, extents,
+                                 (char *)buf);
+    }
+private:
+    OriPriv *priv;
+    const OriFrozenEntry &e;
+    int fd;
+};
+
+/*
+ * Builds the tree of a frozen directory and returns its hash, or an empty
+ * hash if it is unchanged since snap->base.  Runs without nsLock and only
+ * touches the snapshot, the hashes of dirty entries are stored back into it.
+ */
 ObjectHash
-OriPriv::commitTreeHelper(const string &path)
+OriPriv::commitFrozenHelper(const string &path, const ObjectHash &oldHash,
+                            OriSnapshot *snap)
 {
     ObjectHash hash = ObjectHash();
-    OriDir *dir = getDir(path == "" ? "/" : path);
+    OriSnapshot::Dir &dir = snap->dirs[path];
     Tree oldTree = Tree();
     Tree newTree;
     bool dirty = false;
 
-    // Load repo directory
-    try {
-        /*
-         * XXX: This is unclean but lookup returns an empty hash or
-         * throws a runtime_error depending on a few corner cases when the 
-         * directory does not exist.
-         */
-        ObjectHash treeHash = repo->lookup(headCommit,
-                                           path == "" ? "/" : path);
-        if (!treeHash.isEmpty()) {
-            oldTree = repo->getTree(treeHash);
-        } else {
-            dirty = true;
-        }
-    } catch (runtime_error &e) {
-        // Directory does not exist
+    // Load repo directory, oldHash is empty if it did not exist
+    if (!oldHash.isEmpty()) {
+        oldTree = repo->getTree(oldHash);
+    } else {
         dirty = true;
     }
 
     // Check this directory
-    for (OriDir::iterator it = dir->begin(); it != dir->end(); it++) {
-        string objPath = path + "/" + it->first;
-        OriFileInfo *info = getFileInfo(objPath);
+    for (OriSnapshot::Dir::iterator it = dir.begin(); it != dir.end(); it++) {
+        OriFrozenEntry &info = it->second;
 
-        if (info->type == FILETYPE_DIRTY) {
+        if (info.dirty) {
 	mustBeDirty:
             dirty = true;
         
             // Created or modified
             TreeEntry e;
 
-            if (info->isSymlink()) {
-                ObjectHash hash = repo->addBlob(ObjectInfo::Blob, info->link);
-
-                // Copy hash back to info stgructure
-                info->hash = hash;
-
-                e = TreeEntry(hash, ObjectHash());
+            if (info.isSymlink) {
+                info.hash = repo->addBlob(ObjectInfo::Blob, info.link);
+                e = TreeEntry(info.hash, ObjectHash());
             } else {
-                if (info->path != "") {
+                if (info.path != "") {
                     pair<ObjectHash, ObjectHash> hashes;
-                    hashes = repo->addFile(info->path);
 
-                    // Copy hashes back to info stgructure
-                    info->hash = hashes.first;
-                    info->largeHash = hashes.second;
+                    if (info.cow) {
+                        OriCowSource src(this, info);
+                        uint64_t size = info.statInfo.st_size;
+
+                        hashes = repo->addModifiedFile(info.cow->base,
+                                                       info.cow->changed(size),
+                                                       size, &src);
+                    } else {
+                        hashes = repo->addFile(info.path);
+                    }
+
+                    info.hash = hashes.first;
+                    info.largeHash = hashes.second;
                 }
-                e = TreeEntry(info->hash, info->largeHash);
+                e = TreeEntry(info.hash, info.largeHash);
             }
 
-            info->storeAttr(&e.attrs);
+            OriFileInfo::storeAttr(info.statInfo, &e.attrs);
 
-            if (info->isDir()) {
+            if (info.isDir) {
                 e.type = TreeEntry::Tree;
             } else {
                 if (e.largeHash.isEmpty())
@@ -878,8 +1487,6 @@ OriPriv::commitTreeHelper(const string &path)
             ASSERT(e.hasBasicAttrs());
 
             newTree.tree[it->first] = e;
-
-            info->type = FILETYPE_COMMITTED;
         } else {
             Tree::iterator oldEntry = oldTree.find(it->first);
 
@@ -894,21 +1501,21 @@ OriPriv::commitTreeHelper(const string &path)
         }
     }
     for (Tree::iterator it = oldTree.begin(); it != oldTree.end(); it++) {
-        string objPath = path + "/" + it->first;
-
-        if (dir->find(it->first) == dir->end()) {
+        if (dir.find(it->first) == dir.end()) {
             dirty = true;
             // Deleted
         }
     }
 
     // Check subdirectories
-    for (OriDir::iterator it = dir->begin(); it != dir->end(); it++) {
-        string objPath = path + "/" + it->first;
-        OriFileInfo *info = getFileInfo(objPath);
+    for (OriSnapshot::Dir::iterator it = dir.begin(); it != dir.end(); it++) {
+        OriFrozenEntry &info = it->second;
 
-        if (info->isDir() && info->dirLoaded) {
-            ObjectHash subdir = commitTreeHelper(objPath);
+        if (info.isDir && info.dirLoaded) {
+            ObjectHash subdir = commitFrozenHelper(path + "/" + it->first,
+                                                   oldSubtree(oldTree,
+                                                              it->first),
+                                                   snap);
 
             if (!subdir.isEmpty()) {
                 dirty = true;
@@ -934,54 +1541,247 @@ OriPriv::commitTreeHelper(const string &path)
     return hash;
 }
 
+/*
+ * Marks the entries a snapshot committed as such, unless they changed after
+ * they were frozen, and drops the snapshot's references.  A failed snapshot
+ * only drops its references.  Called with nsLock held for writing.
+ */
+void
+OriPriv::applySnapshot(OriSnapshot *snap, bool committed)
+{
+    unique_lock<mutex> l(snapshotLock);
+    map<string, OriSnapshot::Dir>::iterator dit;
+
+    for (dit = snap->dirs.begin(); dit != snap->dirs.end(); dit++) {
+        OriSnapshot::Dir::iterator it;
+
+        for (it = dit->second.begin(); it != dit->second.end(); it++) {
+            OriFrozenEntry &e = it->second;
+            OriFileInfo *info = e.info;
+            bool changed = false;
+
+            unordered_map<OriFileInfo *, pair<string, int> >::iterator d;
+            d = detached.find(info);
+            if (d != detached.end()) {
+                // Written after the freeze, the copy is all that is left
+                if (d->second.second != -1)
+                    close(d->second.second);
+                OriFile_Delete(d->second.first);
+                detached.erase(d);
+                changed = true;
+            }
+            if (e.path != "" && !info->frozen)
+                changed = true;
+            if (e.gen != info->gen)
+                changed = true;
+            info->frozen = false;
+
+            if (committed && e.dirty && !changed && info->type == FILETYPE_DIRTY &&
+                memcmp(&e.statInfo, &info->statInfo, sizeof(e.statInfo)) == 0) {
+                info->hash = e.hash;
+                info->largeHash = e.largeHash;
+                info->type = FILETYPE_COMMITTED;
+
+                if (info->cow) {
+                    unique_lock<mutex> cl(cowLock);
+                    off_t size = e.statInfo.st_size;
+
+                    // Nothing is read from the temporary file any more
+                    info->cow.reset(new OriCowState(e.hash, size));
+                    if (::truncate(e.path.c_str(), 0) < 0 ||
+                        ::truncate(e.path.c_str(), size) < 0)
+                        WARNING("Could not release the blocks of '%s'",
+                                e.path.c_str());
+                }
+            }
+
+            info->release();
+        }
+    }
+}
+
 ObjectHash
 OriPriv::commit(const Commit &cTemplate, bool temporary)
 {
+    Stopwatch total, held;
+    OriSnapshot snap;
     Commit c;
-    ObjectHash root = commitTreeHelper("");
+    ObjectHash root;
     ObjectHash commitHash = ObjectHash();
+    ObjectHash newHead;
+    Commit newHeadCommit;
+    uint64_t freezeUs, applyUs;
+
+    total.start();
+    RWKey::sp ioKey = ioLock.writeLock();
+
+    // Freeze
+    RWKey::sp nsKey = nsLock.writeLock();
+    held.start();
+    snap.base = headCommit;
+    freezeHelper("", &snap);
+    held.stop();
+    nsKey.reset();
+    freezeUs = held.getElapsedTime();
+
+    // Hash and pack without blocking the file system
+    try {
+        root = commitFrozenHelper("", snap.base.getTree(), &snap);
+        if (!root.isEmpty() && root != snap.base.getTree()) {
+            c.setMessage(cTemplate.getMessage());
+            c.setSnapshot(cTemplate.getSnapshot());
+            commitHash = repo->commitFromTree(root, c);
 
-    if (root.isEmpty() || root == headCommit.getTree())
-        return commitHash;
+            repo->sync();
 
-    c.setMessage(cTemplate.getMessage());
-    c.setSnapshot(cTemplate.getSnapshot());
-    commitHash = repo->commitFromTree(root, c);
+            newHead = repo->getHead();
+            newHeadCommit = repo->getCommit(newHead);
+            refreshSnapshots();
+        }
+    } catch (...) {
+        nsKey = nsLock.writeLock();
+        applySnapshot(&snap, false);
+        throw;
+    }
 
-    head = repo->getHead();
-    headCommit = repo->getCommit(head);
+    // Apply
+    nsKey = nsLock.writeLock();
+    held.reset();
+    held.start();
+    applySnapshot(&snap, true);
+    if (!commitHash.isEmpty()) {
+        head = newHead;
+        headCommit = newHeadCommit;
+        headChanged();
+
+        journal("snapshot", commitHash.hex());
+    }
+    held.stop();
+    nsKey.reset();
+    applyUs = held.getElapsedTime();
+    total.stop();
+
+    unique_lock<mutex> l(snapshotLock);
+    snapStats.snapshots++;
+    snapStats.totalUs += total.getElapsedTime();
+    snapStats.maxUs = max(snapStats.maxUs, total.getElapsedTime());
+    snapStats.freezeUs += freezeUs;
+    snapStats.freezeMaxUs = max(snapStats.freezeMaxUs, freezeUs);
+    snapStats.applyUs += applyUs;
+    snapStats.applyMaxUs = max(snapStats.applyMaxUs, applyUs);
 
-    repo->sync();
+    return commitHash;
+}
 
-    journal("snapshot", commitHash.hex());
+/*
+ * Copies the written ranges of a copy-on-write file into a new temporary
+ * file, the rest of it still reads from the committed object.
+ */
+static int
+OriPriv_CopyRanges(const string &src, int dstFd, const OriCowState &cow,
+                   off_t size)
+{
+    map<uint64_t, uint64_t>::const_iterator it;
+    vector<char> buf(1024 * 1024);
+    int srcFd = open(src.c_str(), O_RDONLY);
+    int status = 0;
 
-    return commitHash;
+    if (srcFd < 0)
+        return -errno;
+
+    if (ftruncate(dstFd, size) < 0)
+        status = -errno;
+
+    for (it = cow.ranges.begin(); status == 0 && it != cow.ranges.end(); it++) {
+        uint64_t off = it->first;
+
+        while (status == 0 && off < it->second) {
+            size_t len = MIN(buf.size(), it->second - off);
+            ssize_t n = pread(srcFd, &buf[0], len, off);
+
+            if (n <= 0)
+                status = (n < 0) ? -errno : -EIO;
+            else if (pwrite(dstFd, &buf[0], n, off) != n)
+                status = -errno;
+            else
+                off += n;
+        }
+    }
+
+    close(srcFd);
+
+    return status;
+}
+
+/*
+ * Must be called before the contents of a dirty file change.  If a snapshot
+ * is reading the temporary file the file is copied and info is switched to
+ * the copy, the snapshot keeps the original until it is applied.  Callers
+ * hold nsLock for reading or writing.
+ */
+void
+OriPriv::prepareWrite(OriFileInfo *info)
+{
+    unique_lock<mutex> l(snapshotLock);
+
+    if (!info->frozen)
+        return;
+
+    pair<string, int> temp = getTemp();
+    int status;
+
+    if (info->cow) {
+        OriCowState cow = OriCowState(ObjectHash(), 0);
+        {
+            unique_lock<mutex> cl(cowLock);
+            cow = *info->cow;
+        }
+        status = OriPriv_CopyRanges(info->path, temp.second, cow,
+                                    info->statInfo.st_size);
+    } else {
+        status = OriFile_Copy(info->path, temp.first);
+    }
+    if (status < 0) {
+        close(temp.second);
+        OriFile_Delete(temp.first);
+        throw SystemException(-status);
+    }
+
+    detached[info] = make_pair(info->path, info->fd);
+    info->path = temp.first;
+    if (info->fd != -1) {
+        info->fd = temp.second;
+    } else {
+        close(temp.second);
+    }
+    info->frozen = false;
+    snapStats.copies++;
+}
+
+OriPriv::SnapshotStats
+OriPriv::getSnapshotStats()
+{
+    unique_lock<mutex> l(snapshotLock);
+
+    return snapStats;
 }
 
 void
-OriPriv::getDiffHelper(const string &path,
+OriPriv::getDiffHelper(const string &path, const ObjectHash &treeHash,
                        map<string, OriFileState::StateType> *diff)
 {
-    OriDir *dir = getDir(path == "" ? "/" : path);
+    OriDir *dir = getDir(path);
     Tree t;
 
     // Load repo directory
-    try {
-        ObjectHash treeHash = repo->lookup(headCommit,
-                                           path == "" ? "/" : path);
-        if (treeHash.isEmpty())
-            return;
-
-        t = repo->getTree(treeHash);
-    } catch (runtime_error &e) {
-        // Directory does not exist
+    if (treeHash.isEmpty())
         return;
-    }
+    t = repo->getTree(treeHash);
 
     // Check this directory
     for (OriDir::iterator it = dir->begin(); it != dir->end(); it++) {
         string objPath = path + "/" + it->first;
-        OriFileInfo *info = getFileInfo(objPath);
+        OriFileInfo *info = it->second;
 
         if (info->type == FILETYPE_DIRTY) {
             if (t.find(it->first) == t.end())
@@ -999,11 +1799,11 @@ OriPriv::getDiffHelper(const string &path,
 
     // Check subdirectories
     for (OriDir::iterator it = dir->begin(); it != dir->end(); it++) {
-        string objPath = path + "/" + it->first;
-        OriFileInfo *info = getFileInfo(objPath);
+        OriFileInfo *info = it->second;
 
         if (info->isDir() && info->dirLoaded) {
-            getDiffHelper(objPath, diff);
+            getDiffHelper(path + "/" + it->first, oldSubtree(t, it->first),
+                          diff);
         }
     }
 }
@@ -1013,37 +1813,29 @@ OriPriv::getDiff()
 {
     map<string, OriFileState::StateType> diff;
 
-    getDiffHelper("", &diff);
+    getDiffHelper("", headCommit.getTree(), &diff);
 
     return diff;
 }
 
 void
-OriPriv::getCheckoutHelper(const string &path,
+OriPriv::getCheckoutHelper(const string &path, const ObjectHash &treeHash,
                            map<string, OriFileInfo *> *diffInfo,
                            map<string, OriFileState::StateType> *diffState)
 {
-    OriDir *dir = getDir(path == "" ? "/" : path);
+    OriDir *dir = getDir(path);
     Tree t;
 
     // Load repo directory
     // XXX: This function needs to return all new objects in current diff
-    try {
-        ObjectHash treeHash = repo->lookup(headCommit,
-                                           path == "" ? "/" : path);
-        if (treeHash.isEmpty())
-            return;
-
-        t = repo->getTree(treeHash);
-    } catch (runtime_error &e) {
-        // Directory does not exist
+    if (treeHash.isEmpty())
         return;
-    }
+    t = repo->getTree(treeHash);
 
     // Check this directory
     for (OriDir::iterator it = dir->begin(); it != dir->end(); it++) {
         string objPath = path + "/" + it->first;
-        OriFileInfo *info = getFileInfo(objPath);
+        OriFileInfo *info = it->second;
 
         if (info->type == FILETYPE_DIRTY) {
             if (t.find(it->first) == t.end()) {
@@ -1067,11 +1859,11 @@ OriPriv::getCheckoutHelper(const string &path,
 
     // Check subdirectories
     for (OriDir::iterator it = dir->begin(); it != dir->end(); it++) {
-        string objPath = path + "/" + it->first;
-        OriFileInfo *info = getFileInfo(objPath);
+        OriFileInfo *info = it->second;
 
         if (info->isDir() && info->dirLoaded) {
-            getCheckoutHelper(objPath, diffInfo, diffState);
+            getCheckoutHelper(path + "/" + it->first,
+                              oldSubtree(t, it->first), diffInfo, diffState);
         }
     }
 }
@@ -1083,7 +1875,7 @@ OriPriv::checkout(ObjectHash hash, bool force)
     map<string, OriFileInfo *> diffInfo;
     map<string, OriFileState::StateType> diffState;
 
-    getCheckoutHelper("", &diffInfo, &diffState);
+    getCheckoutHelper("", headCommit.getTree(), &diffInfo, &diffState);
 
     // Store a set of directories containing changes
     map<string, OriFileState::StateType>::iterator it;
@@ -1099,26 +1891,9 @@ OriPriv::checkout(ObjectHash hash, bool force)
 
     // Reset
     map<string, OriFileInfo*>::iterator pit;
-    map<OriPrivId, OriDir*>::iterator dit;
-    for (pit = paths.begin(); pit != paths.end(); pit++)
-    {
-        if (pit->first == "/") {
-            if (pit->second->dirLoaded)
-                dirs.erase(pit->second->id);
-            pit->second->statInfo.st_nlink = 2;
-            pit->second->dirLoaded = false;
-            continue;
-        }
+    unloadDir(rootInfo);
+    rootInfo->statInfo.st_nlink = 2;
 
-        if (pit->second->isDir() && pit->second->dirLoaded) {
-            delete dirs[pit->second->id];
-            dirs.erase(pit->second->id);
-        }
-        pit->second->release();
-        paths.erase(pit);
-    }
-
-    OriFileInfo *rootInfo = paths["/"];
     rootInfo->statInfo.st_mtime = c.getTime();
     rootInfo->statInfo.st_ctime = c.getTime();
 
@@ -1132,6 +1907,7 @@ OriPriv::checkout(ObjectHash hash, bool force)
         head = hash;
         headCommit = c;
         repo->updateHead(head);
+        headChanged();
         return "";
     }
 
@@ -1161,13 +1937,12 @@ OriPriv::checkout(ObjectHash hash, bool force)
                 OriDir *parentDir = getDir(parentPath);
 
                 // Rename conflicting file if it exists
-                if (paths.find(filePath) != paths.end()) {
+                if (parentDir->lookup(OriFile_Basename(filePath)) != NULL) {
                     rename(filePath, filePath + ":create_conflict");
                 }
 
                 // Create the new file
-                paths[it->first] = info;
-                parentDir->add(OriFile_Basename(filePath), info->id);
+                parentDir->add(OriFile_Basename(filePath), info);
                 if (info->isDir()) {
                     OriFileInfo *parentInfo = getFileInfo(parentPath);
                     parentInfo->statInfo.st_nlink++;
@@ -1200,11 +1975,10 @@ OriPriv::checkout(ObjectHash hash, bool force)
                 } else if (newInfo->hash != myInfo->hash) {
                     // Conflict
                     rename(filePath, filePath + ":conflict");
-                    parentDir->add(OriFile_Basename(filePath), myInfo->id);
+                    parentDir->add(OriFile_Basename(filePath), myInfo);
                 } else {
                     // No conflict
-                    paths[it->first] = myInfo;
-                    parentDir->add(OriFile_Basename(filePath), myInfo->id);
+                    parentDir->add(OriFile_Basename(filePath), myInfo);
                     newInfo->release();
                 }
                 break;
@@ -1219,6 +1993,7 @@ OriPriv::checkout(ObjectHash hash, bool force)
     head = hash;
     headCommit = c;
     repo->updateHead(head);
+    headChanged();
 
     return "";
 }
@@ -1245,10 +2020,9 @@ OriPriv::merge(ObjectHash hash)
         tc = repo->getTree(cc.getTree());
     }
 
-    // Load flattened trees
+    // Load flattened trees, the other side is diffed structurally
     TreeDiff td1, td2;
     Tree::Flat t1Flat = t1.flattened(repo);
-    Tree::Flat t2Flat = t2.flattened(repo);
     Tree::Flat tcFlat = tc.flattened(repo);
 
     // Apply current changes to t1Flat
@@ -1256,7 +2030,7 @@ OriPriv::merge(ObjectHash hash)
     map<string, OriFileState::StateType> diffState;
     map<string, OriFileState::StateType>::iterator dsit;
 
-    getCheckoutHelper("", &diffInfo, &diffState);
+    getCheckoutHelper("", headCommit.getTree(), &diffInfo, &diffState);
 
     for (dsit = diffState.begin(); dsit != diffState.end(); dsit++) {
         // Update tree
@@ -1314,7 +2088,7 @@ OriPriv::merge(ObjectHash hash)
     td1.diffTwoTrees(t1Flat, tcFlat);
     LOG("Diff from %s to %s", lca.hex().c_str(), p1.hex().c_str());
     td1.dump();
-    td2.diffTwoTrees(t2Flat, tcFlat);
+    td2.diffTwoTrees(t2, tc, repo);
     LOG("Diff from %s to %s", lca.hex().c_str(), p2.hex().c_str());
     td2.dump();
 
@@ -1363,8 +2137,7 @@ OriPriv::merge(ObjectHash hash)
             }
 
             OriDir *parentDir = getDir(OriFile_Dirname(e.filepath));
-            parentDir->add(OriFile_Basename(e.filepath), info->id);
-            paths[e.filepath] = info;
+            parentDir->add(OriFile_Basename(e.filepath), info);
         } else if (e.type == TreeDiffEntry::NewDir) {
             DLOG("N       %s", e.filepath.c_str());
             OriFileInfo *info = addDir(e.filepath);
@@ -1394,6 +2167,7 @@ OriPriv::merge(ObjectHash hash)
                 }
                 info->path = "";
             }
+            info->cow.reset();
 
             info->hash = e.hashes.first;
             info->largeHash = e.hashes.second;
@@ -1431,8 +2205,7 @@ OriPriv::merge(ObjectHash hash)
                 }
 
                 parentDir->add(OriFile_Basename(e.filepath) + ":conflict",
-                               conflictInfo->id);
-                paths[e.filepath + ":conflict"] = conflictInfo;
+                               conflictInfo);
 
                 /*
                  * Create '*:base' file if it exists.  It may not exist because 
@@ -1457,8 +2230,7 @@ OriPriv::merge(ObjectHash hash)
                     }
 
                     parentDir->add(OriFile_Basename(e.filepath) + ":base",
-                                   baseInfo->id);
-                    paths[e.filepath + ":base"] = baseInfo;
+                                   baseInfo);
                 }
             }
 
@@ -1540,12 +2312,65 @@ OriPriv::journal(const string &event, const string &arg)
     return;
 }
 
+/*
+ * Change Notification
+ */
+
+/*
+ * Called by every FUSE operation that modifies the file system.  This is on
+ * the write path so the lock is only taken when someone is waiting.
+ */
+void
+OriPriv::notifyChange()
+{
+    changeGen++;
+    if (changeWaiters > 0) {
+        unique_lock<mutex> l(changeLock);
+        changeCV.notify_all();
+    }
+}
+
+void
+OriPriv::headChanged()
+{
+    unique_lock<mutex> l(changeLock);
+    changeHead = head;
+    changeCV.notify_all();
+}
+
+/*
+ * Blocks up to timeout seconds until the file system changes after gen or the
+ * head differs from knownHead, then returns the current generation and head.
+ */
+void
+OriPriv::waitChange(uint64_t gen, const ObjectHash &knownHead, int timeout,
+                    uint64_t *curGen, ObjectHash *curHead)
+{
+    unique_lock<mutex> l(changeLock);
+    chrono::steady_clock::time_point deadline;
+
+    if (timeout > ORIFS_CHANGEWAIT_MAX)
+        timeout = ORIFS_CHANGEWAIT_MAX;
+    deadline = chrono::steady_clock::now() + chrono::seconds(timeout);
+
+    changeWaiters++;
+    while (!changeExit && changeGen == gen && changeHead == knownHead) {
+        if (changeCV.wait_until(l, deadline) == cv_status::timeout)
+            break;
+    }
+    changeWaiters--;
+
+    *curGen = changeGen;
+    *curHead = changeHead;
+}
+
 /*
  * Debugging
  */
 
 void
-OriPrivCheckDir(OriPriv *priv, const string &path, OriDir *dir)
+OriPrivCheckDir(OriPriv *priv, const string &path, OriDir *dir,
+                set<OriPrivId> *reached)
 {
     OriDir::iterator it;
 
@@ -1567,7 +2392,8 @@ OriPrivCheckDir(OriPriv *priv, const string &path, OriDir *dir)
 
             try {
                 dir = priv->getDir(objPath);
-                OriPrivCheckDir(priv, objPath, dir);
+                reached->insert(info->id);
+                OriPrivCheckDir(priv, objPath, dir, reached);
             } catch (SystemException e) {
                 FUSE_LOG("fsck: getDir(%s) encountered %s",
                          objPath.c_str(), e.what());
@@ -1594,8 +2420,8 @@ OriPrivCheckDir(OriPriv *priv, const string &path, OriDir *dir)
             }
         }
 
-        if (info && info->id != it->second) {
-            FUSE_LOG("fsck: %s object Id mismatch!", objPath.c_str());
+        if (info && info != it->second) {
+            FUSE_LOG("fsck: %s object mismatch!", objPath.c_str());
         }
     }
 }
@@ -1604,42 +2430,22 @@ void
 OriPriv::fsck()
 {
     RWKey::sp lock;
-    map<string, OriFileInfo *>::iterator it;
+    unordered_map<OriPrivId, OriDir *>::iterator it;
+    set<OriPrivId> reached;
     OriDir *dir;
 
     lock = nsLock.writeLock();
 
     dir = getDir("/");
+    reached.insert(rootInfo->id);
 
-    OriPrivCheckDir(this, "", dir);
-
-    for (it = paths.begin(); it != paths.end(); it++) {
-        string basename = OriFile_Basename(it->first);
-        string parentPath = OriFile_Dirname(it->first);
-        OriDir *dir = NULL;
-
-        if (it->first == "/")
-            continue;
-
-        if (parentPath == "")
-            parentPath = "/";
+    OriPrivCheckDir(this, "", dir, &reached);
 
-        try {
-            dir = getDir(parentPath);
-        } catch (SystemException e) {
-            FUSE_LOG("fsck: %s path encountered an error %s",
-                     it->first.c_str(), e.what());
-        }
-
-        if (dir) {
-            OriDir::iterator dirIt = dir->find(basename);
-
-            if (dirIt == dir->end()) {
-                FUSE_LOG("fsck: %s not present in directory!",
-                         it->first.c_str());
-            } else if (dirIt->second != it->second->id) {
-                FUSE_LOG("fsck: %s object Id mismatch!", it->first.c_str());
-            }
+    // Every loaded directory must be part of the namespace
+    for (it = dirs.begin(); it != dirs.end(); it++) {
+        if (reached.find(it->first) == reached.end()) {
+            FUSE_LOG("fsck: directory %" PRIu64 " is not reachable",
+                     it->first);
         }
     }
 }
@@ -17,8 +17,24 @@
 #ifndef __ORIPRIV_H__
 #define __ORIPRIV_H__
 
+#include <stdint.h>
+
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
 #include <oriutil/orifile.h>
 
+#include "oricache.h"
+
+// Longest a change waiter may block, below the UDS session shutdown timeout
+#define ORIFS_CHANGEWAIT_MAX        10
+
 typedef enum OriFileType
 {
     FILETYPE_NULL,
@@ -29,6 +45,34 @@ typedef enum OriFileType
 #define ORIPRIVID_INVALID 0
 typedef uint64_t OriPrivId;
 
+/*
+ * Copy-on-write state of a committed LargeBlob opened for writing.  Its
+ * temporary file is sparse and holds only the byte ranges written since, the
+ * rest of the file below baseSize still reads from the committed object
+ * base.  Truncating lowers baseSize so that the bytes cut off read as zeros
+ * from the temporary file if the file grows again.
+ */
+class OriCowState
+{
+public:
+    struct Extent {
+        uint64_t off;
+        uint64_t len;
+        bool temp; // read from the temporary file, otherwise from base
+    };
+    OriCowState(const ObjectHash &base, uint64_t baseSize)
+        : base(base), baseSize(baseSize), ranges() { }
+    void add(uint64_t start, uint64_t end);
+    void truncate(uint64_t size);
+    /// Splits [off, end) by where the bytes are read from
+    void extents(uint64_t off, uint64_t end, std::vector<Extent> *out) const;
+    /// Ranges that differ from base in a file of the given size
+    std::map<uint64_t, uint64_t> changed(uint64_t size) const;
+    ObjectHash base;
+    uint64_t baseSize;
+    std::map<uint64_t, uint64_t> ranges; // start -> end of written ranges
+};
+
 class OriFileInfo
 {
 public:
@@ -41,6 +85,8 @@ public:
         refCount = 1;
         openCount = 0;
         dirLoaded = false;
+        frozen = false;
+        gen = 0;
     }
     ~OriFileInfo() {
         ASSERT(refCount == 0);
@@ -80,7 +126,9 @@ public:
     bool isSymlink() const { return (statInfo.st_mode & S_IFLNK) == S_IFLNK; }
     bool isReg() const { return (statInfo.st_mode & S_IFREG) == S_IFREG; }
     void loadAttr(const AttrMap &attr);
+    static void loadAttr(const AttrMap &attr, struct stat *statInfo);
     void storeAttr(AttrMap *attr) const;
+    static void storeAttr(const struct stat &statInfo, AttrMap *attr);
     struct stat statInfo;
     ObjectHash hash;
     ObjectHash largeHash;
@@ -92,17 +140,26 @@ public:
     int refCount;
     int openCount;
     bool dirLoaded;
+    bool frozen; // temporary file is being read by a snapshot
+    std::shared_ptr<OriCowState> cow; // set for lazily copied files
+    uint64_t gen; // bumped when the entry moves in the namespace
 };
 
+/*
+ * Entries of a loaded directory by name.  An entry holds the namespace's
+ * reference to its OriFileInfo.  Directories only know their children, so
+ * lookups walk the path from the root and a directory is renamed by moving
+ * its entry.
+ */
 class OriDir
 {
 public:
-    typedef std::map<std::string, OriPrivId>::iterator iterator;
-    OriDir() { }
+    typedef std::unordered_map<std::string, OriFileInfo *>::iterator iterator;
+    OriDir() : dirty(false) { }
     ~OriDir() { }
-    void add(const std::string &name, OriPrivId id)
+    void add(const std::string &name, OriFileInfo *info)
     {
-        entries[name] = id;
+        entries[name] = info;
         setDirty();
     }
     void remove(const std::string &name)
@@ -111,6 +168,11 @@ public:
         entries.erase(name);
         setDirty();
     }
+    OriFileInfo *lookup(const std::string &name)
+    {
+        iterator it = entries.find(name);
+        return (it == entries.end()) ? NULL : it->second;
+    }
     bool isEmpty() { return entries.size() == 0; }
     void setDirty() { dirty = true; }
     void clrDirty() { dirty = true; }
@@ -120,7 +182,41 @@ public:
     iterator find(const std::string &name) { return entries.find(name); }
 private:
     bool dirty;
-    std::map<std::string, OriPrivId> entries;
+    std::unordered_map<std::string, OriFileInfo *> entries;
+};
+
+/*
+ * Copy of a directory entry taken while freezing the namespace for a
+ * snapshot.  The OriFileInfo stays retained until the snapshot is applied so
+ * that a frozen temporary file survives an unlink in the meantime.
+ */
+class OriFrozenEntry
+{
+public:
+    OriFileInfo *info;
+    struct stat statInfo;
+    bool dirty;
+    bool isDir;
+    bool isSymlink;
+    bool dirLoaded;
+    uint64_t gen;
+    ObjectHash hash;
+    ObjectHash largeHash;
+    std::string path; // temporary file
+    std::string link; // link target
+    std::shared_ptr<OriCowState> cow; // copied at the freeze
+};
+
+/*
+ * Loaded directories of the namespace as seen by a snapshot, indexed by path
+ * with "" for the root.
+ */
+class OriSnapshot
+{
+public:
+    typedef std::map<std::string, OriFrozenEntry> Dir;
+    Commit base;
+    std::map<std::string, Dir> dirs;
 };
 
 class OriFileState
@@ -179,43 +275,102 @@ public:
     std::pair<OriFileInfo*, uint64_t> openFile(const std::string &path,
                                                bool writing, bool trunc);
     size_t readFile(OriFileInfo *info, char *buf, size_t size, off_t offset);
+    ssize_t writeFile(OriFileInfo *info, const char *buf, size_t size,
+                      off_t offset);
+    int truncateFile(OriFileInfo *info, off_t length);
+    struct stat getStat(OriFileInfo *info);
     void unlink(const std::string &path);
     void rename(const std::string &fromPath, const std::string &toPath);
     OriFileInfo* addDir(const std::string &path);
     void rmDir(const std::string &path);
     OriDir* getDir(const std::string &path);
-    // Snapshot Operations
+    RWKey::sp readLockDir(const std::string &path);
+    /*
+     * Snapshot Operations
+     *
+     * The .snapshot namespace is read-only and served without nsLock.  Paths
+     * are relative to .snapshot (NAME or NAME/PATH) and are resolved through
+     * trees cached by hash, which are shared by all snapshots.  The snapshot
+     * list is a copy that the repository writers refresh.
+     */
     std::map<std::string, ObjectHash> listSnapshots();
     Commit lookupSnapshot(const std::string &name);
-    Tree getTree(const Commit &c, const std::string &path);
+    OriObjectCache::TreeP getSnapshotTree(const ObjectHash &hash);
+    TreeEntry lookupSnapshotPath(const std::string &path, Commit *c = NULL);
+    void getSnapshotAttr(const std::string &path, struct stat *sb,
+                         TreeEntry *entry = NULL);
+    uint64_t openSnapshotFile(const TreeEntry &entry, const struct stat &sb);
+    void refreshSnapshots();
     ObjectHash getTip();
 private:
-    ObjectHash commitTreeHelper(const std::string &path);
-    void getDiffHelper(const std::string &path,
+    OriFileInfo *resolve(const std::string &path, bool load);
+    OriDir *loadDir(OriFileInfo *dirInfo);
+    void unloadDir(OriFileInfo *dirInfo);
+    bool isDirLoaded(const std::string &path);
+    void freezeHelper(const std::string &path, OriSnapshot *snap);
+    ObjectHash commitFrozenHelper(const std::string &path,
+                                  const ObjectHash &oldHash,
+                                  OriSnapshot *snap);
+    void applySnapshot(OriSnapshot *snap, bool committed);
+    ssize_t readObject(const ObjectHash &hash, char *buf, size_t size,
+                       off_t offset);
+    ssize_t readExtents(const ObjectHash &base, const std::string &path,
+                        int fd,
+                        const std::vector<OriCowState::Extent> &extents,
+                        char *buf);
+    void getDiffHelper(const std::string &path, const ObjectHash &treeHash,
                     std::map<std::string, OriFileState::StateType> *diff);
-    void getCheckoutHelper(const std::string &path,
+    void getCheckoutHelper(const std::string &path, const ObjectHash &treeHash,
                     std::map<std::string, OriFileInfo *> *diffInfo,
                     std::map<std::string, OriFileState::StateType> *diffState);
 public:
+    struct SnapshotStats {
+        uint64_t snapshots;
+        uint64_t copies; // frozen temporary files copied before a write
+        uint64_t totalUs;
+        uint64_t maxUs;
+        uint64_t freezeUs; // nsLock held to freeze the namespace
+        uint64_t freezeMaxUs;
+        uint64_t applyUs; // nsLock held to apply the new head
+        uint64_t applyMaxUs;
+    };
     ObjectHash commit(const Commit &cTemplate, bool temporary = false);
+    void prepareWrite(OriFileInfo *info);
+    SnapshotStats getSnapshotStats();
     std::map<std::string, OriFileState::StateType> getDiff();
     std::string checkout(ObjectHash hash, bool force);
     std::string merge(ObjectHash hash);
     void setJournalMode(OriJournalMode::JournalMode mode);
     void journal(const std::string &event, const std::string &arg);
+    // Change Notification
+    void notifyChange();
+    void waitChange(uint64_t gen, const ObjectHash &knownHead, int timeout,
+                    uint64_t *curGen, ObjectHash *curHead);
     // Debugging
     void fsck();
 
-    // Locks
-    RWLock ioLock; // File I/O lock to allow atomic commits
-    RWLock nsLock; // Namespace lock
+    /*
+     * Locks
+     *
+     * ioLock serializes the writers of the repository and of head (commit,
+     * pull, checkout, merge and purge), it is always taken before nsLock.  A
+     * commit holds nsLock only while it freezes the namespace and while it
+     * installs the new head, the files are hashed and packed in between
+     * with only ioLock held.  Writes to a frozen file go through
+     * prepareWrite first.
+     */
+    RWLock ioLock; // Repository writer lock
+    RWLock nsLock; // Namespace lock, see readLockDir for lookups
+
+    // Decoded objects for the read path
+    OriObjectCache cache;
 
     LocalRepo *getRepo();
 private:
     OriPrivId nextId;
     uint64_t nextFH;
-    std::map<OriPrivId, OriDir*> dirs;
-    std::map<std::string, OriFileInfo*> paths;
+    OriFileInfo *rootInfo;
+    std::unordered_map<OriPrivId, OriDir*> dirs; // loaded directories
     std::unordered_map<uint64_t, OriFileInfo*> handles;
 
     // Journal
@@ -229,7 +384,39 @@ private:
     Commit headCommit;
     std::string tmpDir;
 
+    /*
+     * Change notification: changeGen counts modifications to the file system
+     * and changeHead mirrors head.  Waiters are woken when either moves.
+     */
+    void headChanged();
+    std::mutex changeLock;
+    std::condition_variable changeCV;
+    std::atomic<uint64_t> changeGen;
+    std::atomic<int> changeWaiters;
+    ObjectHash changeHead;
+    bool changeExit;
+
+    /*
+     * Snapshot state: temporary files copied away from under a snapshot by
+     * prepareWrite (their old path and descriptor, closed and deleted once
+     * the snapshot is applied) and the statistics.
+     */
+    std::mutex snapshotLock;
+    std::unordered_map<OriFileInfo *, std::pair<std::string, int> > detached;
+    SnapshotStats snapStats;
+
+    // Protects the OriCowState of files, written under the reader nsLock
+    std::mutex cowLock;
+    // Protects statInfo and type of files written under the reader nsLock
+    std::mutex statLock;
+
+    // Snapshot list and the commits resolved from it, see refreshSnapshots
+    std::mutex snapListLock;
+    std::map<std::string, ObjectHash> snapList;
+    std::unordered_map<ObjectHash, Commit> snapCommits;
+
     friend class OriCommand;
+    friend class OriCowSource;
 };
 
 OriPriv *GetOriPriv();
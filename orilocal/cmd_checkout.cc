@@ -35,27 +35,49 @@ using namespace std;
 
 extern LocalRepo repository;
 
+struct CheckoutScan
+{
+    string repoRoot;
+    map<string, ObjectHash> files;
+    DirState *state;
+};
+
 int
-StatusDirectoryCB(map<string, ObjectHash> *dirState, const string &path)
+StatusDirectoryCB(CheckoutScan *scan, const string &path)
 {
-    string repoRoot = LocalRepo::findRootPath();
-    string objPath = path;
+    string objPath = path.substr(scan->repoRoot.size());
     ObjectHash objHash;
+    struct stat sb;
 
-    if (!OriFile_IsDirectory(objPath)) {
-        objHash = OriCrypt_HashFile(objPath);
+    if (stat(path.c_str(), &sb) == 0 && !S_ISDIR(sb.st_mode)) {
+        if (!scan->state->lookup(objPath, sb, &objHash)) {
+            objHash = OriCrypt_HashFile(path);
+            scan->state->update(objPath, sb, objHash);
+        }
         ASSERT(!objHash.isEmpty());
-        objPath = objPath.substr(repoRoot.size());
-    } else {
-        objPath = objPath.substr(repoRoot.size());
     }
 
     // TODO: empty hash means dir
-    dirState->insert(make_pair(objPath, objHash));
+    scan->files.insert(make_pair(objPath, objHash));
 
     return 0;
 }
 
+/*
+ * Copies out a file and records it in the dirstate.
+ */
+static void
+CheckoutFile(DirState *state, const string &relPath, const TreeEntry &te)
+{
+    string path = LocalRepo::findRootPath() + relPath;
+    struct stat sb;
+
+    repository.copyObject(te.hash, path);
+    if (stat(path.c_str(), &sb) == 0)
+        state->update(relPath, sb, (te.type == TreeEntry::LargeBlob) ?
+                                   te.largeHash : te.hash);
+}
+
 /*int
 StatusTreeIter(map<string, pair<string, string> > *tipState,
                const string &path,
@@ -107,11 +129,15 @@ cmd_checkout(int argc, char * const argv[])
         tipTree = repository.getTree(c.getTree()).flattened(&repository);
     }
 
-    map<string, ObjectHash> dirState;
-    DirTraverse(LocalRepo::findRootPath().c_str(),
-                &dirState,
-                StatusDirectoryCB);
+    DirState state;
+    state.open(repository.getRootPath() + ORI_PATH_DIRSTATE);
 
+    CheckoutScan scan;
+    scan.repoRoot = LocalRepo::findRootPath();
+    scan.state = &state;
+    DirTraverse(scan.repoRoot.c_str(), &scan, StatusDirectoryCB);
+
+    map<string, ObjectHash> &dirState = scan.files;
     map<string, ObjectHash>::iterator it;
     for (it = dirState.begin(); it != dirState.end(); it++) {
         Tree::Flat::iterator tipIt = tipTree.find((*it).first);
@@ -127,8 +153,7 @@ cmd_checkout(int argc, char * const argv[])
             if (totalHash != (*it).second && !(*it).second.isEmpty()) {
                 printf("M       %s\n", (*it).first.c_str());
                 // XXX: Handle replace a file <-> directory with same name
-                repository.copyObject(te.hash,
-                                    LocalRepo::findRootPath()+(*tipIt).first);
+                CheckoutFile(&state, (*tipIt).first, te);
             }
         }
     }
@@ -147,13 +172,15 @@ cmd_checkout(int argc, char * const argv[])
                 printf("U       %s\n", (*tipIt).first.c_str());
                 if (repository.getObjectType(te.hash)
                         != ObjectInfo::Purged)
-                    repository.copyObject(te.hash, path);
+                    CheckoutFile(&state, (*tipIt).first, te);
                 else
                     cout << "Object has been purged." << endl;
             }
         }
     }
 
+    state.save();
+
     return 0;
 }
 
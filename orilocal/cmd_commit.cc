@@ -15,12 +15,17 @@
  */
 
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <getopt.h>
 
 #include <string>
 #include <iostream>
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
+#include <oriutil/threadpool.h>
 #include <ori/localrepo.h>
 
 using namespace std;
@@ -30,16 +35,41 @@ extern LocalRepo repository;
 void
 usage_commit(void)
 {
-    cout << "ori commit [MESSAGE]" << endl;
+    cout << "ori commit [OPTIONS] [MESSAGE]" << endl;
     cout << endl;
     cout << "Commit any outstanding changes into the repository." << endl;
     cout << endl;
     cout << "An optional message can be added to the commit." << endl;
+    cout << endl;
+    cout << "Options:" << endl;
+    cout << "    -j threads     Number of threads used to scan and hash files" << endl;
+    cout << "                   (defaults to the number of processors)" << endl;
 }
 
 int
 cmd_commit(int argc, char * const argv[])
 {
+    int ch;
+    int threads = -1;
+
+    struct option longopts[] = {
+        { "threads",    required_argument,  NULL,   'j' },
+        { NULL,         0,                  NULL,   0   }
+    };
+
+    while ((ch = getopt_long(argc, argv, "j:", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            default:
+                printf("Usage: ori commit [OPTIONS] [MESSAGE]\n");
+                return 1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
     Commit c;
     Tree tip_tree;
     ObjectHash tip = repository.getHead();
@@ -48,10 +78,16 @@ cmd_commit(int argc, char * const argv[])
         tip_tree = repository.getTree(c.getTree());
     }
 
+    DirState state;
+    state.open(repository.getRootPath() + ORI_PATH_DIRSTATE);
+
+    ThreadPool pool(threads);
     TreeDiff diff;
-    diff.diffToDir(c, repository.getRootPath(), &repository);
+    diff.diffToDir(c, repository.getRootPath(), &repository, &state,
+                   &pool);
     if (diff.entries.size() == 0) {
         cout << "Nothing to commit!" << endl;
+        state.save();
         return 0;
     }
 
@@ -59,11 +95,14 @@ cmd_commit(int argc, char * const argv[])
             &repository);
 
     Commit newCommit;
-    if (argc == 2) {
-        newCommit.setMessage(argv[1]);
+    if (argc == 1) {
+        newCommit.setMessage(argv[0]);
     }
     repository.commitFromTree(new_tree.hash(), newCommit);
 
+    state.updateFromTree(new_tree.flattened(&repository));
+    state.save();
+
     return 0;
 }
 
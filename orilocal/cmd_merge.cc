@@ -75,8 +75,8 @@ cmd_merge(int argc, char * const argv[])
 	tc = repository.getTree(cc.getTree());
     }
 
-    td1.diffTwoTrees(t1.flattened(&repository), tc.flattened(&repository));
-    td2.diffTwoTrees(t2.flattened(&repository), tc.flattened(&repository));
+    td1.diffTwoTrees(t1, tc, &repository);
+    td2.diffTwoTrees(t2, tc, &repository);
 
 #ifdef DEBUG
     printf("Tree 1:\n");
@@ -24,6 +24,7 @@
 #include <string>
 #include <iostream>
 
+#include <oriutil/threadpool.h>
 #include <ori/localrepo.h>
 
 using namespace std;
@@ -91,8 +92,13 @@ cmd_snapshot(int argc, char * const argv[])
         tip_tree = repository.getTree(c.getTree());
     }
 
+    DirState state;
+    state.open(repository.getRootPath() + ORI_PATH_DIRSTATE);
+
+    ThreadPool pool;
     TreeDiff diff;
-    diff.diffToDir(c, repository.getRootPath(), &repository);
+    diff.diffToDir(c, repository.getRootPath(), &repository, &state,
+                   &pool);
     if (diff.entries.size() == 0) {
         cout << "Note: nothing to commit" << endl;
     }
@@ -112,6 +118,9 @@ cmd_snapshot(int argc, char * const argv[])
 
     repository.commitFromTree(new_tree.hash(), newCommit);
 
+    state.updateFromTree(new_tree.flattened(&repository));
+    state.save();
+
     return 0;
 }
 
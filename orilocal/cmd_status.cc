@@ -15,28 +15,70 @@
  */
 
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <getopt.h>
 
 #include <string>
 #include <iostream>
 #include <iomanip>
 
+#include <oriutil/threadpool.h>
 #include <ori/localrepo.h>
 
 using namespace std;
 
 extern LocalRepo repository;
 
+void
+usage_status(void)
+{
+    cout << "ori status [OPTIONS]" << endl;
+    cout << endl;
+    cout << "Scan for changes since the last commit." << endl;
+    cout << endl;
+    cout << "Options:" << endl;
+    cout << "    -j threads     Number of threads used to scan and hash files" << endl;
+    cout << "                   (defaults to the number of processors)" << endl;
+}
+
 int
 cmd_status(int argc, char * const argv[])
 {
+    int ch;
+    int threads = -1;
+
+    struct option longopts[] = {
+        { "threads",    required_argument,  NULL,   'j' },
+        { NULL,         0,                  NULL,   0   }
+    };
+
+    while ((ch = getopt_long(argc, argv, "j:", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            default:
+                printf("Usage: ori status [OPTIONS]\n");
+                return 1;
+        }
+    }
+
     Commit c;
     ObjectHash tip = repository.getHead();
     if (tip != EMPTY_COMMIT) {
         c = repository.getCommit(tip);
     }
 
+    DirState state;
+    state.open(repository.getRootPath() + ORI_PATH_DIRSTATE);
+
+    ThreadPool pool(threads);
     TreeDiff td;
-    td.diffToDir(c, repository.getRootPath(), &repository);
+    td.diffToDir(c, repository.getRootPath(), &repository, &state,
+                 &pool);
+    state.save();
 
     for (size_t i = 0; i < td.entries.size(); i++) {
         printf("%c   %s\n",
@@ -91,6 +91,7 @@ int cmd_show(int argc, char * const argv[]);
 void usage_snapshot(void);
 int cmd_snapshot(int argc, char * const argv[]);
 int cmd_snapshots(int argc, char * const argv[]);
+void usage_status(void);
 int cmd_status(int argc, char * const argv[]);
 int cmd_tip(int argc, char * const argv[]);
 
@@ -295,7 +296,7 @@ static Cmd commands[] = {
         "status",
         "Scan for changes since last commit",
         cmd_status,
-        NULL,
+        usage_status,
         CMD_NEED_REPO,
     },
     {
@@ -444,6 +445,12 @@ main(int argc, char *argv[])
 
 
     DLOG("Executing '%s'", argv[1]);
-    return commands[idx].cmd(argc-1, (char * const*)argv+1);
+    int status = commands[idx].cmd(argc-1, (char * const*)argv+1);
+
+    // Write out pending objects now, the index cannot be locked from static
+    // destructors
+    repository.close();
+
+    return status;
 }
 
@@ -28,10 +28,11 @@
 #include "orisyncconf.h"
 #include "repoinfo.h"
 #include "hostinfo.h"
-
+#include "syncqueue.h"
 
 using namespace std;
 extern map<string, HostInfo *> hosts;
+extern SyncQueue syncQueue;
 
 int
 cmd_status(int mode, const char *argv)
@@ -46,6 +47,19 @@ cmd_status(int mode, const char *argv)
       for (auto &it : hosts) {
         cout << left << setw(32) << it.second->getHost() << it.second->getStatus() << endl;
       }
+
+      SyncQueue::Stats ss = syncQueue.getStats();
+      cout << endl;
+      cout << left << setw(32) << "SYNC" << "VALUE" << endl;
+      cout << left << setw(32) << "queue depth" << ss.depth << endl;
+      cout << left << setw(32) << "pulls in progress" << ss.inflight << endl;
+      cout << left << setw(32) << "requests" << ss.requests << endl;
+      cout << left << setw(32) << "requests merged" << ss.merged << endl;
+      cout << left << setw(32) << "pulls" << ss.pulls << endl;
+      cout << left << setw(32) << "last queue wait (ms)" << ss.lastWaitMS << endl;
+      cout << left << setw(32) << "last pull (ms)" << ss.lastPullMS << endl;
+      cout << left << setw(32) << "average pull (ms)" << ss.avgPullMS << endl;
+      cout << left << setw(32) << "max pull (ms)" << ss.maxPullMS << endl;
     }
 
     return 0;
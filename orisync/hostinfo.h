@@ -207,21 +207,21 @@ public:
     void insertRepoPeer(const std::string &repoID, const std::string &peer) {
         if (!hasRepo(repoID)) return;
         // Need to grab the hostLock.readLock
-        RWKey::sp key = repos[repoID].repoLock.writeLock();
+        RWKey::sp key = repos[repoID].peerLock.writeLock();
         repos[repoID].insertPeer(peer);
         key.reset();
     }
     void removeRepoPeer(const std::string &repoID, const std::string &peer) {
         // Need to grab the hostLock.readLock
         if (!hasRepo(repoID)) return;
-        RWKey::sp key = repos[repoID].repoLock.writeLock();
+        RWKey::sp key = repos[repoID].peerLock.writeLock();
         repos[repoID].removePeer(peer);
         key.reset();
     }
     RWLock *getHostLock() {
         return &hostLock;
     }
-    RWLock *getRepoLock(const std::string &repoID) {
+    std::shared_ptr<RWLock> getRepoLock(const std::string &repoID) {
         return repos[repoID].getRepoLock();
     }
     RWLock hostLock;
@@ -93,6 +93,18 @@ RepoControl::getPath()
     return path;
 }
 
+/*
+ * Returns the directory holding the repository (.ori or the bare repository)
+ * for unmounted repositories and an empty string for mounted ones.
+ */
+string
+RepoControl::getRootPath()
+{
+    if (localRepo)
+        return localRepo->getRootPath();
+    return "";
+}
+
 string
 RepoControl::getUUID()
 {
@@ -261,6 +273,47 @@ RepoControl::snapshot()
     return -1;
 }
 
+/*
+ * Blocks until the mounted file system changes after gen or its head moves
+ * away from head, or until timeout seconds pass.  Only mounted repositories
+ * support this, returns -1 otherwise or if the file system went away.
+ */
+int
+RepoControl::waitChange(uint64_t gen, const string &head, int timeout,
+                        uint64_t *curGen, string *curHead)
+{
+    if (!udsRepo)
+        return -1;
+
+    strwstream req;
+    ObjectHash knownHead;
+
+    if (head != "")
+        knownHead = ObjectHash::fromHex(head);
+
+    req.writePStr("waitchange");
+    req.writeUInt64(gen);
+    req.writeHash(knownHead);
+    req.writeUInt32(timeout);
+
+    try {
+        strstream resp = udsRepo->callExt("FUSE", req.str());
+        ObjectHash hash;
+
+        if (resp.ended())
+            return -1;
+
+        *curGen = resp.readUInt64();
+        resp.readHash(hash);
+        *curHead = hash.hex();
+    } catch (SystemException e) {
+        WARNING("%s", e.what());
+        return -1;
+    }
+
+    return 0;
+}
+
 /*
 int
 RepoControl::checkoutPrev(time_t time)
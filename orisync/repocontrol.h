@@ -31,12 +31,15 @@ public:
     void open();
     void close();
     std::string getPath();
+    std::string getRootPath();
     std::string getUUID();
     std::string getHead();
     bool hasCommit(const std::string &objId);
     std::string pull(const std::string &host, const std::string &path);
     std::string push(const std::string &host, const std::string &path);
     int snapshot();
+    int waitChange(uint64_t gen, const std::string &head, int timeout,
+                   uint64_t *curGen, std::string *curHead);
     void gc(time_t time);
     bool isMounted();
 private:
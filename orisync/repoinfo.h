@@ -23,7 +23,10 @@
 
 class RepoInfo {
 public:
-    RepoInfo() {
+    RepoInfo() : repoLock(new RWLock()) {
+        mounted = false;
+        remote = false;
+        lastSnapShot = 0;
     }
     /*
     RepoInfo(const std::string &repoId, const std::string &path) {
@@ -32,11 +35,13 @@ public:
         hasRemote = false;
     }
     */
-    RepoInfo(const std::string &repoId, const std::string &path, bool mounted) {
+    RepoInfo(const std::string &repoId, const std::string &path, bool mounted)
+        : repoLock(new RWLock()) {
         this->repoId = repoId;
         this->path = path;
         this->mounted = mounted;
         remote = false;
+        lastSnapShot = 0;
     }
     ~RepoInfo() {
     }
@@ -108,11 +113,17 @@ public:
     time_t getSStime() {
         return lastSnapShot;
     }
-    RWLock *getRepoLock() {
-        return &repoLock;
-    }
-    RWLock repoLock;
+    /*
+     * Serializes snapshots and pulls of the repository.  Copies of the
+     * RepoInfo share the lock so it stays valid while the entry in HostInfo
+     * is replaced.
+     */
+    std::shared_ptr<RWLock> getRepoLock() {
+        return repoLock;
+    }
+    RWLock peerLock;
 private:
+    std::shared_ptr<RWLock> repoLock;
     std::string repoId;
     std::string head;
     std::string path;
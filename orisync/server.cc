@@ -21,19 +21,27 @@
 
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif /* __linux__ */
 
 #include <string>
 #include <vector>
+#include <list>
+#include <set>
 #include <map>
+#include <algorithm>
 #include <iostream>
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
 #include <chrono>
-#include <queue>
 
 #include <event2/event.h>
 #include <event2/http.h>
@@ -49,6 +57,8 @@
 #include <oriutil/orinet.h>
 #include <oriutil/systemexception.h>
 #include <oriutil/thread.h>
+#include <oriutil/threadpool.h>
+#include <oriutil/stopwatch.h>
 #include <oriutil/kvserializer.h>
 #include <ori/localrepo.h>
 
@@ -56,6 +66,7 @@
 #include "repoinfo.h"
 #include "hostinfo.h"
 #include "repocontrol.h"
+#include "syncqueue.h"
 #include "commands.h"
 
 using namespace std;
@@ -65,15 +76,25 @@ using namespace std;
 // Announcement UDP port
 #define ORISYNC_UDPPORT		8051
 // Advertisement interval
-#define ORISYNC_ADVINTERVAL	1 //5
+#define ORISYNC_ADVINTERVAL	3
 // Reject advertisements with large time skew
 #define ORISYNC_ADVSKEW		5
-// Repository check interval
-#define ORISYNC_MONINTERVAL	1 //10
+// Repository check interval for missed change notifications and retries
+#define ORISYNC_MONINTERVAL	60
+// Repository check interval without inotify
+#define ORISYNC_POLLINTERVAL	5
+// Quiet period after a change before a mounted repository is snapshotted
+#define ORISYNC_SSDEBOUNCE	2
+// Longest delay of a snapshot while a repository is continuously modified
+#define ORISYNC_SSMAXDELAY	10
+// Long poll timeout for change notifications from mounted repositories
+#define ORISYNC_WAITTIMEOUT	10
 // Repository snapshot interval in slow mode
 #define ORISYNC_SLOWSSINTERVAL	30
 // Sync interval
 #define ORISYNC_SYNCINTERVAL	1 //5
+// Number of repositories pulled concurrently
+#define ORISYNC_SYNCWORKERS	4
 // Watchdog interval
 #define ORISYNC_WDINTERVAL	10 // seconds for now
 // Garbage collection interval
@@ -95,13 +116,7 @@ HostInfo myInfo;
 //RWLock infoLock;
 map<string, HostInfo *> hosts;
 RWLock hostsLock;
-struct mrqElem {
-    string uuid;
-    string hostId;
-};
-queue<struct mrqElem> mrq; // Modified Repo Queue
-mutex mrqLock;
-condition_variable mrqCV;
+SyncQueue syncQueue(ORISYNC_SYNCWORKERS);
 mutex exitLock;
 condition_variable exitCV;
 
@@ -190,15 +205,8 @@ public:
                 continue;
 
 	    // Enqueue repo for Syncer
-            struct mrqElem repo;
-            repo.uuid = repoID;
-            repo.hostId = remote->getHostId();
-            {
-                lock_guard<mutex> lk(mrqLock);
-                mrq.push(repo);
-                DLOG("New MRQ elem pushed");
-            }
-            mrqCV.notify_one();
+            syncQueue.push(repoID, remote->getHostId(),
+                           remote->getRepo(repoID).getHead());
         }
         key.reset();
         rhostKey.reset();
@@ -325,6 +333,127 @@ private:
     int fd;
 };
 
+/*
+ * Change notifications handed to the RepoMonitor by the ChangeWatcher
+ * threads.  A byte is written to a pipe for every event so the monitor can
+ * wait on it together with inotify.
+ */
+struct RepoEvent {
+    string path;
+    bool failed;
+    uint64_t gen;
+    string head;
+};
+
+class RepoEventQueue
+{
+public:
+    RepoEventQueue() {
+        if (pipe(fds) < 0)
+            throw SystemException();
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    }
+    ~RepoEventQueue() {
+        close(fds[0]);
+        close(fds[1]);
+    }
+    void push(const RepoEvent &ev) {
+        char c = 0;
+
+        {
+            lock_guard<mutex> lk(lock);
+            events.push_back(ev);
+        }
+        // A full pipe already has a wakeup pending
+        if (write(fds[1], &c, 1) < 0 && errno != EAGAIN)
+            perror("write");
+    }
+    list<RepoEvent> drain() {
+        char buf[64];
+        list<RepoEvent> rval;
+
+        while (read(fds[0], buf, sizeof(buf)) > 0)
+            ;
+
+        lock_guard<mutex> lk(lock);
+        rval.swap(events);
+        return rval;
+    }
+    int getFd() {
+        return fds[0];
+    }
+private:
+    int fds[2];
+    mutex lock;
+    list<RepoEvent> events;
+};
+
+/*
+ * Long polls a mounted file system for changes over its UDS socket and
+ * forwards them to the RepoMonitor.  Exits after reporting a failure, the
+ * monitor starts a new watcher once the repository can be reached again.
+ */
+class ChangeWatcher : public Thread
+{
+public:
+    ChangeWatcher(const string &path, uint64_t gen, const string &head,
+                  RepoEventQueue *q)
+        : Thread(), path(path), gen(gen), head(head), q(q), done(false)
+    {
+    }
+    void run() {
+        RepoControl repo = RepoControl(path);
+        RepoEvent ev;
+
+        ev.path = path;
+        ev.failed = true;
+        ev.gen = 0;
+
+        try {
+            repo.open();
+        } catch (SystemException &e) {
+            q->push(ev);
+            done = true;
+            return;
+        }
+
+        while (!interruptionRequested()) {
+            uint64_t curGen;
+            string curHead;
+
+            if (repo.waitChange(gen, head, ORISYNC_WAITTIMEOUT,
+                                &curGen, &curHead) < 0) {
+                q->push(ev);
+                break;
+            }
+
+            if (curGen != gen || curHead != head) {
+                gen = curGen;
+                head = curHead;
+
+                ev.failed = false;
+                ev.gen = gen;
+                ev.head = head;
+                q->push(ev);
+                ev.failed = true;
+            }
+        }
+
+        repo.close();
+        done = true;
+    }
+    bool isDone() {
+        return done;
+    }
+private:
+    string path;
+    uint64_t gen;
+    string head;
+    RepoEventQueue *q;
+    atomic<bool> done;
+};
+
 class RepoMonitor : public Thread
 {
 public:
@@ -348,9 +477,22 @@ public:
         dstAddr.sin_family = AF_INET;
         dstAddr.sin_addr.s_addr = inet_addr(ORISYNC_MCADDR);
         dstAddr.sin_port = htons(ORISYNC_UDPPORT);
+
+#ifdef __linux__
+        inotifyFd = inotify_init();
+        if (inotifyFd < 0) {
+            WARNING("inotify unavailable, polling unmounted repositories");
+        } else {
+            fcntl(inotifyFd, F_SETFL, O_NONBLOCK);
+        }
+#else
+        inotifyFd = -1;
+#endif /* __linux__ */
     }
     ~RepoMonitor() {
         close(fd);
+        if (inotifyFd != -1)
+            close(inotifyFd);
     }
     string generate() {
         //RWKey::sp key = infoLock.readLock();
@@ -380,100 +522,435 @@ public:
         if (status < 0) {
             perror("sendto");
         }
+
+        lastAnnounce = time(NULL);
     }
     /*
-     * Update repository information and return thre repoId, otherwise empty 
-     * string.
+     * Monitoring state of a registered repository.  Mounted repositories keep
+     * their UDS connection open and have a ChangeWatcher, unmounted ones are
+     * watched with inotify and only opened when their head may have moved.
      */
-    void updateRepo(const string &path) {
-        RWKey::sp key = myInfo.hostLock.writeLock();
-        RepoControl repo = RepoControl(path);
+    struct MonitoredRepo {
+        string path;
+        RepoControl *repo;
+        ChangeWatcher *watcher;
+        int headWd;
+        int refsWd;
+        bool check;         // head needs to be read again
+        time_t lastCheck;
+        time_t retryTime;   // reopen after a failure, 0 if reachable
+        uint64_t gen;       // last change generation reported by orifs
+        string head;
+        time_t firstChange; // first change not in a snapshot, 0 if clean
+        time_t lastChange;
+        time_t ssDeferred;  // snapshot held back in slow mode until then
+    };
+    /*
+     * Update repository information, take a snapshot if requested and
+     * announce if the head moved.  Returns false if the repository could not
+     * be reached.
+     */
+    bool updateRepo(MonitoredRepo &m, bool takeSnapshot) {
+        RepoControl local = RepoControl(m.path);
+        RepoControl *repo = m.repo;
         RepoInfo info;
-        int ret = 0;;
-
-        try {
-            repo.open();
-        } catch (SystemException &e) {
-            WARNING("Failed to open repository %s: %s", path.c_str(), e.what());
-            return;
+        string head;
+        bool changed;
+        bool snapshotted = false;
+        int ret = 0;
+
+        if (repo == NULL) {
+            try {
+                local.open();
+            } catch (SystemException &e) {
+                WARNING("Failed to open repository %s: %s",
+                        m.path.c_str(), e.what());
+                return false;
+            }
+            repo = &local;
         }
 
-        //RWKey::sp key = infoLock.writeLock();
-        if (myInfo.hasRepo(repo.getUUID())) {
-            info = myInfo.getRepo(repo.getUUID());
-            if (info.getPath() != path) {
-                 info = RepoInfo(repo.getUUID(), repo.getPath(), repo.isMounted());
+        if (takeSnapshot && !repo->isMounted()) {
+            m.firstChange = 0;
+        } else if (takeSnapshot) {
+            shared_ptr<RWLock> repoLock;
+            time_t ssTime = 0;
+            bool slow = false;
+
+            RWKey::sp key = myInfo.hostLock.readLock();
+            if (myInfo.hasRepo(repo->getUUID())) {
+                RepoInfo cur = myInfo.getRepo(repo->getUUID());
+                repoLock = cur.getRepoLock();
+                ssTime = cur.getSStime();
+                slow = !cur.hasRemote();
+            }
+            key.reset();
+
+            // Take snapshots with a longer interval without remote peers
+            if (slow && ssTime > time(NULL) - ORISYNC_SLOWSSINTERVAL) {
+                m.ssDeferred = ssTime + ORISYNC_SLOWSSINTERVAL;
+            } else {
+                // Only the repository is locked while the snapshot is taken
+                RWKey::sp repoKey;
+                if (repoLock)
+                    repoKey = repoLock->writeLock();
+                ret = repo->snapshot();
+                repoKey.reset();
+                snapshotted = true;
+                m.firstChange = 0;
+                m.ssDeferred = 0;
             }
-            info.setMounted(repo.isMounted());
-        } else {
-            DLOG("New repo added: %s", repo.getPath().c_str());
-            info = RepoInfo(repo.getUUID(), repo.getPath(), repo.isMounted());
         }
 
-        if (repo.isMounted()) {
-            if (!info.hasRemote()) {
-                // Take snapshot with longer interval
-                if (info.getSStime() > time(NULL) - ORISYNC_SLOWSSINTERVAL)
-                    goto skipss;
+        head = repo->getHead();
 
+        RWKey::sp key = myInfo.hostLock.writeLock();
+        //RWKey::sp key = infoLock.writeLock();
+        if (myInfo.hasRepo(repo->getUUID())) {
+            info = myInfo.getRepo(repo->getUUID());
+            if (info.getPath() != m.path) {
+                 info = RepoInfo(repo->getUUID(), repo->getPath(), repo->isMounted());
             }
-            RWKey::sp repoKey = myInfo.getRepoLock(repo.getUUID())->writeLock();
-            ret = repo.snapshot();
-            info.setSStime();
-            repoKey.reset();
+            info.setMounted(repo->isMounted());
+        } else {
+            DLOG("New repo added: %s", repo->getPath().c_str());
+            info = RepoInfo(repo->getUUID(), repo->getPath(), repo->isMounted());
         }
+        if (snapshotted)
+            info.setSStime();
 
-skipss:
         //before my change to updateRepo,
         //when local2 is a replica of local 1, and when we check local2, say local 2 
         //has a new commit, but local1 hasn't yet. local1's head will be updated here
         //isn't this a bug??????
-        info.updateHead(repo.getHead());
-        myInfo.updateRepo(repo.getUUID(), info);
+        changed = (head != info.getHead());
+        info.updateHead(head);
+        myInfo.updateRepo(repo->getUUID(), info);
         key.reset();
 
-        //LOG("Checked %s: %s %s", path.c_str(), repo.getHead().c_str(), repo.getUUID().c_str());
+        //LOG("Checked %s: %s %s", m.path.c_str(), head.c_str(), repo->getUUID().c_str());
 
-        if (ret == 1) {// Repo has changed
+        m.head = head;
+        m.check = false;
+        m.lastCheck = time(NULL);
+
+        if (ret == 1 || changed) {// Repo has changed
+          DLOG("Repository %s is now at %s", m.path.c_str(), head.c_str());
           announce();
         }
-        
-        repo.close();
 
-        return;
+        if (repo == &local)
+            local.close();
+
+        return true;
+    }
+    /*
+     * Connects to a repository and decides how to watch it.
+     */
+    void openRepo(MonitoredRepo &m) {
+        RepoControl *repo = new RepoControl(m.path);
+
+        try {
+            repo->open();
+        } catch (SystemException &e) {
+            WARNING("Failed to open repository %s: %s", m.path.c_str(), e.what());
+            delete repo;
+            m.retryTime = time(NULL) + ORISYNC_MONINTERVAL;
+            return;
+        }
+
+        m.retryTime = 0;
+        if (repo->isMounted()) {
+            m.repo = repo;
+        } else {
+            string root = repo->getRootPath();
+            repo->close();
+            delete repo;
+            watchRepo(m, root);
+        }
+
+        if (!updateRepo(m, false)) {
+            closeRepo(m);
+            m.retryTime = time(NULL) + ORISYNC_MONINTERVAL;
+            return;
+        }
+
+        if (m.repo != NULL) {
+            m.watcher = new ChangeWatcher(m.path, m.gen, m.head, &events);
+            m.watcher->start();
+        }
+    }
+    void closeRepo(MonitoredRepo &m) {
+        if (m.watcher) {
+            m.watcher->interrupt();
+            retired.push_back(m.watcher);
+            m.watcher = NULL;
+        }
+        if (m.repo) {
+            m.repo->close();
+            delete m.repo;
+            m.repo = NULL;
+        }
+        unwatchRepo(m);
+    }
+    void watchRepo(MonitoredRepo &m, const string &oriDir) {
+#ifdef __linux__
+        if (inotifyFd == -1)
+            return;
+
+        uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE;
+
+        m.headWd = inotify_add_watch(inotifyFd, oriDir.c_str(),
+                                     mask | IN_DELETE_SELF | IN_MOVE_SELF);
+        m.refsWd = inotify_add_watch(inotifyFd,
+                                     (oriDir + ORI_PATH_HEADS).c_str(), mask);
+        if (m.headWd < 0) {
+            WARNING("Cannot watch %s: %s", oriDir.c_str(), strerror(errno));
+        } else {
+            watches[m.headWd] = m.path;
+        }
+        if (m.refsWd >= 0)
+            watches[m.refsWd] = m.path;
+#endif /* __linux__ */
+    }
+    void unwatchRepo(MonitoredRepo &m) {
+#ifdef __linux__
+        if (m.headWd >= 0) {
+            inotify_rm_watch(inotifyFd, m.headWd);
+            watches.erase(m.headWd);
+        }
+        if (m.refsWd >= 0) {
+            inotify_rm_watch(inotifyFd, m.refsWd);
+            watches.erase(m.refsWd);
+        }
+#endif /* __linux__ */
+        m.headWd = -1;
+        m.refsWd = -1;
+    }
+    /*
+     * Picks up repositories added or removed through the orisync command.
+     */
+    void refreshRepos() {
+        RWKey::sp key = rcLock.readLock();
+        list<string> paths = rc.getRepos();
+        key.reset();
+        set<string> current(paths.begin(), paths.end());
+
+        for (auto it = repos.begin(); it != repos.end(); ) {
+            if (current.find(it->first) == current.end()) {
+                closeRepo(it->second);
+                it = repos.erase(it);
+            } else {
+                it++;
+            }
+        }
+
+        for (auto &path : paths) {
+            if (repos.find(path) != repos.end())
+                continue;
+
+            MonitoredRepo &m = repos[path];
+            m.path = path;
+            m.repo = NULL;
+            m.watcher = NULL;
+            m.headWd = -1;
+            m.refsWd = -1;
+            m.check = false;
+            m.lastCheck = 0;
+            m.retryTime = 0;
+            m.gen = 0;
+            m.firstChange = 0;
+            m.lastChange = 0;
+            m.ssDeferred = 0;
+            openRepo(m);
+        }
+
+        // Reap watchers that were asked to stop
+        for (auto it = retired.begin(); it != retired.end(); ) {
+            if ((*it)->isDone()) {
+                (*it)->wait();
+                delete *it;
+                it = retired.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+    /*
+     * Snapshots are taken once a mounted file system has been quiet for
+     * ORISYNC_SSDEBOUNCE seconds, but no later than ORISYNC_SSMAXDELAY after
+     * the first change.
+     */
+    time_t snapshotTime(const MonitoredRepo &m) {
+        time_t t;
+
+        if (m.firstChange == 0)
+            return 0;
+
+        t = min(m.lastChange + ORISYNC_SSDEBOUNCE,
+                m.firstChange + ORISYNC_SSMAXDELAY);
+        return max(t, m.ssDeferred);
+    }
+    /*
+     * Applies pending change notifications, blocking up to timeout seconds
+     * for the first one.
+     */
+    void waitEvents(int timeout) {
+        struct pollfd fds[2];
+        int nfds = 0;
+
+        fds[nfds].fd = events.getFd();
+        fds[nfds].events = POLLIN;
+        nfds++;
+        if (inotifyFd != -1) {
+            fds[nfds].fd = inotifyFd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+
+        if (poll(fds, nfds, timeout * 1000) <= 0)
+            return;
+
+        for (auto &ev : events.drain()) {
+            auto it = repos.find(ev.path);
+            if (it == repos.end())
+                continue;
+
+            MonitoredRepo &m = it->second;
+            if (ev.failed) {
+                if (m.watcher == NULL)
+                    continue;
+                // Possibly unmounted, reconnect on the next pass
+                closeRepo(m);
+                m.retryTime = time(NULL);
+                continue;
+            }
+            if (ev.gen != m.gen) {
+                m.gen = ev.gen;
+                m.lastChange = time(NULL);
+                if (m.firstChange == 0)
+                    m.firstChange = m.lastChange;
+            }
+            if (ev.head != m.head)
+                m.check = true;
+        }
+
+#ifdef __linux__
+        if (inotifyFd == -1)
+            return;
+
+        char buf[4096]
+            __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        ssize_t len;
+
+        while ((len = read(inotifyFd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len; ) {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                p += sizeof(struct inotify_event) + ev->len;
+
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    for (auto &it : repos)
+                        it.second.check = true;
+                    continue;
+                }
+
+                auto w = watches.find(ev->wd);
+                if (w == watches.end())
+                    continue;
+                auto it = repos.find(w->second);
+                if (it == repos.end())
+                    continue;
+
+                MonitoredRepo &m = it->second;
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                    if (ev->wd == m.headWd) {
+                        closeRepo(m);
+                        m.retryTime = time(NULL) + ORISYNC_MONINTERVAL;
+                    }
+                    continue;
+                }
+                // Only HEAD matters in the repository directory itself
+                if (ev->wd == m.headWd &&
+                    (ev->len == 0 || strcmp(ev->name, ORI_PATH_HEAD + 1) != 0))
+                    continue;
+                m.check = true;
+            }
+        }
+#endif /* __linux__ */
     }
     void run() {
+        lastAnnounce = 0;
 
         while (!interruptionRequested()) {
-            RWKey::sp key = rcLock.readLock();
-            list<string> repos = rc.getRepos();
-            key.reset();
+            time_t now = time(NULL);
+            time_t next;
+
+            refreshRepos();
+
             for (auto &it : repos) {
-                updateRepo(it);
+                MonitoredRepo &m = it.second;
+                time_t ssTime;
+
+                if (m.retryTime != 0) {
+                    if (m.retryTime <= now)
+                        openRepo(m);
+                    continue;
+                }
+
+                // Safety net for missed events, also polls without inotify
+                if (m.lastCheck + (inotifyFd == -1 ? ORISYNC_POLLINTERVAL :
+                                   ORISYNC_MONINTERVAL) <= now)
+                    m.check = true;
+
+                ssTime = snapshotTime(m);
+                if (ssTime != 0 && ssTime <= now) {
+                    updateRepo(m, true);
+                } else if (m.check) {
+                    updateRepo(m, false);
+                }
             }
 
-            announce();
-            sleep(ORISYNC_MONINTERVAL);
+            if (lastAnnounce + ORISYNC_ADVINTERVAL <= now)
+                announce();
+
+            // Sleep until the next announcement or snapshot is due
+            now = time(NULL);
+            next = lastAnnounce + ORISYNC_ADVINTERVAL;
+            for (auto &it : repos) {
+                time_t ssTime = snapshotTime(it.second);
+                if (ssTime != 0)
+                    next = min(next, ssTime);
+            }
+            waitEvents(next > now ? (int)(next - now) : 0);
         }
 
+        for (auto &it : repos)
+            closeRepo(it.second);
 
         DLOG("RepoMonitor exited!");
     }
 private:
     int fd;
     struct sockaddr_in dstAddr;
+    int inotifyFd;
+    time_t lastAnnounce;
+    RepoEventQueue events;
+    map<string, MonitoredRepo> repos;
+    map<int, string> watches;
+    list<ChangeWatcher *> retired;
 };
 
 class Syncer : public Thread
 {
 public:
-    Syncer() : Thread()
+    Syncer() : Thread(), pool(ORISYNC_SYNCWORKERS)
     {
     }
     void pullRepoLocal(RepoInfo &localRepoA,
                        RepoInfo &localRepoB)
     {
-        RWKey::sp key = myInfo.hostLock.writeLock();
+        shared_ptr<RWLock> repoLock = localRepoA.getRepoLock();
+        RWKey::sp repoKey = repoLock->writeLock();
         RepoControl repo = RepoControl(localRepoA.getPath());
 
         DLOG("Local and Remote heads mismatch on repo %s", localRepoA.getRepoId().c_str());
@@ -495,22 +972,26 @@ public:
         if (!hasCommit) {
             LOG("Pulling from local repo %s",
                 localRepoB.getPath().c_str());
-            RWKey::sp repoKey = myInfo.getRepoLock(localRepoA.getRepoId())->writeLock();
             repo.pull("localhost", localRepoB.getPath());
-            repoKey.reset();
         }
         repo.close();
     }
-    void pullRepo(struct mrqElem &mRepo)
+    /*
+     * Only the repository being pulled is locked so that the Listener and
+     * RepoMonitor keep running and pulls of other repositories proceed.
+     */
+    void pullRepo(const SyncQueue::Request &mRepo)
     {
-        RWKey::sp key = myInfo.hostLock.writeLock();
-        HostInfo localHost = myInfo;
-        if (!localHost.hasRepo(mRepo.uuid)) {
+        RWKey::sp key = myInfo.hostLock.readLock();
+        if (!myInfo.hasRepo(mRepo.uuid)) {
             DLOG("Local info not found for repo %s", mRepo.uuid.c_str());
             return;
         }
-        RWKey::sp repoKey = myInfo.getRepoLock(mRepo.uuid)->writeLock();
-        RepoInfo local = localHost.getRepo(mRepo.uuid);
+        RepoInfo local = myInfo.getRepo(mRepo.uuid);
+        key.reset();
+
+        shared_ptr<RWLock> repoLock = local.getRepoLock();
+        RWKey::sp repoKey = repoLock->writeLock();
         RepoControl repo = RepoControl(local.getPath());
         RepoInfo remote;
         string srcPath;
@@ -524,6 +1005,7 @@ public:
                 return;
             }
             HostInfo *remoteHost = hosts[mRepo.hostId];
+            RWKey::sp rhostKey = remoteHost->hostLock.readLock();
             if (!remoteHost->hasRepo(mRepo.uuid)) {
                 DLOG("Repo %s not found on host %s", mRepo.uuid.c_str(), remoteHost->getHost().c_str());
                 return;
@@ -555,52 +1037,74 @@ public:
                 remote.getPath().c_str());
             repo.pull(srcPath, remote.getPath());
         }
-        key.reset();
         repoKey.reset();
         repo.close();
     }
+    /*
+     * Brings copies of the same repository on this host up to date with each
+     * other.
+     */
+    void checkLocal()
+    {
+        RWKey::sp key = myInfo.hostLock.readLock();
+        list<RepoInfo> allrepos = myInfo.listAllRepos();
+        key.reset();
+
+        map<string, vector<RepoInfo> > copies;
+        for (auto &it : allrepos) {
+            copies[it.getRepoId()].push_back(it);
+        }
+
+        for (auto &it : copies) {
+            vector<RepoInfo> &c = it.second;
+
+            for (size_t i = 0; i < c.size(); i++) {
+                for (size_t j = 0; j < c.size(); j++) {
+                    if (i == j || c[i].getHead() == c[j].getHead())
+                        continue;
+                    LOG("local repo %s and %s don't have the same head",
+                        c[i].getPath().c_str(), c[j].getPath().c_str());
+                    pullRepoLocal(c[i], c[j]);
+                }
+            }
+        }
+    }
     void run() {
+        TaskGroup group(&pool);
+        time_t lastLocal = 0;
+
         while (!interruptionRequested()) {
-            unique_lock<mutex> lk(mrqLock);
-            mrqCV.wait_for(lk, chrono::seconds(ORISYNC_SYNCINTERVAL));
-            if (interruptionRequested()) {
-                lk.unlock();
-                break;
+            SyncQueue::Request mRepo;
+
+            if (syncQueue.pop(&mRepo, ORISYNC_SYNCINTERVAL)) {
+                group.run([this, mRepo]() {
+                    Stopwatch sw = Stopwatch();
+
+                    LOG("Syncer checking %s", mRepo.uuid.c_str());
+                    sw.start();
+                    try {
+                        pullRepo(mRepo);
+                    } catch (exception &e) {
+                        WARNING("Pull of %s failed: %s",
+                                mRepo.uuid.c_str(), e.what());
+                    }
+                    sw.stop();
+                    syncQueue.done(mRepo, sw.getElapsedMS());
+                });
             }
 
-            while (!mrq.empty()) {
-                struct mrqElem mRepo = mrq.front();
-                mrq.pop();
-                lk.unlock();
-                LOG("Syncer checking %s", mRepo.uuid.c_str());
-                pullRepo(mRepo);
-                lk.lock();
+            if (lastLocal + ORISYNC_SYNCINTERVAL <= time(NULL)) {
+                checkLocal();
+                lastLocal = time(NULL);
             }
-            lk.unlock();
-
-            HostInfo infoSnapshot = myInfo;
-            list<RepoInfo> allrepos = infoSnapshot.listAllRepos();
-            for (auto &it : allrepos) {
-                //LOG("Syncer local checking %s, %s", it.getRepoId().c_str(), it.getPath().c_str());
-                //check local repo
-                for (auto &it_cpy : allrepos) {
-                      //LOG("local repo check, %s and %s have uuid %s and %s", it.getPath().c_str(),
-                      //    it_cpy.getPath().c_str(), it.getRepoId().c_str(), it_cpy.getRepoId().c_str());
-                    if (it.getRepoId() == it_cpy.getRepoId()) {
-                      //LOG("local repo check, %s and %s have same uuid", it.getPath().c_str(),
-                      //    it_cpy.getPath().c_str());
-                      if (it.getHead() != it_cpy.getHead()) {
-                          LOG("local repo %s and %s don't have the same head",
-                              it.getPath().c_str(), it_cpy.getPath().c_str());
-                        pullRepoLocal(it, it_cpy);
-                      }
-                    }
-                }
-           }
         }
 
+        group.wait();
+
         DLOG("Syncer exited!");
     }
+private:
+    ThreadPool pool;
 };
 
 void
@@ -823,7 +1327,7 @@ start_server()
     listener->interrupt();
 
     // Wait for syncer to quit
-    mrqCV.notify_one();
+    syncQueue.shutdown();
     syncer->wait();
 
     MSG("OriSync quits");
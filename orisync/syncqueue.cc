@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <map>
+#include <set>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
+#include <oriutil/debug.h>
+
+#include "syncqueue.h"
+
+using namespace std;
+
+static uint64_t
+SyncQueue_NowMS()
+{
+    return chrono::duration_cast<chrono::milliseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+SyncQueue::SyncQueue(int maxInflight)
+    : lock(), cv(), pending(), inflight(), maxInflight(maxInflight),
+      exiting(false), nextSeq(0), totalPullMS(0)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+SyncQueue::~SyncQueue()
+{
+}
+
+void
+SyncQueue::push(const string &uuid, const string &hostId, const string &head)
+{
+    unique_lock<mutex> l(lock);
+    map<string, Request>::iterator it = pending.find(uuid);
+
+    stats.requests++;
+    if (it != pending.end()) {
+        stats.merged++;
+        if (it->second.head != head) {
+            it->second.hostId = hostId;
+            it->second.head = head;
+            it->second.headTime = time(NULL);
+        }
+        return;
+    }
+
+    Request &r = pending[uuid];
+    r.uuid = uuid;
+    r.hostId = hostId;
+    r.head = head;
+    r.headTime = time(NULL);
+    r.seq = nextSeq++;
+    r.queuedMS = SyncQueue_NowMS();
+
+    cv.notify_one();
+}
+
+/*
+ * Newest remote head first, then in arrival order.
+ */
+bool
+SyncQueue::better(const Request &a, const Request &b) const
+{
+    if (a.headTime != b.headTime)
+        return a.headTime > b.headTime;
+    return a.seq < b.seq;
+}
+
+bool
+SyncQueue::pop(Request *req, int timeout)
+{
+    unique_lock<mutex> l(lock);
+    chrono::steady_clock::time_point deadline =
+        chrono::steady_clock::now() + chrono::seconds(timeout);
+
+    while (!exiting) {
+        if ((int)inflight.size() < maxInflight) {
+            map<string, Request>::iterator best = pending.end();
+            map<string, Request>::iterator it;
+
+            for (it = pending.begin(); it != pending.end(); it++) {
+                if (inflight.find(it->first) != inflight.end())
+                    continue;
+                if (best == pending.end() || better(it->second, best->second))
+                    best = it;
+            }
+
+            if (best != pending.end()) {
+                *req = best->second;
+                pending.erase(best);
+                inflight.insert(req->uuid);
+                stats.lastWaitMS = SyncQueue_NowMS() - req->queuedMS;
+                return true;
+            }
+        }
+
+        if (cv.wait_until(l, deadline) == cv_status::timeout)
+            return false;
+    }
+
+    return false;
+}
+
+void
+SyncQueue::done(const Request &req, uint64_t pullMS)
+{
+    unique_lock<mutex> l(lock);
+
+    inflight.erase(req.uuid);
+    stats.pulls++;
+    stats.lastPullMS = pullMS;
+    if (pullMS > stats.maxPullMS)
+        stats.maxPullMS = pullMS;
+    totalPullMS += pullMS;
+
+    cv.notify_all();
+}
+
+void
+SyncQueue::shutdown()
+{
+    unique_lock<mutex> l(lock);
+
+    exiting = true;
+    cv.notify_all();
+}
+
+SyncQueue::Stats
+SyncQueue::getStats()
+{
+    unique_lock<mutex> l(lock);
+    Stats s = stats;
+
+    s.depth = pending.size();
+    s.inflight = inflight.size();
+    s.avgPullMS = stats.pulls ? totalPullMS / stats.pulls : 0;
+
+    return s;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __SYNCQUEUE_H__
+#define __SYNCQUEUE_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include <string>
+#include <set>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+
+/*
+ * Queue of pulls for the Syncer.  Requests are deduplicated per repository:
+ * a repository appears at most once and a newer remote head replaces the
+ * pending one.  Repositories whose remote head changed most recently are
+ * pulled first, and no repository is pulled by two workers at once.
+ */
+class SyncQueue
+{
+public:
+    struct Request {
+        std::string uuid;
+        std::string hostId;
+        std::string head;
+        time_t headTime;    // when this remote head was first queued
+        uint64_t seq;
+        uint64_t queuedMS;
+    };
+    struct Stats {
+        uint64_t depth;
+        uint64_t inflight;
+        uint64_t requests;
+        uint64_t merged;    // requests folded into a pending one
+        uint64_t pulls;
+        uint64_t lastWaitMS;
+        uint64_t lastPullMS;
+        uint64_t avgPullMS;
+        uint64_t maxPullMS;
+    };
+    explicit SyncQueue(int maxInflight);
+    ~SyncQueue();
+    void push(const std::string &uuid, const std::string &hostId,
+              const std::string &head);
+    /// Waits up to timeout seconds for a request and a free worker slot
+    bool pop(Request *req, int timeout);
+    /// Releases the slot taken by pop and records the pull latency
+    void done(const Request &req, uint64_t pullMS);
+    /// Makes pop return false from now on
+    void shutdown();
+    Stats getStats();
+private:
+    bool better(const Request &a, const Request &b) const;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::map<std::string, Request> pending;
+    std::set<std::string> inflight;
+    int maxInflight;
+    bool exiting;
+    uint64_t nextSeq;
+    Stats stats;
+    uint64_t totalPullMS;
+};
+
+#endif /* __SYNCQUEUE_H__ */
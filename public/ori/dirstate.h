@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __DIRSTATE_H__
+#define __DIRSTATE_H__
+
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <mutex>
+#include <unordered_map>
+
+#include <oriutil/objecthash.h>
+#include "tree.h"
+
+/*
+ * Stat cache for a working directory, kept in ORI_PATH_DIRSTATE.  For every
+ * file it records the size, mtime, ctime and inode seen when the file was
+ * last hashed together with the hash of its contents (the largeHash for
+ * LargeBlobs).  TreeDiff::diffToDir only hashes files whose stat information
+ * no longer matches.
+ *
+ * Files modified in the same timestamp tick as the dirstate was written
+ * cannot be told apart by stat and are always hashed again.  The file is a
+ * cache: if it is missing or unreadable everything is simply hashed.
+ *
+ * lookup, update and remove may be called from several scanning threads.
+ */
+class DirState
+{
+public:
+    struct Entry {
+        uint64_t size;
+        int64_t mtime; // nanoseconds
+        int64_t ctime; // nanoseconds
+        uint64_t ino;
+        ObjectHash hash; // empty until the contents have been hashed
+    };
+
+    DirState();
+    ~DirState();
+    void open(const std::string &stateFile);
+    /// Writes the state back if it changed
+    void save();
+    void clear();
+    /// Returns true and sets hash if path is known and unchanged
+    bool lookup(const std::string &path, const struct stat &sb,
+                ObjectHash *hash) const;
+    /// Records the stat information of path and the hash of its contents
+    void update(const std::string &path, const struct stat &sb,
+                const ObjectHash &hash = ObjectHash());
+    void remove(const std::string &path);
+    /// Fills in hashes of files recorded without one from a committed tree
+    /// and forgets files that are not part of it
+    void updateFromTree(const Tree::Flat &flat);
+    size_t size() const;
+private:
+    std::string fileName;
+    int64_t savedTime;
+    bool dirty;
+    mutable std::mutex lock;
+    std::unordered_map<std::string, Entry> entries;
+};
+
+#endif /* __DIRSTATE_H__ */
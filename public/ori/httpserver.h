@@ -17,6 +17,10 @@
 #ifndef __HTTPSERVER_H__
 #define __HTTPSERVER_H__
 
+#include <stdint.h>
+
+#include <vector>
+
 #include <event2/event.h>
 #include <event2/http.h>
 #include <event2/http_struct.h>
@@ -24,17 +28,33 @@
 #include <event2/util.h>
 #include <event2/keyvalq_struct.h>
 
+class HTTPStream;
+
+/*
+ * Serves a repository to HttpRepo clients.  Each of the server's threads runs
+ * its own event loop accepting connections from the shared listening socket,
+ * so a slow client only holds up the connections of its own thread.  The
+ * index, commit list and object transfers are sent as chunked responses that
+ * are produced a chunk at a time as the client drains them, which bounds the
+ * memory held for each request.
+ */
 class HTTPServer
 {
 public:
-    HTTPServer(LocalRepo &repository, uint16_t port);
+    /// threads < 0 selects HTTPSERVER_THREADS
+    HTTPServer(LocalRepo &repository, uint16_t port, int threads = -1);
     ~HTTPServer();
+    /// Serves requests until stop is called
     void start(bool mDNSEnable);
+    /// May be called from any thread
     void stop();
+    /// The bound port, useful when constructed with port 0
+    uint16_t getPort();
 protected:
     void entry(struct evhttp_request *req);
 private:
     int authenticate(struct evhttp_request *req, struct evbuffer *buf);
+    void sendStream(HTTPStream *stream);
     // Handlers
     void stop(struct evhttp_request *req);
     void getId(struct evhttp_request *req);
@@ -47,9 +67,15 @@ private:
     void getObjInfo(struct evhttp_request *req);
     LocalRepo &repo;
     uint16_t port;
-    struct evhttp *httpd;
-    /* set if a test needs to call loopexit on a base */
-    struct event_base *base;
+    int listenFd;
+    // Written to stop every event loop
+    int stopPipe[2];
+    struct Worker {
+        struct event_base *base;
+        struct evhttp *httpd;
+        struct event *stopEvent;
+    };
+    std::vector<Worker> workers;
     friend void HTTPServerReqHandlerCB(struct evhttp_request *req, void *arg);
 };
 
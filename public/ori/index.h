@@ -21,11 +21,33 @@
 
 #include <string>
 #include <set>
-#include <unordered_map>
+#include <vector>
+#include <map>
+
+#include <oriutil/rwlock.h>
 
 #include "object.h"
 #include "packfile.h"
 
+/// Suffix of the sorted base index stored next to the index log
+#define INDEX_SORTED_SUFFIX ".sorted"
+
+/*
+ * The index is stored in two parts.  A sorted, immutable base file that is
+ * memory mapped and binary searched in place, and an append-only log of the
+ * entries added since the base was last written.  Only the log is loaded
+ * into memory on open.  Index::rewrite folds the log into a new base, which
+ * the writer does on its own once the log grows too large and before it
+ * first appends to an index written before the sorted base existed.
+ *
+ * Other processes may open the index at any time, so open never writes.
+ * Replacing the base and the log by rename leaves their open files intact.
+ *
+ * Lookups may run on any number of threads concurrently with a single
+ * writer.  The in-memory log and the base mapping are guarded by a reader
+ * writer lock that the writer only holds while publishing entries, never
+ * across disk I/O.
+ */
 class Index
 {
 public:
@@ -37,15 +59,49 @@ public:
     void rewrite();
     void dump();
     void updateEntry(const ObjectHash &objId, const IndexEntry &entry);
-    const IndexEntry &getEntry(const ObjectHash &objId) const;
-    const ObjectInfo &getInfo(const ObjectHash &objId) const;
+    /*
+     * Entries updated between beginBatch and commitBatch are appended to the
+     * log with a single writev followed by one fsync.  Batches may nest.
+     */
+    void beginBatch();
+    void commitBatch();
+    IndexEntry getEntry(const ObjectHash &objId) const;
+    ObjectInfo getInfo(const ObjectHash &objId) const;
     bool hasObject(const ObjectHash &objId) const;
+    /// Returns false if objId is not indexed, otherwise sets entry
+    bool lookup(const ObjectHash &objId, IndexEntry *entry) const;
     std::set<ObjectInfo> getList();
+    /// Appends up to max entries with hashes after the given one (from the
+    /// first if it is empty) to infos in hash order
+    void getList(const ObjectHash &after, size_t max,
+                 std::vector<ObjectInfo> *infos) const;
+    /// Number of distinct objects
+    size_t size() const;
 private:
     int fd;
     std::string fileName;
-    std::unordered_map<ObjectHash, IndexEntry> index;
+    // The log is torn or predates the base, see _needsRewrite
+    bool rewriteLog;
+    mutable RWLock lock;
+    std::map<ObjectHash, IndexEntry> index; // log, in hash order
+
+    // Pending log entries
+    int batchDepth;
+    std::vector<std::string> batch;
+
+    // Sorted base index
+    int baseFd;
+    const uint8_t *baseMap;
+    size_t baseLen;
+    const uint8_t *baseEntries;
+    uint32_t baseCount;
+    uint32_t fanout[256];
 
+    void _openBase();
+    void _closeBase();
+    bool _needsRewrite() const;
+    const uint8_t *_findBase(const ObjectHash &objId) const;
+    bool _lookup(const ObjectHash &objId, IndexEntry *entry) const;
     void _writeEntry(const IndexEntry &e);
 };
 
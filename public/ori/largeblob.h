@@ -36,14 +36,29 @@ public:
 
 class Repo;
 
+/*
+ * Positioned reads of the contents being chunked.  read fills the whole
+ * buffer unless it reaches the end of the contents and returns the bytes
+ * read or a negative errno.
+ */
+class LargeBlobSource
+{
+public:
+    virtual ~LargeBlobSource() { }
+    virtual ssize_t read(uint8_t *buf, size_t s, off_t off) = 0;
+};
+
 class LargeBlob
 {
 public:
     explicit LargeBlob(Repo *r);
     ~LargeBlob();
     void chunkFile(const std::string &path);
+    void rechunk(const LargeBlob &base,
+                 const std::map<uint64_t, uint64_t> &changed,
+                 uint64_t size, LargeBlobSource *src);
     void extractFile(const std::string &path);
-    /// May read less than s bytes
+    /// Reads less than s bytes only at the end of the blob
     ssize_t read(uint8_t *buf, size_t s, off_t off) const;
     // XXX: Stream read/write operations
     const std::string getBlob();
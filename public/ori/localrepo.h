@@ -33,6 +33,7 @@
 #include "remoterepo.h"
 #include "packfile.h"
 #include "mergestate.h"
+#include "dirstate.h"
 #include "varlink.h"
 
 #define ORI_PATH_DIR "/.ori"
@@ -55,6 +56,7 @@
 #define ORI_PATH_LOCK "/lock"
 #define ORI_PATH_UDSSOCK "/uds"
 #define ORI_PATH_BACKUP_CONF "/backup.conf"
+#define ORI_PATH_COMPRESSION "/compression"
 
 int LocalRepo_Init(const std::string &path, bool barerepo,
                    const std::string &uuid = "");
@@ -75,6 +77,25 @@ public:
     typedef std::shared_ptr<LocalRepoLock> sp;
 };
 
+/*
+ * Concurrency model
+ *
+ * Object reads (getObject, getLocalObject, getPayload, getObjectInfo,
+ * hasObject, isObjectStored and listObjects) may be issued from any number
+ * of threads at once.  They take the index reader lock for a single lookup
+ * and then read the packfile through a shared mapping or with pread, so they
+ * never wait on disk I/O done by the writer.  Objects still in the open
+ * transaction are served from it once their compression has finished.
+ *
+ * Everything that adds or changes objects or refs (addObject, addBlob,
+ * commit, sync, pull, updateHead and friends) must be issued by a single
+ * writer at a time; callers serialize writers among themselves.  Reads that
+ * fall through to a remote repository set up with setRemoteFlags(true) add
+ * the fetched objects and so count as writes.
+ *
+ * gc, purgeObject, rebuildIndex, open and close are maintenance operations
+ * and must not run concurrently with anything else.
+ */
 class LocalRepo : public Repo
 {
 public:
@@ -82,6 +103,9 @@ public:
     ~LocalRepo();
     void open(const std::string &root = "");
     void close();
+    void setWorkerThreads(int threads);
+    void setCompression(ObjectInfo::ZipAlgo algo);
+    ObjectInfo::ZipAlgo getCompression() const;
     LocalRepoLock::sp lock();
 
     // Remote Repository (Thin/Insta-clone)
@@ -112,6 +136,11 @@ public:
     bool isObjectStored(const ObjectHash &objId);
     //std::set<ObjectInfo> slowListObjects();
     std::set<ObjectInfo> listObjects();
+    /// Up to max objects with hashes after the given one (from the first if
+    /// it is empty) in hash order, to list the objects a page at a time
+    std::vector<ObjectInfo> listObjects(const ObjectHash &after, size_t max);
+    /// Number of objects listObjects returns
+    size_t numObjects();
     int addObject(ObjectType type, const ObjectHash &hash,
             const std::string &payload);
 
@@ -121,6 +150,8 @@ public:
     bool rebuildIndex();
     void dumpIndex();
     void dumpPackfile(packid_t packfileId);
+    std::vector<packid_t> listPackfiles();
+    std::string verifyPackfile(packid_t packfileId);
 
     LocalObject::sp getLocalObject(const ObjectHash &objId);
     
@@ -128,12 +159,15 @@ public:
     std::map<std::string, ObjectHash> listSnapshots();
     ObjectHash lookupSnapshot(const std::string &name);
 
+    std::vector<std::pair<ObjectHash, ObjectHash> >
+        addFiles(const std::vector<std::string> &paths);
     ObjectHash addTree(const Tree &tree);
     ObjectHash addCommit(/* const */ Commit &commit);
     //std::string addBlob(const std::string &blob, ObjectType type);
     size_t getObjectLength(const ObjectHash &objId);
     ObjectType getObjectType(const ObjectHash &objId);
     std::string getPayload(const ObjectHash &objId);
+    void prefetchObjects(const ObjectHashVec &objs);
     std::string verifyObject(const ObjectHash &objId);
     size_t sendObject(const char *objId);
 
@@ -144,6 +178,9 @@ public:
     void pull(Repo *r);
     void multiPull(RemoteRepo::sp defaultRemote);
     void transmit(bytewstream *bs, const std::vector<ObjectHash> &objs);
+    /// transmit without the terminating empty group, so that a response can
+    /// be sent in parts.  Returns false if an object is missing.
+    bool transmitGroups(bytewstream *bs, const std::vector<ObjectHash> &objs);
     void receive(bytestream *bs);
     bytestream *getObjects(const std::vector<ObjectHash> &objs);
 
@@ -224,6 +261,9 @@ public:
 private:
     // Helper Functions
     void createObjDirs(const ObjectHash &objId);
+    PfTransaction::sp getTransaction();
+    void setTransaction(PfTransaction::sp tr);
+    void sealPackfile();
 public: // Hack to enable rebuild operations
     std::string objIdToPath(const ObjectHash &objId);
 private:
@@ -238,7 +278,12 @@ private:
     MetadataLog metadata;
 
     // Packfiles
+    int workerThreads;
+    std::shared_ptr<ThreadPool> workers;
+    ObjectInfo::ZipAlgo compression;
     Packfile::sp currPackfile;
+    // Guards the currTransaction pointer for readers, set by the writer
+    Mutex txLock;
     PfTransaction::sp currTransaction;
     PackfileManager::sp packfiles;
 
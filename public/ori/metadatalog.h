@@ -17,8 +17,17 @@
 #ifndef __METADATALOG_H__
 #define __METADATALOG_H__
 
+#include <stdint.h>
+
+#include <string>
+#include <memory>
+#include <unordered_map>
+
 #include <oriutil/objecthash.h>
 
+/// Suffix of the checkpoint stored next to the metadata log
+#define METADATALOG_CHECKPOINT_SUFFIX ".ckpt"
+
 typedef int32_t refcount_t;
 typedef std::unordered_map<ObjectHash, refcount_t> RefcountMap;
 typedef std::unordered_map<std::string, std::string> ObjMetadata;
@@ -36,6 +45,9 @@ public:
     void decRef(const ObjectHash &hash);
     void setMeta(const ObjectHash &hash, const std::string &key,
             const std::string &value);
+    /// Writes the changes to the log, throws SystemException if it cannot.
+    /// The destructor commits whatever is left but only warns on failure.
+    void commit();
 private:
     friend class MetadataLog;
     MetadataLog *log;
@@ -43,6 +55,23 @@ private:
     MetadataMap metadata;
 };
 
+/*
+ * The metadata log is stored as a checkpoint and a tail log.  The checkpoint
+ * holds the reference counts sorted by hash, memory mapped and binary
+ * searched in place, followed by the object metadata.  The tail is an
+ * append-only log of the transactions committed since the checkpoint was
+ * written.  Only the tail and the metadata are loaded into memory on open.
+ *
+ * Tail records store absolute counts and carry a checksum.  The checkpoint
+ * and the tail share a generation number so a tail left behind by a crash
+ * while writing a checkpoint is recognized and ignored.  Once the tail
+ * outgrows the checkpoint both are folded into a new checkpoint.
+ *
+ * Other processes may open the log at any time, so open never writes.  A
+ * torn, stale or legacy tail is read as far as it is valid and the first
+ * commit replaces it with a new checkpoint and an empty tail.  Callers
+ * serialize writers.
+ */
 class MetadataLog
 {
 public:
@@ -53,6 +82,8 @@ public:
     void sync();
     /// rewrites the log file, optionally with new counts
     void rewrite(const RefcountMap *refs = NULL, const MetadataMap *data = NULL);
+    /// folds the tail into a new checkpoint
+    void checkpoint();
 
     void addRef(const ObjectHash &hash, MdTransaction::sp trs =
             MdTransaction::sp());
@@ -69,8 +100,28 @@ private:
     friend class MdTransaction;
     int fd;
     std::string filename;
+    uint32_t generation;
+    size_t tailBytes;
+    // The tail can be appended to, see open
+    bool tailValid;
+    // Counts changed since the checkpoint
     RefcountMap refcounts;
     MetadataMap metadata;
+
+    // Checkpoint
+    int baseFd;
+    const uint8_t *baseMap;
+    size_t baseLen;
+    const uint8_t *baseEntries;
+    uint32_t baseCount;
+    uint32_t fanout[256];
+
+    void _openBase();
+    void _closeBase();
+    const uint8_t *_findBase(const ObjectHash &hash) const;
+    void _replay(const std::string &log);
+    void _replayLegacy(const std::string &log);
+    bool _writeCheckpoint(const RefcountMap *refs, const MetadataMap &data);
 };
 
 #endif
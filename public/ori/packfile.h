@@ -19,12 +19,17 @@
 
 #include <set>
 #include <deque>
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
 #include <unordered_map>
 
 #include <oriutil/objecthash.h>
 #include <oriutil/stream.h>
 #include <oriutil/lrucache.h>
+#include <oriutil/mutex.h>
+#include <oriutil/threadpool.h>
 #include "object.h"
 
 typedef uint32_t offset_t;
@@ -42,23 +47,54 @@ struct IndexEntry
         sizeof(uint32_t) + sizeof(packid_t);
 };
 
+/// Table of contents entry of a sealed packfile
+struct PfTocEntry
+{
+    IndexEntry entry;
+    /// Hash of the bytes stored in the packfile
+    ObjectHash checksum;
+};
+
 class Packfile;
 class Index;
+/*
+ * Payloads are compressed on the worker pool (if any) as they are added.
+ * infos and payloads are deques so that queued work can keep pointers to
+ * its entry while more are appended.  commit() waits and writes them in the
+ * order added.
+ *
+ * Only the writer adds to and commits a transaction, but readers may look
+ * up objects in it concurrently with find() and getInfo()/getPayload(),
+ * which wait for just the entry they need.
+ */
 class PfTransaction
 {
 public:
     typedef std::shared_ptr<PfTransaction> sp;
 
-    PfTransaction(Packfile *pf, Index *idx);
+    PfTransaction(Packfile *pf, Index *idx,
+                  std::shared_ptr<ThreadPool> pool = NULL,
+                  ObjectInfo::ZipAlgo algo = ObjectInfo::ZIPALGO_FASTLZ);
     ~PfTransaction();
 
     bool full() const;
     void addPayload(ObjectInfo info, const std::string &payload);
     bool has(const ObjectHash &hash) const;
+    /// Returns true and sets ix if hash was added to this transaction
+    bool find(const ObjectHash &hash, size_t *ix) const;
+    /// Returns the info of entry ix once it has been compressed
+    ObjectInfo getInfo(size_t ix) const;
+    /// Returns the stored payload of entry ix once it has been compressed
+    std::string getPayload(size_t ix) const;
+    /// Waits for queued compression to finish
+    void wait();
     void commit();
 
-    std::vector<ObjectInfo> infos;
-    std::vector<std::string> payloads;
+    std::deque<ObjectInfo> infos;
+    std::deque<std::string> payloads;
+    /// Hashes of the stored payloads, filled in as they are compressed
+    std::deque<ObjectHash> checksums;
+    /// Uncompressed size of the payloads
     size_t totalSize;
     bool committed;
 
@@ -67,9 +103,28 @@ public:
 private:
     Packfile *pf;
     Index *idx;
+    std::shared_ptr<ThreadPool> pool;
+    /// Compression tried on each new payload
+    ObjectInfo::ZipAlgo algo;
+    // Guards the containers above against concurrent readers
+    mutable std::mutex lock;
+    mutable std::condition_variable compressed;
+    std::deque<bool> done;
+    TaskGroup group;
+    void _finish(size_t ix, ObjectInfo::ZipAlgo used, std::string *data,
+                 const ObjectHash &checksum);
+    void _waitFor(std::unique_lock<std::mutex> &l, size_t ix) const;
     float _checkCompressionRatio(const std::string &payload);
 };
 
+/*
+ * A packfile is a sequence of groups, each a header table followed by the
+ * payloads.  Once the writer moves on to another packfile it is sealed by
+ * appending a table of contents of all objects sorted by hash, each with a
+ * checksum of its stored bytes, so the index can be rebuilt and the
+ * packfile verified without walking the groups.  Sealed packfiles are never
+ * appended to.
+ */
 class Packfile
 {
 public:
@@ -81,32 +136,73 @@ public:
     packid_t getPackfileID() const;
 
     bool full() const;
-    PfTransaction::sp begin(Index *idx);
+    PfTransaction::sp begin(Index *idx,
+                            std::shared_ptr<ThreadPool> pool = NULL,
+                            ObjectInfo::ZipAlgo algo = ObjectInfo::ZIPALGO_FASTLZ);
     void commit(PfTransaction *t, Index *idx);
     //void addPayload(ObjectInfo info, const std::string &payload, Index *idx);
     bytestream *getPayload(const IndexEntry &entry);
+    /// Hint that [off, off + len) will be read soon
+    void prefetch(offset_t off, size_t len);
     /// @returns true when the packfile is empty
     bool purge(const std::set<ObjectHash> &hset, Index *idx);
+    /// Appends the table of contents, no objects can be added afterwards
+    void seal();
+    bool isSealed() const;
 
-    typedef void (*ReadEntryCb)(const ObjectInfo &info, offset_t off,
-                                void *arg);
+    typedef void (*ReadEntryCb)(const IndexEntry &entry, void *arg);
+    /// Calls cb for every object, from the table of contents if sealed
     void readEntries(ReadEntryCb cb, void *arg);
+    /// Checks every object against its checksum reading the packfile in
+    /// order, returns an empty string if it is intact or not sealed
+    std::string verify();
 
     void transmit(bytewstream *bs, std::vector<IndexEntry> objects);
+    /// Receives one group of objects, appending their infos to received
     /// @returns false if nothing to receive
-    bool receive(bytestream *bs, Index *idx);
+    bool receive(bytestream *bs, Index *idx,
+                 std::vector<ObjectInfo> *received = NULL);
 
 private:
     int fd;
     std::string filename;
     packid_t packid;
-    size_t numObjects;
-    size_t fileSize;
+    std::atomic<size_t> numObjects;
+    // Only the writer changes this, readers use it to bound mappings
+    std::atomic<size_t> fileSize;
+
+    // Table of contents, collected while objects are added to a packfile
+    // created empty (tocValid) and read back from a sealed one.  Sealing
+    // stores tocOffset and numObjects before sealed and grows fileSize last,
+    // see _dataEnd.
+    std::atomic<bool> sealed;
+    std::atomic<offset_t> tocOffset;
+    bool tocValid;
+    std::vector<PfTocEntry> toc;
+    void _openToc();
+    void _truncateTorn();
+    size_t _dataEnd() const;
+    bool _readToc(std::vector<PfTocEntry> *entries, std::string *error);
+    offset_t _readGroups(std::vector<IndexEntry> *entries);
+
+    // Read-only mapping of the packfile, shared with outstanding streams
+    Mutex mapLock;
+    std::shared_ptr<const void> mapping;
+    const uint8_t *mapAddr;
+    size_t mapLen;
+    bool _mapRange(offset_t off, size_t len,
+                   std::shared_ptr<const void> *owner, const uint8_t **addr);
+    void _unmap();
 };
 
 
 #define PFMGR_FREELIST ".freelist"
 
+/*
+ * Packfile lookups may come from any reader thread, the cache and free list
+ * are guarded by cacheLock.  Packfile handles returned stay valid after they
+ * are evicted from the cache.
+ */
 class PackfileManager
 {
 public:
@@ -128,7 +224,10 @@ private:
     bool _loadFreeList();
     void _writeFreeList();
 
+    Mutex cacheLock;
     LRUCache<uint32_t, Packfile::sp, 96> _packfileCache;
+    // Packfiles handed out by newPackfile, readers share the writer's handle
+    std::unordered_map<packid_t, std::weak_ptr<Packfile> > writers;
 
     std::string _getPackfileName(packid_t id);
 };
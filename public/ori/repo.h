@@ -20,6 +20,7 @@
 #include <stdint.h>
 
 #include <string>
+#include <map>
 #include <set>
 #include <deque>
 
@@ -35,6 +36,7 @@ extern ObjectHash EMPTYFILE_HASH;
 typedef std::vector<ObjectHash> ObjectHashVec;
 
 class LargeBlob;
+class LargeBlobSource;
 
 class Repo
 {
@@ -56,6 +58,8 @@ public:
             ) = 0;
     virtual bool hasObject(const ObjectHash &id) = 0;
     virtual std::vector<bool> hasObjects(const ObjectHashVec &ids);
+    /// Hint that the objects will be read soon
+    virtual void prefetchObjects(const ObjectHashVec &ids);
     virtual bytestream *getObjects(
             const ObjectHashVec &objs
             ) = 0;
@@ -79,6 +83,12 @@ public:
         addLargeFile(const std::string &path);
     std::pair<ObjectHash, ObjectHash>
         addFile(const std::string &path);
+    std::pair<ObjectHash, ObjectHash>
+        addModifiedFile(const ObjectHash &base,
+                        const std::map<uint64_t, uint64_t> &changed,
+                        uint64_t size, LargeBlobSource *src);
+    virtual std::vector<std::pair<ObjectHash, ObjectHash> >
+        addFiles(const std::vector<std::string> &paths);
 
     virtual Tree getTree(const ObjectHash &treeId);
     virtual Commit getCommit(const ObjectHash &commitId);
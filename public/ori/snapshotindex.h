@@ -33,6 +33,8 @@ public:
     void addSnapshot(const std::string &name, const ObjectHash &commitId);
     void delSnapshot(const std::string &name);
     const ObjectHash &getSnapshot(const std::string &name) const;
+    /// Returns true and sets commitId if the snapshot exists
+    bool lookup(const std::string &name, ObjectHash *commitId) const;
     std::map<std::string, ObjectHash> getList();
     std::map<int64_t, ObjectHash> getOrisyncList();
     void addOrisyncSnapshot(int64_t time, const ObjectHash &commitId);
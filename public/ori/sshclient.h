@@ -43,7 +43,7 @@ private:
     std::string remoteHost, remoteRepo;
 
     int fdFromChild, fdToChild;
-    bytewstream::ap streamToChild;
+    std::auto_ptr<bufferedwstream> streamToChild;
     int childPid;
 };
 
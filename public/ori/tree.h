@@ -22,6 +22,7 @@
 #include <string.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include <string>
 #include <map>
@@ -69,6 +70,7 @@ public:
     bool has(const std::string &attrName) const;
 
     void setFromFile(const std::string &filename);
+    void setFromStat(const struct stat &sb);
     void setCreation(mode_t perms);
     void mergeFrom(const AttrMap &other);
 
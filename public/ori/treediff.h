@@ -56,12 +56,28 @@ struct TreeDiffEntry
     void _diffAttrs(const AttrMap &a_old, const AttrMap &a_new);
 };
 
+class DirState;
+class ThreadPool;
+
 class TreeDiff
 {
 public:
     TreeDiff();
     void diffTwoTrees(const Tree::Flat &t1, const Tree::Flat &t2);
-    void diffToDir(Commit from, const std::string &dir, Repo *r);
+    /**
+     * Same as diffing the flattened trees t1 and t2 of r, but directories
+     * with the same hash in both are skipped without being loaded.  The
+     * work done is proportional to the size of the change.
+     */
+    void diffTwoTrees(const Tree &t1, const Tree &t2, Repo *r);
+    /**
+     * Compares the working directory dir against the commit from.  Files
+     * whose stat information matches state are not read, state is updated
+     * with the files hashed and seen.  Directories are scanned and files
+     * hashed on pool if given, which requires r to allow concurrent reads.
+     */
+    void diffToDir(Commit from, const std::string &dir, Repo *r,
+                   DirState *state = NULL, ThreadPool *pool = NULL);
     TreeDiffEntry *getLatestEntry(const std::string &path);
     const TreeDiffEntry *getLatestEntry(const std::string &path) const;
     void append(const TreeDiffEntry &to_append);
@@ -17,11 +17,41 @@
 #ifndef __UDSCLIENT_H__
 #define __UDSCLIENT_H__
 
+#include <stdint.h>
+
 #include <string>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
 
 #include <oriutil/stream.h>
 #include "object.h"
 
+/*
+ * Version 2 of the protocol frames requests so that a client can have several
+ * outstanding at once.  A new session still starts in the version 1 request
+ * and response mode; the client switches it with the "pipeline" command.
+ */
+#define ORI_UDS_PROTO_VERSION "2.0"
+
+// Response frame flags
+#define UDS_FRAME_END       1
+#define UDS_FRAME_ABORT     2
+
+/*
+ * Client side of the UDS protocol.  Requests are framed as
+ *
+ *     uint32 id, uint32 length, PStr command, arguments
+ *
+ * and answered by one or more frames
+ *
+ *     uint32 id, uint8 flags, uint32 length, data
+ *
+ * carrying the version 1 response (status byte and body) in order.  Responses
+ * to different requests may be interleaved.  Any number of threads may send
+ * and receive, the thread waiting for a frame reads on behalf of the others.
+ */
 class UDSClient
 {
 public:
@@ -33,18 +63,47 @@ public:
     void disconnect();
     bool connected();
 
-    // At the moment the protocol is synchronous
-    void sendCommand(const std::string &command);
-    void sendData(const std::string &data);
-    bytestream *getStream();
+    /// Sends a request without waiting for the response, returns its id
+    uint32_t send(const std::string &command,
+                  const std::string &args = "");
+    /// Returns a stream over the response to request id, which the caller
+    /// owns.  Deleting it before the end discards the rest of the response.
+    bytestream *receive(uint32_t id);
+    /// send and receive
+    bytestream *call(const std::string &command,
+                     const std::string &args = "");
 
-    bool respIsOK();
+    /// Reads the status byte of a response, logs the error if it failed
+    static bool respIsOK(bytestream *bs);
 
 private:
+    friend class UDSResponseStream;
+    struct Response {
+        Response() : chunks(), done(false), abandoned(false), aborted(false) {}
+        std::deque<std::string> chunks;
+        bool done;
+        bool abandoned;
+        bool aborted;
+    };
+
     std::string udsPath, remoteRepo;
 
     int fd;
-    bytewstream::ap streamToChild;
+    std::auto_ptr<bufferedstream> in;
+    std::auto_ptr<bufferedwstream> out;
+
+    std::mutex writeLock;
+    std::mutex lock;
+    std::condition_variable cv;
+    uint32_t nextId;
+    bool reading;
+    bool broken;
+    std::map<uint32_t, Response> responses;
+
+    int _nextChunk(uint32_t id, std::string &chunk);
+    void _abandon(uint32_t id);
+    bool _readFrame(std::unique_lock<std::mutex> &l);
+    void _fail(std::unique_lock<std::mutex> &l);
 };
 
 
@@ -17,18 +17,35 @@
 #ifndef __UDSREPO_H__
 #define __UDSREPO_H__
 
+#include <stdint.h>
+
 #include <string>
 #include <vector>
 #include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
 
+#include <oriutil/lrucache.h>
 #include "repo.h"
 #include "udsclient.h"
 
-class UDSObject;
+// Decoded objects kept by a UDSRepo
+#define UDSREPO_CACHEOBJS       256
+// Prefetch requests outstanding at once
+#define UDSREPO_PREFETCHREQS    4
+
+/*
+ * Repository served by orifs over its UDS socket.  Objects read are kept in a
+ * bounded cache shared by copies of the UDSRepo.  prefetchObjects requests
+ * objects without waiting for them, so that LargeBlob reads overlap the
+ * transfer of the following chunks.
+ */
 class UDSRepo : public Repo
 {
 public:
-    friend class UDSObject;
     UDSRepo();
     UDSRepo(UDSClient *client);
     ~UDSRepo();
@@ -41,6 +58,7 @@ public:
     Object::sp getObject(const ObjectHash &id);
     ObjectInfo getObjectInfo(const ObjectHash &id);
     bool hasObject(const ObjectHash &id);
+    void prefetchObjects(const ObjectHashVec &ids);
     bytestream *getObjects(const ObjectHashVec &objs);
     std::set<ObjectInfo> listObjects();
     int addObject(ObjectType type, const ObjectHash &hash,
@@ -56,26 +74,47 @@ public:
                                 const std::string &data);
 private:
     UDSClient *client;
-    
-    std::string &_payload(const ObjectHash &id);
-    void _addPayload(const ObjectHash &id, const std::string &payload);
-    void _clearPayload(const ObjectHash &id);
 
-    std::map<ObjectHash, std::string> payloads;
+    struct CachedObject {
+        ObjectInfo info;
+        std::shared_ptr<const std::string> payload;
+    };
+    /*
+     * Objects named by a prefetch are pending until the response to its
+     * request has been read.  The response is received without the lock,
+     * other threads needing it wait for received.
+     */
+    struct Cache {
+        std::mutex lock;
+        LRUCache<ObjectHash, CachedObject, UDSREPO_CACHEOBJS> objects;
+        std::unordered_map<ObjectHash, uint32_t> pending;
+        std::deque<uint32_t> requests;
+        std::unordered_set<uint32_t> receiving;
+        std::condition_variable received;
+    };
+    std::shared_ptr<Cache> cache;
 
     std::unordered_set<ObjectHash> *containedObjs;
+
+    static std::string _readObjsArgs(const ObjectHashVec &objs);
+    void _readObjects(bytestream *bs, std::vector<CachedObject> *objs);
+    bool _cacheObjects(const std::vector<CachedObject> &objs,
+                       const ObjectHash &want, CachedObject *obj);
+    bool _completePrefetch(std::unique_lock<std::mutex> &l, uint32_t req,
+                           const ObjectHash &want, CachedObject *obj);
 };
 
 class UDSObject : public Object
 {
 public:
-    UDSObject(UDSRepo *repo, ObjectInfo info);
+    UDSObject(const ObjectInfo &info,
+              std::shared_ptr<const std::string> payload);
     ~UDSObject();
 
     bytestream *getPayloadStream();
 
 private:
-    UDSRepo *repo;
+    std::shared_ptr<const std::string> payload;
 };
 
 #endif /* __UDSREPO_H__ */
@@ -17,9 +17,21 @@
 #ifndef __SERVER_H__
 #define __SERVER_H__
 
+#include <stdint.h>
+
+#include <mutex>
+#include <condition_variable>
+
 #include <oriutil/mutex.h>
+#include <oriutil/stream.h>
+#include "udsclient.h" // ORI_UDS_PROTO_VERSION
 
-#define ORI_UDS_PROTO_VERSION "1.0"
+// Largest response frame
+#define ORI_UDS_CHUNKSIZE       (256 * 1024)
+// Threads serving the framed requests of one session
+#define ORI_UDS_SESSIONWORKERS  4
+// Framed requests read ahead of the responses
+#define ORI_UDS_MAXINFLIGHT     64
 
 class UDSSession;
 
@@ -47,6 +59,13 @@ private:
     std::map<std::string, UDSExtCB> extensions;
 };
 
+/*
+ * A client connection.  Sessions start with synchronous requests, each a
+ * PStr command with its arguments answered by a status byte and a body.
+ * The "pipeline" command switches to framed requests (see UDSClient) which
+ * are served concurrently on a small pool of threads, so a slow request such
+ * as a blocking extension call does not hold up the others.
+ */
 class UDSSession : public Thread
 {
 public:
@@ -56,22 +75,36 @@ public:
     virtual void run();
     void forceExit();
     void serve();
-    
-    void printError(const std::string &what);
-    void cmd_hello();
-    void cmd_listObjs();
-    void cmd_listCommits();
-    void cmd_readObjs();
-    void cmd_getObjInfo();
-    void cmd_getHead();
-    void cmd_getFSID();
-    void cmd_getVersion();
-    void cmd_listExt();
-    void cmd_callExt();
+    void servePipelined();
+    /// Sends one response frame, safe to call from any thread
+    bool writeFrame(uint32_t id, uint8_t flags, const std::string &data);
+
+    void printError(bytewstream *out, const std::string &what);
+    bool dispatch(const std::string &command, bytestream *in, bytewstream *out);
+    void cmd_hello(bytestream *in, bytewstream *out);
+    void cmd_listObjs(bytestream *in, bytewstream *out);
+    void cmd_listCommits(bytestream *in, bytewstream *out);
+    void cmd_readObjs(bytestream *in, bytewstream *out);
+    void cmd_getObjInfo(bytestream *in, bytewstream *out);
+    void cmd_getHead(bytestream *in, bytewstream *out);
+    void cmd_getFSID(bytestream *in, bytewstream *out);
+    void cmd_getVersion(bytestream *in, bytewstream *out);
+    void cmd_listExt(bytestream *in, bytewstream *out);
+    void cmd_callExt(bytestream *in, bytewstream *out);
 private:
     UDSServer *uds;
     int fd;
     LocalRepo *repo;
+    // Buffered socket streams, responses are flushed once they are complete
+    bufferedstream in;
+    bufferedwstream out;
+    // Framed mode
+    std::mutex writeLock;
+    std::mutex inflightLock;
+    std::condition_variable inflightCV;
+    int inflight;
+
+    void _serveRequest(uint32_t id, const std::string &request);
 };
 
 #endif
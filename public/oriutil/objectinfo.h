@@ -31,13 +31,15 @@
 #define ORI_FLAG_UNCOMPRESSED   0x0000
 #define ORI_FLAG_FASTLZ         0x0001
 #define ORI_FLAG_LZMA           0x0002
+#define ORI_FLAG_SNAPPY         0x0003
 #define ORI_FLAG_ZIPMASK        0x000F
 
 #define ORI_FLAG_DEFAULT        0x0000
 
 struct ObjectInfo {
     enum Type { Null, Commit, Tree, Blob, LargeBlob, Purged };
-    enum ZipAlgo { ZIPALGO_UNKNOWN, ZIPALGO_NONE, ZIPALGO_FASTLZ, ZIPALGO_LZMA };
+    enum ZipAlgo { ZIPALGO_UNKNOWN, ZIPALGO_NONE, ZIPALGO_FASTLZ, ZIPALGO_LZMA,
+                   ZIPALGO_SNAPPY };
 
     ObjectInfo();
     explicit ObjectInfo(const ObjectHash &hash);
@@ -57,6 +59,10 @@ struct ObjectInfo {
     static const char *getStrForType(Type t);
     static Type getTypeForStr(const char *str);
 
+    // Compression algorithm
+    static const char *getStrForAlgo(ZipAlgo algo);
+    static ZipAlgo getAlgoForStr(const std::string &str);
+
     // For debug use
     void print(std::ostream &outStream = std::cout) const;
 
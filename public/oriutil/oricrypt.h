@@ -17,8 +17,27 @@
 #ifndef __ORICRYPT_H__
 #define __ORICRYPT_H__
 
+#ifdef ORI_USE_SHA256
+#include <openssl/sha.h>
+#endif
+
 #include "objecthash.h"
 
+/*
+ * Incremental form of OriCrypt_HashBlob for data that arrives in pieces.
+ */
+class OriCryptHash
+{
+public:
+    OriCryptHash();
+    void update(const uint8_t *data, size_t len);
+    ObjectHash final();
+private:
+#ifdef ORI_USE_SHA256
+    SHA256_CTX state;
+#endif
+};
+
 std::string OriCrypt_MD5String(const std::string &str);
 ObjectHash OriCrypt_HashString(const std::string &str);
 ObjectHash OriCrypt_HashBlob(const uint8_t *data, size_t len);
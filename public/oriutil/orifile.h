@@ -36,6 +36,8 @@ int OriFile_Copy(const std::string &origPath, const std::string &newPath);
 int OriFile_Move(const std::string &origPath, const std::string &newPath);
 int OriFile_Delete(const std::string &path);
 int OriFile_Rename(const std::string &from, const std::string &to);
+int OriFile_CreateTemp(const std::string &path, std::string *tmpPath);
+void OriFile_DeleteTemps(const std::string &path);
 
 std::string OriFile_Basename(const std::string &path);
 std::string OriFile_Dirname(const std::string &path);
@@ -19,6 +19,8 @@
 
 #include <stdint.h>
 
+#include <sys/uio.h>
+
 #include <string>
 #include <vector>
 
@@ -33,6 +35,7 @@ std::string Util_GetHome();
 std::string Util_GetOSType();
 std::string Util_GetMachType();
 int Util_SetBlocking(int fd, bool block);
+int Util_WriteV(int fd, std::vector<struct iovec> &iov);
 
 std::string Util_NewUUID();
 bool Util_IsPathRemote(const std::string &path);
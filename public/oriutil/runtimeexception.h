@@ -32,7 +32,8 @@ enum OriErrorCode {
     ORIEC_INDEXDIRTY,
     ORIEC_INDEXCORRUPT,
     ORIEC_INDEXNOTFOUND,
-    ORIEC_BSCORRUPT
+    ORIEC_BSCORRUPT,
+    ORIEC_MDLOGCORRUPT
 };
 
 class RuntimeException : public std::exception
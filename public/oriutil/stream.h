@@ -112,6 +112,29 @@ private:
     size_t len;
 };
 
+/// Reads from a memory region without copying it.  The owner reference
+/// keeps the region (e.g. a file mapping) alive as long as the stream.
+class memstream : public bytestream
+{
+public:
+    memstream(const uint8_t *buf, size_t len,
+              std::shared_ptr<const void> owner = std::shared_ptr<const void>());
+    bool ended();
+    size_t read(uint8_t *, size_t);
+    size_t sizeHint() const;
+private:
+    const uint8_t *buf;
+    size_t off;
+    size_t len;
+    std::shared_ptr<const void> owner;
+};
+
+/*
+ * Reads from a file descriptor.  With a non-negative offset the stream reads
+ * with pread and never moves the file position, so several streams can share
+ * one descriptor across threads.  An offset of -1 reads from the current
+ * position (pipes and sockets).
+ */
 class fdstream : public bytestream
 {
 public:
@@ -122,81 +145,101 @@ public:
 
 private:
     int fd;
+    off_t offset;
     size_t length;
     size_t left;
 };
 
-class diskstream : public bytestream
+// Default buffer size of bufferedstream and bufferedwstream
+#define STREAM_BUFSZ (64 * 1024)
+
+/*
+ * Buffers reads from another stream so that parsing small fields does not
+ * cost a read of the source (a system call for an fdstream) each.  A refill
+ * issues a single read of the source, so on a socket it returns whatever has
+ * arrived instead of waiting for a full buffer.  Reads larger than the buffer
+ * bypass it.  Bytes may be read ahead of the caller, the source must not be
+ * read directly while the bufferedstream is in use.
+ */
+class bufferedstream : public bytestream
 {
 public:
-    diskstream(const std::string &filename);
-    ~diskstream();
+    /// Takes ownership of source
+    bufferedstream(bytestream *source, size_t bufSize = STREAM_BUFSZ);
+    ~bufferedstream();
     bool ended();
     size_t read(uint8_t *, size_t);
     size_t sizeHint() const;
 
 private:
-    int fd;
-    bytestream::ap source;
+    bytestream *source;
+    std::vector<uint8_t> buf;
+    size_t off;
+    size_t len;
 };
 
-
-#define COMPRESS true
-#define DECOMPRESS false
-
-#ifdef ORI_USE_LZMA
-
-class zipstream : public bytestream
+class diskstream : public bytestream
 {
 public:
-    /// Takes ownership of source. size_hint is total number of bytes output (from read) 
-    zipstream(bytestream *source, bool compress = false, size_t size_hint = 0);
-    ~zipstream();
+    diskstream(const std::string &filename);
+    ~diskstream();
     bool ended();
     size_t read(uint8_t *, size_t);
     size_t sizeHint() const;
-    size_t inputConsumed() const;
 
 private:
-    bytestream *source;
-    size_t size_hint;
-
-    bool output_ended;
-    lzma_stream strm;
-    uint8_t in_buf[COMPFILE_BUFSZ];
-
-    void setLzmaErr(const char *msg, lzma_ret ret);
+    int fd;
+    bytestream::ap source;
 };
 
-#endif /* ORI_USE_LZMA */
 
-#ifdef ORI_USE_FASTLZ
+#define COMPRESS true
+#define DECOMPRESS false
 
+/*
+ * Compresses or decompresses source with one of the ObjectInfo::ZipAlgo
+ * codecs.  FastLZ and snappy work on the whole object at once, LZMA streams.
+ */
 class zipstream : public bytestream
 {
 public:
     /// Takes ownership of source. size_hint is total number of bytes output (from read) 
-    zipstream(bytestream *source, bool compress = false, size_t size_hint = 0);
+    zipstream(bytestream *source, ObjectInfo::ZipAlgo algo,
+              bool compress = false, size_t size_hint = 0);
     ~zipstream();
     bool ended();
     size_t read(uint8_t *, size_t);
     size_t sizeHint() const;
     size_t inputConsumed() const;
 
+    /// True if this build can encode and decode algo
+    static bool hasAlgo(ObjectInfo::ZipAlgo algo);
+    /// Returns a stream of the payload described by info given its stored
+    /// bytes, takes ownership of stored
+    static bytestream *decode(bytestream *stored, const ObjectInfo &info);
+
 private:
     bytestream *source;
+    ObjectInfo::ZipAlgo algo;
     size_t size_hint;
 
     bool compress;
+    bool output_ended;
+
+    // Block codecs
     bool input_processed;
-    std::string input; // TODO
+    std::string input;
     std::vector<uint8_t> output;
-
     size_t offset;
-    bool output_ended;
-};
+    size_t _readBlock(uint8_t *, size_t);
 
-#endif /* ORI_USE_FASTLZ */
+#ifdef ORI_USE_LZMA
+    lzma_stream strm;
+    std::vector<uint8_t> in_buf;
+    size_t _readLzma(uint8_t *, size_t);
+    void setLzmaErr(const char *msg, lzma_ret ret);
+#endif /* ORI_USE_LZMA */
+};
 
 ////////////////////////////////
 // Writable streams
@@ -210,6 +253,10 @@ public:
     virtual ~bytewstream() {}
 
     virtual ssize_t write(const void *, size_t) = 0;
+    /// Writes a buffer kept alive by owner.  Streams that queue their output
+    /// may hold on to owner instead of copying the data.
+    virtual ssize_t writeRef(const void *, size_t,
+                             const std::shared_ptr<const void> &owner);
 
     /// Enable typed stream
     void enableTypes();
@@ -262,5 +309,27 @@ private:
     int fd;
 };
 
+/*
+ * Collects small writes and passes them to another stream in one write once
+ * the buffer is full or flush is called.  Writes larger than the buffer go
+ * straight through.  The destructor flushes, but protocol code should flush
+ * explicitly at the end of every message.
+ */
+class bufferedwstream : public bytewstream
+{
+public:
+    /// Takes ownership of sink
+    bufferedwstream(bytewstream *sink, size_t bufSize = STREAM_BUFSZ);
+    ~bufferedwstream();
+    ssize_t write(const void *, size_t);
+    /// Writes out buffered bytes, returns a negative errno on failure
+    int flush();
+
+private:
+    bytewstream *sink;
+    std::vector<uint8_t> buf;
+    size_t len;
+};
+
 #endif
 
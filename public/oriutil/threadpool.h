@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <exception>
+
+/*
+ * Fixed-size pool of worker threads.  Work is submitted through a TaskGroup
+ * so that each submitter can wait for its own tasks.  A pool without
+ * threads runs tasks inline on the submitting thread.  Threads waiting for a
+ * TaskGroup run queued tasks meanwhile, so tasks may wait for groups of
+ * their own on the same pool.
+ */
+class ThreadPool
+{
+public:
+    /// threads < 0 selects one thread per online CPU
+    explicit ThreadPool(int threads = -1);
+    ~ThreadPool();
+    int size() const;
+    static int defaultSize();
+    /// Process-wide pool with one thread per online CPU
+    static std::shared_ptr<ThreadPool> shared();
+private:
+    friend class TaskGroup;
+    void enqueue(const std::function<void()> &task);
+    bool runOne();
+    void worker();
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<std::function<void()> > tasks;
+    std::vector<std::thread> threads;
+    bool done;
+};
+
+/*
+ * A set of tasks submitted to a pool.  wait() rethrows the first exception
+ * thrown by a task once all of them have finished.  The destructor waits for
+ * any tasks still running since they usually reference the submitter's
+ * state, but drops their exceptions.
+ */
+class TaskGroup
+{
+public:
+    explicit TaskGroup(ThreadPool *pool = NULL);
+    ~TaskGroup();
+    void run(const std::function<void()> &task);
+    void wait();
+private:
+    TaskGroup(const TaskGroup &);
+    TaskGroup &operator=(const TaskGroup &);
+    void _run(const std::function<void()> &task);
+    void _wait();
+    ThreadPool *pool;
+    std::mutex lock;
+    std::condition_variable finished;
+    size_t pending;
+    std::exception_ptr error;
+};
+
+#endif /* __THREADPOOL_H__ */
@@ -12,6 +12,7 @@ export ORI_EXE=$ORIG_DIR/build/ori/ori
 export ORI_HTTPD=$ORIG_DIR/build/ori_httpd/ori_httpd
 export ORIFS_EXE=$ORIG_DIR/build/orifs/orifs
 export ORIDBG_EXE=$ORIG_DIR/build/oridbg/oridbg
+export ORILOCAL_EXE=$ORIG_DIR/build/orilocal/orilocal
 export ORISYNC_EXE=$ORIG_DIR/build/orisync/orisync
 export ORI_TESTS=$ORIG_DIR/tests
 
@@ -0,0 +1,64 @@
+#!/usr/bin/env python
+#
+# Rewrites a metadata log checkpoint in the format used before checkpoints
+# existed, to test upgrading old repositories.  Run 'oridbg gc' first so the
+# checkpoint holds every count.
+#
+# Usage: mdlog_legacy.py REPO/metadata
+#
+
+import os
+import sys
+import struct
+
+KEYS = [ "status" ]
+VALUES = [ "normal", "graft", "fuse", "purging", "purged" ]
+
+HDRSIZE = 5 * 4 + 256 * 4 + 16 + 16
+ENTRYSIZE = 32 + 4
+
+def read_str(buf, off, table):
+    sid = ord(buf[off:off+1])
+    off += 1
+    if sid != 0:
+        return table[sid - 1], off
+    slen = ord(buf[off:off+1])
+    return buf[off+1:off+1+slen].decode(), off + 1 + slen
+
+def pstr(s):
+    s = s.encode()
+    return struct.pack("B", len(s)) + s
+
+path = sys.argv[1]
+with open(path + ".ckpt", "rb") as f:
+    ckpt = f.read()
+with open(path, "rb") as f:
+    tail = f.read()
+
+assert ckpt[0:4] == b"ORIM"
+version, generation, count, mdlen = struct.unpack(">IIII", ckpt[4:20])
+assert len(tail) == 12, "Run 'oridbg gc' first"
+
+entries = ckpt[HDRSIZE:HDRSIZE + count * ENTRYSIZE]
+md = ckpt[HDRSIZE + count * ENTRYSIZE:HDRSIZE + count * ENTRYSIZE + mdlen]
+
+rec = b""
+for i in range(count):
+    rec += entries[i * ENTRYSIZE:(i + 1) * ENTRYSIZE]
+
+num_md = struct.unpack(">I", md[0:4])[0]
+off = 4
+for i in range(num_md):
+    rec += md[off:off+32]
+    num_mde = struct.unpack(">I", md[off+32:off+36])[0]
+    rec += md[off+32:off+36]
+    off += 36
+    for j in range(num_mde):
+        key, off = read_str(md, off, KEYS)
+        value, off = read_str(md, off, VALUES)
+        rec += pstr(key) + pstr(value)
+
+rec = struct.pack(">II", count, num_md) + rec
+with open(path, "wb") as f:
+    f.write(struct.pack("=I", len(rec)) + rec)
+os.unlink(path + ".ckpt")
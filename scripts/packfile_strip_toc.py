@@ -0,0 +1,31 @@
+#!/usr/bin/env python
+#
+# Strips the table of contents from sealed packfiles, leaving them as they
+# were written before packfiles had one, to test upgrading old repositories.
+#
+# Usage: packfile_strip_toc.py PACKFILE...
+#
+
+import os
+import sys
+import struct
+
+PFTOC_MAGIC = 0x50544F43
+PFTOC_TRAILERSIZE = 4 + 4 + 4 + 4 + 32
+
+for path in sys.argv[1:]:
+    size = os.path.getsize(path)
+    if size < PFTOC_TRAILERSIZE:
+        continue
+
+    with open(path, "rb") as f:
+        f.seek(size - PFTOC_TRAILERSIZE)
+        trailer = f.read(16)
+    magic, version, off, num = struct.unpack(">IIII", trailer)
+    if magic != PFTOC_MAGIC:
+        continue
+    assert off + PFTOC_TRAILERSIZE <= size
+
+    with open(path, "r+b") as f:
+        f.truncate(off)
+    print("Stripped {} entries from {}".format(num, path))
@@ -0,0 +1,83 @@
+#!/usr/bin/env python
+#
+# Minimal UDS protocol client to test old clients and broken requests
+# against a running server.
+#
+# Usage: uds_client.py SOCKET MODE
+#   head    print the head with a version 1 request
+#   head2   print the head with a framed version 2.0 request
+#   torn1   send half of a version 1 request and disconnect
+#   torn2   send half of a framed request and disconnect
+#
+
+import sys
+import socket
+import struct
+import binascii
+
+UDS_FRAME_END = 1
+UDS_FRAME_ABORT = 2
+
+def pstr(s):
+    s = s.encode()
+    return struct.pack("B", len(s)) + s
+
+def read_exact(sock, n):
+    buf = b""
+    while len(buf) < n:
+        data = sock.recv(n - len(buf))
+        if not data:
+            raise IOError("Connection closed")
+        buf += data
+    return buf
+
+def read_ok(buf):
+    if ord(buf[0:1]) != 0:
+        print("Request failed")
+        sys.exit(1)
+    return buf[1:]
+
+def pipeline(sock):
+    sock.sendall(pstr("pipeline") + pstr("2.0"))
+    read_ok(read_exact(sock, 1))
+    vlen = ord(read_exact(sock, 1))
+    assert read_exact(sock, vlen) == b"2.0"
+
+def call2(sock, reqid, command):
+    req = pstr(command)
+    sock.sendall(struct.pack(">II", reqid, len(req)) + req)
+    resp = b""
+    while True:
+        rid, flags, length = struct.unpack(">IBI", read_exact(sock, 9))
+        assert rid == reqid
+        resp += read_exact(sock, length)
+        if flags & UDS_FRAME_ABORT:
+            print("Request aborted")
+            sys.exit(1)
+        if flags & UDS_FRAME_END:
+            return resp
+
+sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+sock.connect(sys.argv[1])
+read_ok(read_exact(sock, 1))
+
+mode = sys.argv[2]
+if mode == "head":
+    sock.sendall(pstr("get head"))
+    head = read_ok(read_exact(sock, 33))
+    print(binascii.hexlify(head).decode())
+elif mode == "head2":
+    pipeline(sock)
+    head = read_ok(call2(sock, 1, "get head"))
+    print(binascii.hexlify(head).decode())
+elif mode == "torn1":
+    sock.sendall(pstr("get head")[0:4])
+elif mode == "torn2":
+    pipeline(sock)
+    req = pstr("get head")
+    sock.sendall(struct.pack(">II", 1, len(req) + 16) + req)
+else:
+    print("Unknown mode " + mode)
+    sys.exit(1)
+
+sock.close()
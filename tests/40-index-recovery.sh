@@ -0,0 +1,84 @@
+cd $TEMP_DIR
+
+$ORI_EXE replicate $SOURCE_FS $TEST_FS
+
+# A torn entry at the end of the log is ignored until the next write
+cd ~/.ori/$TEST_FS.ori
+printf "torn entry" >> index
+$ORIDBG_EXE verify
+
+cd $TEMP_DIR
+$ORIFS_EXE $SOURCE_FS $SOURCE_FS
+$ORIFS_EXE $TEST_FS $TEST_FS
+
+sleep 1
+
+$PYTHON $SCRIPTS/compare.py "$SOURCE_FS" "$TEST_FS"
+
+cd $TEST_FS
+$ORI_EXE log
+$ORI_EXE fsck
+echo "Torn index" > index-torn.txt
+$ORI_EXE snapshot
+cd ..
+
+$UMOUNT $TEST_FS
+
+cd ~/.ori/$TEST_FS.ori
+$ORIDBG_EXE verify
+
+# Repositories from before the sorted index keep every entry in the log,
+# strip the 1052 byte header to get the same entries back
+test "`head -c 4 index.sorted`" = "ORIX"
+tail -c +1053 index.sorted > index.legacy
+cat index >> index.legacy
+mv index.legacy index
+rm index.sorted
+$ORIDBG_EXE verify
+
+cd $TEMP_DIR
+$ORIFS_EXE $TEST_FS $TEST_FS
+
+sleep 1
+
+cd $TEST_FS
+$ORI_EXE log
+$ORI_EXE fsck
+echo "Legacy index" > index-legacy.txt
+$ORI_EXE snapshot
+cd ..
+
+# Clone while a snapshot is being written
+cp $SOURCE_FILES/file11.tst $TEST_FS/index-big.tst
+cd $TEST_FS
+$ORI_EXE snapshot &
+SNAPSHOT_PID=$!
+cd ..
+$ORI_EXE replicate $TEST_FS $TEST_FS2
+wait $SNAPSHOT_PID
+
+$ORIFS_EXE $TEST_FS2 $TEST_FS2
+
+sleep 1
+
+cd $TEST_FS2
+$ORI_EXE pull
+cd ..
+
+$PYTHON $SCRIPTS/compare.py "$TEST_FS" "$TEST_FS2"
+
+$UMOUNT $SOURCE_FS
+$UMOUNT $TEST_FS
+$UMOUNT $TEST_FS2
+
+cd ~/.ori/$TEST_FS.ori
+test -f index.sorted
+$ORIDBG_EXE verify
+
+cd ~/.ori/$TEST_FS2.ori
+$ORIDBG_EXE verify
+$ORIDBG_EXE stats
+
+cd $TEMP_DIR
+$ORI_EXE removefs $TEST_FS
+$ORI_EXE removefs $TEST_FS2
@@ -0,0 +1,84 @@
+cd $TEMP_DIR
+
+$ORI_EXE replicate $SOURCE_FS $TEST_FS
+$ORI_EXE replicate $TEST_FS $TEST_FS2
+
+# A packfile torn while its table of contents was written is read by
+# walking its objects
+cd ~/.ori/$TEST_FS.ori
+PACKFILE=`ls objs/*.pak | sort -V | tail -n 1`
+truncate -s -20 $PACKFILE
+$ORIDBG_EXE verify
+$ORIDBG_EXE rebuildindex
+$ORIDBG_EXE verify
+
+cd $TEMP_DIR
+$ORIFS_EXE $SOURCE_FS $SOURCE_FS
+$ORIFS_EXE $TEST_FS $TEST_FS
+
+sleep 1
+
+$PYTHON $SCRIPTS/compare.py "$SOURCE_FS" "$TEST_FS"
+
+cd $TEST_FS
+$ORI_EXE log
+$ORI_EXE fsck
+echo "Torn packfile" > packfile-torn.txt
+$ORI_EXE snapshot
+cd ..
+
+$UMOUNT $TEST_FS
+
+cd ~/.ori/$TEST_FS.ori
+$ORIDBG_EXE verify
+
+# Packfiles from before tables of contents existed
+$PYTHON $SCRIPTS/packfile_strip_toc.py objs/*.pak
+$ORIDBG_EXE verify
+$ORIDBG_EXE rebuildindex
+$ORIDBG_EXE verify
+
+cd $TEMP_DIR
+$ORIFS_EXE $TEST_FS $TEST_FS
+$ORIFS_EXE $TEST_FS2 $TEST_FS2
+
+sleep 1
+
+cd $TEST_FS
+$ORI_EXE log
+$ORI_EXE fsck
+echo "Old packfiles" > packfile-old.txt
+$ORI_EXE snapshot
+cd ..
+
+# Pull while a snapshot is being written
+cp $SOURCE_FILES/file11.tst $TEST_FS/packfile-big.tst
+cd $TEST_FS
+$ORI_EXE snapshot &
+SNAPSHOT_PID=$!
+cd ..
+cd $TEST_FS2
+$ORI_EXE pull
+cd ..
+wait $SNAPSHOT_PID
+
+cd $TEST_FS2
+$ORI_EXE pull
+cd ..
+
+$PYTHON $SCRIPTS/compare.py "$TEST_FS" "$TEST_FS2"
+
+$UMOUNT $SOURCE_FS
+$UMOUNT $TEST_FS
+$UMOUNT $TEST_FS2
+
+cd ~/.ori/$TEST_FS.ori
+$ORIDBG_EXE verify
+
+cd ~/.ori/$TEST_FS2.ori
+$ORIDBG_EXE verify
+$ORIDBG_EXE stats
+
+cd $TEMP_DIR
+$ORI_EXE removefs $TEST_FS
+$ORI_EXE removefs $TEST_FS2
@@ -0,0 +1,98 @@
+cd $TEMP_DIR
+
+$ORI_EXE replicate $SOURCE_FS $TEST_FS
+
+cd ~/.ori/$TEST_FS.ori
+$ORIDBG_EXE refcount | sort > $TEMP_DIR/mdlog_refs1.txt
+
+# A torn record at the end of the log is ignored until the next commit
+printf '\0\0\0\x40torn' >> metadata
+$ORIDBG_EXE refcount | sort > $TEMP_DIR/mdlog_refs2.txt
+diff $TEMP_DIR/mdlog_refs1.txt $TEMP_DIR/mdlog_refs2.txt
+$ORIDBG_EXE verify
+
+cd $TEMP_DIR
+$ORIFS_EXE $SOURCE_FS $SOURCE_FS
+$ORIFS_EXE $TEST_FS $TEST_FS
+
+sleep 1
+
+$PYTHON $SCRIPTS/compare.py "$SOURCE_FS" "$TEST_FS"
+
+cd $TEST_FS
+$ORI_EXE log
+$ORI_EXE fsck
+echo "Torn metadata" > metadata-torn.txt
+$ORI_EXE snapshot
+cd ..
+
+$UMOUNT $TEST_FS
+
+cd ~/.ori/$TEST_FS.ori
+$ORIDBG_EXE verify
+
+# A crash between writing a checkpoint and its new log leaves the log of
+# the previous generation behind
+cp metadata $TEMP_DIR/metadata.old
+$ORIDBG_EXE gc
+$ORIDBG_EXE refcount | sort > $TEMP_DIR/mdlog_refs1.txt
+cp $TEMP_DIR/metadata.old metadata
+$ORIDBG_EXE refcount | sort > $TEMP_DIR/mdlog_refs2.txt
+diff $TEMP_DIR/mdlog_refs1.txt $TEMP_DIR/mdlog_refs2.txt
+$ORIDBG_EXE verify
+
+# Repositories from before checkpoints existed replay the whole log
+$ORIDBG_EXE gc
+$PYTHON $SCRIPTS/mdlog_legacy.py metadata
+test ! -f metadata.ckpt
+$ORIDBG_EXE refcount | sort > $TEMP_DIR/mdlog_refs2.txt
+diff $TEMP_DIR/mdlog_refs1.txt $TEMP_DIR/mdlog_refs2.txt
+$ORIDBG_EXE verify
+
+cd $TEMP_DIR
+$ORIFS_EXE $TEST_FS $TEST_FS
+
+sleep 1
+
+cd $TEST_FS
+$ORI_EXE log
+$ORI_EXE fsck
+echo "Legacy metadata" > metadata-legacy.txt
+$ORI_EXE snapshot
+cd ..
+
+# Clone while a snapshot is being written
+cp $SOURCE_FILES/file11.tst $TEST_FS/metadata-big.tst
+cd $TEST_FS
+$ORI_EXE snapshot &
+SNAPSHOT_PID=$!
+cd ..
+$ORI_EXE replicate $TEST_FS $TEST_FS2
+wait $SNAPSHOT_PID
+
+$ORIFS_EXE $TEST_FS2 $TEST_FS2
+
+sleep 1
+
+cd $TEST_FS2
+$ORI_EXE pull
+cd ..
+
+$PYTHON $SCRIPTS/compare.py "$TEST_FS" "$TEST_FS2"
+
+$UMOUNT $SOURCE_FS
+$UMOUNT $TEST_FS
+$UMOUNT $TEST_FS2
+
+cd ~/.ori/$TEST_FS.ori
+test -f metadata.ckpt
+$ORIDBG_EXE verify
+
+cd ~/.ori/$TEST_FS2.ori
+$ORIDBG_EXE verify
+$ORIDBG_EXE stats
+
+cd $TEMP_DIR
+rm -f mdlog_refs1.txt mdlog_refs2.txt metadata.old
+$ORI_EXE removefs $TEST_FS
+$ORI_EXE removefs $TEST_FS2
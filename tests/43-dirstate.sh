@@ -0,0 +1,67 @@
+cd $TEMP_DIR
+
+# orilocal is only built with WITH_ORILOCAL=1
+if [ ! -x "$ORILOCAL_EXE" ]; then
+    echo "orilocal not built, skipping"
+    exit 0
+fi
+
+DS_REPO=$TEMP_DIR/dirstate_repo
+DS_REPO2=$TEMP_DIR/dirstate_repo2
+
+# The working directory of a bare repository is the repository itself, only
+# look at the status of the test files
+ds_status() {
+    $ORILOCAL_EXE status | grep " /files/" || true
+}
+
+$ORILOCAL_EXE init $DS_REPO
+cd $DS_REPO
+mkdir files
+cp -R $SOURCE_FILES/a $SOURCE_FILES/b files/
+$ORILOCAL_EXE commit
+test -f dirstate
+test -z "`ds_status`"
+
+# A change that keeps the size must still be seen
+sleep 1
+echo "Bar" > files/b/b.txt
+ds_status | grep "/files/b/b.txt"
+$ORILOCAL_EXE commit
+test -z "`ds_status`"
+
+# A torn dirstate is ignored and rewritten by the next commit
+truncate -s -7 dirstate
+test -z "`ds_status`"
+echo "Baz" > files/b/b.txt
+ds_status | grep "/files/b/b.txt"
+$ORILOCAL_EXE commit
+test -z "`ds_status`"
+
+# Repositories from before the dirstate existed have none
+rm dirstate
+test -z "`ds_status`"
+echo "Hello, dirstate!" > files/a/a.txt
+ds_status | grep "/files/a/a.txt"
+$ORILOCAL_EXE commit
+test -f dirstate
+test -z "`ds_status`"
+
+# Clone and pull while a commit runs in another process
+cp $SOURCE_FILES/file11.tst files/
+$ORILOCAL_EXE commit &
+COMMIT_PID=$!
+$ORILOCAL_EXE replicate $DS_REPO $DS_REPO2
+wait $COMMIT_PID
+test -z "`ds_status`"
+
+cd $DS_REPO2
+$ORILOCAL_EXE pull $DS_REPO
+test "`$ORILOCAL_EXE log | head -1`" = "`cd $DS_REPO; $ORILOCAL_EXE log | head -1`"
+$ORIDBG_EXE verify
+
+cd $DS_REPO
+$ORIDBG_EXE verify
+
+cd $TEMP_DIR
+rm -rf $DS_REPO $DS_REPO2
@@ -0,0 +1,64 @@
+cd $TEMP_DIR
+
+$ORI_EXE replicate $SOURCE_FS $TEST_FS
+
+$ORIFS_EXE $TEST_FS $TEST_FS
+
+sleep 1
+
+UDS_SOCK=~/.ori/$TEST_FS.ori/uds
+
+cd $TEST_FS
+HEAD=`$ORI_EXE tip`
+cd ..
+
+# Clients from before the framed protocol keep working
+test "`$PYTHON $SCRIPTS/uds_client.py $UDS_SOCK head`" = "$HEAD"
+test "`$PYTHON $SCRIPTS/uds_client.py $UDS_SOCK head2`" = "$HEAD"
+
+# A client that disconnects in the middle of a request only ends its session
+$PYTHON $SCRIPTS/uds_client.py $UDS_SOCK torn1
+$PYTHON $SCRIPTS/uds_client.py $UDS_SOCK torn2
+
+cd $TEST_FS
+$ORI_EXE log
+$ORI_EXE fsck
+test "`$ORI_EXE tip`" = "$HEAD"
+cd ..
+
+# Clone over the socket while a snapshot is being written
+cp $SOURCE_FILES/file11.tst $TEST_FS/uds-big.tst
+cd $TEST_FS
+$ORI_EXE snapshot &
+SNAPSHOT_PID=$!
+cd ..
+$ORI_EXE replicate $TEST_FS $TEST_FS2
+$PYTHON $SCRIPTS/uds_client.py $UDS_SOCK head2
+wait $SNAPSHOT_PID
+
+cd $TEST_FS
+HEAD=`$ORI_EXE tip`
+cd ..
+test "`$PYTHON $SCRIPTS/uds_client.py $UDS_SOCK head`" = "$HEAD"
+test "`$PYTHON $SCRIPTS/uds_client.py $UDS_SOCK head2`" = "$HEAD"
+
+$ORIFS_EXE $TEST_FS2 $TEST_FS2
+
+sleep 1
+
+cd $TEST_FS2
+$ORI_EXE pull
+cd ..
+
+$PYTHON $SCRIPTS/compare.py "$TEST_FS" "$TEST_FS2"
+
+$UMOUNT $TEST_FS
+$UMOUNT $TEST_FS2
+
+cd ~/.ori/$TEST_FS2.ori
+$ORIDBG_EXE verify
+$ORIDBG_EXE stats
+
+cd $TEMP_DIR
+$ORI_EXE removefs $TEST_FS
+$ORI_EXE removefs $TEST_FS2
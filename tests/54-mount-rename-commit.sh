@@ -0,0 +1,36 @@
+cd $TEMP_DIR
+mkdir -p $MTPOINT
+
+$ORIFS_EXE --repo=$SOURCE_REPO $MTPOINT
+sleep 1.5
+
+# Committed targets for the renames below
+echo "old b" > $MTPOINT/rename-b.tst
+mkdir $MTPOINT/rename-e
+cd $MTPOINT
+$ORI_EXE commit
+
+# Rename dirty entries over committed ones while a commit is hashing
+echo "new a" > $MTPOINT/rename-a.tst
+mkdir $MTPOINT/rename-d
+echo "in d" > $MTPOINT/rename-d/file.tst
+dd if=/dev/urandom of=$MTPOINT/rename-big.tst bs=1M count=64 2> /dev/null
+$ORI_EXE commit &
+COMMIT_PID=$!
+sleep 0.2
+mv $MTPOINT/rename-a.tst $MTPOINT/rename-b.tst
+mv -T $MTPOINT/rename-d $MTPOINT/rename-e
+wait $COMMIT_PID
+
+$ORI_EXE commit
+sleep 3
+
+cd $SOURCE_REPO
+# TODO: without this, deleted files won't be removed by checkout
+rm -rf *
+$ORI_EXE checkout
+
+$PYTHON $SCRIPTS/compare.py "$SOURCE_REPO" "$MTPOINT"
+
+$UMOUNT $MTPOINT
+